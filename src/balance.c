@@ -72,6 +72,24 @@ typedef struct {
 #endif
 
 #define BALANCE_UNIT 0x100000 // only read 1 MB at a time
+#define BALANCE_UNIT_MAX 0x400000
+#define BALANCE_BUFFERS 3
+
+typedef struct {
+    UINT8* data;
+    chunk* c;
+    write_data_context wtc;
+    BOOL in_flight;
+    UINT64 length;
+    UINT64 lockaddr;
+    UINT64 locklen;
+} reloc_buffer;
+
+typedef struct {
+    reloc_buffer bufs[BALANCE_BUFFERS];
+    unsigned int next;
+    ULONG unit;
+} reloc_pipeline;
 
 static NTSTATUS add_metadata_reloc(_Requires_exclusive_lock_held_(_Curr_->tree_lock) device_extension* Vcb, LIST_ENTRY* items, traverse_ptr* tp,
                                    BOOL skinny, metadata_reloc** mr2, chunk* c, LIST_ENTRY* rollback) {
@@ -1065,7 +1083,7 @@ static NTSTATUS write_metadata_items(_Requires_exclusive_lock_held_(_Curr_->tree
         }
     }
 
-    Status = do_tree_writes(Vcb, &tree_writes, TRUE);
+    Status = do_tree_writes(Vcb, &tree_writes);
     if (!NT_SUCCESS(Status)) {
         ERR("do_tree_writes returned %08x\n", Status);
         goto end;
@@ -1663,6 +1681,211 @@ static NTSTATUS add_data_reloc_extent_item(_Requires_exclusive_lock_held_(_Curr_
     return STATUS_SUCCESS;
 }
 
+static NTSTATUS init_reloc_pipeline(reloc_pipeline* pl, UINT64 max_size) {
+    unsigned int i;
+
+    RtlZeroMemory(pl, sizeof(reloc_pipeline));
+
+    // don't allocate bigger buffers than the largest extent needs
+    pl->unit = BALANCE_UNIT_MAX;
+    while (pl->unit > BALANCE_UNIT && pl->unit / 2 >= max_size) {
+        pl->unit /= 2;
+    }
+
+    while (TRUE) {
+        for (i = 0; i < BALANCE_BUFFERS; i++) {
+            pl->bufs[i].data = ExAllocatePoolWithTag(PagedPool, pl->unit, ALLOC_TAG);
+            if (!pl->bufs[i].data)
+                break;
+        }
+
+        if (i == BALANCE_BUFFERS)
+            return STATUS_SUCCESS;
+
+        while (i > 0) {
+            i--;
+            ExFreePool(pl->bufs[i].data);
+            pl->bufs[i].data = NULL;
+        }
+
+        // fall back to smaller transfers if we're short of memory
+        if (pl->unit <= BALANCE_UNIT) {
+            ERR("out of memory\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        pl->unit /= 2;
+    }
+}
+
+static NTSTATUS reloc_write_start(device_extension* Vcb, reloc_buffer* rb, chunk* c, UINT64 address, UINT32 length) {
+    NTSTATUS Status;
+    LIST_ENTRY* le;
+
+    KeInitializeEvent(&rb->wtc.Event, NotificationEvent, FALSE);
+    InitializeListHead(&rb->wtc.stripes);
+    rb->wtc.stripes_left = 0;
+    rb->wtc.need_wait = FALSE;
+    rb->wtc.parity1 = rb->wtc.parity2 = rb->wtc.scratch = NULL;
+    rb->wtc.mdl = rb->wtc.parity1_mdl = rb->wtc.parity2_mdl = NULL;
+
+    rb->c = c;
+    rb->length = length;
+
+    if (c->chunk_item->type & BLOCK_FLAG_RAID5 || c->chunk_item->type & BLOCK_FLAG_RAID6) {
+        get_raid56_lock_range(c, address, length, &rb->lockaddr, &rb->locklen);
+        chunk_lock_range(Vcb, c, rb->lockaddr, rb->locklen, TRUE);
+    }
+
+    try {
+        Status = write_data(Vcb, address, rb->data, length, &rb->wtc, NULL, c, FALSE, 0, NormalPagePriority);
+    } except (EXCEPTION_EXECUTE_HANDLER) {
+        Status = GetExceptionCode();
+    }
+
+    if (!NT_SUCCESS(Status)) {
+        ERR("write_data returned %08x\n", Status);
+
+        if (c->chunk_item->type & BLOCK_FLAG_RAID5 || c->chunk_item->type & BLOCK_FLAG_RAID6)
+            chunk_unlock_range(Vcb, c, rb->lockaddr, rb->locklen);
+
+        free_write_data_stripes(&rb->wtc);
+        return Status;
+    }
+
+    le = rb->wtc.stripes.Flink;
+    while (le != &rb->wtc.stripes) {
+        write_data_stripe* stripe = CONTAINING_RECORD(le, write_data_stripe, list_entry);
+
+        if (stripe->status != WriteDataStatus_Ignore) {
+            IoCallDriver(stripe->device->devobj, stripe->Irp);
+            rb->wtc.need_wait = TRUE;
+        }
+
+        le = le->Flink;
+    }
+
+    rb->in_flight = TRUE;
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS reloc_write_wait(device_extension* Vcb, reloc_buffer* rb) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    LIST_ENTRY* le;
+
+    if (!rb->in_flight)
+        return STATUS_SUCCESS;
+
+    if (rb->wtc.need_wait)
+        KeWaitForSingleObject(&rb->wtc.Event, Executive, KernelMode, FALSE, NULL);
+
+    le = rb->wtc.stripes.Flink;
+    while (le != &rb->wtc.stripes) {
+        write_data_stripe* stripe = CONTAINING_RECORD(le, write_data_stripe, list_entry);
+
+        if (stripe->status != WriteDataStatus_Ignore && !NT_SUCCESS(stripe->iosb.Status)) {
+            Status = stripe->iosb.Status;
+
+            log_device_error(Vcb, stripe->device, BTRFS_DEV_STAT_WRITE_ERRORS);
+            break;
+        }
+
+        le = le->Flink;
+    }
+
+    free_write_data_stripes(&rb->wtc);
+
+    if (rb->c->chunk_item->type & BLOCK_FLAG_RAID5 || rb->c->chunk_item->type & BLOCK_FLAG_RAID6)
+        chunk_unlock_range(Vcb, rb->c, rb->lockaddr, rb->locklen);
+
+    rb->in_flight = FALSE;
+
+    if (NT_SUCCESS(Status))
+        Vcb->balance.data_relocated += rb->length;
+
+    return Status;
+}
+
+static NTSTATUS drain_reloc_pipeline(device_extension* Vcb, reloc_pipeline* pl) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    unsigned int i;
+
+    // wait for writes in the order they were issued
+    for (i = 0; i < BALANCE_BUFFERS; i++) {
+        NTSTATUS Status2 = reloc_write_wait(Vcb, &pl->bufs[(pl->next + i) % BALANCE_BUFFERS]);
+
+        if (!NT_SUCCESS(Status2) && NT_SUCCESS(Status))
+            Status = Status2;
+    }
+
+    return Status;
+}
+
+static void free_reloc_pipeline(device_extension* Vcb, reloc_pipeline* pl) {
+    unsigned int i;
+
+    drain_reloc_pipeline(Vcb, pl);
+
+    for (i = 0; i < BALANCE_BUFFERS; i++) {
+        if (pl->bufs[i].data) {
+            ExFreePool(pl->bufs[i].data);
+            pl->bufs[i].data = NULL;
+        }
+    }
+}
+
+// Copies a run of sectors to its new location. Reads are synchronous, but we don't wait for the
+// write to finish before reading the next piece, so up to BALANCE_BUFFERS writes can be in flight.
+static NTSTATUS copy_reloc_run(device_extension* Vcb, reloc_pipeline* pl, chunk* c, chunk* newchunk, UINT64 address, UINT64 new_address,
+                               ULONG sectors, UINT32* csum) {
+    NTSTATUS Status;
+
+    while (sectors > 0) {
+        reloc_buffer* rb = &pl->bufs[pl->next];
+        ULONG rl = min(sectors, pl->unit / Vcb->superblock.sector_size);
+
+        Status = reloc_write_wait(Vcb, rb);
+        if (!NT_SUCCESS(Status)) {
+            ERR("reloc_write_wait returned %08x\n", Status);
+            return Status;
+        }
+
+        Status = read_data(Vcb, address, rl * Vcb->superblock.sector_size, csum, FALSE, rb->data, c, NULL, NULL, 0, FALSE, NormalPagePriority);
+        if (!NT_SUCCESS(Status)) {
+            ERR("read_data returned %08x\n", Status);
+            return Status;
+        }
+
+        // RAID5 and 6 writes read and modify parity, so they can't overlap each other
+        if (newchunk->chunk_item->type & BLOCK_FLAG_RAID5 || newchunk->chunk_item->type & BLOCK_FLAG_RAID6) {
+            Status = drain_reloc_pipeline(Vcb, pl);
+            if (!NT_SUCCESS(Status)) {
+                ERR("drain_reloc_pipeline returned %08x\n", Status);
+                return Status;
+            }
+        }
+
+        Status = reloc_write_start(Vcb, rb, newchunk, new_address, rl * Vcb->superblock.sector_size);
+        if (!NT_SUCCESS(Status)) {
+            ERR("reloc_write_start returned %08x\n", Status);
+            return Status;
+        }
+
+        pl->next = (pl->next + 1) % BALANCE_BUFFERS;
+
+        address += rl * Vcb->superblock.sector_size;
+        new_address += rl * Vcb->superblock.sector_size;
+
+        if (csum)
+            csum += rl;
+
+        sectors -= rl;
+    }
+
+    return STATUS_SUCCESS;
+}
+
 static NTSTATUS balance_data_chunk(device_extension* Vcb, chunk* c, BOOL* changed) {
     KEY searchkey;
     traverse_ptr tp;
@@ -1671,10 +1894,14 @@ static NTSTATUS balance_data_chunk(device_extension* Vcb, chunk* c, BOOL* change
     LIST_ENTRY items, metadata_items, rollback, *le;
     UINT64 loaded = 0, num_loaded = 0;
     chunk* newchunk = NULL;
-    UINT8* data = NULL;
+    reloc_pipeline pl;
+    UINT64 max_size = 0;
+    LARGE_INTEGER time1, time2, freq;
 
     TRACE("chunk %llx\n", c->offset);
 
+    pl.bufs[0].data = NULL;
+
     InitializeListHead(&rollback);
     InitializeListHead(&items);
     InitializeListHead(&metadata_items);
@@ -1736,13 +1963,23 @@ static NTSTATUS balance_data_chunk(device_extension* Vcb, chunk* c, BOOL* change
     } else
         *changed = TRUE;
 
-    data = ExAllocatePoolWithTag(PagedPool, BALANCE_UNIT, ALLOC_TAG);
-    if (!data) {
-        ERR("out of memory\n");
-        Status = STATUS_INSUFFICIENT_RESOURCES;
+    le = items.Flink;
+    while (le != &items) {
+        data_reloc* dr = CONTAINING_RECORD(le, data_reloc, list_entry);
+
+        max_size = max(max_size, dr->size);
+
+        le = le->Flink;
+    }
+
+    Status = init_reloc_pipeline(&pl, max_size);
+    if (!NT_SUCCESS(Status)) {
+        ERR("init_reloc_pipeline returned %08x\n", Status);
         goto end;
     }
 
+    time1 = KeQueryPerformanceCounter(&freq);
+
     le = items.Flink;
     while (le != &items) {
         data_reloc* dr = CONTAINING_RECORD(le, data_reloc, list_entry);
@@ -1893,70 +2130,30 @@ static NTSTATUS balance_data_chunk(device_extension* Vcb, chunk* c, BOOL* change
                 ULONG size = index - lastoff;
 
                 // handle no csum run
-                do {
-                    ULONG rl;
-
-                    if (size * Vcb->superblock.sector_size > BALANCE_UNIT)
-                        rl = BALANCE_UNIT / Vcb->superblock.sector_size;
-                    else
-                        rl = size;
-
-                    Status = read_data(Vcb, dr->address + (off * Vcb->superblock.sector_size), rl * Vcb->superblock.sector_size, NULL, FALSE, data,
-                                       c, NULL, NULL, 0, FALSE, NormalPagePriority);
-                    if (!NT_SUCCESS(Status)) {
-                        ERR("read_data returned %08x\n", Status);
-                        ExFreePool(csum);
-                        ExFreePool(bmparr);
-                        goto end;
-                    }
-
-                    Status = write_data_complete(Vcb, dr->new_address + (off * Vcb->superblock.sector_size), data, rl * Vcb->superblock.sector_size,
-                                                 NULL, newchunk, FALSE, 0, NormalPagePriority);
-                    if (!NT_SUCCESS(Status)) {
-                        ERR("write_data_complete returned %08x\n", Status);
-                        ExFreePool(csum);
-                        ExFreePool(bmparr);
-                        goto end;
-                    }
-
-                    size -= rl;
-                    off += rl;
-                } while (size > 0);
-            }
-
-            add_checksum_entry(Vcb, dr->new_address + (index * Vcb->superblock.sector_size), runlength, &csum[index], NULL);
-            add_checksum_entry(Vcb, dr->address + (index * Vcb->superblock.sector_size), runlength, NULL, NULL);
-
-            // handle csum run
-            do {
-                ULONG rl;
-
-                if (runlength * Vcb->superblock.sector_size > BALANCE_UNIT)
-                    rl = BALANCE_UNIT / Vcb->superblock.sector_size;
-                else
-                    rl = runlength;
-
-                Status = read_data(Vcb, dr->address + (index * Vcb->superblock.sector_size), rl * Vcb->superblock.sector_size, &csum[index], FALSE, data,
-                                   c, NULL, NULL, 0, FALSE, NormalPagePriority);
+                Status = copy_reloc_run(Vcb, &pl, c, newchunk, dr->address + (off * Vcb->superblock.sector_size),
+                                        dr->new_address + (off * Vcb->superblock.sector_size), size, NULL);
                 if (!NT_SUCCESS(Status)) {
-                    ERR("read_data returned %08x\n", Status);
+                    ERR("copy_reloc_run returned %08x\n", Status);
                     ExFreePool(csum);
                     ExFreePool(bmparr);
                     goto end;
                 }
+            }
 
-                Status = write_data_complete(Vcb, dr->new_address + (index * Vcb->superblock.sector_size), data, rl * Vcb->superblock.sector_size,
-                                             NULL, newchunk, FALSE, 0, NormalPagePriority);
-                if (!NT_SUCCESS(Status)) {
-                    ERR("write_data_complete returned %08x\n", Status);
-                    ExFreePool(csum);
-                    ExFreePool(bmparr);
-                    goto end;
-                }
+            add_checksum_entry(Vcb, dr->new_address + (index * Vcb->superblock.sector_size), runlength, &csum[index], NULL);
+            add_checksum_entry(Vcb, dr->address + (index * Vcb->superblock.sector_size), runlength, NULL, NULL);
+
+            // handle csum run
+            Status = copy_reloc_run(Vcb, &pl, c, newchunk, dr->address + (index * Vcb->superblock.sector_size),
+                                    dr->new_address + (index * Vcb->superblock.sector_size), runlength, &csum[index]);
+            if (!NT_SUCCESS(Status)) {
+                ERR("copy_reloc_run returned %08x\n", Status);
+                ExFreePool(csum);
+                ExFreePool(bmparr);
+                goto end;
+            }
 
-                runlength -= rl;
-                index += rl;
-            } while (runlength > 0);
+            index += runlength;
 
             lastoff = index;
             runlength = RtlFindNextForwardRunClear(&bmp, index, &index);
@@ -1970,38 +2167,27 @@ static NTSTATUS balance_data_chunk(device_extension* Vcb, chunk* c, BOOL* change
             ULONG off = lastoff;
             ULONG size = (ULONG)((dr->size / Vcb->superblock.sector_size) - lastoff);
 
-            do {
-                ULONG rl;
-
-                if (size * Vcb->superblock.sector_size > BALANCE_UNIT)
-                    rl = BALANCE_UNIT / Vcb->superblock.sector_size;
-                else
-                    rl = size;
-
-                Status = read_data(Vcb, dr->address + (off * Vcb->superblock.sector_size), rl * Vcb->superblock.sector_size, NULL, FALSE, data,
-                                   c, NULL, NULL, 0, FALSE, NormalPagePriority);
-                if (!NT_SUCCESS(Status)) {
-                    ERR("read_data returned %08x\n", Status);
-                    goto end;
-                }
-
-                Status = write_data_complete(Vcb, dr->new_address + (off * Vcb->superblock.sector_size), data, rl * Vcb->superblock.sector_size,
-                                             NULL, newchunk, FALSE, 0, NormalPagePriority);
-                if (!NT_SUCCESS(Status)) {
-                    ERR("write_data_complete returned %08x\n", Status);
-                    goto end;
-                }
-
-                size -= rl;
-                off += rl;
-            } while (size > 0);
+            Status = copy_reloc_run(Vcb, &pl, c, newchunk, dr->address + (off * Vcb->superblock.sector_size),
+                                    dr->new_address + (off * Vcb->superblock.sector_size), size, NULL);
+            if (!NT_SUCCESS(Status)) {
+                ERR("copy_reloc_run returned %08x\n", Status);
+                goto end;
+            }
         }
 
         le = le->Flink;
     }
 
-    ExFreePool(data);
-    data = NULL;
+    Status = drain_reloc_pipeline(Vcb, &pl);
+    if (!NT_SUCCESS(Status)) {
+        ERR("drain_reloc_pipeline returned %08x\n", Status);
+        goto end;
+    }
+
+    time2 = KeQueryPerformanceCounter(NULL);
+    Vcb->balance.data_reloc_time += (time2.QuadPart - time1.QuadPart) * 10000000 / freq.QuadPart;
+
+    free_reloc_pipeline(Vcb, &pl);
 
     Status = write_metadata_items(Vcb, &metadata_items, &items, NULL, &rollback);
     if (!NT_SUCCESS(Status)) {
@@ -2051,6 +2237,9 @@ static NTSTATUS balance_data_chunk(device_extension* Vcb, chunk* c, BOOL* change
     Vcb->need_write = TRUE;
 
 end:
+    if (pl.bufs[0].data)
+        free_reloc_pipeline(Vcb, &pl);
+
     if (NT_SUCCESS(Status)) {
         // update extents in cache inodes before we flush
         le = Vcb->chunks.Flink;
@@ -2155,9 +2344,6 @@ end:
 
     ExReleaseResourceLite(&Vcb->tree_lock);
 
-    if (data)
-        ExFreePool(data);
-
     while (!IsListEmpty(&items)) {
         data_reloc* dr = CONTAINING_RECORD(RemoveHeadList(&items), data_reloc, list_entry);
 
@@ -3064,6 +3250,7 @@ void balance_thread(void* context) {
 
     num_chunks[0] = num_chunks[1] = num_chunks[2] = 0;
     Vcb->balance.total_chunks = Vcb->balance.chunks_left = 0;
+    Vcb->balance.data_relocated = Vcb->balance.data_reloc_time = 0;
 
     InitializeListHead(&chunks);
 
@@ -3711,6 +3898,8 @@ NTSTATUS query_balance(device_extension* Vcb, void* data, ULONG length) {
     bqb->chunks_left = Vcb->balance.chunks_left;
     bqb->total_chunks = Vcb->balance.total_chunks;
     bqb->error = Vcb->balance.status;
+    bqb->data_relocated = Vcb->balance.data_relocated;
+    bqb->data_reloc_time = Vcb->balance.data_reloc_time;
     RtlCopyMemory(&bqb->data_opts, &Vcb->balance.opts[BALANCE_OPTS_DATA], sizeof(btrfs_balance_opts));
     RtlCopyMemory(&bqb->metadata_opts, &Vcb->balance.opts[BALANCE_OPTS_METADATA], sizeof(btrfs_balance_opts));
     RtlCopyMemory(&bqb->system_opts, &Vcb->balance.opts[BALANCE_OPTS_SYSTEM], sizeof(btrfs_balance_opts));
@@ -57,7 +57,7 @@ DEFINE_GUID(BtrfsBusInterface, 0x4d414874, 0x6865, 0x6761, 0x6d, 0x65, 0x83, 0x6
 
 PDRIVER_OBJECT drvobj;
 PDEVICE_OBJECT master_devobj;
-BOOL have_sse42 = FALSE, have_sse2 = FALSE;
+BOOL have_sse42 = FALSE, have_sse2 = FALSE, have_ssse3 = FALSE;
 UINT64 num_reads = 0;
 LIST_ENTRY uid_map_list, gid_map_list;
 LIST_ENTRY VcbList;
@@ -70,6 +70,13 @@ UINT32 mount_zlib_level = 3;
 UINT32 mount_zstd_level = 3;
 UINT32 mount_flush_interval = 30;
 UINT32 mount_max_inline = 2048;
+UINT32 mount_tree_cache_size = 64;
+UINT32 mount_read_policy = READ_POLICY_ROUND_ROBIN;
+UINT32 mount_scrub_rate_limit = 0;
+UINT32 mount_scrub_iops_limit = 0;
+UINT32 mount_send_buffer_size = 0x400000;
+UINT32 mount_dir_cache_size = 16;
+UINT32 mount_csum_cache_size = 8;
 UINT32 mount_skip_balance = 0;
 UINT32 mount_no_barrier = 0;
 UINT32 mount_no_trim = 0;
@@ -309,6 +316,8 @@ static void DriverUnload(_In_ PDRIVER_OBJECT DriverObject) {
         ZwClose(log_handle);
 #endif
 
+    free_comp_contexts();
+
     ExDeleteResourceLite(&global_loading_lock);
     ExDeleteResourceLite(&pdo_list_lock);
 
@@ -369,7 +378,7 @@ static BOOL get_last_inode(_In_ _Requires_exclusive_lock_held_(_Curr_->tree_lock
 }
 
 _Success_(return)
-static BOOL extract_xattr(_In_reads_bytes_(size) void* item, _In_ USHORT size, _In_z_ char* name, _Out_ UINT8** data, _Out_ UINT16* datalen) {
+BOOL extract_xattr(_In_reads_bytes_(size) void* item, _In_ USHORT size, _In_z_ char* name, _Out_ UINT8** data, _Out_ UINT16* datalen) {
     DIR_ITEM* xa = (DIR_ITEM*)item;
     USHORT xasize;
 
@@ -991,6 +1000,12 @@ NTSTATUS create_root(_In_ _Requires_exclusive_lock_held_(_Curr_->tree_lock) devi
 
         t->is_unique = TRUE;
         t->uniqueness_determined = TRUE;
+        t->referenced = TRUE;
+        t->index = NULL;
+        t->index_size = 0;
+        t->index_valid = FALSE;
+        t->slab = NULL;
+        t->slab_len = 0;
         t->buf = NULL;
     }
 
@@ -1019,6 +1034,9 @@ NTSTATUS create_root(_In_ _Requires_exclusive_lock_held_(_Curr_->tree_lock) devi
     RtlZeroMemory(&r->root_item, sizeof(ROOT_ITEM));
     r->root_item.num_references = 1;
     InitializeListHead(&r->fcbs);
+    r->fcbs_hash = NULL;
+    r->fcbs_hash_size = 0;
+    r->num_fcbs = 0;
 
     RtlCopyMemory(ri, &r->root_item, sizeof(ROOT_ITEM));
 
@@ -1065,11 +1083,12 @@ NTSTATUS create_root(_In_ _Requires_exclusive_lock_held_(_Curr_->tree_lock) devi
         t->new_address = 0;
         t->has_new_address = FALSE;
         t->updated_extents = FALSE;
+        t->write = FALSE;
 
         InsertTailList(&Vcb->trees, &t->list_entry);
         t->list_entry_hash.Flink = NULL;
 
-        t->write = TRUE;
+        mark_tree_dirty(t);
         Vcb->need_write = TRUE;
     }
 
@@ -1468,6 +1487,8 @@ void free_fcb(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) _In_ device_exten
     if (fcb->list_entry.Flink)
         RemoveEntryList(&fcb->list_entry);
 
+    remove_fcb_from_hash(Vcb, fcb);
+
     if (fcb->list_entry_all.Flink)
         RemoveEntryList(&fcb->list_entry_all);
 
@@ -1524,6 +1545,9 @@ void free_fcb(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) _In_ device_exten
         ExFreePool(xa);
     }
 
+    if (fcb->type == BTRFS_TYPE_DIRECTORY)
+        cache_dir_children(Vcb, fcb);
+
     while (!IsListEmpty(&fcb->dir_children_index)) {
         LIST_ENTRY* le = RemoveHeadList(&fcb->dir_children_index);
         dir_child* dc = CONTAINING_RECORD(le, dir_child, list_entry_index);
@@ -1615,6 +1639,57 @@ void free_fileref(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) _In_ device_e
     ExFreeToPagedLookasideList(&Vcb->fileref_lookaside, fr);
 }
 
+// Drops a reference without taking fcb_lock, provided it isn't the last one. Taking
+// a reference from zero only happens under fcb_lock, so once the count is above one
+// nobody else can free the object from under us; the final release still has to go
+// through free_fcb or free_fileref with the lock held exclusively.
+static BOOL release_refcount_unlocked(LONG* refcount) {
+    LONG rc = *refcount;
+
+    while (rc > 1) {
+        LONG old = InterlockedCompareExchange(refcount, rc - 1, rc);
+
+        if (old == rc)
+            return TRUE;
+
+        rc = old;
+    }
+
+    return FALSE;
+}
+
+void release_fcb(_Requires_lock_not_held_(_Curr_->fcb_lock) _In_ device_extension* Vcb, _Inout_ fcb* fcb) {
+    if (release_refcount_unlocked(&fcb->refcount)) {
+#ifdef DEBUG_FCB_REFCOUNTS
+        ERR("fcb %p: refcount now %i (subvol %llx, inode %llx)\n", fcb, fcb->refcount, fcb->subvol ? fcb->subvol->id : 0, fcb->inode);
+#endif
+#ifdef DEBUG_STATS
+        InterlockedIncrement64(&Vcb->stats.unlocked_releases);
+#endif
+        return;
+    }
+
+    acquire_fcb_lock_exclusive(Vcb);
+    free_fcb(Vcb, fcb);
+    release_fcb_lock(Vcb);
+}
+
+void release_fileref(_Requires_lock_not_held_(_Curr_->fcb_lock) _In_ device_extension* Vcb, _Inout_ file_ref* fr) {
+    if (release_refcount_unlocked(&fr->refcount)) {
+#ifdef DEBUG_FCB_REFCOUNTS
+        ERR("fileref %p: refcount now %i\n", fr, fr->refcount);
+#endif
+#ifdef DEBUG_STATS
+        InterlockedIncrement64(&Vcb->stats.unlocked_releases);
+#endif
+        return;
+    }
+
+    acquire_fcb_lock_exclusive(Vcb);
+    free_fileref(Vcb, fr);
+    release_fcb_lock(Vcb);
+}
+
 static NTSTATUS close_file(_In_ PFILE_OBJECT FileObject, _In_ PIRP Irp) {
     fcb* fcb;
     ccb* ccb;
@@ -1686,14 +1761,10 @@ static NTSTATUS close_file(_In_ PFILE_OBJECT FileObject, _In_ PIRP Irp) {
 
     Vcb = fcb->Vcb;
 
-    acquire_fcb_lock_exclusive(Vcb);
-
     if (fileref)
-        free_fileref(fcb->Vcb, fileref);
+        release_fileref(Vcb, fileref);
     else
-        free_fcb(Vcb, fcb);
-
-    release_fcb_lock(Vcb);
+        release_fcb(Vcb, fcb);
 
     return STATUS_SUCCESS;
 }
@@ -1806,9 +1877,18 @@ void uninit(_In_ device_extension* Vcb) {
         le = le->Flink;
     }
 
+    acquire_fcb_lock_exclusive(Vcb);
+    free_dir_cache(Vcb);
+    release_fcb_lock(Vcb);
+
+    free_csum_cache(Vcb);
+
     while (!IsListEmpty(&Vcb->roots)) {
         root* r = CONTAINING_RECORD(RemoveHeadList(&Vcb->roots), root, list_entry);
 
+        if (r->fcbs_hash)
+            ExFreePool(r->fcbs_hash);
+
         ExDeleteResourceLite(&r->nonpaged->load_tree_lock);
         ExFreePool(r->nonpaged);
         ExFreePool(r);
@@ -1849,6 +1929,9 @@ void uninit(_In_ device_extension* Vcb) {
         ExFreePool(c);
     }
 
+    if (Vcb->chunk_index)
+        ExFreePool(Vcb->chunk_index);
+
     // FIXME - free any open fcbs?
 
     while (!IsListEmpty(&Vcb->devices)) {
@@ -1881,6 +1964,7 @@ void uninit(_In_ device_extension* Vcb) {
     ExDeleteResourceLite(&Vcb->dirty_subvols_lock);
     ExDeleteResourceLite(&Vcb->scrub.stats_lock);
     ExDeleteResourceLite(&Vcb->send_load_lock);
+    ExDeleteResourceLite(&Vcb->csum_cache_lock);
 
     ExDeletePagedLookasideList(&Vcb->tree_data_lookaside);
     ExDeletePagedLookasideList(&Vcb->traverse_ptr_lookaside);
@@ -2308,18 +2392,14 @@ BOOL get_file_attributes_from_xattr(_In_reads_bytes_(len) char* val, _In_ UINT16
     return FALSE;
 }
 
-ULONG get_file_attributes(_In_ _Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, _In_ root* r, _In_ UINT64 inode,
-                          _In_ UINT8 type, _In_ BOOL dotfile, _In_ BOOL ignore_xa, _In_opt_ PIRP Irp) {
+ULONG make_file_attributes(_In_ root* r, _In_ UINT64 inode, _In_ UINT8 type, _In_ BOOL dotfile,
+                           _In_reads_bytes_opt_(ealen) char* eaval, _In_ UINT16 ealen) {
     ULONG att;
-    char* eaval;
-    UINT16 ealen;
 
-    if (!ignore_xa && get_xattr(Vcb, r, inode, EA_DOSATTRIB, EA_DOSATTRIB_HASH, (UINT8**)&eaval, &ealen, Irp)) {
+    if (eaval) {
         ULONG dosnum = 0;
 
         if (get_file_attributes_from_xattr(eaval, ealen, &dosnum)) {
-            ExFreePool(eaval);
-
             if (type == BTRFS_TYPE_DIRECTORY)
                 dosnum |= FILE_ATTRIBUTE_DIRECTORY;
             else if (type == BTRFS_TYPE_SYMLINK)
@@ -2337,8 +2417,6 @@ ULONG get_file_attributes(_In_ _Requires_lock_held_(_Curr_->tree_lock) device_ex
 
             return dosnum;
         }
-
-        ExFreePool(eaval);
     }
 
     switch (type) {
@@ -2377,6 +2455,24 @@ ULONG get_file_attributes(_In_ _Requires_lock_held_(_Curr_->tree_lock) device_ex
     return att;
 }
 
+ULONG get_file_attributes(_In_ _Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, _In_ root* r, _In_ UINT64 inode,
+                          _In_ UINT8 type, _In_ BOOL dotfile, _In_ BOOL ignore_xa, _In_opt_ PIRP Irp) {
+    ULONG att;
+    char* eaval;
+    UINT16 ealen;
+
+    if (!ignore_xa && get_xattr(Vcb, r, inode, EA_DOSATTRIB, EA_DOSATTRIB_HASH, (UINT8**)&eaval, &ealen, Irp)) {
+        att = make_file_attributes(r, inode, type, dotfile, eaval, ealen);
+
+        if (eaval)
+            ExFreePool(eaval);
+
+        return att;
+    }
+
+    return make_file_attributes(r, inode, type, dotfile, NULL, 0);
+}
+
 NTSTATUS sync_read_phys(_In_ PDEVICE_OBJECT DeviceObject, _In_ UINT64 StartingOffset, _In_ ULONG Length,
                         _Out_writes_bytes_(Length) PUCHAR Buffer, _In_ BOOL override) {
     IO_STATUS_BLOCK IoStatus;
@@ -2604,6 +2700,9 @@ static NTSTATUS add_root(_Inout_ device_extension* Vcb, _In_ UINT64 id, _In_ UIN
     r->parent = 0;
     r->send_ops = 0;
     InitializeListHead(&r->fcbs);
+    r->fcbs_hash = NULL;
+    r->fcbs_hash_size = 0;
+    r->num_fcbs = 0;
 
     r->nonpaged = ExAllocatePoolWithTag(NonPagedPool, sizeof(root_nonpaged), ALLOC_TAG);
     if (!r->nonpaged) {
@@ -3311,12 +3410,12 @@ static NTSTATUS load_chunk_root(_In_ _Requires_lock_held_(_Curr_->tree_lock) dev
 
                 InitializeListHead(&c->space);
                 InitializeListHead(&c->space_size);
+                RtlZeroMemory(c->space_size_ptrs, sizeof(c->space_size_ptrs));
                 InitializeListHead(&c->deleting);
                 InitializeListHead(&c->changed_extents);
 
                 InitializeListHead(&c->range_locks);
                 ExInitializeResourceLite(&c->range_locks_lock);
-                KeInitializeEvent(&c->range_locks_event, NotificationEvent, FALSE);
 
                 InitializeListHead(&c->partial_stripes);
                 ExInitializeResourceLite(&c->partial_stripes_lock);
@@ -3337,6 +3436,8 @@ static NTSTATUS load_chunk_root(_In_ _Requires_lock_held_(_Curr_->tree_lock) dev
             tp = next_tp;
     } while (b);
 
+    update_chunk_index(Vcb);
+
     Vcb->log_to_phys_loaded = TRUE;
 
     if (Vcb->data_flags == 0)
@@ -3945,6 +4046,7 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
     volume_child* vc;
     BOOL no_pnp = FALSE;
     UINT64 readobjsize;
+    ULONG i;
 
     TRACE("(%p, %p)\n", DeviceObject, Irp);
 
@@ -4082,6 +4184,7 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
     ExInitializeResourceLite(&Vcb->dirty_filerefs_lock);
     ExInitializeResourceLite(&Vcb->dirty_subvols_lock);
     ExInitializeResourceLite(&Vcb->scrub.stats_lock);
+    ExInitializeResourceLite(&Vcb->csum_cache_lock);
 
     ExInitializeResourceLite(&Vcb->load_lock);
     ExAcquireResourceExclusiveLite(&Vcb->load_lock, TRUE);
@@ -4199,6 +4302,23 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
     InitializeListHead(&Vcb->chunks);
     InitializeListHead(&Vcb->trees);
     InitializeListHead(&Vcb->trees_hash);
+
+    for (i = 0; i < BTRFS_MAX_LEVEL; i++) {
+        InitializeListHead(&Vcb->dirty_trees[i]);
+    }
+
+    InitializeListHead(&Vcb->dir_cache);
+
+    for (i = 0; i < DIR_CACHE_BUCKETS; i++) {
+        InitializeListHead(&Vcb->dir_cache_hash[i]);
+    }
+
+    InitializeListHead(&Vcb->csum_cache);
+
+    for (i = 0; i < CSUM_CACHE_BUCKETS; i++) {
+        InitializeListHead(&Vcb->csum_cache_hash[i]);
+    }
+
     InitializeListHead(&Vcb->all_fcbs);
     InitializeListHead(&Vcb->dirty_fcbs);
     InitializeListHead(&Vcb->dirty_filerefs);
@@ -4422,6 +4542,7 @@ static NTSTATUS mount_vol(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp) {
 
     Vcb->root_fileref->fcb = root_fcb;
     InsertTailList(&root_fcb->subvol->fcbs, &root_fcb->list_entry);
+    add_fcb_to_hash(Vcb, root_fcb);
     InsertTailList(&Vcb->all_fcbs, &root_fcb->list_entry_all);
 
     root_fcb->fileref = Vcb->root_fileref;
@@ -4552,6 +4673,11 @@ exit2:
             ExDeleteResourceLite(&Vcb->dirty_subvols_lock);
             ExDeleteResourceLite(&Vcb->scrub.stats_lock);
 
+            if (Vcb->csum_cache.Flink)
+                free_csum_cache(Vcb);
+
+            ExDeleteResourceLite(&Vcb->csum_cache_lock);
+
             if (Vcb->devices.Flink) {
                 while (!IsListEmpty(&Vcb->devices)) {
                     device* dev2 = CONTAINING_RECORD(RemoveHeadList(&Vcb->devices), device, list_entry);
@@ -5031,10 +5157,37 @@ BOOL is_file_name_valid(_In_ PUNICODE_STRING us, _In_ BOOL posix) {
     return TRUE;
 }
 
-void chunk_lock_range(_In_ device_extension* Vcb, _In_ chunk* c, _In_ UINT64 start, _In_ UINT64 length) {
+// Range locks are kept sorted by start, so a search for overlapping locks can stop at the first
+// lock which starts after the end of the range. Each lock has its own list of waiters, so
+// releasing it only wakes the threads which were actually blocked by it.
+static range_lock* find_blocking_range_lock(chunk* c, UINT64 start, UINT64 length, BOOL exclusive, LIST_ENTRY** insert_before) {
     LIST_ENTRY* le;
-    BOOL locked;
+    PETHREAD thread = PsGetCurrentThread();
+
+    *insert_before = &c->range_locks;
+
+    le = c->range_locks.Flink;
+    while (le != &c->range_locks) {
+        range_lock* rl = CONTAINING_RECORD(le, range_lock, list_entry);
+
+        if (rl->start > start && *insert_before == &c->range_locks)
+            *insert_before = le;
+
+        if (rl->start >= start + length)
+            break;
+
+        if (rl->start + rl->length > start && rl->thread != thread && (exclusive || rl->exclusive))
+            return rl;
+
+        le = le->Flink;
+    }
+
+    return NULL;
+}
+
+void chunk_lock_range(_In_ device_extension* Vcb, _In_ chunk* c, _In_ UINT64 start, _In_ UINT64 length, _In_ BOOL exclusive) {
     range_lock* rl;
+    BOOL contended = FALSE;
 
     rl = ExAllocateFromNPagedLookasideList(&Vcb->range_lock_lookaside);
     if (!rl) {
@@ -5045,60 +5198,87 @@ void chunk_lock_range(_In_ device_extension* Vcb, _In_ chunk* c, _In_ UINT64 sta
     rl->start = start;
     rl->length = length;
     rl->thread = PsGetCurrentThread();
+    rl->exclusive = exclusive;
+    KeInitializeEvent(&rl->event, NotificationEvent, FALSE);
+    InitializeListHead(&rl->waiters);
+
+    if (exclusive)
+        InterlockedIncrement64(&Vcb->range_lock_exclusive);
+    else
+        InterlockedIncrement64(&Vcb->range_lock_shared);
 
     while (TRUE) {
-        locked = FALSE;
+        range_lock* blocker;
+        LIST_ENTRY* insert_before;
 
         ExAcquireResourceExclusiveLite(&c->range_locks_lock, TRUE);
 
-        le = c->range_locks.Flink;
-        while (le != &c->range_locks) {
-            range_lock* rl2 = CONTAINING_RECORD(le, range_lock, list_entry);
+        blocker = find_blocking_range_lock(c, start, length, exclusive, &insert_before);
 
-            if (rl2->start < start + length && rl2->start + rl2->length > start && rl2->thread != PsGetCurrentThread()) {
-                locked = TRUE;
-                break;
-            }
-
-            le = le->Flink;
-        }
-
-        if (!locked) {
-            InsertTailList(&c->range_locks, &rl->list_entry);
+        if (!blocker) {
+            InsertTailList(insert_before, &rl->list_entry);
 
             ExReleaseResourceLite(&c->range_locks_lock);
             return;
         }
 
-        KeClearEvent(&c->range_locks_event);
+        if (!contended) {
+            InterlockedIncrement64(&Vcb->range_lock_contended);
+            contended = TRUE;
+        }
+
+        InterlockedIncrement64(&Vcb->range_lock_waits);
+
+        KeClearEvent(&rl->event);
+        InsertTailList(&blocker->waiters, &rl->list_entry_waiter);
 
         ExReleaseResourceLite(&c->range_locks_lock);
 
-        KeWaitForSingleObject(&c->range_locks_event, UserRequest, KernelMode, FALSE, NULL);
+        KeWaitForSingleObject(&rl->event, UserRequest, KernelMode, FALSE, NULL);
     }
 }
 
 void chunk_unlock_range(_In_ device_extension* Vcb, _In_ chunk* c, _In_ UINT64 start, _In_ UINT64 length) {
     LIST_ENTRY* le;
+    range_lock* rl = NULL;
 
     ExAcquireResourceExclusiveLite(&c->range_locks_lock, TRUE);
 
     le = c->range_locks.Flink;
     while (le != &c->range_locks) {
-        range_lock* rl = CONTAINING_RECORD(le, range_lock, list_entry);
+        range_lock* rl2 = CONTAINING_RECORD(le, range_lock, list_entry);
 
-        if (rl->start == start && rl->length == length) {
-            RemoveEntryList(&rl->list_entry);
-            ExFreeToNPagedLookasideList(&Vcb->range_lock_lookaside, rl);
+        if (rl2->start > start)
             break;
+
+        if (rl2->start == start && rl2->length == length) {
+            rl = rl2;
+
+            // prefer our own lock if several threads share the same range
+            if (rl2->thread == PsGetCurrentThread())
+                break;
         }
 
         le = le->Flink;
     }
 
-    KeSetEvent(&c->range_locks_event, 0, FALSE);
+    if (!rl) {
+        ERR("could not find range lock for %llx, %llx\n", start, length);
+        ExReleaseResourceLite(&c->range_locks_lock);
+        return;
+    }
+
+    RemoveEntryList(&rl->list_entry);
+
+    while (!IsListEmpty(&rl->waiters)) {
+        range_lock* waiter = CONTAINING_RECORD(RemoveHeadList(&rl->waiters), range_lock, list_entry_waiter);
+
+        KeSetEvent(&waiter->event, 0, FALSE);
+    }
 
     ExReleaseResourceLite(&c->range_locks_lock);
+
+    ExFreeToNPagedLookasideList(&Vcb->range_lock_lookaside, rl);
 }
 
 void log_device_error(_In_ device_extension* Vcb, _Inout_ device* dev, _In_ int error) {
@@ -5165,10 +5345,12 @@ static void check_cpu() {
     __get_cpuid(1, &cpuInfo[0], &cpuInfo[1], &cpuInfo[2], &cpuInfo[3]);
     have_sse42 = cpuInfo[2] & bit_SSE4_2;
     have_sse2 = cpuInfo[3] & bit_SSE2;
+    have_ssse3 = cpuInfo[2] & bit_SSSE3;
 #else
    __cpuid(cpuInfo, 1);
    have_sse42 = cpuInfo[2] & (1 << 20);
    have_sse2 = cpuInfo[3] & (1 << 26);
+   have_ssse3 = cpuInfo[2] & (1 << 9);
 #endif
 
     if (have_sse42)
@@ -5180,6 +5362,11 @@ static void check_cpu() {
         TRACE("SSE2 is supported\n");
     else
         TRACE("SSE2 is not supported\n");
+
+    if (have_ssse3)
+        TRACE("SSSE3 is supported\n");
+    else
+        TRACE("SSSE3 is not supported\n");
 }
 
 #ifdef _DEBUG
@@ -5440,6 +5627,7 @@ NTSTATUS DriverEntry(_In_ PDRIVER_OBJECT DriverObject, _In_ PUNICODE_STRING Regi
     TRACE("DriverEntry\n");
 
     check_cpu();
+    init_crc32c();
 
     if (RtlIsNtDdiVersionAvailable(NTDDI_WIN8)) {
         UNICODE_STRING name;
@@ -5545,6 +5733,8 @@ NTSTATUS DriverEntry(_In_ PDRIVER_OBJECT DriverObject, _In_ PUNICODE_STRING Regi
     ExInitializeResourceLite(&global_loading_lock);
     ExInitializeResourceLite(&pdo_list_lock);
 
+    init_comp_contexts();
+
     InitializeListHead(&pdo_list);
 
     InitializeObjectAttributes(&oa, RegistryPath, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
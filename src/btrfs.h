@@ -14,6 +14,7 @@ static const UINT64 superblock_addrs[] = { 0x10000, 0x4000000, 0x4000000000, 0x4
 #define BTRFS_MAGIC         0x4d5f53665248425f
 #define MAX_LABEL_SIZE      0x100
 #define SUBVOL_ROOT_INODE   0x100
+#define BTRFS_MAX_LEVEL     8
 
 #define TYPE_INODE_ITEM        0x01
 #define TYPE_INODE_REF         0x0C
@@ -537,6 +538,9 @@ typedef struct {
 #define BTRFS_SEND_CMD_UTIMES         20
 #define BTRFS_SEND_CMD_END            21
 #define BTRFS_SEND_CMD_UPDATE_EXTENT  22
+#define BTRFS_SEND_CMD_FALLOCATE      23
+#define BTRFS_SEND_CMD_FILEATTR       24
+#define BTRFS_SEND_CMD_ENCODED_WRITE  25
 
 #define BTRFS_SEND_TLV_UUID             1
 #define BTRFS_SEND_TLV_TRANSID          2
@@ -562,6 +566,19 @@ typedef struct {
 #define BTRFS_SEND_TLV_CLONE_PATH      22
 #define BTRFS_SEND_TLV_CLONE_OFFSET    23
 #define BTRFS_SEND_TLV_CLONE_LENGTH    24
+#define BTRFS_SEND_TLV_FALLOCATE_MODE  25
+#define BTRFS_SEND_TLV_FILEATTR        26
+#define BTRFS_SEND_TLV_UNENCODED_FILE_LEN 27
+#define BTRFS_SEND_TLV_UNENCODED_LEN   28
+#define BTRFS_SEND_TLV_UNENCODED_OFFSET 29
+#define BTRFS_SEND_TLV_COMPRESSION     30
+#define BTRFS_SEND_TLV_ENCRYPTION      31
+
+#define BTRFS_SEND_COMPRESSION_NONE     0
+#define BTRFS_SEND_COMPRESSION_ZLIB     1
+#define BTRFS_SEND_COMPRESSION_ZSTD     2
+#define BTRFS_SEND_COMPRESSION_LZO_4K   3
+#define BTRFS_SEND_COMPRESSION_LZO_64K  7
 
 #define BTRFS_SEND_MAGIC "btrfs-stream"
 
@@ -94,6 +94,11 @@
 #define MAX_EXTENT_SIZE 0x8000000 // 128 MB
 #define COMPRESSED_EXTENT_SIZE 0x20000 // 128 KB
 
+#define READ_POLICY_ROUND_ROBIN     0
+#define READ_POLICY_LEAST_BUSY      1
+#define READ_POLICY_LATENCY         2
+#define READ_POLICY_PREFERRED       3
+
 #define READ_AHEAD_GRANULARITY COMPRESSED_EXTENT_SIZE // really ought to be a multiple of COMPRESSED_EXTENT_SIZE
 
 #define IO_REPARSE_TAG_LXSS_SYMLINK 0xa000001d // undocumented?
@@ -189,7 +194,7 @@ typedef struct {
     BOOL unique;
     BOOL ignore;
     BOOL inserted;
-    UINT32* csum;
+    UINT32* csum; // NULL for extents loaded from disk - their checksums are read on demand
 
     LIST_ENTRY list_entry;
 
@@ -222,6 +227,32 @@ typedef struct {
     LIST_ENTRY list_entry_hash_uc;
 } dir_child;
 
+#define DIR_CACHE_BUCKETS 256
+
+typedef struct {
+    UINT64 subvol_id;
+    UINT64 inode;
+    LIST_ENTRY dir_children_index;
+    LIST_ENTRY dir_children_hash;
+    LIST_ENTRY dir_children_hash_uc;
+    LIST_ENTRY** hash_ptrs;
+    LIST_ENTRY** hash_ptrs_uc;
+    UINT64 size;
+    LIST_ENTRY list_entry;
+    LIST_ENTRY list_entry_hash;
+} dir_cache_entry;
+
+#define CSUM_CACHE_BLOCK_SECTORS 256
+#define CSUM_CACHE_BUCKETS 256
+
+typedef struct {
+    UINT64 address;
+    ULONG valid[CSUM_CACHE_BLOCK_SECTORS / (sizeof(ULONG) * 8)];
+    UINT32 csum[CSUM_CACHE_BLOCK_SECTORS];
+    LIST_ENTRY list_entry;
+    LIST_ENTRY list_entry_hash;
+} csum_cache_entry;
+
 enum prop_compression_type {
     PropCompression_None,
     PropCompression_Zlib,
@@ -288,6 +319,7 @@ typedef struct _fcb {
     ANSI_STRING adsdata;
 
     LIST_ENTRY list_entry;
+    LIST_ENTRY list_entry_hash;
     LIST_ENTRY list_entry_all;
     LIST_ENTRY list_entry_dirty;
 } fcb;
@@ -366,6 +398,7 @@ typedef struct _tree_data {
     LIST_ENTRY list_entry;
     BOOL ignore;
     BOOL inserted;
+    BOOL data_alloc; // data was allocated separately, rather than pointing into t->buf
 
     union {
         tree_holder treeholder;
@@ -389,12 +422,20 @@ typedef struct _tree {
     LIST_ENTRY itemlist;
     LIST_ENTRY list_entry;
     LIST_ENTRY list_entry_hash;
+    LIST_ENTRY list_entry_dirty;
     UINT64 new_address;
     BOOL has_new_address;
     BOOL updated_extents;
     BOOL write;
     BOOL is_unique;
     BOOL uniqueness_determined;
+    BOOL referenced;
+    tree_data** index;
+    ULONG index_len;
+    ULONG index_size;
+    BOOL index_valid;
+    tree_data* slab;
+    ULONG slab_len;
     UINT8* buf;
 } tree;
 
@@ -414,6 +455,9 @@ typedef struct _root {
     UINT64 parent;
     LONG send_ops;
     LIST_ENTRY fcbs;
+    LIST_ENTRY* fcbs_hash; // non-stream fcbs, keyed by inode
+    ULONG fcbs_hash_size;
+    ULONG num_fcbs;
     LIST_ENTRY list_entry;
     LIST_ENTRY list_entry_dirty;
 } root;
@@ -483,13 +527,24 @@ typedef struct {
     LIST_ENTRY list_entry;
     ULONG num_trim_entries;
     LIST_ENTRY trim_list;
+    LONG reads_in_flight;
+    LONG64 read_latency;
+    BOOL scrub_busy;
+    UINT64 scrub_total_chunks;
+    UINT64 scrub_chunks_left;
+    LONG64 scrub_data;
+    LONG64 scrub_time;
 } device;
 
-typedef struct {
+typedef struct _range_lock {
     UINT64 start;
     UINT64 length;
     PETHREAD thread;
-    LIST_ENTRY list_entry;
+    BOOL exclusive;
+    KEVENT event;
+    LIST_ENTRY waiters;
+    LIST_ENTRY list_entry; // in chunk->range_locks, sorted by start
+    LIST_ENTRY list_entry_waiter;
 } range_lock;
 
 typedef struct {
@@ -511,11 +566,11 @@ typedef struct {
     fcb* old_cache;
     LIST_ENTRY space;
     LIST_ENTRY space_size;
+    LIST_ENTRY* space_size_ptrs[64];
     LIST_ENTRY deleting;
     LIST_ENTRY changed_extents;
     LIST_ENTRY range_locks;
     ERESOURCE range_locks_lock;
-    KEVENT range_locks_event;
     ERESOURCE lock;
     ERESOURCE changed_extents_lock;
     BOOL created;
@@ -566,13 +621,26 @@ typedef struct {
     LIST_ENTRY list_entry;
 } sys_chunk;
 
+enum calc_job_type {
+    calc_job_csum,
+    calc_job_compress
+};
+
 typedef struct {
+    enum calc_job_type type;
     UINT8* data;
     UINT32* csum;
     UINT32 sectors;
+    ULONG slice_sectors;
+    ULONG num_slices;
     LONG pos, done;
     KEVENT event;
     LONG refcount;
+    UINT8 compression;
+    void* out;
+    UINT32 inlen;
+    UINT32 comp_length;
+    NTSTATUS Status;
     LIST_ENTRY list_entry;
 } calc_job;
 
@@ -589,6 +657,11 @@ typedef struct {
     ERESOURCE lock;
     drv_calc_thread* threads;
     KEVENT event;
+    ULONG queue_depth;
+    ULONG max_queue_depth;
+    UINT64 num_jobs;
+    LONG64 slices_submitter;
+    LONG64 slices_threads;
 } drv_calc_threads;
 
 typedef struct {
@@ -601,6 +674,14 @@ typedef struct {
     UINT32 zstd_level;
     UINT32 flush_interval;
     UINT32 max_inline;
+    UINT32 tree_cache_size;
+    UINT32 read_policy;
+    UINT64 read_prefer_device;
+    UINT32 scrub_rate_limit;
+    UINT32 scrub_iops_limit;
+    UINT32 send_buffer_size;
+    UINT32 dir_cache_size;
+    UINT32 csum_cache_size;
     UINT64 subvol_id;
     BOOL skip_balance;
     BOOL no_barrier;
@@ -630,9 +711,13 @@ typedef struct {
     UINT64 create_total_time;
     UINT64 open_fcb_calls;
     UINT64 open_fcb_time;
+    UINT64 open_fcb_max_time;
+    UINT64 open_fcb_cached;
+    UINT64 fcb_lookup_time;
     UINT64 open_fileref_child_calls;
     UINT64 open_fileref_child_time;
     UINT64 fcb_lock_time;
+    LONG64 unlocked_releases;
 } debug_stats;
 #endif
 
@@ -644,6 +729,8 @@ typedef struct {
     HANDLE thread;
     UINT64 total_chunks;
     UINT64 chunks_left;
+    UINT64 data_relocated;
+    UINT64 data_reloc_time;
     btrfs_balance_opts opts[3];
     BOOL paused;
     BOOL stopping;
@@ -697,6 +784,9 @@ typedef struct {
     NTSTATUS error;
     ULONG num_errors;
     LIST_ENTRY errors;
+    LARGE_INTEGER throttle_start;
+    LONG64 throttle_bytes;
+    LONG64 throttle_ios;
 } scrub_info;
 
 struct _volume_device_extension;
@@ -750,9 +840,38 @@ typedef struct _device_extension {
     BOOL chunk_usage_found;
     LIST_ENTRY sys_chunks;
     LIST_ENTRY chunks;
+    chunk** chunk_index;
+    ULONG chunk_index_len;
+    ULONG chunk_index_size;
+    chunk* last_chunk;
     LIST_ENTRY trees;
     LIST_ENTRY trees_hash;
     LIST_ENTRY* trees_ptrs[256];
+    LIST_ENTRY dirty_trees[BTRFS_MAX_LEVEL];
+    LONGLONG tree_cache_hits; // signed so we can use InterlockedIncrement64
+    LONGLONG tree_cache_misses;
+    UINT64 tree_cache_evictions;
+    LIST_ENTRY dir_cache; // least recently used first
+    LIST_ENTRY dir_cache_hash[DIR_CACHE_BUCKETS];
+    UINT64 dir_cache_size;
+    UINT64 dir_cache_hits;
+    UINT64 dir_cache_misses;
+    UINT64 dir_cache_evictions;
+    LIST_ENTRY csum_cache; // least recently used first
+    LIST_ENTRY csum_cache_hash[CSUM_CACHE_BUCKETS];
+    ERESOURCE csum_cache_lock;
+    UINT64 csum_cache_size;
+    UINT64 csum_cache_hits;
+    UINT64 csum_cache_misses;
+    UINT64 csum_cache_evictions;
+    LONG64 range_lock_shared;
+    LONG64 range_lock_exclusive;
+    LONG64 range_lock_contended;
+    LONG64 range_lock_waits;
+    UINT64 tree_write_trees;
+    UINT64 tree_write_ios;
+    UINT64 tree_write_bytes;
+    UINT64 tree_write_max_io;
     LIST_ENTRY all_fcbs;
     LIST_ENTRY dirty_fcbs;
     ERESOURCE dirty_fcbs_lock;
@@ -884,9 +1003,21 @@ typedef struct {
     UINT32 length;
     UINT8* data;
     chunk* c;
+    PMDL mdl;
     LIST_ENTRY list_entry;
 } tree_write;
 
+#define TREE_WRITE_RUN_MAX 0x100000 // 1 MB
+
+typedef struct {
+    UINT64 address;
+    UINT32 length;
+    UINT8* data;
+    PMDL mdl;
+    tree_write* first;
+    ULONG num_trees;
+} tree_write_run;
+
 typedef struct {
     UNICODE_STRING us;
     LIST_ENTRY list_entry;
@@ -938,6 +1069,15 @@ static __inline void release_fcb_lock(device_extension* Vcb) {
     ExReleaseResourceLite(&Vcb->fcb_lock);
 }
 
+// Trees with write set are also kept on Vcb->dirty_trees, one list per level, so that
+// the flush doesn't have to go through every cached tree to find them.
+static __inline void mark_tree_dirty(tree* t) {
+    if (!t->write) {
+        t->write = TRUE;
+        InsertTailList(&t->Vcb->dirty_trees[t->header.level], &t->list_entry_dirty);
+    }
+}
+
 static __inline void* map_user_buffer(PIRP Irp, ULONG priority) {
     if (!Irp->MdlAddress) {
         return Irp->UserBuffer;
@@ -977,6 +1117,8 @@ static __inline UINT64 make_file_id(root* r, UINT64 inode) {
     return (r->id << 40) | (inode & 0xffffffffff);
 }
 
+#define tree_data_in_slab(t, td) ((td) >= (t)->slab && (td) < (t)->slab + (t)->slab_len)
+
 #define keycmp(key1, key2)\
     ((key1.obj_id < key2.obj_id) ? -1 :\
     ((key1.obj_id > key2.obj_id) ? 1 :\
@@ -1064,9 +1206,15 @@ device* find_device_from_uuid(_In_ device_extension* Vcb, _In_ BTRFS_UUID* uuid)
 _Success_(return)
 BOOL get_file_attributes_from_xattr(_In_reads_bytes_(len) char* val, _In_ UINT16 len, _Out_ ULONG* atts);
 
+ULONG make_file_attributes(_In_ root* r, _In_ UINT64 inode, _In_ UINT8 type, _In_ BOOL dotfile,
+                           _In_reads_bytes_opt_(ealen) char* eaval, _In_ UINT16 ealen);
+
 ULONG get_file_attributes(_In_ _Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, _In_ root* r, _In_ UINT64 inode,
                           _In_ UINT8 type, _In_ BOOL dotfile, _In_ BOOL ignore_xa, _In_opt_ PIRP Irp);
 
+_Success_(return)
+BOOL extract_xattr(_In_reads_bytes_(size) void* item, _In_ USHORT size, _In_z_ char* name, _Out_ UINT8** data, _Out_ UINT16* datalen);
+
 _Success_(return)
 BOOL get_xattr(_In_ _Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, _In_ root* subvol, _In_ UINT64 inode, _In_z_ char* name, _In_ UINT32 crc32,
                _Out_ UINT8** data, _Out_ UINT16* datalen, _In_opt_ PIRP Irp);
@@ -1075,6 +1223,8 @@ BOOL get_xattr(_In_ _Requires_lock_held_(_Curr_->tree_lock) device_extension* Vc
 void free_fcb(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) _In_ device_extension* Vcb, _Inout_ fcb* fcb);
 #endif
 void free_fileref(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) _In_ device_extension* Vcb, _Inout_ file_ref* fr);
+void release_fcb(_Requires_lock_not_held_(_Curr_->fcb_lock) _In_ device_extension* Vcb, _Inout_ fcb* fcb);
+void release_fileref(_Requires_lock_not_held_(_Curr_->fcb_lock) _In_ device_extension* Vcb, _Inout_ file_ref* fr);
 void protect_superblocks(_Inout_ chunk* c);
 BOOL is_top_level(_In_ PIRP Irp);
 NTSTATUS create_root(_In_ _Requires_exclusive_lock_held_(_Curr_->tree_lock) device_extension* Vcb, _In_ UINT64 id,
@@ -1100,7 +1250,7 @@ WCHAR* file_desc_fileref(_In_ file_ref* fileref);
 void mark_fcb_dirty(_In_ fcb* fcb);
 void mark_fileref_dirty(_In_ file_ref* fileref);
 NTSTATUS delete_fileref(_In_ file_ref* fileref, _In_opt_ PFILE_OBJECT FileObject, _In_opt_ PIRP Irp, _In_ LIST_ENTRY* rollback);
-void chunk_lock_range(_In_ device_extension* Vcb, _In_ chunk* c, _In_ UINT64 start, _In_ UINT64 length);
+void chunk_lock_range(_In_ device_extension* Vcb, _In_ chunk* c, _In_ UINT64 start, _In_ UINT64 length, _In_ BOOL exclusive);
 void chunk_unlock_range(_In_ device_extension* Vcb, _In_ chunk* c, _In_ UINT64 start, _In_ UINT64 length);
 void init_device(_In_ device_extension* Vcb, _Inout_ device* dev, _In_ BOOL get_nums);
 void init_file_cache(_In_ PFILE_OBJECT FileObject, _In_ CC_FILE_SIZES* ccfs);
@@ -1126,6 +1276,13 @@ extern UINT32 mount_zlib_level;
 extern UINT32 mount_zstd_level;
 extern UINT32 mount_flush_interval;
 extern UINT32 mount_max_inline;
+extern UINT32 mount_tree_cache_size;
+extern UINT32 mount_read_policy;
+extern UINT32 mount_scrub_rate_limit;
+extern UINT32 mount_scrub_iops_limit;
+extern UINT32 mount_send_buffer_size;
+extern UINT32 mount_dir_cache_size;
+extern UINT32 mount_csum_cache_size;
 extern UINT32 mount_skip_balance;
 extern UINT32 mount_no_barrier;
 extern UINT32 mount_no_trim;
@@ -1182,6 +1339,8 @@ void init_fast_io_dispatch(FAST_IO_DISPATCH** fiod);
 
 // in crc32c.c
 UINT32 calc_crc32c(_In_ UINT32 seed, _In_reads_bytes_(msglen) UINT8* msg, _In_ ULONG msglen);
+void calc_crc32c_sectors(_In_reads_bytes_(sector_size * sectors) UINT8* data, _In_ ULONG sector_size, _In_ ULONG sectors, _Out_writes_(sectors) UINT32* csum);
+void init_crc32c();
 
 typedef struct {
     LIST_ENTRY* list;
@@ -1228,6 +1387,9 @@ NTSTATUS find_item_to_level(device_extension* Vcb, root* r, traverse_ptr* tp, co
 BOOL find_next_item(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, const traverse_ptr* tp, traverse_ptr* next_tp, BOOL ignore, PIRP Irp);
 BOOL find_prev_item(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, const traverse_ptr* tp, traverse_ptr* prev_tp, PIRP Irp);
 void free_trees(device_extension* Vcb);
+void clean_trees(device_extension* Vcb);
+void prune_trees(device_extension* Vcb);
+tree_data* unslab_tree_data(device_extension* Vcb, tree* t, tree_data* td);
 NTSTATUS insert_tree_item(_In_ _Requires_exclusive_lock_held_(_Curr_->tree_lock) device_extension* Vcb, _In_ root* r, _In_ UINT64 obj_id,
                           _In_ UINT8 obj_type, _In_ UINT64 offset, _In_reads_bytes_opt_(size) _When_(return >= 0, __drv_aliasesMem) void* data,
                           _In_ UINT16 size, _Out_opt_ traverse_ptr* ptp, _In_opt_ PIRP Irp);
@@ -1275,6 +1437,7 @@ NTSTATUS truncate_file(fcb* fcb, UINT64 end, PIRP Irp, LIST_ENTRY* rollback);
 NTSTATUS extend_file(fcb* fcb, file_ref* fileref, UINT64 end, BOOL prealloc, PIRP Irp, LIST_ENTRY* rollback);
 NTSTATUS excise_extents(device_extension* Vcb, fcb* fcb, UINT64 start_data, UINT64 end_data, PIRP Irp, LIST_ENTRY* rollback);
 chunk* get_chunk_from_address(device_extension* Vcb, UINT64 address);
+void update_chunk_index(device_extension* Vcb);
 NTSTATUS alloc_chunk(device_extension* Vcb, UINT64 flags, chunk** pc, BOOL full_size);
 NTSTATUS write_data(_In_ device_extension* Vcb, _In_ UINT64 address, _In_reads_bytes_(length) void* data, _In_ UINT32 length, _In_ write_data_context* wtc,
                     _In_opt_ PIRP Irp, _In_opt_ chunk* c, _In_ BOOL file_write, _In_ UINT64 irp_offset, _In_ ULONG priority);
@@ -1292,6 +1455,8 @@ BOOL insert_extent_chunk(_In_ device_extension* Vcb, _In_ fcb* fcb, _In_ chunk*
 
 NTSTATUS do_write_file(fcb* fcb, UINT64 start_data, UINT64 end_data, void* data, PIRP Irp, BOOL file_write, UINT32 irp_offset, LIST_ENTRY* rollback);
 NTSTATUS write_compressed(fcb* fcb, UINT64 start_data, UINT64 end_data, void* data, PIRP Irp, LIST_ENTRY* rollback);
+NTSTATUS write_encoded_extent(fcb* fcb, UINT64 start_data, UINT8 compression, void* comp_data, UINT32 comp_length, UINT64 decoded_size,
+                              UINT64 extent_offset, UINT64 num_bytes, PIRP Irp, LIST_ENTRY* rollback);
 BOOL find_data_address_in_chunk(device_extension* Vcb, chunk* c, UINT64 length, UINT64* address);
 void get_raid56_lock_range(chunk* c, UINT64 address, UINT64 length, UINT64* lockaddr, UINT64* locklen);
 NTSTATUS calc_csum(_In_ device_extension* Vcb, _In_reads_bytes_(sectors*Vcb->superblock.sector_size) UINT8* data,
@@ -1372,6 +1537,11 @@ NTSTATUS open_fcb(_Requires_lock_held_(_Curr_->tree_lock) _Requires_exclusive_lo
                   root* subvol, UINT64 inode, UINT8 type, PANSI_STRING utf8, fcb* parent, fcb** pfcb, POOL_TYPE pooltype, PIRP Irp);
 NTSTATUS load_csum(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, UINT32* csum, UINT64 start, UINT64 length, PIRP Irp);
 NTSTATUS load_dir_children(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vcb, fcb* fcb, BOOL ignore_size, PIRP Irp);
+BOOL cache_dir_children(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) device_extension* Vcb, fcb* fcb);
+void free_dir_cache(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) device_extension* Vcb);
+void add_fcb_to_hash(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) device_extension* Vcb, fcb* fcb);
+void remove_fcb_from_hash(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) device_extension* Vcb, fcb* fcb);
+fcb* find_fcb_in_subvol(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) device_extension* Vcb, root* subvol, UINT64 inode);
 NTSTATUS add_dir_child(fcb* fcb, UINT64 inode, BOOL subvol, PANSI_STRING utf8, PUNICODE_STRING name, UINT8 type, dir_child** pdc);
 NTSTATUS open_fileref_child(_Requires_lock_held_(_Curr_->tree_lock) _Requires_exclusive_lock_held_(_Curr_->fcb_lock) _In_ device_extension* Vcb,
                             _In_ file_ref* sf, _In_ PUNICODE_STRING name, _In_ BOOL case_sensitive, _In_ BOOL lastpart, _In_ BOOL streampart,
@@ -1398,7 +1568,7 @@ NTSTATUS get_tree_new_address(device_extension* Vcb, tree* t, PIRP Irp, LIST_ENT
 NTSTATUS flush_fcb(fcb* fcb, BOOL cache, LIST_ENTRY* batchlist, PIRP Irp);
 NTSTATUS write_data_phys(_In_ PDEVICE_OBJECT device, _In_ UINT64 address, _In_reads_bytes_(length) void* data, _In_ UINT32 length);
 BOOL is_tree_unique(device_extension* Vcb, tree* t, PIRP Irp);
-NTSTATUS do_tree_writes(device_extension* Vcb, LIST_ENTRY* tree_writes, BOOL no_free);
+NTSTATUS do_tree_writes(device_extension* Vcb, LIST_ENTRY* tree_writes);
 void add_checksum_entry(device_extension* Vcb, UINT64 address, ULONG length, UINT32* csum, PIRP Irp);
 BOOL find_metadata_address_in_chunk(device_extension* Vcb, chunk* c, UINT64* address);
 void add_trim_entry_avoid_sb(device_extension* Vcb, device* dev, UINT64 address, UINT64 size);
@@ -1421,6 +1591,8 @@ NTSTATUS read_stream(fcb* fcb, UINT8* data, UINT64 start, ULONG length, ULONG* p
 NTSTATUS do_read(PIRP Irp, BOOLEAN wait, ULONG* bytes_read);
 NTSTATUS check_csum(device_extension* Vcb, UINT8* data, UINT32 sectors, UINT32* csum);
 void raid6_recover2(UINT8* sectors, UINT16 num_stripes, ULONG sector_size, UINT16 missing1, UINT16 missing2, UINT8* out);
+void invalidate_csum_cache(_Requires_exclusive_lock_held_(_Curr_->tree_lock) device_extension* Vcb, UINT64 address, ULONG length);
+void free_csum_cache(device_extension* Vcb);
 
 // in pnp.c
 
@@ -1438,6 +1610,8 @@ NTSTATUS allocate_cache(device_extension* Vcb, BOOL* changed, PIRP Irp, LIST_ENT
 NTSTATUS update_chunk_caches(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback);
 NTSTATUS update_chunk_caches_tree(device_extension* Vcb, PIRP Irp);
 NTSTATUS add_space_entry(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 offset, UINT64 size);
+void order_space_entry(space* s, LIST_ENTRY* list_size);
+space* find_space_best_fit(chunk* c, UINT64 length);
 void space_list_add(chunk* c, UINT64 address, UINT64 length, LIST_ENTRY* rollback);
 void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, UINT64 length, chunk* c, LIST_ENTRY* rollback);
 void space_list_subtract(chunk* c, BOOL deleting, UINT64 address, UINT64 length, LIST_ENTRY* rollback);
@@ -1479,11 +1653,17 @@ void watch_registry(HANDLE regh);
 NTSTATUS zlib_decompress(UINT8* inbuf, UINT32 inlen, UINT8* outbuf, UINT32 outlen);
 NTSTATUS lzo_decompress(UINT8* inbuf, UINT32 inlen, UINT8* outbuf, UINT32 outlen, UINT32 inpageoff);
 NTSTATUS zstd_decompress(UINT8* inbuf, UINT32 inlen, UINT8* outbuf, UINT32 outlen);
-NTSTATUS write_compressed_bit(fcb* fcb, UINT64 start_data, UINT64 end_data, void* data, BOOL* compressed, PIRP Irp, LIST_ENTRY* rollback);
+UINT8 get_compression_type(fcb* fcb);
+UINT32 compress_buffer_size(UINT8 compression, UINT32 inlen);
+NTSTATUS compress_bit(device_extension* Vcb, UINT8 compression, void* inbuf, UINT32 inlen, void* outbuf, UINT32* comp_length);
+void init_comp_contexts();
+void free_comp_contexts();
 
 // in galois.c
 void galois_double(UINT8* data, UINT32 len);
 void galois_divpower(UINT8* data, UINT8 div, UINT32 readlen);
+void galois_mul(UINT8* data, UINT8 c, UINT32 len);
+void galois_recover2(UINT8* qxy, UINT8* pxy, UINT8* p, UINT8* q, UINT8 a, UINT8 b, UINT32 len);
 UINT8 gpow2(UINT8 e);
 UINT8 gmul(UINT8 a, UINT8 b);
 UINT8 gdiv(UINT8 a, UINT8 b);
@@ -1500,7 +1680,9 @@ _Function_class_(KSTART_ROUTINE)
 void calc_thread(void* context);
 
 NTSTATUS add_calc_job(device_extension* Vcb, UINT8* data, UINT32 sectors, UINT32* csum, calc_job** pcj);
+NTSTATUS add_calc_job_comp(device_extension* Vcb, UINT8 compression, void* data, UINT32 inlen, void* out, calc_job** pcj);
 void free_calc_job(calc_job* cj);
+void do_calc_job(device_extension* Vcb, calc_job* cj);
 
 // in balance.c
 NTSTATUS start_balance(device_extension* Vcb, void* data, ULONG length, KPROCESSOR_MODE processor_mode);
@@ -1550,6 +1732,7 @@ NTSTATUS stop_scrub(device_extension* Vcb, KPROCESSOR_MODE processor_mode);
 
 // in send.c
 NTSTATUS send_subvol(device_extension* Vcb, void* data, ULONG datalen, PFILE_OBJECT FileObject, PIRP Irp);
+NTSTATUS send_subvol2(device_extension* Vcb, void* data, ULONG datalen, PFILE_OBJECT FileObject, PIRP Irp);
 NTSTATUS read_send_buffer(device_extension* Vcb, PFILE_OBJECT FileObject, void* data, ULONG datalen, ULONG_PTR* retlen, KPROCESSOR_MODE processor_mode);
 
 // based on function in sys/sysmacros.h
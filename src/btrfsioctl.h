@@ -37,6 +37,14 @@
 #define FSCTL_BTRFS_SEND_SUBVOL CTL_CODE(FILE_DEVICE_UNKNOWN, 0x846, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define FSCTL_BTRFS_READ_SEND_BUFFER CTL_CODE(FILE_DEVICE_UNKNOWN, 0x847, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
 #define FSCTL_BTRFS_RESIZE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x848, METHOD_IN_DIRECT, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_GET_TREE_CACHE_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x849, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_GET_CALC_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x84a, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_WRITE_ENCODED CTL_CODE(FILE_DEVICE_UNKNOWN, 0x84b, METHOD_IN_DIRECT, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_GET_DIR_CACHE_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x84c, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_GET_RANGE_LOCK_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x84d, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_GET_CSUM_CACHE_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x84e, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_GET_TREE_WRITE_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x84f, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_SEND_SUBVOL2 CTL_CODE(FILE_DEVICE_UNKNOWN, 0x850, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
 typedef struct {
     UINT64 subvol;
@@ -185,6 +193,8 @@ typedef struct {
     btrfs_balance_opts data_opts;
     btrfs_balance_opts metadata_opts;
     btrfs_balance_opts system_opts;
+    UINT64 data_relocated; // bytes
+    UINT64 data_reloc_time; // 100ns units
 } btrfs_query_balance;
 
 typedef struct {
@@ -233,6 +243,20 @@ typedef struct {
     };
 } btrfs_scrub_error;
 
+typedef struct {
+    UINT64 dev_id;
+    UINT64 total_chunks;
+    UINT64 chunks_left;
+    UINT64 data_scrubbed;
+    UINT64 duration;
+} btrfs_scrub_device;
+
+// Follows the error list in FSCTL_BTRFS_QUERY_SCRUB's output, aligned to 8 bytes
+typedef struct {
+    UINT64 num_devices;
+    btrfs_scrub_device devices[1];
+} btrfs_scrub_devices;
+
 typedef struct {
     UINT32 status;
     LARGE_INTEGER start_time;
@@ -289,9 +313,80 @@ typedef struct {
     void* POINTER_32 clones[1];
 } btrfs_send_subvol32;
 
+typedef struct {
+    ULONG flags;
+    btrfs_send_subvol bss;
+} btrfs_send_subvol2;
+
+typedef struct {
+    ULONG flags;
+    btrfs_send_subvol32 bss;
+} btrfs_send_subvol2_32;
+
+#define BTRFS_SEND_FLAG_V2      0x1
+
 typedef struct {
     UINT64 device;
     UINT64 size;
 } btrfs_resize;
 
+typedef struct {
+    UINT64 hits;
+    UINT64 misses;
+    UINT64 evictions;
+    UINT64 num_trees;
+    UINT64 size;
+    UINT64 max_size;
+} btrfs_tree_cache_stats;
+
+typedef struct {
+    UINT32 num_threads;
+    UINT32 queue_depth;
+    UINT32 max_queue_depth;
+    UINT64 num_jobs;
+    UINT64 slices_submitter;
+    UINT64 slices_threads;
+} btrfs_calc_stats;
+
+typedef struct {
+    UINT64 offset;
+    UINT64 unencoded_file_len;
+    UINT64 unencoded_len;
+    UINT64 unencoded_offset;
+    UINT8 compression;
+    UINT32 datalen;
+    UINT8 data[1];
+} btrfs_write_encoded;
+
+typedef struct {
+    UINT64 hits;
+    UINT64 misses;
+    UINT64 evictions;
+    UINT64 num_dirs;
+    UINT64 size;
+    UINT64 max_size;
+} btrfs_dir_cache_stats;
+
+typedef struct {
+    UINT64 shared;
+    UINT64 exclusive;
+    UINT64 contended;
+    UINT64 waits;
+} btrfs_range_lock_stats;
+
+typedef struct {
+    UINT64 hits;
+    UINT64 misses;
+    UINT64 evictions;
+    UINT64 size;
+    UINT64 max_size;
+} btrfs_csum_cache_stats;
+
+typedef struct {
+    UINT64 trees;
+    UINT64 ios;
+    UINT64 bytes;
+    UINT64 max_io_size;
+} btrfs_tree_write_stats;
+
 #endif
@@ -62,8 +62,15 @@ static BOOLEAN acquire_for_read_ahead(PVOID Context, BOOLEAN Wait) {
 
     TRACE("(%p, %u)\n", Context, Wait);
 
-    if (!ExAcquireResourceSharedLite(fcb->Header.Resource, Wait))
+    // Taken before the fcb's resource, as read_file may need to look up checksums
+
+    if (!ExAcquireResourceSharedLite(&fcb->Vcb->tree_lock, Wait))
+        return FALSE;
+
+    if (!ExAcquireResourceSharedLite(fcb->Header.Resource, Wait)) {
+        ExReleaseResourceLite(&fcb->Vcb->tree_lock);
         return FALSE;
+    }
 
     IoSetTopLevelIrp((PIRP)FSRTL_CACHE_TOP_LEVEL_IRP);
 
@@ -78,6 +85,8 @@ static void release_from_read_ahead(PVOID Context) {
 
     ExReleaseResourceLite(fcb->Header.Resource);
 
+    ExReleaseResourceLite(&fcb->Vcb->tree_lock);
+
     if (IoGetTopLevelIrp() == (PIRP)FSRTL_CACHE_TOP_LEVEL_IRP)
         IoSetTopLevelIrp(NULL);
 }
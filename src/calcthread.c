@@ -18,6 +18,24 @@
 #include "btrfs_drv.h"
 
 #define SECTOR_BLOCK 16
+#define SLICES_PER_THREAD 4
+
+static void queue_calc_job(device_extension* Vcb, calc_job* cj) {
+    ExAcquireResourceExclusiveLite(&Vcb->calcthreads.lock, TRUE);
+
+    InsertTailList(&Vcb->calcthreads.job_list, &cj->list_entry);
+
+    Vcb->calcthreads.queue_depth++;
+    if (Vcb->calcthreads.queue_depth > Vcb->calcthreads.max_queue_depth)
+        Vcb->calcthreads.max_queue_depth = Vcb->calcthreads.queue_depth;
+
+    Vcb->calcthreads.num_jobs++;
+
+    KeSetEvent(&Vcb->calcthreads.event, 0, FALSE);
+    KeClearEvent(&Vcb->calcthreads.event);
+
+    ExReleaseResourceLite(&Vcb->calcthreads.lock);
+}
 
 NTSTATUS add_calc_job(device_extension* Vcb, UINT8* data, UINT32 sectors, UINT32* csum, calc_job** pcj) {
     calc_job* cj;
@@ -28,6 +46,7 @@ NTSTATUS add_calc_job(device_extension* Vcb, UINT8* data, UINT32 sectors, UINT32
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
+    cj->type = calc_job_csum;
     cj->data = data;
     cj->sectors = sectors;
     cj->csum = csum;
@@ -36,14 +55,37 @@ NTSTATUS add_calc_job(device_extension* Vcb, UINT8* data, UINT32 sectors, UINT32
     cj->refcount = 1;
     KeInitializeEvent(&cj->event, NotificationEvent, FALSE);
 
-    ExAcquireResourceExclusiveLite(&Vcb->calcthreads.lock, TRUE);
+    // Aim for a few slices per thread, so large jobs aren't spent fighting over pos, but
+    // never go below SECTOR_BLOCK, as small slices cost more in overhead than they save.
+    cj->slice_sectors = max(SECTOR_BLOCK, sectors / (Vcb->calcthreads.num_threads * SLICES_PER_THREAD));
+    cj->num_slices = (sectors + cj->slice_sectors - 1) / cj->slice_sectors;
 
-    InsertTailList(&Vcb->calcthreads.job_list, &cj->list_entry);
+    queue_calc_job(Vcb, cj);
 
-    KeSetEvent(&Vcb->calcthreads.event, 0, FALSE);
-    KeClearEvent(&Vcb->calcthreads.event);
+    *pcj = cj;
 
-    ExReleaseResourceLite(&Vcb->calcthreads.lock);
+    return STATUS_SUCCESS;
+}
+NTSTATUS add_calc_job_comp(device_extension* Vcb, UINT8 compression, void* data, UINT32 inlen, void* out, calc_job** pcj) {
+    calc_job* cj;
+
+    cj = ExAllocatePoolWithTag(NonPagedPool, sizeof(calc_job), ALLOC_TAG);
+    if (!cj) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    cj->type = calc_job_compress;
+    cj->data = data;
+    cj->inlen = inlen;
+    cj->out = out;
+    cj->compression = compression;
+    cj->comp_length = 0;
+    cj->Status = STATUS_SUCCESS;
+    cj->refcount = 1;
+    KeInitializeEvent(&cj->event, NotificationEvent, FALSE);
+
+    queue_calc_job(Vcb, cj);
 
     *pcj = cj;
 
@@ -57,40 +99,55 @@ void free_calc_job(calc_job* cj) {
         ExFreePool(cj);
 }
 
-static BOOL do_calc(device_extension* Vcb, calc_job* cj) {
+static void do_compress(device_extension* Vcb, calc_job* cj) {
+    cj->Status = compress_bit(Vcb, cj->compression, cj->data, cj->inlen, cj->out, &cj->comp_length);
+
+    KeSetEvent(&cj->event, 0, FALSE);
+}
+
+static BOOL do_calc(device_extension* Vcb, calc_job* cj, BOOL submitter) {
     LONG pos, done;
-    UINT32* csum;
-    UINT8* data;
-    ULONG blocksize, i;
+    ULONG blocksize;
 
     pos = InterlockedIncrement(&cj->pos) - 1;
 
-    if ((UINT32)pos * SECTOR_BLOCK >= cj->sectors)
+    if ((ULONG)pos >= cj->num_slices)
         return FALSE;
 
-    csum = &cj->csum[pos * SECTOR_BLOCK];
-    data = cj->data + (pos * SECTOR_BLOCK * Vcb->superblock.sector_size);
-
-    blocksize = min(SECTOR_BLOCK, cj->sectors - (pos * SECTOR_BLOCK));
-    for (i = 0; i < blocksize; i++) {
-        *csum = ~calc_crc32c(0xffffffff, data, Vcb->superblock.sector_size);
-        csum++;
-        data += Vcb->superblock.sector_size;
-    }
-
-    done = InterlockedIncrement(&cj->done);
-
-    if ((UINT32)done * SECTOR_BLOCK >= cj->sectors) {
+    // Whoever takes the last slice takes the job off the queue, so the calc threads can move on to the next one.
+    if ((ULONG)pos == cj->num_slices - 1) {
         ExAcquireResourceExclusiveLite(&Vcb->calcthreads.lock, TRUE);
         RemoveEntryList(&cj->list_entry);
+        Vcb->calcthreads.queue_depth--;
         ExReleaseResourceLite(&Vcb->calcthreads.lock);
+    }
+
+    blocksize = min(cj->slice_sectors, cj->sectors - (pos * cj->slice_sectors));
+
+    calc_crc32c_sectors(cj->data + (pos * cj->slice_sectors * Vcb->superblock.sector_size), Vcb->superblock.sector_size, blocksize,
+                        &cj->csum[pos * cj->slice_sectors]);
+
+    if (submitter)
+        InterlockedIncrement64(&Vcb->calcthreads.slices_submitter);
+    else
+        InterlockedIncrement64(&Vcb->calcthreads.slices_threads);
 
+    done = InterlockedIncrement(&cj->done);
+
+    if ((ULONG)done == cj->num_slices)
         KeSetEvent(&cj->event, 0, FALSE);
-    }
 
     return TRUE;
 }
 
+// Rather than sitting idle while the calc threads do the work, the submitting thread works through
+// its own job alongside them, and only waits for the slices other threads have already taken.
+void do_calc_job(device_extension* Vcb, calc_job* cj) {
+    while (do_calc(Vcb, cj, TRUE)) { }
+
+    KeWaitForSingleObject(&cj->event, Executive, KernelMode, FALSE, NULL);
+}
+
 _Function_class_(KSTART_ROUTINE)
 void calc_thread(void* context) {
     drv_calc_thread* thread = context;
@@ -102,27 +159,46 @@ void calc_thread(void* context) {
         KeWaitForSingleObject(&Vcb->calcthreads.event, Executive, KernelMode, FALSE, NULL);
 
         while (TRUE) {
-            calc_job* cj;
-            BOOL b;
+            calc_job* cj = NULL;
+            LIST_ENTRY* le;
 
             ExAcquireResourceExclusiveLite(&Vcb->calcthreads.lock, TRUE);
 
-            if (IsListEmpty(&Vcb->calcthreads.job_list)) {
+            // skip over any jobs whose slices have all been taken, but which haven't been removed yet
+            le = Vcb->calcthreads.job_list.Flink;
+            while (le != &Vcb->calcthreads.job_list) {
+                calc_job* cj2 = CONTAINING_RECORD(le, calc_job, list_entry);
+
+                if (cj2->type == calc_job_compress || (ULONG)cj2->pos < cj2->num_slices) {
+                    cj = cj2;
+                    break;
+                }
+
+                le = le->Flink;
+            }
+
+            if (!cj) {
                 ExReleaseResourceLite(&Vcb->calcthreads.lock);
                 break;
             }
 
-            cj = CONTAINING_RECORD(Vcb->calcthreads.job_list.Flink, calc_job, list_entry);
-            cj->refcount++;
+            InterlockedIncrement(&cj->refcount);
+
+            // Compression jobs can't be split between threads, so take them off the list
+            // straight away to let the other threads get on with the jobs behind them.
+            if (cj->type == calc_job_compress) {
+                RemoveEntryList(&cj->list_entry);
+                Vcb->calcthreads.queue_depth--;
+            }
 
             ExReleaseResourceLite(&Vcb->calcthreads.lock);
 
-            b = do_calc(Vcb, cj);
+            if (cj->type == calc_job_compress)
+                do_compress(Vcb, cj);
+            else
+                do_calc(Vcb, cj, FALSE);
 
             free_calc_job(cj);
-
-            if (!b)
-                break;
         }
 
         if (thread->quit)
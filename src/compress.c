@@ -92,6 +92,31 @@ static void zstd_free(void* opaque, void* address);
 
 ZSTD_customMem zstd_mem = { .customAlloc = zstd_malloc, .customFree = zstd_free, .opaque = NULL };
 
+enum comp_context_type {
+    comp_context_deflate,
+    comp_context_inflate,
+    comp_context_zstd_c,
+    comp_context_zstd_d
+};
+
+#define NUM_COMP_CONTEXT_TYPES 4
+
+// Setting up a compression stream costs more than compressing a small extent with it at the
+// lower levels, so we keep the ones we've finished with on a free list and reset them instead.
+typedef struct {
+    enum comp_context_type type;
+    int level;
+    z_stream z;
+    ZSTD_CStream* zstd_c;
+    ZSTD_DStream* zstd_d;
+    LIST_ENTRY list_entry;
+} comp_context;
+
+static ERESOURCE comp_contexts_lock;
+static LIST_ENTRY comp_contexts[NUM_COMP_CONTEXT_TYPES];
+static ULONG num_comp_contexts[NUM_COMP_CONTEXT_TYPES];
+static ULONG max_comp_contexts;
+
 static UINT8 lzo_nextbyte(lzo_stream* stream) {
     UINT8 c;
 
@@ -325,197 +350,214 @@ static void zlib_free(void* opaque, void* ptr) {
     ExFreePool(ptr);
 }
 
-NTSTATUS zlib_decompress(UINT8* inbuf, UINT32 inlen, UINT8* outbuf, UINT32 outlen) {
-    z_stream c_stream;
+static void free_comp_context(comp_context* ctx) {
+    if (ctx->type == comp_context_deflate)
+        deflateEnd(&ctx->z);
+    else if (ctx->type == comp_context_inflate)
+        inflateEnd(&ctx->z);
+    else if (ctx->type == comp_context_zstd_c)
+        ZSTD_freeCStream(ctx->zstd_c);
+    else if (ctx->type == comp_context_zstd_d)
+        ZSTD_freeDStream(ctx->zstd_d);
+
+    ExFreePool(ctx);
+}
+
+static comp_context* get_comp_context(enum comp_context_type type, int level) {
+    comp_context* ctx;
+    LIST_ENTRY* le;
     int ret;
 
-    c_stream.zalloc = zlib_alloc;
-    c_stream.zfree = zlib_free;
-    c_stream.opaque = (voidpf)0;
+    ExAcquireResourceExclusiveLite(&comp_contexts_lock, TRUE);
 
-    ret = inflateInit(&c_stream);
+    le = comp_contexts[type].Flink;
+    while (le != &comp_contexts[type]) {
+        ctx = CONTAINING_RECORD(le, comp_context, list_entry);
 
-    if (ret != Z_OK) {
-        ERR("inflateInit returned %08x\n", ret);
-        return STATUS_INTERNAL_ERROR;
-    }
+        // zstd streams are given their parameters when they're initialized, so any level will do
+        if (type != comp_context_deflate || ctx->level == level) {
+            RemoveEntryList(&ctx->list_entry);
+            num_comp_contexts[type]--;
+            ExReleaseResourceLite(&comp_contexts_lock);
+            return ctx;
+        }
 
-    c_stream.next_in = inbuf;
-    c_stream.avail_in = inlen;
+        le = le->Flink;
+    }
 
-    c_stream.next_out = outbuf;
-    c_stream.avail_out = outlen;
+    ExReleaseResourceLite(&comp_contexts_lock);
 
-    do {
-        ret = inflate(&c_stream, Z_NO_FLUSH);
+    ctx = ExAllocatePoolWithTag(PagedPool, sizeof(comp_context), ALLOC_TAG);
+    if (!ctx) {
+        ERR("out of memory\n");
+        return NULL;
+    }
 
-        if (ret != Z_OK && ret != Z_STREAM_END) {
-            ERR("inflate returned %08x\n", ret);
-            inflateEnd(&c_stream);
-            return STATUS_INTERNAL_ERROR;
-        }
+    RtlZeroMemory(ctx, sizeof(comp_context));
 
-        if (c_stream.avail_out == 0)
-            break;
-    } while (ret != Z_STREAM_END);
+    ctx->type = type;
+    ctx->level = level;
 
-    ret = inflateEnd(&c_stream);
+    if (type == comp_context_deflate || type == comp_context_inflate) {
+        ctx->z.zalloc = zlib_alloc;
+        ctx->z.zfree = zlib_free;
+        ctx->z.opaque = (voidpf)0;
 
-    if (ret != Z_OK) {
-        ERR("inflateEnd returned %08x\n", ret);
-        return STATUS_INTERNAL_ERROR;
-    }
+        if (type == comp_context_deflate) {
+            ret = deflateInit(&ctx->z, level);
 
-    // FIXME - if we're short, should we zero the end of outbuf so we don't leak information into userspace?
+            if (ret != Z_OK) {
+                ERR("deflateInit returned %08x\n", ret);
+                ExFreePool(ctx);
+                return NULL;
+            }
+        } else {
+            ret = inflateInit(&ctx->z);
 
-    return STATUS_SUCCESS;
-}
+            if (ret != Z_OK) {
+                ERR("inflateInit returned %08x\n", ret);
+                ExFreePool(ctx);
+                return NULL;
+            }
+        }
+    } else if (type == comp_context_zstd_c) {
+        ctx->zstd_c = ZSTD_createCStream_advanced(zstd_mem);
 
-static NTSTATUS zlib_write_compressed_bit(fcb* fcb, UINT64 start_data, UINT64 end_data, void* data, BOOL* compressed, PIRP Irp, LIST_ENTRY* rollback) {
-    NTSTATUS Status;
-    UINT8 compression;
-    UINT32 comp_length;
-    UINT8* comp_data;
-    UINT32 out_left;
-    LIST_ENTRY* le;
-    chunk* c;
-    z_stream c_stream;
-    int ret;
+        if (!ctx->zstd_c) {
+            ERR("ZSTD_createCStream failed.\n");
+            ExFreePool(ctx);
+            return NULL;
+        }
+    } else {
+        ctx->zstd_d = ZSTD_createDStream_advanced(zstd_mem);
 
-    comp_data = ExAllocatePoolWithTag(PagedPool, (UINT32)(end_data - start_data), ALLOC_TAG);
-    if (!comp_data) {
-        ERR("out of memory\n");
-        return STATUS_INSUFFICIENT_RESOURCES;
+        if (!ctx->zstd_d) {
+            ERR("ZSTD_createDStream failed.\n");
+            ExFreePool(ctx);
+            return NULL;
+        }
     }
 
-    Status = excise_extents(fcb->Vcb, fcb, start_data, end_data, Irp, rollback);
-    if (!NT_SUCCESS(Status)) {
-        ERR("excise_extents returned %08x\n", Status);
-        ExFreePool(comp_data);
-        return Status;
+    return ctx;
+}
+
+// If reusable is FALSE, the stream was left in an unknown state by an error, so we throw it away.
+static void put_comp_context(comp_context* ctx, BOOL reusable) {
+    if (reusable) {
+        if (ctx->type == comp_context_deflate)
+            reusable = deflateReset(&ctx->z) == Z_OK;
+        else if (ctx->type == comp_context_inflate)
+            reusable = inflateReset(&ctx->z) == Z_OK;
     }
 
-    c_stream.zalloc = zlib_alloc;
-    c_stream.zfree = zlib_free;
-    c_stream.opaque = (voidpf)0;
+    if (reusable) {
+        ExAcquireResourceExclusiveLite(&comp_contexts_lock, TRUE);
 
-    ret = deflateInit(&c_stream, fcb->Vcb->options.zlib_level);
+        if (num_comp_contexts[ctx->type] < max_comp_contexts) {
+            InsertHeadList(&comp_contexts[ctx->type], &ctx->list_entry);
+            num_comp_contexts[ctx->type]++;
+            ExReleaseResourceLite(&comp_contexts_lock);
+            return;
+        }
 
-    if (ret != Z_OK) {
-        ERR("deflateInit returned %08x\n", ret);
-        ExFreePool(comp_data);
-        return STATUS_INTERNAL_ERROR;
+        ExReleaseResourceLite(&comp_contexts_lock);
     }
 
-    c_stream.avail_in = (UINT32)(end_data - start_data);
-    c_stream.next_in = data;
-    c_stream.avail_out = (UINT32)(end_data - start_data);
-    c_stream.next_out = comp_data;
-
-    do {
-        ret = deflate(&c_stream, Z_FINISH);
-
-        if (ret == Z_STREAM_ERROR) {
-            ERR("deflate returned %x\n", ret);
-            ExFreePool(comp_data);
-            return STATUS_INTERNAL_ERROR;
-        }
-    } while (c_stream.avail_in > 0 && c_stream.avail_out > 0);
+    free_comp_context(ctx);
+}
 
-    out_left = c_stream.avail_out;
+void init_comp_contexts() {
+    ULONG i;
 
-    ret = deflateEnd(&c_stream);
+    ExInitializeResourceLite(&comp_contexts_lock);
 
-    if (ret != Z_OK) {
-        ERR("deflateEnd returned %08x\n", ret);
-        ExFreePool(comp_data);
-        return STATUS_INTERNAL_ERROR;
+    for (i = 0; i < NUM_COMP_CONTEXT_TYPES; i++) {
+        InitializeListHead(&comp_contexts[i]);
+        num_comp_contexts[i] = 0;
     }
 
-    if (out_left < fcb->Vcb->superblock.sector_size) { // compressed extent would be larger than or same size as uncompressed extent
-        ExFreePool(comp_data);
+    // enough for each of the calc threads to have one
+    max_comp_contexts = KeQueryActiveProcessorCount(NULL);
+}
 
-        comp_length = (UINT32)(end_data - start_data);
-        comp_data = data;
-        compression = BTRFS_COMPRESSION_NONE;
+void free_comp_contexts() {
+    ULONG i;
 
-        *compressed = FALSE;
-    } else {
-        UINT32 cl;
+    for (i = 0; i < NUM_COMP_CONTEXT_TYPES; i++) {
+        while (!IsListEmpty(&comp_contexts[i])) {
+            comp_context* ctx = CONTAINING_RECORD(RemoveHeadList(&comp_contexts[i]), comp_context, list_entry);
 
-        compression = BTRFS_COMPRESSION_ZLIB;
-        cl = (UINT32)(end_data - start_data - out_left);
-        comp_length = (UINT32)sector_align(cl, fcb->Vcb->superblock.sector_size);
-
-        RtlZeroMemory(comp_data + cl, comp_length - cl);
+            free_comp_context(ctx);
+        }
 
-        *compressed = TRUE;
+        num_comp_contexts[i] = 0;
     }
 
-    ExAcquireResourceSharedLite(&fcb->Vcb->chunk_lock, TRUE);
+    ExDeleteResourceLite(&comp_contexts_lock);
+}
 
-    le = fcb->Vcb->chunks.Flink;
-    while (le != &fcb->Vcb->chunks) {
-        c = CONTAINING_RECORD(le, chunk, list_entry);
+NTSTATUS zlib_decompress(UINT8* inbuf, UINT32 inlen, UINT8* outbuf, UINT32 outlen) {
+    comp_context* ctx;
+    int ret;
 
-        if (!c->readonly && !c->reloc) {
-            acquire_chunk_lock(c, fcb->Vcb);
+    ctx = get_comp_context(comp_context_inflate, 0);
+    if (!ctx)
+        return STATUS_INTERNAL_ERROR;
 
-            if (c->chunk_item->type == fcb->Vcb->data_flags && (c->chunk_item->size - c->used) >= comp_length) {
-                if (insert_extent_chunk(fcb->Vcb, fcb, c, start_data, comp_length, FALSE, comp_data, Irp, rollback, compression, end_data - start_data, FALSE, 0)) {
-                    ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
+    ctx->z.next_in = inbuf;
+    ctx->z.avail_in = inlen;
 
-                    if (compression != BTRFS_COMPRESSION_NONE)
-                        ExFreePool(comp_data);
+    ctx->z.next_out = outbuf;
+    ctx->z.avail_out = outlen;
 
-                    return STATUS_SUCCESS;
-                }
-            }
+    do {
+        ret = inflate(&ctx->z, Z_NO_FLUSH);
 
-            release_chunk_lock(c, fcb->Vcb);
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            ERR("inflate returned %08x\n", ret);
+            put_comp_context(ctx, FALSE);
+            return STATUS_INTERNAL_ERROR;
         }
 
-        le = le->Flink;
-    }
-
-    ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
-
-    ExAcquireResourceExclusiveLite(&fcb->Vcb->chunk_lock, TRUE);
+        if (ctx->z.avail_out == 0)
+            break;
+    } while (ret != Z_STREAM_END);
 
-    Status = alloc_chunk(fcb->Vcb, fcb->Vcb->data_flags, &c, FALSE);
+    put_comp_context(ctx, TRUE);
 
-    ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
+    // FIXME - if we're short, should we zero the end of outbuf so we don't leak information into userspace?
 
-    if (!NT_SUCCESS(Status)) {
-        ERR("alloc_chunk returned %08x\n", Status);
+    return STATUS_SUCCESS;
+}
 
-        if (compression != BTRFS_COMPRESSION_NONE)
-            ExFreePool(comp_data);
+static NTSTATUS zlib_compress(UINT8* inbuf, UINT32 inlen, UINT8* outbuf, UINT32 outlen, unsigned int level, UINT32* space_left) {
+    comp_context* ctx;
+    int ret;
 
-        return Status;
-    }
+    ctx = get_comp_context(comp_context_deflate, level);
+    if (!ctx)
+        return STATUS_INTERNAL_ERROR;
 
-    if (c) {
-        acquire_chunk_lock(c, fcb->Vcb);
+    ctx->z.avail_in = inlen;
+    ctx->z.next_in = inbuf;
+    ctx->z.avail_out = outlen;
+    ctx->z.next_out = outbuf;
 
-        if (c->chunk_item->type == fcb->Vcb->data_flags && (c->chunk_item->size - c->used) >= comp_length) {
-            if (insert_extent_chunk(fcb->Vcb, fcb, c, start_data, comp_length, FALSE, comp_data, Irp, rollback, compression, end_data - start_data, FALSE, 0)) {
-                if (compression != BTRFS_COMPRESSION_NONE)
-                    ExFreePool(comp_data);
+    do {
+        ret = deflate(&ctx->z, Z_FINISH);
 
-                return STATUS_SUCCESS;
-            }
+        if (ret == Z_STREAM_ERROR) {
+            ERR("deflate returned %x\n", ret);
+            put_comp_context(ctx, FALSE);
+            return STATUS_INTERNAL_ERROR;
         }
+    } while (ctx->z.avail_in > 0 && ctx->z.avail_out > 0);
 
-        release_chunk_lock(c, fcb->Vcb);
-    }
-
-    WARN("couldn't find any data chunks with %llx bytes free\n", comp_length);
+    *space_left = ctx->z.avail_out;
 
-    if (compression != BTRFS_COMPRESSION_NONE)
-        ExFreePool(comp_data);
+    put_comp_context(ctx, TRUE);
 
-    return STATUS_DISK_FULL;
+    return STATUS_SUCCESS;
 }
 
 static NTSTATUS lzo_do_compress(const UINT8* in, UINT32 in_len, UINT8* out, UINT32* out_len, void* wrkmem) {
@@ -759,63 +801,36 @@ static __inline UINT32 lzo_max_outlen(UINT32 inlen) {
     return inlen + (inlen / 16) + 64 + 3; // formula comes from LZO.FAQ
 }
 
-static NTSTATUS lzo_write_compressed_bit(fcb* fcb, UINT64 start_data, UINT64 end_data, void* data, BOOL* compressed, PIRP Irp, LIST_ENTRY* rollback) {
+static NTSTATUS lzo_compress(UINT8* inbuf, UINT32 inlen, UINT8* outbuf, UINT32 outlen, UINT32* out_size) {
     NTSTATUS Status;
-    UINT8 compression;
-    UINT64 comp_length;
-    ULONG comp_data_len, num_pages, i;
-    UINT8* comp_data;
-    BOOL skip_compression = FALSE;
+    ULONG num_pages, i;
     lzo_stream stream;
-    UINT32* out_size;
-    LIST_ENTRY* le;
-    chunk* c;
 
-    num_pages = (ULONG)((sector_align(end_data - start_data, LINUX_PAGE_SIZE)) / LINUX_PAGE_SIZE);
+    UNUSED(outlen);
 
-    // Four-byte overall header
-    // Another four-byte header page
-    // Each page has a maximum size of lzo_max_outlen(LINUX_PAGE_SIZE)
-    // Plus another four bytes for possible padding
-    comp_data_len = sizeof(UINT32) + ((lzo_max_outlen(LINUX_PAGE_SIZE) + (2 * sizeof(UINT32))) * num_pages);
-
-    comp_data = ExAllocatePoolWithTag(PagedPool, comp_data_len, ALLOC_TAG);
-    if (!comp_data) {
-        ERR("out of memory\n");
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
+    num_pages = (ULONG)((sector_align(inlen, LINUX_PAGE_SIZE)) / LINUX_PAGE_SIZE);
 
     stream.wrkmem = ExAllocatePoolWithTag(PagedPool, LZO1X_MEM_COMPRESS, ALLOC_TAG);
     if (!stream.wrkmem) {
         ERR("out of memory\n");
-        ExFreePool(comp_data);
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    Status = excise_extents(fcb->Vcb, fcb, start_data, end_data, Irp, rollback);
-    if (!NT_SUCCESS(Status)) {
-        ERR("excise_extents returned %08x\n", Status);
-        ExFreePool(comp_data);
-        ExFreePool(stream.wrkmem);
-        return Status;
-    }
-
-    out_size = (UINT32*)comp_data;
     *out_size = sizeof(UINT32);
 
-    stream.in = data;
-    stream.out = comp_data + (2 * sizeof(UINT32));
+    stream.in = inbuf;
+    stream.out = outbuf + (2 * sizeof(UINT32));
 
     for (i = 0; i < num_pages; i++) {
         UINT32* pagelen = (UINT32*)(stream.out - sizeof(UINT32));
 
-        stream.inlen = (UINT32)min(LINUX_PAGE_SIZE, end_data - start_data - (i * LINUX_PAGE_SIZE));
+        stream.inlen = (UINT32)min(LINUX_PAGE_SIZE, inlen - (i * LINUX_PAGE_SIZE));
 
         Status = lzo1x_1_compress(&stream);
         if (!NT_SUCCESS(Status)) {
             ERR("lzo1x_1_compress returned %08x\n", Status);
-            skip_compression = TRUE;
-            break;
+            ExFreePool(stream.wrkmem);
+            return Status;
         }
 
         *pagelen = stream.outlen;
@@ -831,283 +846,140 @@ static NTSTATUS lzo_write_compressed_bit(fcb* fcb, UINT64 start_data, UINT64 end
         }
     }
 
-    ExFreePool(stream.wrkmem);
-
-    if (skip_compression || *out_size >= end_data - start_data - fcb->Vcb->superblock.sector_size) { // compressed extent would be larger than or same size as uncompressed extent
-        ExFreePool(comp_data);
-
-        comp_length = end_data - start_data;
-        comp_data = data;
-        compression = BTRFS_COMPRESSION_NONE;
-
-        *compressed = FALSE;
-    } else {
-        compression = BTRFS_COMPRESSION_LZO;
-        comp_length = sector_align(*out_size, fcb->Vcb->superblock.sector_size);
-
-        RtlZeroMemory(comp_data + *out_size, (ULONG)(comp_length - *out_size));
-
-        *compressed = TRUE;
-    }
-
-    ExAcquireResourceSharedLite(&fcb->Vcb->chunk_lock, TRUE);
-
-    le = fcb->Vcb->chunks.Flink;
-    while (le != &fcb->Vcb->chunks) {
-        c = CONTAINING_RECORD(le, chunk, list_entry);
-
-        if (!c->readonly && !c->reloc) {
-            acquire_chunk_lock(c, fcb->Vcb);
-
-            if (c->chunk_item->type == fcb->Vcb->data_flags && (c->chunk_item->size - c->used) >= comp_length) {
-                if (insert_extent_chunk(fcb->Vcb, fcb, c, start_data, comp_length, FALSE, comp_data, Irp, rollback, compression, end_data - start_data, FALSE, 0)) {
-                    ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
-
-                    if (compression != BTRFS_COMPRESSION_NONE)
-                        ExFreePool(comp_data);
-
-                    return STATUS_SUCCESS;
-                }
-            }
-
-            release_chunk_lock(c, fcb->Vcb);
-        }
-
-        le = le->Flink;
-    }
-
-    ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
-
-    ExAcquireResourceExclusiveLite(&fcb->Vcb->chunk_lock, TRUE);
-
-    Status = alloc_chunk(fcb->Vcb, fcb->Vcb->data_flags, &c, FALSE);
-
-    ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
-
-    if (!NT_SUCCESS(Status)) {
-        ERR("alloc_chunk returned %08x\n", Status);
-
-        if (compression != BTRFS_COMPRESSION_NONE)
-            ExFreePool(comp_data);
-
-        return Status;
-    }
-
-    if (c) {
-        acquire_chunk_lock(c, fcb->Vcb);
-
-        if (c->chunk_item->type == fcb->Vcb->data_flags && (c->chunk_item->size - c->used) >= comp_length) {
-            if (insert_extent_chunk(fcb->Vcb, fcb, c, start_data, comp_length, FALSE, comp_data, Irp, rollback, compression, end_data - start_data, FALSE, 0)) {
-                if (compression != BTRFS_COMPRESSION_NONE)
-                    ExFreePool(comp_data);
-
-                return STATUS_SUCCESS;
-            }
-        }
-
-        release_chunk_lock(c, fcb->Vcb);
-    }
-
-    WARN("couldn't find any data chunks with %llx bytes free\n", comp_length);
+    *(UINT32*)outbuf = *out_size;
 
-    if (compression != BTRFS_COMPRESSION_NONE)
-        ExFreePool(comp_data);
+    ExFreePool(stream.wrkmem);
 
-    return STATUS_DISK_FULL;
+    return STATUS_SUCCESS;
 }
 
-static NTSTATUS zstd_write_compressed_bit(fcb* fcb, UINT64 start_data, UINT64 end_data, void* data, BOOL* compressed, PIRP Irp, LIST_ENTRY* rollback) {
-    NTSTATUS Status;
-    UINT8 compression;
-    UINT32 comp_length;
-    UINT8* comp_data;
-    UINT32 out_left;
-    LIST_ENTRY* le;
-    chunk* c;
-    ZSTD_CStream* stream;
+static NTSTATUS zstd_compress(UINT8* inbuf, UINT32 inlen, UINT8* outbuf, UINT32 outlen, unsigned int level, UINT32* space_left) {
+    comp_context* ctx;
     size_t init_res, written;
     ZSTD_inBuffer input;
     ZSTD_outBuffer output;
     ZSTD_parameters params;
 
-    comp_data = ExAllocatePoolWithTag(PagedPool, (UINT32)(end_data - start_data), ALLOC_TAG);
-    if (!comp_data) {
-        ERR("out of memory\n");
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
-
-    Status = excise_extents(fcb->Vcb, fcb, start_data, end_data, Irp, rollback);
-    if (!NT_SUCCESS(Status)) {
-        ERR("excise_extents returned %08x\n", Status);
-        ExFreePool(comp_data);
-        return Status;
-    }
-
-    stream = ZSTD_createCStream_advanced(zstd_mem);
-
-    if (!stream) {
-        ERR("ZSTD_createCStream failed.\n");
-        ExFreePool(comp_data);
+    ctx = get_comp_context(comp_context_zstd_c, level);
+    if (!ctx)
         return STATUS_INTERNAL_ERROR;
-    }
 
-    params = ZSTD_getParams(fcb->Vcb->options.zstd_level, (UINT32)(end_data - start_data), 0);
+    params = ZSTD_getParams(level, inlen, 0);
 
     if (params.cParams.windowLog > ZSTD_BTRFS_MAX_WINDOWLOG)
         params.cParams.windowLog = ZSTD_BTRFS_MAX_WINDOWLOG;
 
-    init_res = ZSTD_initCStream_advanced(stream, NULL, 0, params, (UINT32)(end_data - start_data));
+    init_res = ZSTD_initCStream_advanced(ctx->zstd_c, NULL, 0, params, inlen);
 
     if (ZSTD_isError(init_res)) {
         ERR("ZSTD_initCStream_advanced failed: %s\n", ZSTD_getErrorName(init_res));
-        ZSTD_freeCStream(stream);
-        ExFreePool(comp_data);
+        put_comp_context(ctx, FALSE);
         return STATUS_INTERNAL_ERROR;
     }
 
-    input.src = data;
-    input.size = (UINT32)(end_data - start_data);
+    input.src = inbuf;
+    input.size = inlen;
     input.pos = 0;
 
-    output.dst = comp_data;
-    output.size = (UINT32)(end_data - start_data);
+    output.dst = outbuf;
+    output.size = outlen;
     output.pos = 0;
 
     while (input.pos < input.size && output.pos < output.size) {
-        written = ZSTD_compressStream(stream, &output, &input);
+        written = ZSTD_compressStream(ctx->zstd_c, &output, &input);
 
         if (ZSTD_isError(written)) {
             ERR("ZSTD_compressStream failed: %s\n", ZSTD_getErrorName(written));
-            ZSTD_freeCStream(stream);
-            ExFreePool(comp_data);
+            put_comp_context(ctx, FALSE);
             return STATUS_INTERNAL_ERROR;
         }
     }
 
-    written = ZSTD_endStream(stream, &output);
+    written = ZSTD_endStream(ctx->zstd_c, &output);
     if (ZSTD_isError(written)) {
         ERR("ZSTD_endStream failed: %s\n", ZSTD_getErrorName(written));
-        ZSTD_freeCStream(stream);
-        ExFreePool(comp_data);
+        put_comp_context(ctx, FALSE);
         return STATUS_INTERNAL_ERROR;
     }
 
-    ZSTD_freeCStream(stream);
+    put_comp_context(ctx, TRUE);
 
-    out_left = output.size - output.pos;
+    *space_left = (UINT32)(output.size - output.pos);
 
-    if (out_left < fcb->Vcb->superblock.sector_size) { // compressed extent would be larger than or same size as uncompressed extent
-        ExFreePool(comp_data);
-
-        comp_length = (UINT32)(end_data - start_data);
-        comp_data = data;
-        compression = BTRFS_COMPRESSION_NONE;
-
-        *compressed = FALSE;
-    } else {
-        UINT32 cl;
+    return STATUS_SUCCESS;
+}
 
-        compression = BTRFS_COMPRESSION_ZSTD;
-        cl = (UINT32)(end_data - start_data - out_left);
-        comp_length = (UINT32)sector_align(cl, fcb->Vcb->superblock.sector_size);
+UINT8 get_compression_type(fcb* fcb) {
+    if (fcb->Vcb->options.compress_type != 0 && fcb->prop_compression == PropCompression_None)
+        return fcb->Vcb->options.compress_type;
+
+    if (!(fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD) && fcb->prop_compression == PropCompression_ZSTD)
+        return BTRFS_COMPRESSION_ZSTD;
+    else if (fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD && fcb->prop_compression != PropCompression_Zlib && fcb->prop_compression != PropCompression_LZO)
+        return BTRFS_COMPRESSION_ZSTD;
+    else if (!(fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO) && fcb->prop_compression == PropCompression_LZO)
+        return BTRFS_COMPRESSION_LZO;
+    else if (fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO && fcb->prop_compression != PropCompression_Zlib)
+        return BTRFS_COMPRESSION_LZO;
+    else
+        return BTRFS_COMPRESSION_ZLIB;
+}
 
-        RtlZeroMemory(comp_data + cl, comp_length - cl);
+UINT32 compress_buffer_size(UINT8 compression, UINT32 inlen) {
+    if (compression == BTRFS_COMPRESSION_LZO) {
+        ULONG num_pages = (ULONG)((sector_align(inlen, LINUX_PAGE_SIZE)) / LINUX_PAGE_SIZE);
 
-        *compressed = TRUE;
+        // Four-byte overall header
+        // Another four-byte header page
+        // Each page has a maximum size of lzo_max_outlen(LINUX_PAGE_SIZE)
+        // Plus another four bytes for possible padding
+        return sizeof(UINT32) + ((lzo_max_outlen(LINUX_PAGE_SIZE) + (2 * sizeof(UINT32))) * num_pages);
     }
 
-    ExAcquireResourceSharedLite(&fcb->Vcb->chunk_lock, TRUE);
-
-    le = fcb->Vcb->chunks.Flink;
-    while (le != &fcb->Vcb->chunks) {
-        c = CONTAINING_RECORD(le, chunk, list_entry);
-
-        if (!c->readonly && !c->reloc) {
-            acquire_chunk_lock(c, fcb->Vcb);
+    return inlen;
+}
 
-            if (c->chunk_item->type == fcb->Vcb->data_flags && (c->chunk_item->size - c->used) >= comp_length) {
-                if (insert_extent_chunk(fcb->Vcb, fcb, c, start_data, comp_length, FALSE, comp_data, Irp, rollback, compression, end_data - start_data, FALSE, 0)) {
-                    ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
+// Compresses a single extent's worth of data into outbuf, which must be at least compress_buffer_size bytes long.
+// On success, comp_length is the sector-aligned length of the compressed data, or 0 if it wasn't worth compressing.
+// This doesn't touch the fcb or any trees, so it's safe to call from the calc threads.
+NTSTATUS compress_bit(device_extension* Vcb, UINT8 compression, void* inbuf, UINT32 inlen, void* outbuf, UINT32* comp_length) {
+    NTSTATUS Status;
+    UINT32 cl, space_left;
+    UINT32 outlen = compress_buffer_size(compression, inlen);
 
-                    if (compression != BTRFS_COMPRESSION_NONE)
-                        ExFreePool(comp_data);
+    if (compression == BTRFS_COMPRESSION_LZO) {
+        Status = lzo_compress(inbuf, inlen, outbuf, outlen, &cl);
 
-                    return STATUS_SUCCESS;
-                }
-            }
+        if (Status == STATUS_INSUFFICIENT_RESOURCES)
+            return Status;
 
-            release_chunk_lock(c, fcb->Vcb);
+        // compressed extent would be larger than or same size as uncompressed extent
+        if (!NT_SUCCESS(Status) || cl >= inlen - Vcb->superblock.sector_size) {
+            *comp_length = 0;
+            return STATUS_SUCCESS;
         }
+    } else {
+        if (compression == BTRFS_COMPRESSION_ZSTD)
+            Status = zstd_compress(inbuf, inlen, outbuf, outlen, Vcb->options.zstd_level, &space_left);
+        else
+            Status = zlib_compress(inbuf, inlen, outbuf, outlen, Vcb->options.zlib_level, &space_left);
 
-        le = le->Flink;
-    }
-
-    ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
-
-    ExAcquireResourceExclusiveLite(&fcb->Vcb->chunk_lock, TRUE);
-
-    Status = alloc_chunk(fcb->Vcb, fcb->Vcb->data_flags, &c, FALSE);
-
-    ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
-
-    if (!NT_SUCCESS(Status)) {
-        ERR("alloc_chunk returned %08x\n", Status);
-
-        if (compression != BTRFS_COMPRESSION_NONE)
-            ExFreePool(comp_data);
-
-        return Status;
-    }
-
-    if (c) {
-        acquire_chunk_lock(c, fcb->Vcb);
-
-        if (c->chunk_item->type == fcb->Vcb->data_flags && (c->chunk_item->size - c->used) >= comp_length) {
-            if (insert_extent_chunk(fcb->Vcb, fcb, c, start_data, comp_length, FALSE, comp_data, Irp, rollback, compression, end_data - start_data, FALSE, 0)) {
-                if (compression != BTRFS_COMPRESSION_NONE)
-                    ExFreePool(comp_data);
+        if (!NT_SUCCESS(Status))
+            return Status;
 
-                return STATUS_SUCCESS;
-            }
+        if (space_left < Vcb->superblock.sector_size) { // compressed extent would be larger than or same size as uncompressed extent
+            *comp_length = 0;
+            return STATUS_SUCCESS;
         }
 
-        release_chunk_lock(c, fcb->Vcb);
+        cl = inlen - space_left;
     }
 
-    WARN("couldn't find any data chunks with %llx bytes free\n", comp_length);
-
-    if (compression != BTRFS_COMPRESSION_NONE)
-        ExFreePool(comp_data);
-
-    return STATUS_DISK_FULL;
-}
+    *comp_length = (UINT32)sector_align(cl, Vcb->superblock.sector_size);
 
-NTSTATUS write_compressed_bit(fcb* fcb, UINT64 start_data, UINT64 end_data, void* data, BOOL* compressed, PIRP Irp, LIST_ENTRY* rollback) {
-    UINT8 type;
+    RtlZeroMemory((UINT8*)outbuf + cl, *comp_length - cl);
 
-    if (fcb->Vcb->options.compress_type != 0 && fcb->prop_compression == PropCompression_None)
-        type = fcb->Vcb->options.compress_type;
-    else {
-        if (!(fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD) && fcb->prop_compression == PropCompression_ZSTD)
-            type = BTRFS_COMPRESSION_ZSTD;
-        else if (fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD && fcb->prop_compression != PropCompression_Zlib && fcb->prop_compression != PropCompression_LZO)
-            type = BTRFS_COMPRESSION_ZSTD;
-        else if (!(fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO) && fcb->prop_compression == PropCompression_LZO)
-            type = BTRFS_COMPRESSION_LZO;
-        else if (fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO && fcb->prop_compression != PropCompression_Zlib)
-            type = BTRFS_COMPRESSION_LZO;
-        else
-            type = BTRFS_COMPRESSION_ZLIB;
-    }
-
-    if (type == BTRFS_COMPRESSION_ZSTD) {
-        fcb->Vcb->superblock.incompat_flags |= BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD;
-        return zstd_write_compressed_bit(fcb, start_data, end_data, data, compressed, Irp, rollback);
-    } else if (type == BTRFS_COMPRESSION_LZO) {
-        fcb->Vcb->superblock.incompat_flags |= BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO;
-        return lzo_write_compressed_bit(fcb, start_data, end_data, data, compressed, Irp, rollback);
-    } else
-        return zlib_write_compressed_bit(fcb, start_data, end_data, data, compressed, Irp, rollback);
+    return STATUS_SUCCESS;
 }
 
 static void* zstd_malloc(void* opaque, size_t size) {
@@ -1123,25 +995,21 @@ static void zstd_free(void* opaque, void* address) {
 }
 
 NTSTATUS zstd_decompress(UINT8* inbuf, UINT32 inlen, UINT8* outbuf, UINT32 outlen) {
-    NTSTATUS Status;
-    ZSTD_DStream* stream;
+    comp_context* ctx;
     size_t init_res, read;
     ZSTD_inBuffer input;
     ZSTD_outBuffer output;
 
-    stream = ZSTD_createDStream_advanced(zstd_mem);
-
-    if (!stream) {
-        ERR("ZSTD_createDStream failed.\n");
+    ctx = get_comp_context(comp_context_zstd_d, 0);
+    if (!ctx)
         return STATUS_INTERNAL_ERROR;
-    }
 
-    init_res = ZSTD_initDStream(stream);
+    init_res = ZSTD_initDStream(ctx->zstd_d);
 
     if (ZSTD_isError(init_res)) {
         ERR("ZSTD_initDStream failed: %s\n", ZSTD_getErrorName(init_res));
-        Status = STATUS_INTERNAL_ERROR;
-        goto end;
+        put_comp_context(ctx, FALSE);
+        return STATUS_INTERNAL_ERROR;
     }
 
     input.src = inbuf;
@@ -1152,18 +1020,15 @@ NTSTATUS zstd_decompress(UINT8* inbuf, UINT32 inlen, UINT8* outbuf, UINT32 outle
     output.size = outlen;
     output.pos = 0;
 
-    read = ZSTD_decompressStream(stream, &output, &input);
+    read = ZSTD_decompressStream(ctx->zstd_d, &output, &input);
 
     if (ZSTD_isError(read)) {
         ERR("ZSTD_decompressStream failed: %s\n", ZSTD_getErrorName(read));
-        Status = STATUS_INTERNAL_ERROR;
-        goto end;
+        put_comp_context(ctx, FALSE);
+        return STATUS_INTERNAL_ERROR;
     }
 
-    Status = STATUS_SUCCESS;
+    put_comp_context(ctx, TRUE);
 
-end:
-    ZSTD_freeDStream(stream);
-
-    return Status;
+    return STATUS_SUCCESS;
 }
@@ -55,6 +55,9 @@ static const UINT32 crctable[] = {
     0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e, 0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351,
 };
 
+// crctable_slice[n][i] is the CRC of byte i followed by n + 1 zero bytes, built by init_crc32c
+static UINT32 crctable_slice[7][256];
+
 // HW code taken from https://github.com/rurban/smhasher/blob/master/crc32_hw.c
 #define ALIGN_SIZE      0x08UL
 #define ALIGN_MASK      (ALIGN_SIZE - 1)
@@ -105,19 +108,93 @@ static UINT32 crc32c_hw(const void *input, ULONG len, UINT32 crc) {
     return crc;
 }
 
-UINT32 calc_crc32c(_In_ UINT32 seed, _In_reads_bytes_(msglen) UINT8* msg, _In_ ULONG msglen) {
-    UINT32 rem;
+static UINT32 crc32c_slice8(const UINT8* buf, ULONG len, UINT32 crc) {
+    for (; len > 0 && ((size_t)buf & ALIGN_MASK); len--, buf++) {
+        crc = crctable[(crc ^ *buf) & 0xff] ^ (crc >> 8);
+    }
+
+    for (; len >= 8; len -= 8, buf += 8) {
+        UINT32 lo = *(UINT32*)buf ^ crc;
+        UINT32 hi = *(UINT32*)(buf + 4);
+
+        crc = crctable_slice[6][lo & 0xff] ^ crctable_slice[5][(lo >> 8) & 0xff] ^
+              crctable_slice[4][(lo >> 16) & 0xff] ^ crctable_slice[3][lo >> 24] ^
+              crctable_slice[2][hi & 0xff] ^ crctable_slice[1][(hi >> 8) & 0xff] ^
+              crctable_slice[0][(hi >> 16) & 0xff] ^ crctable[hi >> 24];
+    }
+
+    for (; len > 0; len--, buf++) {
+        crc = crctable[(crc ^ *buf) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+// The CRC32 instruction has a latency of three cycles but a throughput of one, so a single
+// dependency chain leaves it idle two-thirds of the time. Each sector's checksum is independent,
+// so we interleave three of them. len must be a multiple of eight, which sector sizes always are.
+static void crc32c_hw_x3(const UINT8* buf, ULONG len, UINT32* csum) {
+    const UINT8* buf2 = buf + len;
+    const UINT8* buf3 = buf + (2 * len);
     ULONG i;
+#ifdef _AMD64_
+    UINT64 crc1 = 0xffffffff, crc2 = 0xffffffff, crc3 = 0xffffffff;
 
-    if (have_sse42) {
-        return crc32c_hw(msg, msglen, seed);
-    } else {
-        rem = seed;
+    for (i = 0; i < len; i += sizeof(UINT64)) {
+        crc1 = _mm_crc32_u64(crc1, *(UINT64*)(buf + i));
+        crc2 = _mm_crc32_u64(crc2, *(UINT64*)(buf2 + i));
+        crc3 = _mm_crc32_u64(crc3, *(UINT64*)(buf3 + i));
+    }
+#else
+    UINT32 crc1 = 0xffffffff, crc2 = 0xffffffff, crc3 = 0xffffffff;
 
-        for (i = 0; i < msglen; i++) {
-            rem = crctable[(rem ^ msg[i]) & 0xff] ^ (rem >> 8);
+    for (i = 0; i < len; i += sizeof(UINT32)) {
+        crc1 = _mm_crc32_u32(crc1, *(UINT32*)(buf + i));
+        crc2 = _mm_crc32_u32(crc2, *(UINT32*)(buf2 + i));
+        crc3 = _mm_crc32_u32(crc3, *(UINT32*)(buf3 + i));
+    }
+#endif
+
+    csum[0] = ~(UINT32)crc1;
+    csum[1] = ~(UINT32)crc2;
+    csum[2] = ~(UINT32)crc3;
+}
+
+void init_crc32c() {
+    ULONG i, j;
+
+    for (i = 0; i < 256; i++) {
+        UINT32 crc = crctable[i];
+
+        for (j = 0; j < 7; j++) {
+            crc = crctable[crc & 0xff] ^ (crc >> 8);
+            crctable_slice[j][i] = crc;
         }
     }
+}
+
+UINT32 calc_crc32c(_In_ UINT32 seed, _In_reads_bytes_(msglen) UINT8* msg, _In_ ULONG msglen) {
+    if (have_sse42)
+        return crc32c_hw(msg, msglen, seed);
+    else
+        return crc32c_slice8(msg, msglen, seed);
+}
+
+// Equivalent to csum[i] = ~calc_crc32c(0xffffffff, data + (i * sector_size), sector_size) for each sector.
+void calc_crc32c_sectors(_In_reads_bytes_(sector_size * sectors) UINT8* data, _In_ ULONG sector_size, _In_ ULONG sectors, _Out_writes_(sectors) UINT32* csum) {
+    ULONG i = 0;
+
+    if (have_sse42) {
+        for (; i + 3 <= sectors; i += 3) {
+            crc32c_hw_x3(data + (i * sector_size), sector_size, &csum[i]);
+        }
 
-    return rem;
+        for (; i < sectors; i++) {
+            csum[i] = ~crc32c_hw(data + (i * sector_size), sector_size, 0xffffffff);
+        }
+    } else {
+        for (; i < sectors; i++) {
+            csum[i] = ~crc32c_slice8(data + (i * sector_size), sector_size, 0xffffffff);
+        }
+    }
 }
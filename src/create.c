@@ -566,57 +566,301 @@ cont:
     return STATUS_SUCCESS;
 }
 
+static void move_list(LIST_ENTRY* dest, LIST_ENTRY* src) {
+    if (IsListEmpty(src)) {
+        InitializeListHead(dest);
+        return;
+    }
+
+    dest->Flink = src->Flink;
+    dest->Blink = src->Blink;
+    dest->Flink->Blink = dest;
+    dest->Blink->Flink = dest;
+
+    InitializeListHead(src);
+}
+
+static void free_dir_cache_entry(device_extension* Vcb, dir_cache_entry* dce) {
+    RemoveEntryList(&dce->list_entry);
+    RemoveEntryList(&dce->list_entry_hash);
+
+    Vcb->dir_cache_size -= dce->size;
+
+    while (!IsListEmpty(&dce->dir_children_index)) {
+        dir_child* dc = CONTAINING_RECORD(RemoveHeadList(&dce->dir_children_index), dir_child, list_entry_index);
+
+        ExFreePool(dc->utf8.Buffer);
+        ExFreePool(dc->name.Buffer);
+        ExFreePool(dc->name_uc.Buffer);
+        ExFreePool(dc);
+    }
+
+    ExFreePool(dce->hash_ptrs);
+    ExFreePool(dce->hash_ptrs_uc);
+    ExFreePool(dce);
+}
+
+// Called by free_fcb - rather than throwing away the children of a directory, we keep them
+// around so that if the directory is opened again we don't have to call load_dir_children.
+// Anything that changes a directory's entries does so through its fcb, which takes the list
+// back out of the cache, so the entries here are never out of date.
+BOOL cache_dir_children(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) device_extension* Vcb, fcb* fcb) {
+    dir_cache_entry* dce;
+    UINT64 size, max_size = (UINT64)Vcb->options.dir_cache_size * 1048576;
+    LIST_ENTRY* le;
+
+    if (max_size == 0 || Vcb->removing || fcb == Vcb->dummy_fcb || fcb->deleted || fcb->ads || !fcb->subvol || !fcb->hash_ptrs || !fcb->hash_ptrs_uc)
+        return FALSE;
+
+    size = sizeof(dir_cache_entry) + (2 * sizeof(LIST_ENTRY*) * 256);
+
+    le = fcb->dir_children_index.Flink;
+    while (le != &fcb->dir_children_index) {
+        dir_child* dc = CONTAINING_RECORD(le, dir_child, list_entry_index);
+
+        if (dc->fileref)
+            return FALSE;
+
+        size += sizeof(dir_child) + dc->utf8.Length + dc->name.Length + dc->name_uc.Length;
+
+        le = le->Flink;
+    }
+
+    if (size > max_size)
+        return FALSE;
+
+    dce = ExAllocatePoolWithTag(PagedPool, sizeof(dir_cache_entry), ALLOC_TAG);
+    if (!dce) {
+        ERR("out of memory\n");
+        return FALSE;
+    }
+
+    dce->subvol_id = fcb->subvol->id;
+    dce->inode = fcb->inode;
+    dce->size = size;
+
+    move_list(&dce->dir_children_index, &fcb->dir_children_index);
+    move_list(&dce->dir_children_hash, &fcb->dir_children_hash);
+    move_list(&dce->dir_children_hash_uc, &fcb->dir_children_hash_uc);
+
+    dce->hash_ptrs = fcb->hash_ptrs;
+    dce->hash_ptrs_uc = fcb->hash_ptrs_uc;
+    fcb->hash_ptrs = NULL;
+    fcb->hash_ptrs_uc = NULL;
+
+    InsertTailList(&Vcb->dir_cache, &dce->list_entry);
+    InsertTailList(&Vcb->dir_cache_hash[(dce->inode + dce->subvol_id) % DIR_CACHE_BUCKETS], &dce->list_entry_hash);
+    Vcb->dir_cache_size += size;
+
+    while (Vcb->dir_cache_size > max_size) {
+        free_dir_cache_entry(Vcb, CONTAINING_RECORD(Vcb->dir_cache.Flink, dir_cache_entry, list_entry));
+        Vcb->dir_cache_evictions++;
+    }
+
+    return TRUE;
+}
+
+static BOOL get_cached_dir_children(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) device_extension* Vcb, fcb* fcb) {
+    LIST_ENTRY* head;
+    LIST_ENTRY* le;
+
+    if (Vcb->options.dir_cache_size == 0)
+        return FALSE;
+
+    head = &Vcb->dir_cache_hash[(fcb->inode + fcb->subvol->id) % DIR_CACHE_BUCKETS];
+
+    le = head->Flink;
+    while (le != head) {
+        dir_cache_entry* dce = CONTAINING_RECORD(le, dir_cache_entry, list_entry_hash);
+
+        if (dce->inode == fcb->inode && dce->subvol_id == fcb->subvol->id) {
+            move_list(&fcb->dir_children_index, &dce->dir_children_index);
+            move_list(&fcb->dir_children_hash, &dce->dir_children_hash);
+            move_list(&fcb->dir_children_hash_uc, &dce->dir_children_hash_uc);
+
+            fcb->hash_ptrs = dce->hash_ptrs;
+            fcb->hash_ptrs_uc = dce->hash_ptrs_uc;
+
+            RemoveEntryList(&dce->list_entry);
+            RemoveEntryList(&dce->list_entry_hash);
+            Vcb->dir_cache_size -= dce->size;
+
+            ExFreePool(dce);
+
+            Vcb->dir_cache_hits++;
+
+            return TRUE;
+        }
+
+        le = le->Flink;
+    }
+
+    Vcb->dir_cache_misses++;
+
+    return FALSE;
+}
+
+void free_dir_cache(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) device_extension* Vcb) {
+    while (!IsListEmpty(&Vcb->dir_cache)) {
+        free_dir_cache_entry(Vcb, CONTAINING_RECORD(Vcb->dir_cache.Flink, dir_cache_entry, list_entry));
+    }
+}
+
+#define FCB_HASH_MIN_SIZE 256
+#define FCB_HASH_MAX_SIZE 65536
+
+// Rebuilds subvol->fcbs_hash from subvol->fcbs, so every non-stream fcb in the list ends up in it.
+static BOOL build_fcbs_hash(root* subvol, ULONG size) {
+    LIST_ENTRY *hash, *le;
+    ULONG i;
+
+    hash = ExAllocatePoolWithTag(PagedPool, sizeof(LIST_ENTRY) * size, ALLOC_TAG);
+    if (!hash) {
+        ERR("out of memory\n");
+        return FALSE;
+    }
+
+    for (i = 0; i < size; i++) {
+        InitializeListHead(&hash[i]);
+    }
+
+    if (subvol->fcbs_hash)
+        ExFreePool(subvol->fcbs_hash);
+
+    subvol->fcbs_hash = hash;
+    subvol->fcbs_hash_size = size;
+    subvol->num_fcbs = 0;
+
+    le = subvol->fcbs.Flink;
+    while (le != &subvol->fcbs) {
+        struct _fcb* fcb = CONTAINING_RECORD(le, struct _fcb, list_entry);
+
+        if (!fcb->ads) {
+            InsertTailList(&hash[fcb->inode % size], &fcb->list_entry_hash);
+            subvol->num_fcbs++;
+        }
+
+        le = le->Flink;
+    }
+
+    return TRUE;
+}
+
+// Call this after adding the fcb to subvol->fcbs, and whenever its inode changes.
+void add_fcb_to_hash(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) device_extension* Vcb, fcb* fcb) {
+    root* subvol = fcb->subvol;
+
+    UNUSED(Vcb);
+
+    if (fcb->ads || fcb->list_entry_hash.Flink)
+        return;
+
+    if (!subvol->fcbs_hash || (subvol->num_fcbs >= subvol->fcbs_hash_size * 2 && subvol->fcbs_hash_size < FCB_HASH_MAX_SIZE)) {
+        if (build_fcbs_hash(subvol, subvol->fcbs_hash ? (subvol->fcbs_hash_size * 2) : FCB_HASH_MIN_SIZE))
+            return;
+
+        if (!subvol->fcbs_hash) // find_fcb_in_subvol will have to walk the list
+            return;
+    }
+
+    InsertTailList(&subvol->fcbs_hash[fcb->inode % subvol->fcbs_hash_size], &fcb->list_entry_hash);
+    subvol->num_fcbs++;
+}
+
+void remove_fcb_from_hash(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) device_extension* Vcb, fcb* fcb) {
+    UNUSED(Vcb);
+
+    if (!fcb->list_entry_hash.Flink)
+        return;
+
+    RemoveEntryList(&fcb->list_entry_hash);
+    fcb->list_entry_hash.Flink = fcb->list_entry_hash.Blink = NULL;
+
+    fcb->subvol->num_fcbs--;
+}
+
+// Returns the fcb for an inode if it's already open, preferring one which isn't deleted.
+fcb* find_fcb_in_subvol(_Requires_exclusive_lock_held_(_Curr_->fcb_lock) device_extension* Vcb, root* subvol, UINT64 inode) {
+    fcb *fcb, *deleted_fcb = NULL;
+    LIST_ENTRY *head, *le;
+#ifdef DEBUG_STATS
+    LARGE_INTEGER time1, time2;
+
+    time1 = KeQueryPerformanceCounter(NULL);
+#else
+    UNUSED(Vcb);
+#endif
+
+    if (subvol->fcbs_hash) {
+        head = &subvol->fcbs_hash[inode % subvol->fcbs_hash_size];
+
+        le = head->Flink;
+        while (le != head) {
+            fcb = CONTAINING_RECORD(le, struct _fcb, list_entry_hash);
+
+            if (fcb->inode == inode) {
+                if (!fcb->deleted)
+                    goto end;
+
+                deleted_fcb = fcb;
+            }
+
+            le = le->Flink;
+        }
+    } else {
+        head = &subvol->fcbs;
+
+        le = head->Flink;
+        while (le != head) {
+            fcb = CONTAINING_RECORD(le, struct _fcb, list_entry);
+
+            if (fcb->inode == inode && !fcb->ads) {
+                if (!fcb->deleted)
+                    goto end;
+
+                deleted_fcb = fcb;
+            }
+
+            le = le->Flink;
+        }
+    }
+
+    fcb = deleted_fcb;
+
+end:
+#ifdef DEBUG_STATS
+    time2 = KeQueryPerformanceCounter(NULL);
+    Vcb->stats.fcb_lookup_time += time2.QuadPart - time1.QuadPart;
+#endif
+
+    return fcb;
+}
+
 NTSTATUS open_fcb(_Requires_lock_held_(_Curr_->tree_lock) _Requires_exclusive_lock_held_(_Curr_->fcb_lock) device_extension* Vcb,
                   root* subvol, UINT64 inode, UINT8 type, PANSI_STRING utf8, fcb* parent, fcb** pfcb, POOL_TYPE pooltype, PIRP Irp) {
     KEY searchkey;
     traverse_ptr tp, next_tp;
     NTSTATUS Status;
-    fcb *fcb, *deleted_fcb = NULL;
+    fcb* fcb;
     BOOL atts_set = FALSE, sd_set = FALSE, no_data;
-    LIST_ENTRY* lastle = NULL;
     EXTENT_DATA* ed = NULL;
 
-    if (!IsListEmpty(&subvol->fcbs)) {
-        LIST_ENTRY* le = subvol->fcbs.Flink;
-
-        while (le != &subvol->fcbs) {
-            fcb = CONTAINING_RECORD(le, struct _fcb, list_entry);
+    fcb = find_fcb_in_subvol(Vcb, subvol, inode);
 
-            if (fcb->inode == inode) {
-                if (!fcb->ads) {
-                    if (fcb->deleted)
-                        deleted_fcb = fcb;
-                    else {
+    if (fcb) {
 #ifdef DEBUG_FCB_REFCOUNTS
-                        LONG rc = InterlockedIncrement(&fcb->refcount);
+        LONG rc = InterlockedIncrement(&fcb->refcount);
 
-                        WARN("fcb %p: refcount now %i (subvol %llx, inode %llx)\n", fcb, rc, fcb->subvol->id, fcb->inode);
+        WARN("fcb %p: refcount now %i (subvol %llx, inode %llx)\n", fcb, rc, fcb->subvol->id, fcb->inode);
 #else
-                        InterlockedIncrement(&fcb->refcount);
+        InterlockedIncrement(&fcb->refcount);
 #endif
 
-                        *pfcb = fcb;
-                        return STATUS_SUCCESS;
-                    }
-                }
-            } else if (fcb->inode > inode) {
-                if (deleted_fcb) {
-                    InterlockedIncrement(&deleted_fcb->refcount);
-                    *pfcb = deleted_fcb;
-                    return STATUS_SUCCESS;
-                }
-
-                lastle = le->Blink;
-                break;
-            }
-
-            le = le->Flink;
-        }
-    }
+#ifdef DEBUG_STATS
+        Vcb->stats.open_fcb_cached++;
+#endif
 
-    if (deleted_fcb) {
-        InterlockedIncrement(&deleted_fcb->refcount);
-        *pfcb = deleted_fcb;
+        *pfcb = fcb;
         return STATUS_SUCCESS;
     }
 
@@ -1072,10 +1316,17 @@ NTSTATUS open_fcb(_Requires_lock_held_(_Curr_->tree_lock) _Requires_exclusive_lo
         }
     }
 
-    if (fcb->type == BTRFS_TYPE_DIRECTORY) {
+    if (fcb->type == BTRFS_TYPE_DIRECTORY && !get_cached_dir_children(Vcb, fcb)) {
         Status = load_dir_children(Vcb, fcb, FALSE, Irp);
         if (!NT_SUCCESS(Status)) {
             ERR("load_dir_children returned %08x\n", Status);
+
+            // don't let free_fcb put a partial list into the dir cache
+            if (fcb->hash_ptrs) {
+                ExFreePool(fcb->hash_ptrs);
+                fcb->hash_ptrs = NULL;
+            }
+
             free_fcb(Vcb, fcb);
             return Status;
         }
@@ -1110,10 +1361,8 @@ NTSTATUS open_fcb(_Requires_lock_held_(_Curr_->tree_lock) _Requires_exclusive_lo
         }
     }
 
-    if (lastle)
-        InsertHeadList(lastle, &fcb->list_entry);
-    else
-        InsertTailList(&subvol->fcbs, &fcb->list_entry);
+    InsertTailList(&subvol->fcbs, &fcb->list_entry);
+    add_fcb_to_hash(Vcb, fcb);
 
     InsertTailList(&Vcb->all_fcbs, &fcb->list_entry_all);
 
@@ -1348,6 +1597,9 @@ NTSTATUS open_fileref_child(_Requires_lock_held_(_Curr_->tree_lock) _Requires_ex
                 time2 = KeQueryPerformanceCounter(NULL);
                 Vcb->stats.open_fcb_calls++;
                 Vcb->stats.open_fcb_time += time2.QuadPart - time1.QuadPart;
+
+                if ((UINT64)(time2.QuadPart - time1.QuadPart) > Vcb->stats.open_fcb_max_time)
+                    Vcb->stats.open_fcb_max_time = time2.QuadPart - time1.QuadPart;
 #endif
 
                 if (!NT_SUCCESS(Status)) {
@@ -2174,6 +2426,7 @@ static NTSTATUS file_create2(_In_ PIRP Irp, _Requires_exclusive_lock_held_(_Curr
     increase_fileref_refcount(parfileref);
 
     InsertTailList(&fcb->subvol->fcbs, &fcb->list_entry);
+    add_fcb_to_hash(Vcb, fcb);
     InsertTailList(&Vcb->all_fcbs, &fcb->list_entry_all);
 
     *pfr = fileref;
@@ -3263,9 +3516,7 @@ static NTSTATUS open_file(PDEVICE_OBJECT DeviceObject, _Requires_lock_held_(_Cur
             if (fileref->fcb->type == BTRFS_TYPE_DIRECTORY || is_subvol_readonly(fileref->fcb->subvol, Irp)) {
                 Status = STATUS_ACCESS_DENIED;
 
-                acquire_fcb_lock_exclusive(Vcb);
-                free_fileref(Vcb, fileref);
-                release_fcb_lock(Vcb);
+                release_fileref(Vcb, fileref);
 
                 goto exit;
             }
@@ -3273,9 +3524,7 @@ static NTSTATUS open_file(PDEVICE_OBJECT DeviceObject, _Requires_lock_held_(_Cur
             if (Vcb->readonly) {
                 Status = STATUS_MEDIA_WRITE_PROTECTED;
 
-                acquire_fcb_lock_exclusive(Vcb);
-                free_fileref(Vcb, fileref);
-                release_fcb_lock(Vcb);
+                release_fileref(Vcb, fileref);
 
                 goto exit;
             }
@@ -3284,9 +3533,7 @@ static NTSTATUS open_file(PDEVICE_OBJECT DeviceObject, _Requires_lock_held_(_Cur
             if (!MmCanFileBeTruncated(&fileref->fcb->nonpaged->segment_object, &zero)) {
                 Status = STATUS_USER_MAPPED_FILE;
 
-                acquire_fcb_lock_exclusive(Vcb);
-                free_fileref(Vcb, fileref);
-                release_fcb_lock(Vcb);
+                release_fileref(Vcb, fileref);
 
                 goto exit;
             }
@@ -3303,9 +3550,7 @@ static NTSTATUS open_file(PDEVICE_OBJECT DeviceObject, _Requires_lock_held_(_Cur
                 SeUnlockSubjectContext(&IrpSp->Parameters.Create.SecurityContext->AccessState->SubjectSecurityContext);
                 TRACE("SeAccessCheck failed, returning %08x\n", Status);
 
-                acquire_fcb_lock_exclusive(Vcb);
-                free_fileref(Vcb, fileref);
-                release_fcb_lock(Vcb);
+                release_fileref(Vcb, fileref);
 
                 goto exit;
             }
@@ -3322,9 +3567,7 @@ static NTSTATUS open_file(PDEVICE_OBJECT DeviceObject, _Requires_lock_held_(_Cur
                 TRACE("could not open as deletion pending\n");
                 Status = STATUS_DELETE_PENDING;
 
-                acquire_fcb_lock_exclusive(Vcb);
-                free_fileref(Vcb, fileref);
-                release_fcb_lock(Vcb);
+                release_fileref(Vcb, fileref);
 
                 goto exit;
             }
@@ -3337,9 +3580,7 @@ static NTSTATUS open_file(PDEVICE_OBJECT DeviceObject, _Requires_lock_held_(_Cur
         if (options & FILE_DELETE_ON_CLOSE && (fileref == Vcb->root_fileref || readonly)) {
             Status = STATUS_CANNOT_DELETE;
 
-            acquire_fcb_lock_exclusive(Vcb);
-            free_fileref(Vcb, fileref);
-            release_fcb_lock(Vcb);
+            release_fileref(Vcb, fileref);
 
             goto exit;
         }
@@ -3371,9 +3612,7 @@ static NTSTATUS open_file(PDEVICE_OBJECT DeviceObject, _Requires_lock_held_(_Cur
             } else if (granted_access & ~allowed) {
                 Status = Vcb->readonly ? STATUS_MEDIA_WRITE_PROTECTED : STATUS_ACCESS_DENIED;
 
-                acquire_fcb_lock_exclusive(Vcb);
-                free_fileref(Vcb, fileref);
-                release_fcb_lock(Vcb);
+                release_fileref(Vcb, fileref);
 
                 goto exit;
             }
@@ -3402,9 +3641,7 @@ static NTSTATUS open_file(PDEVICE_OBJECT DeviceObject, _Requires_lock_held_(_Cur
 
                 Irp->Tail.Overlay.AuxiliaryBuffer = (void*)data;
 
-                acquire_fcb_lock_exclusive(Vcb);
-                free_fileref(Vcb, fileref);
-                release_fcb_lock(Vcb);
+                release_fileref(Vcb, fileref);
 
                 goto exit;
             }
@@ -3414,9 +3651,7 @@ static NTSTATUS open_file(PDEVICE_OBJECT DeviceObject, _Requires_lock_held_(_Cur
             if (options & FILE_NON_DIRECTORY_FILE && !(fileref->fcb->atts & FILE_ATTRIBUTE_REPARSE_POINT)) {
                 Status = STATUS_FILE_IS_A_DIRECTORY;
 
-                acquire_fcb_lock_exclusive(Vcb);
-                free_fileref(Vcb, fileref);
-                release_fcb_lock(Vcb);
+                release_fileref(Vcb, fileref);
 
                 goto exit;
             }
@@ -3424,9 +3659,7 @@ static NTSTATUS open_file(PDEVICE_OBJECT DeviceObject, _Requires_lock_held_(_Cur
             TRACE("returning STATUS_NOT_A_DIRECTORY (type = %u, %S)\n", fileref->fcb->type, file_desc_fileref(fileref));
             Status = STATUS_NOT_A_DIRECTORY;
 
-            acquire_fcb_lock_exclusive(Vcb);
-            free_fileref(Vcb, fileref);
-            release_fcb_lock(Vcb);
+            release_fileref(Vcb, fileref);
 
             goto exit;
         }
@@ -3440,9 +3673,7 @@ static NTSTATUS open_file(PDEVICE_OBJECT DeviceObject, _Requires_lock_held_(_Cur
                 else
                     WARN("IoCheckShareAccess failed, returning %08x\n", Status);
 
-                acquire_fcb_lock_exclusive(Vcb);
-                free_fileref(Vcb, fileref);
-                release_fcb_lock(Vcb);
+                release_fileref(Vcb, fileref);
 
                 goto exit;
             }
@@ -3457,9 +3688,7 @@ static NTSTATUS open_file(PDEVICE_OBJECT DeviceObject, _Requires_lock_held_(_Cur
 
                 IoRemoveShareAccess(FileObject, &fileref->fcb->share_access);
 
-                acquire_fcb_lock_exclusive(Vcb);
-                free_fileref(Vcb, fileref);
-                release_fcb_lock(Vcb);
+                release_fileref(Vcb, fileref);
 
                 goto exit;
             }
@@ -3476,9 +3705,7 @@ static NTSTATUS open_file(PDEVICE_OBJECT DeviceObject, _Requires_lock_held_(_Cur
 
                 IoRemoveShareAccess(FileObject, &fileref->fcb->share_access);
 
-                acquire_fcb_lock_exclusive(Vcb);
-                free_fileref(Vcb, fileref);
-                release_fcb_lock(Vcb);
+                release_fileref(Vcb, fileref);
 
                 goto exit;
             }
@@ -3486,9 +3713,7 @@ static NTSTATUS open_file(PDEVICE_OBJECT DeviceObject, _Requires_lock_held_(_Cur
             if (!fileref->fcb->ads && (IrpSp->Parameters.Create.FileAttributes & (FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM)) != ((fileref->fcb->atts & (FILE_ATTRIBUTE_SYSTEM | FILE_ATTRIBUTE_HIDDEN)))) {
                 IoRemoveShareAccess(FileObject, &fileref->fcb->share_access);
 
-                acquire_fcb_lock_exclusive(Vcb);
-                free_fileref(Vcb, fileref);
-                release_fcb_lock(Vcb);
+                release_fileref(Vcb, fileref);
 
                 Status = STATUS_ACCESS_DENIED;
                 goto exit;
@@ -3501,9 +3726,7 @@ static NTSTATUS open_file(PDEVICE_OBJECT DeviceObject, _Requires_lock_held_(_Cur
 
                     IoRemoveShareAccess(FileObject, &fileref->fcb->share_access);
 
-                    acquire_fcb_lock_exclusive(Vcb);
-                    free_fileref(Vcb, fileref);
-                    release_fcb_lock(Vcb);
+                    release_fileref(Vcb, fileref);
 
                     goto exit;
                 }
@@ -3514,9 +3737,7 @@ static NTSTATUS open_file(PDEVICE_OBJECT DeviceObject, _Requires_lock_held_(_Cur
 
                     IoRemoveShareAccess(FileObject, &fileref->fcb->share_access);
 
-                    acquire_fcb_lock_exclusive(Vcb);
-                    free_fileref(Vcb, fileref);
-                    release_fcb_lock(Vcb);
+                    release_fileref(Vcb, fileref);
 
                     goto exit;
                 }
@@ -3530,9 +3751,7 @@ static NTSTATUS open_file(PDEVICE_OBJECT DeviceObject, _Requires_lock_held_(_Cur
 
                     IoRemoveShareAccess(FileObject, &fileref->fcb->share_access);
 
-                    acquire_fcb_lock_exclusive(Vcb);
-                    free_fileref(Vcb, fileref);
-                    release_fcb_lock(Vcb);
+                    release_fileref(Vcb, fileref);
 
                     goto exit;
                 }
@@ -3551,9 +3770,7 @@ static NTSTATUS open_file(PDEVICE_OBJECT DeviceObject, _Requires_lock_held_(_Cur
 
                         IoRemoveShareAccess(FileObject, &fileref->fcb->share_access);
 
-                        acquire_fcb_lock_exclusive(Vcb);
-                        free_fileref(Vcb, fileref);
-                        release_fcb_lock(Vcb);
+                        release_fileref(Vcb, fileref);
 
                         goto exit;
                     }
@@ -3588,9 +3805,7 @@ static NTSTATUS open_file(PDEVICE_OBJECT DeviceObject, _Requires_lock_held_(_Cur
 
                         IoRemoveShareAccess(FileObject, &fileref->fcb->share_access);
 
-                        acquire_fcb_lock_exclusive(Vcb);
-                        free_fileref(Vcb, fileref);
-                        release_fcb_lock(Vcb);
+                        release_fileref(Vcb, fileref);
 
                         goto exit;
                     }
@@ -3630,9 +3845,7 @@ static NTSTATUS open_file(PDEVICE_OBJECT DeviceObject, _Requires_lock_held_(_Cur
                             if (!NT_SUCCESS(Status)) {
                                 ERR("delete_fileref returned %08x\n", Status);
 
-                                acquire_fcb_lock_exclusive(Vcb);
-                                free_fileref(Vcb, fileref);
-                                release_fcb_lock(Vcb);
+                                release_fileref(Vcb, fileref);
 
                                 goto exit;
                             }
@@ -3693,9 +3906,7 @@ static NTSTATUS open_file(PDEVICE_OBJECT DeviceObject, _Requires_lock_held_(_Cur
 
                         IoRemoveShareAccess(FileObject, &fileref->fcb->share_access);
 
-                        acquire_fcb_lock_exclusive(Vcb);
-                        free_fileref(Vcb, fileref);
-                        release_fcb_lock(Vcb);
+                        release_fileref(Vcb, fileref);
 
                         goto exit;
                     }
@@ -3717,9 +3928,7 @@ static NTSTATUS open_file(PDEVICE_OBJECT DeviceObject, _Requires_lock_held_(_Cur
 
             IoRemoveShareAccess(FileObject, &fileref->fcb->share_access);
 
-            acquire_fcb_lock_exclusive(Vcb);
-            free_fileref(Vcb, fileref);
-            release_fcb_lock(Vcb);
+            release_fileref(Vcb, fileref);
 
             goto exit;
         }
@@ -3816,11 +4025,8 @@ static NTSTATUS open_file(PDEVICE_OBJECT DeviceObject, _Requires_lock_held_(_Cur
         FileObject->Flags |= FO_CACHE_SUPPORTED;
 
 exit:
-    if (loaded_related) {
-        acquire_fcb_lock_exclusive(Vcb);
-        free_fileref(Vcb, related);
-        release_fcb_lock(Vcb);
-    }
+    if (loaded_related)
+        release_fileref(Vcb, related);
 
     if (Status == STATUS_SUCCESS) {
         fcb* fcb2;
@@ -3839,9 +4045,13 @@ exit:
             fcb2 = ccb2->fileref->parent->fcb;
         }
 
-        ExAcquireResourceExclusiveLite(fcb2->Header.Resource, TRUE);
-        fcb_load_csums(Vcb, fcb2, Irp);
-        ExReleaseResourceLite(fcb2->Header.Resource);
+        // Paging IO to the page file can't wait for the tree lock, so load its checksums into
+        // non-paged memory now. Other files look them up as they're read.
+        if (fcb2->Header.Flags2 & FSRTL_FLAG2_IS_PAGING_FILE) {
+            ExAcquireResourceExclusiveLite(fcb2->Header.Resource, TRUE);
+            fcb_load_csums(Vcb, fcb2, Irp);
+            ExReleaseResourceLite(fcb2->Header.Resource);
+        }
     } else if (Status != STATUS_REPARSE && Status != STATUS_OBJECT_NAME_NOT_FOUND && Status != STATUS_OBJECT_PATH_NOT_FOUND)
         TRACE("returning %08x\n", Status);
 
@@ -31,6 +31,22 @@ typedef struct {
     dir_child* dc;
 } dir_entry;
 
+#define DIR_PREFETCH_MAX 256
+
+typedef struct {
+    dir_child* dc;
+    BOOL valid;
+    INODE_ITEM ii;
+    ULONG atts;
+    ULONG ealen;
+} dir_prefetch_entry;
+
+typedef struct {
+    ULONG num_entries;
+    ULONG pos;
+    dir_prefetch_entry* entries;
+} dir_prefetch;
+
 ULONG get_reparse_tag_fcb(fcb* fcb) {
     ULONG tag;
 
@@ -96,44 +112,242 @@ ULONG get_reparse_tag(device_extension* Vcb, root* subvol, UINT64 inode, UINT8 t
     return tag;
 }
 
+static ULONG get_ea_len_from_xattr(UINT8* eadata, UINT16 len) {
+    ULONG offset;
+    NTSTATUS Status;
+    FILE_FULL_EA_INFORMATION* eainfo;
+    ULONG ealen;
+
+    if (!eadata)
+        return 0;
+
+    Status = IoCheckEaBufferValidity((FILE_FULL_EA_INFORMATION*)eadata, len, &offset);
+
+    if (!NT_SUCCESS(Status)) {
+        WARN("IoCheckEaBufferValidity returned %08x (error at offset %u)\n", Status, offset);
+        return 0;
+    }
+
+    ealen = 4;
+    eainfo = (FILE_FULL_EA_INFORMATION*)eadata;
+    do {
+        ealen += 5 + eainfo->EaNameLength + eainfo->EaValueLength;
+
+        if (eainfo->NextEntryOffset == 0)
+            break;
+
+        eainfo = (FILE_FULL_EA_INFORMATION*)(((UINT8*)eainfo) + eainfo->NextEntryOffset);
+    } while (TRUE);
+
+    return ealen;
+}
+
 static ULONG get_ea_len(device_extension* Vcb, root* subvol, UINT64 inode, PIRP Irp) {
     UINT8* eadata;
     UINT16 len;
 
     if (get_xattr(Vcb, subvol, inode, EA_EA, EA_EA_HASH, &eadata, &len, Irp)) {
-        ULONG offset;
-        NTSTATUS Status;
-
-        Status = IoCheckEaBufferValidity((FILE_FULL_EA_INFORMATION*)eadata, len, &offset);
+        ULONG ealen = get_ea_len_from_xattr(eadata, len);
 
-        if (!NT_SUCCESS(Status)) {
-            WARN("IoCheckEaBufferValidity returned %08x (error at offset %u)\n", Status, offset);
+        if (eadata)
             ExFreePool(eadata);
-            return 0;
-        } else {
-            FILE_FULL_EA_INFORMATION* eainfo;
-            ULONG ealen;
 
-            ealen = 4;
-            eainfo = (FILE_FULL_EA_INFORMATION*)eadata;
-            do {
-                ealen += 5 + eainfo->EaNameLength + eainfo->EaValueLength;
+        return ealen;
+    } else
+        return 0;
+}
+
+// Reads the INODE_ITEM and the DOSATTRIB and EA xattrs of one inode, starting from tp, which
+// points to its INODE_ITEM. On return tp is left on the first item we didn't need, which if
+// the next inode in the batch is close by saves us having to search for it from the top.
+static BOOL prefetch_inode(device_extension* Vcb, root* r, dir_prefetch_entry* pe, traverse_ptr* tp, PIRP Irp) {
+    UINT64 inode = pe->dc->key.obj_id;
+    BOOL dotfile = pe->dc->name.Length > sizeof(WCHAR) && pe->dc->name.Buffer[0] == '.';
+    char* dosattrib = NULL;
+    UINT8* eadata = NULL;
+    UINT16 dosattriblen = 0, ealen = 0;
+    BOOL more;
+
+    RtlZeroMemory(&pe->ii, sizeof(INODE_ITEM));
+
+    if (tp->item->size > 0)
+        RtlCopyMemory(&pe->ii, tp->item->data, min(sizeof(INODE_ITEM), tp->item->size));
+
+    do {
+        traverse_ptr next_tp;
+
+        more = find_next_item(Vcb, tp, &next_tp, FALSE, Irp);
+
+        if (more) {
+            *tp = next_tp;
+
+            if (tp->item->key.obj_id != inode || tp->item->key.obj_type > TYPE_XATTR_ITEM)
+                break;
+
+            if (tp->item->key.obj_type == TYPE_XATTR_ITEM && tp->item->size >= sizeof(DIR_ITEM)) {
+                if (tp->item->key.offset == EA_DOSATTRIB_HASH && !dosattrib)
+                    extract_xattr(tp->item->data, tp->item->size, EA_DOSATTRIB, (UINT8**)&dosattrib, &dosattriblen);
+                else if (tp->item->key.offset == EA_EA_HASH && !eadata)
+                    extract_xattr(tp->item->data, tp->item->size, EA_EA, &eadata, &ealen);
+            }
+        }
+    } while (more);
+
+    pe->atts = make_file_attributes(r, inode, pe->dc->type, dotfile, dosattrib, dosattriblen);
+    pe->ealen = get_ea_len_from_xattr(eadata, ealen);
+    pe->valid = TRUE;
+
+    if (dosattrib)
+        ExFreePool(dosattrib);
+
+    if (eadata)
+        ExFreePool(eadata);
+
+    return more;
+}
+
+// Looks up the inodes of the next batch of children that query_directory is going to return,
+// in inode order rather than index order, so that the tree is walked forwards once rather than
+// searched from the top for every entry.
+static void prefetch_dir_items(device_extension* Vcb, root* r, file_ref* fileref, ccb* ccb, dir_child* start, LONG length,
+                               BOOL has_wildcard, dir_prefetch* pf, PIRP Irp) {
+    LIST_ENTRY* le;
+    ULONG max_entries, scanned = 0, i;
+    dir_prefetch_entry** sorted;
+    traverse_ptr tp;
+    BOOL have_tp = FALSE;
+
+    max_entries = min(DIR_PREFETCH_MAX, (ULONG)(length / sizeof(FILE_DIRECTORY_INFORMATION)) + 1);
+
+    pf->entries = ExAllocatePoolWithTag(PagedPool, max_entries * (sizeof(dir_prefetch_entry) + sizeof(dir_prefetch_entry*)), ALLOC_TAG);
+    if (!pf->entries) {
+        ERR("out of memory\n");
+        return;
+    }
+
+    sorted = (dir_prefetch_entry**)&pf->entries[max_entries];
+
+    if (start)
+        le = &start->list_entry_index;
+    else {
+        le = fileref->fcb->dir_children_index.Flink;
+
+        while (le != &fileref->fcb->dir_children_index) {
+            dir_child* dc = CONTAINING_RECORD(le, dir_child, list_entry_index);
+
+            if (dc->index >= ccb->query_dir_offset)
+                break;
+
+            le = le->Flink;
+        }
+    }
+
+    while (le != &fileref->fcb->dir_children_index && pf->num_entries < max_entries && scanned < max_entries * 4) {
+        dir_child* dc = CONTAINING_RECORD(le, dir_child, list_entry_index);
+
+        scanned++;
+
+        if (!has_wildcard || FsRtlIsNameInExpression(&ccb->query_string, &dc->name, !ccb->case_sensitive, NULL)) {
+            dir_prefetch_entry* pe = &pf->entries[pf->num_entries];
+
+            pe->dc = dc;
+            pe->valid = FALSE;
+
+            // subvols and open files get their details elsewhere
 
-                if (eainfo->NextEntryOffset == 0)
+            if (dc->key.obj_type != TYPE_ROOT_ITEM && !(dc->fileref && dc->fileref->fcb)) {
+                ULONG j = pf->num_entries;
+
+                // insertion sort - inode order usually follows index order, so this is quick
+
+                while (j > 0 && sorted[j - 1]->dc->key.obj_id > dc->key.obj_id) {
+                    sorted[j] = sorted[j - 1];
+                    j--;
+                }
+
+                sorted[j] = pe;
+            } else
+                sorted[pf->num_entries] = NULL;
+
+            pf->num_entries++;
+        }
+
+        le = le->Flink;
+    }
+
+    for (i = 0; i < pf->num_entries; i++) {
+        dir_prefetch_entry* pe = sorted[i];
+        UINT64 inode;
+
+        if (!pe)
+            continue;
+
+        inode = pe->dc->key.obj_id;
+
+        // carry on from where the last inode finished, if this one is only a few items further on
+
+        if (have_tp) {
+            ULONG steps = 0;
+
+            while (tp.item->key.obj_id < inode) {
+                traverse_ptr next_tp;
+
+                if (steps == 8 || !find_next_item(Vcb, &tp, &next_tp, FALSE, Irp)) {
+                    have_tp = FALSE;
                     break;
+                }
 
-                eainfo = (FILE_FULL_EA_INFORMATION*)(((UINT8*)eainfo) + eainfo->NextEntryOffset);
-            } while (TRUE);
+                tp = next_tp;
+                steps++;
+            }
 
-            ExFreePool(eadata);
+            if (have_tp && (tp.item->key.obj_id != inode || tp.item->key.obj_type != TYPE_INODE_ITEM))
+                have_tp = FALSE;
+        }
 
-            return ealen;
+        if (!have_tp) {
+            KEY searchkey;
+            NTSTATUS Status;
+
+            searchkey.obj_id = inode;
+            searchkey.obj_type = TYPE_INODE_ITEM;
+            searchkey.offset = 0xffffffffffffffff;
+
+            Status = find_item(Vcb, r, &tp, &searchkey, FALSE, Irp);
+            if (!NT_SUCCESS(Status)) {
+                ERR("error - find_item returned %08x\n", Status);
+                continue;
+            }
+
+            // leave it for query_dir_item to complain about
+            if (tp.item->key.obj_id != searchkey.obj_id || tp.item->key.obj_type != searchkey.obj_type)
+                continue;
         }
-    } else
-        return 0;
+
+        have_tp = prefetch_inode(Vcb, r, pe, &tp, Irp);
+    }
+}
+
+static dir_prefetch_entry* find_prefetched(dir_prefetch* pf, dir_child* dc) {
+    ULONG pos;
+
+    if (!pf || !dc)
+        return NULL;
+
+    // entries are asked for in the order we stored them in, so this is normally the first one we look at
+
+    for (pos = pf->pos; pos < pf->num_entries; pos++) {
+        if (pf->entries[pos].dc == dc) {
+            pf->pos = pos;
+
+            return pf->entries[pos].valid ? &pf->entries[pos] : NULL;
+        }
+    }
+
+    return NULL;
 }
 
-static NTSTATUS query_dir_item(fcb* fcb, ccb* ccb, void* buf, LONG* len, PIRP Irp, dir_entry* de, root* r) {
+static NTSTATUS query_dir_item(fcb* fcb, ccb* ccb, void* buf, LONG* len, PIRP Irp, dir_entry* de, root* r, dir_prefetch* pf) {
     PIO_STACK_LOCATION IrpSp;
     LONG needed;
     UINT64 inode;
@@ -193,6 +407,17 @@ static NTSTATUS query_dir_item(fcb* fcb, ccb* ccb, void* buf, LONG* len, PIRP Ir
                         found = TRUE;
                     }
 
+                    if (!found) {
+                        dir_prefetch_entry* pe = find_prefetched(pf, de->dc);
+
+                        if (pe) {
+                            ii = pe->ii;
+                            atts = pe->atts;
+                            ealen = pe->ealen;
+                            found = TRUE;
+                        }
+                    }
+
                     if (!found) {
                         KEY searchkey;
                         traverse_ptr tp;
@@ -604,9 +829,14 @@ static NTSTATUS query_directory(PIRP Irp) {
     UINT64 newoffset;
     ANSI_STRING utf8;
     dir_child* dc = NULL;
+    dir_prefetch pf;
 
     TRACE("query directory\n");
 
+    pf.num_entries = 0;
+    pf.pos = 0;
+    pf.entries = NULL;
+
     IrpSp = IoGetCurrentIrpStackLocation(Irp);
     fcb = IrpSp->FileObject->FsContext;
     ccb = IrpSp->FileObject->FsContext2;
@@ -858,7 +1088,16 @@ static NTSTATUS query_directory(PIRP Irp) {
     TRACE("file(0) = %.*S\n", de.name.Length / sizeof(WCHAR), de.name.Buffer);
     TRACE("offset = %u\n", ccb->query_dir_offset - 1);
 
-    Status = query_dir_item(fcb, ccb, buf, &length, Irp, &de, fcb->subvol);
+    if (!specific_file && !(IrpSp->Flags & SL_RETURN_SINGLE_ENTRY) && (
+        IrpSp->Parameters.QueryDirectory.FileInformationClass == FileBothDirectoryInformation ||
+        IrpSp->Parameters.QueryDirectory.FileInformationClass == FileDirectoryInformation ||
+        IrpSp->Parameters.QueryDirectory.FileInformationClass == FileFullDirectoryInformation ||
+        IrpSp->Parameters.QueryDirectory.FileInformationClass == FileIdBothDirectoryInformation ||
+        IrpSp->Parameters.QueryDirectory.FileInformationClass == FileIdFullDirectoryInformation)) {
+        prefetch_dir_items(Vcb, fcb->subvol, fileref, ccb, de.dir_entry_type == DirEntryType_File ? de.dc : NULL, length, has_wildcard, &pf, Irp);
+    }
+
+    Status = query_dir_item(fcb, ccb, buf, &length, Irp, &de, fcb->subvol, &pf);
 
     count = 0;
     if (NT_SUCCESS(Status) && !(IrpSp->Flags & SL_RETURN_SINGLE_ENTRY) && !specific_file) {
@@ -894,7 +1133,7 @@ static NTSTATUS query_directory(PIRP Irp) {
                         TRACE("file(%u) %u = %.*S\n", count, curitem - (UINT8*)buf, de.name.Length / sizeof(WCHAR), de.name.Buffer);
                         TRACE("offset = %u\n", ccb->query_dir_offset - 1);
 
-                        status2 = query_dir_item(fcb, ccb, curitem, &length, Irp, &de, fcb->subvol);
+                        status2 = query_dir_item(fcb, ccb, curitem, &length, Irp, &de, fcb->subvol, &pf);
 
                         if (NT_SUCCESS(status2)) {
                             ULONG* lastoffset = (ULONG*)lastitem;
@@ -923,6 +1162,9 @@ static NTSTATUS query_directory(PIRP Irp) {
 end:
     ExReleaseResourceLite(&fileref->fcb->nonpaged->dir_children_lock);
 
+    if (pf.entries)
+        ExFreePool(pf.entries);
+
 end2:
     release_fcb_lock(Vcb);
     ExReleaseResourceLite(&Vcb->tree_lock);
@@ -338,6 +338,44 @@ static BOOLEAN fast_io_write(PFILE_OBJECT FileObject, PLARGE_INTEGER FileOffset,
     return FALSE;
 }
 
+// FsRtlCopyRead and FsRtlMdlReadDev take the fcb's resource, and the paging read this can lead to
+// may need to look up checksums - take the tree lock first, so we're in the same order as flushing.
+
+_Function_class_(FAST_IO_READ)
+static BOOLEAN fast_io_read(PFILE_OBJECT FileObject, PLARGE_INTEGER FileOffset, ULONG Length, BOOLEAN Wait, ULONG LockKey, PVOID Buffer, PIO_STATUS_BLOCK IoStatus, PDEVICE_OBJECT DeviceObject) {
+    fcb* fcb = FileObject->FsContext;
+    BOOLEAN ret;
+
+    if (!fcb)
+        return FALSE;
+
+    if (!ExAcquireResourceSharedLite(&fcb->Vcb->tree_lock, Wait))
+        return FALSE;
+
+    ret = FsRtlCopyRead(FileObject, FileOffset, Length, Wait, LockKey, Buffer, IoStatus, DeviceObject);
+
+    ExReleaseResourceLite(&fcb->Vcb->tree_lock);
+
+    return ret;
+}
+
+_Function_class_(FAST_IO_MDL_READ)
+static BOOLEAN fast_io_mdl_read(PFILE_OBJECT FileObject, PLARGE_INTEGER FileOffset, ULONG Length, ULONG LockKey, PMDL* MdlChain, PIO_STATUS_BLOCK IoStatus, PDEVICE_OBJECT DeviceObject) {
+    fcb* fcb = FileObject->FsContext;
+    BOOLEAN ret;
+
+    if (!fcb)
+        return FALSE;
+
+    ExAcquireResourceSharedLite(&fcb->Vcb->tree_lock, TRUE);
+
+    ret = FsRtlMdlReadDev(FileObject, FileOffset, Length, LockKey, MdlChain, IoStatus, DeviceObject);
+
+    ExReleaseResourceLite(&fcb->Vcb->tree_lock);
+
+    return ret;
+}
+
 void init_fast_io_dispatch(FAST_IO_DISPATCH** fiod) {
     RtlZeroMemory(&FastIoDispatch, sizeof(FastIoDispatch));
 
@@ -352,8 +390,8 @@ void init_fast_io_dispatch(FAST_IO_DISPATCH** fiod) {
     FastIoDispatch.AcquireForCcFlush = fast_io_acquire_for_ccflush;
     FastIoDispatch.ReleaseForCcFlush = fast_io_release_for_ccflush;
     FastIoDispatch.FastIoWrite = fast_io_write;
-    FastIoDispatch.FastIoRead = FsRtlCopyRead;
-    FastIoDispatch.MdlRead = FsRtlMdlReadDev;
+    FastIoDispatch.FastIoRead = fast_io_read;
+    FastIoDispatch.MdlRead = fast_io_mdl_read;
     FastIoDispatch.MdlReadComplete = FsRtlMdlReadCompleteDev;
     FastIoDispatch.PrepareMdlWrite = FsRtlPrepareMdlWriteDev;
     FastIoDispatch.MdlWriteComplete = FsRtlMdlWriteCompleteDev;
@@ -688,6 +688,7 @@ static NTSTATUS create_directory_fcb(device_extension* Vcb, root* r, fcb* parfcb
     fcb->inode_item_changed = TRUE;
 
     InsertTailList(&r->fcbs, &fcb->list_entry);
+    add_fcb_to_hash(Vcb, fcb);
     InsertTailList(&Vcb->all_fcbs, &fcb->list_entry_all);
 
     fcb->Header.IsFastIoPossible = fast_io_possible(fcb);
@@ -787,8 +788,6 @@ static NTSTATUS move_across_subvols(file_ref* fileref, ccb* ccb, file_ref* destd
         if (me->fileref->fcb->inode != SUBVOL_ROOT_INODE && me->fileref->fcb != fileref->fcb->Vcb->dummy_fcb) {
             if (!me->dummyfcb) {
                 ULONG defda;
-                BOOL inserted = FALSE;
-                LIST_ENTRY* le3;
 
                 ExAcquireResourceExclusiveLite(me->fileref->fcb->Header.Resource, TRUE);
 
@@ -818,6 +817,8 @@ static NTSTATUS move_across_subvols(file_ref* fileref, ccb* ccb, file_ref* destd
                 if (!me->fileref->fcb->ads) {
                     LIST_ENTRY* le2;
 
+                    remove_fcb_from_hash(me->fileref->fcb->Vcb, me->fileref->fcb);
+
                     me->fileref->fcb->subvol = destdir->fcb->subvol;
                     me->fileref->fcb->inode = InterlockedIncrement64(&destdir->fcb->subvol->lastinode);
                     me->fileref->fcb->inode_item.st_nlink = 1;
@@ -888,22 +889,10 @@ static NTSTATUS move_across_subvols(file_ref* fileref, ccb* ccb, file_ref* destd
 
                 InsertHeadList(&me->fileref->fcb->list_entry, &me->dummyfcb->list_entry);
                 RemoveEntryList(&me->fileref->fcb->list_entry);
+                InsertTailList(&destdir->fcb->subvol->fcbs, &me->fileref->fcb->list_entry);
 
-                le3 = destdir->fcb->subvol->fcbs.Flink;
-                while (le3 != &destdir->fcb->subvol->fcbs) {
-                    fcb* fcb = CONTAINING_RECORD(le3, struct _fcb, list_entry);
-
-                    if (fcb->inode > me->fileref->fcb->inode) {
-                        InsertHeadList(le3->Blink, &me->fileref->fcb->list_entry);
-                        inserted = TRUE;
-                        break;
-                    }
-
-                    le3 = le3->Flink;
-                }
-
-                if (!inserted)
-                    InsertTailList(&destdir->fcb->subvol->fcbs, &me->fileref->fcb->list_entry);
+                add_fcb_to_hash(me->fileref->fcb->Vcb, me->dummyfcb);
+                add_fcb_to_hash(me->fileref->fcb->Vcb, me->fileref->fcb);
 
                 InsertTailList(&me->fileref->fcb->Vcb->all_fcbs, &me->dummyfcb->list_entry_all);
 
@@ -1689,7 +1678,7 @@ static NTSTATUS set_rename_information(device_extension* Vcb, PIRP Irp, PFILE_OB
     fr2 = create_fileref(Vcb);
 
     fr2->fcb = fileref->fcb;
-    fr2->fcb->refcount++;
+    InterlockedIncrement(&fr2->fcb->refcount);
 
     fr2->oldutf8 = fileref->oldutf8;
     fr2->oldindex = fileref->dc->index;
@@ -2350,7 +2339,7 @@ static NTSTATUS set_link_information(device_extension* Vcb, PIRP Irp, PFILE_OBJE
     fr2 = create_fileref(Vcb);
 
     fr2->fcb = fcb;
-    fcb->refcount++;
+    InterlockedIncrement(&fcb->refcount);
 
     fr2->created = TRUE;
     fr2->parent = related;
@@ -446,12 +446,13 @@ nextdev:
 static BOOL trees_consistent(device_extension* Vcb) {
     ULONG maxsize = Vcb->superblock.node_size - sizeof(tree_header);
     LIST_ENTRY* le;
+    ULONG level;
 
-    le = Vcb->trees.Flink;
-    while (le != &Vcb->trees) {
-        tree* t = CONTAINING_RECORD(le, tree, list_entry);
+    for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
+        le = Vcb->dirty_trees[level].Flink;
+        while (le != &Vcb->dirty_trees[level]) {
+            tree* t = CONTAINING_RECORD(le, tree, list_entry_dirty);
 
-        if (t->write) {
             if (t->header.num_items == 0 && t->parent) {
 #ifdef DEBUG_WRITE_LOOPS
                 ERR("empty tree found, looping again\n");
@@ -472,9 +473,9 @@ static BOOL trees_consistent(device_extension* Vcb) {
 #endif
                 return FALSE;
             }
-        }
 
-        le = le->Flink;
+            le = le->Flink;
+        }
     }
 
     return TRUE;
@@ -484,68 +485,66 @@ static NTSTATUS add_parents(device_extension* Vcb, PIRP Irp) {
     ULONG level;
     LIST_ENTRY* le;
 
-    for (level = 0; level <= 255; level++) {
+    for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
         BOOL nothing_found = TRUE;
 
         TRACE("level = %u\n", level);
 
-        le = Vcb->trees.Flink;
-        while (le != &Vcb->trees) {
-            tree* t = CONTAINING_RECORD(le, tree, list_entry);
+        le = Vcb->dirty_trees[level].Flink;
+        while (le != &Vcb->dirty_trees[level]) {
+            tree* t = CONTAINING_RECORD(le, tree, list_entry_dirty);
 
-            if (t->write && t->header.level == level) {
-                TRACE("tree %p: root = %llx, level = %x, parent = %p\n", t, t->header.tree_id, t->header.level, t->parent);
+            TRACE("tree %p: root = %llx, level = %x, parent = %p\n", t, t->header.tree_id, t->header.level, t->parent);
 
-                nothing_found = FALSE;
+            nothing_found = FALSE;
 
-                if (t->parent) {
-                    if (!t->parent->write)
-                        TRACE("adding tree %p (level %x)\n", t->parent, t->header.level);
+            if (t->parent) {
+                if (!t->parent->write)
+                    TRACE("adding tree %p (level %x)\n", t->parent, t->header.level);
 
-                    t->parent->write = TRUE;
-                } else if (t->root != Vcb->root_root && t->root != Vcb->chunk_root) {
-                    KEY searchkey;
-                    traverse_ptr tp;
-                    NTSTATUS Status;
+                mark_tree_dirty(t->parent);
+            } else if (t->root != Vcb->root_root && t->root != Vcb->chunk_root) {
+                KEY searchkey;
+                traverse_ptr tp;
+                NTSTATUS Status;
 
-                    searchkey.obj_id = t->root->id;
-                    searchkey.obj_type = TYPE_ROOT_ITEM;
-                    searchkey.offset = 0xffffffffffffffff;
+                searchkey.obj_id = t->root->id;
+                searchkey.obj_type = TYPE_ROOT_ITEM;
+                searchkey.offset = 0xffffffffffffffff;
 
-                    Status = find_item(Vcb, Vcb->root_root, &tp, &searchkey, FALSE, Irp);
-                    if (!NT_SUCCESS(Status)) {
-                        ERR("error - find_item returned %08x\n", Status);
-                        return Status;
-                    }
+                Status = find_item(Vcb, Vcb->root_root, &tp, &searchkey, FALSE, Irp);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("error - find_item returned %08x\n", Status);
+                    return Status;
+                }
 
-                    if (tp.item->key.obj_id != searchkey.obj_id || tp.item->key.obj_type != searchkey.obj_type) {
-                        ERR("could not find ROOT_ITEM for tree %llx\n", searchkey.obj_id);
-                        return STATUS_INTERNAL_ERROR;
-                    }
+                if (tp.item->key.obj_id != searchkey.obj_id || tp.item->key.obj_type != searchkey.obj_type) {
+                    ERR("could not find ROOT_ITEM for tree %llx\n", searchkey.obj_id);
+                    return STATUS_INTERNAL_ERROR;
+                }
 
-                    if (tp.item->size < sizeof(ROOT_ITEM)) { // if not full length, delete and create new entry
-                        ROOT_ITEM* ri = ExAllocatePoolWithTag(PagedPool, sizeof(ROOT_ITEM), ALLOC_TAG);
+                if (tp.item->size < sizeof(ROOT_ITEM)) { // if not full length, delete and create new entry
+                    ROOT_ITEM* ri = ExAllocatePoolWithTag(PagedPool, sizeof(ROOT_ITEM), ALLOC_TAG);
 
-                        if (!ri) {
-                            ERR("out of memory\n");
-                            return STATUS_INSUFFICIENT_RESOURCES;
-                        }
+                    if (!ri) {
+                        ERR("out of memory\n");
+                        return STATUS_INSUFFICIENT_RESOURCES;
+                    }
 
-                        RtlCopyMemory(ri, &t->root->root_item, sizeof(ROOT_ITEM));
+                    RtlCopyMemory(ri, &t->root->root_item, sizeof(ROOT_ITEM));
 
-                        Status = delete_tree_item(Vcb, &tp);
-                        if (!NT_SUCCESS(Status)) {
-                            ERR("delete_tree_item returned %08x\n", Status);
-                            ExFreePool(ri);
-                            return Status;
-                        }
+                    Status = delete_tree_item(Vcb, &tp);
+                    if (!NT_SUCCESS(Status)) {
+                        ERR("delete_tree_item returned %08x\n", Status);
+                        ExFreePool(ri);
+                        return Status;
+                    }
 
-                        Status = insert_tree_item(Vcb, Vcb->root_root, tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset, ri, sizeof(ROOT_ITEM), NULL, Irp);
-                        if (!NT_SUCCESS(Status)) {
-                            ERR("insert_tree_item returned %08x\n", Status);
-                            ExFreePool(ri);
-                            return Status;
-                        }
+                    Status = insert_tree_item(Vcb, Vcb->root_root, tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset, ri, sizeof(ROOT_ITEM), NULL, Irp);
+                    if (!NT_SUCCESS(Status)) {
+                        ERR("insert_tree_item returned %08x\n", Status);
+                        ExFreePool(ri);
+                        return Status;
                     }
                 }
             }
@@ -563,7 +562,7 @@ static NTSTATUS add_parents(device_extension* Vcb, PIRP Irp) {
 static void add_parents_to_cache(tree* t) {
     while (t->parent) {
         t = t->parent;
-        t->write = TRUE;
+        mark_tree_dirty(t);
     }
 }
 
@@ -649,38 +648,14 @@ BOOL find_metadata_address_in_chunk(device_extension* Vcb, chunk* c, UINT64* add
         le = le->Flink;
     }
 
-    le = c->space_size.Flink;
-    while (le != &c->space_size) {
-        s = CONTAINING_RECORD(le, space, list_entry_size);
-
-        if (s->size == Vcb->superblock.node_size) {
-            *address = s->address;
-            c->last_alloc = s->address + Vcb->superblock.node_size;
-            return TRUE;
-        } else if (s->size < Vcb->superblock.node_size) {
-            if (le == c->space_size.Flink)
-                return FALSE;
-
-            s = CONTAINING_RECORD(le->Blink, space, list_entry_size);
-
-            *address = s->address;
-            c->last_alloc = s->address + Vcb->superblock.node_size;
-
-            return TRUE;
-        }
-
-        le = le->Flink;
-    }
-
-    s = CONTAINING_RECORD(c->space_size.Blink, space, list_entry_size);
+    s = find_space_best_fit(c, Vcb->superblock.node_size);
+    if (!s)
+        return FALSE;
 
-    if (s->size > Vcb->superblock.node_size) {
-        *address = s->address;
-        c->last_alloc = s->address + Vcb->superblock.node_size;
-        return TRUE;
-    }
+    *address = s->address;
+    c->last_alloc = s->address + Vcb->superblock.node_size;
 
-    return FALSE;
+    return TRUE;
 }
 
 static BOOL insert_tree_extent(device_extension* Vcb, UINT8 level, UINT64 root_id, chunk* c, UINT64* new_address, PIRP Irp, LIST_ENTRY* rollback) {
@@ -1331,59 +1306,61 @@ static NTSTATUS allocate_tree_extents(device_extension* Vcb, PIRP Irp, LIST_ENTR
 
     TRACE("(%p)\n", Vcb);
 
-    le = Vcb->trees.Flink;
-    while (le != &Vcb->trees) {
-        tree* t = CONTAINING_RECORD(le, tree, list_entry);
-
-        if (t->write && !t->has_new_address) {
-            chunk* c;
+    for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
+        le = Vcb->dirty_trees[level].Flink;
+        while (le != &Vcb->dirty_trees[level]) {
+            tree* t = CONTAINING_RECORD(le, tree, list_entry_dirty);
 
-            if (t->has_address) {
-                c = get_chunk_from_address(Vcb, t->header.address);
+            if (!t->has_new_address) {
+                chunk* c;
 
-                if (c) {
-                    if (!c->cache_loaded) {
-                        acquire_chunk_lock(c, Vcb);
+                if (t->has_address) {
+                    c = get_chunk_from_address(Vcb, t->header.address);
 
+                    if (c) {
                         if (!c->cache_loaded) {
-                            Status = load_cache_chunk(Vcb, c, NULL);
+                            acquire_chunk_lock(c, Vcb);
 
-                            if (!NT_SUCCESS(Status)) {
-                                ERR("load_cache_chunk returned %08x\n", Status);
-                                release_chunk_lock(c, Vcb);
-                                return Status;
+                            if (!c->cache_loaded) {
+                                Status = load_cache_chunk(Vcb, c, NULL);
+
+                                if (!NT_SUCCESS(Status)) {
+                                    ERR("load_cache_chunk returned %08x\n", Status);
+                                    release_chunk_lock(c, Vcb);
+                                    return Status;
+                                }
                             }
-                        }
 
-                        release_chunk_lock(c, Vcb);
+                            release_chunk_lock(c, Vcb);
+                        }
                     }
                 }
-            }
 
-            Status = get_tree_new_address(Vcb, t, Irp, rollback);
-            if (!NT_SUCCESS(Status)) {
-                ERR("get_tree_new_address returned %08x\n", Status);
-                return Status;
-            }
+                Status = get_tree_new_address(Vcb, t, Irp, rollback);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("get_tree_new_address returned %08x\n", Status);
+                    return Status;
+                }
 
-            TRACE("allocated extent %llx\n", t->new_address);
+                TRACE("allocated extent %llx\n", t->new_address);
 
-            c = get_chunk_from_address(Vcb, t->new_address);
+                c = get_chunk_from_address(Vcb, t->new_address);
 
-            if (c)
-                c->used += Vcb->superblock.node_size;
-            else {
-                ERR("could not find chunk for address %llx\n", t->new_address);
-                return STATUS_INTERNAL_ERROR;
-            }
+                if (c)
+                    c->used += Vcb->superblock.node_size;
+                else {
+                    ERR("could not find chunk for address %llx\n", t->new_address);
+                    return STATUS_INTERNAL_ERROR;
+                }
 
-            changed = TRUE;
+                changed = TRUE;
 
-            if (t->header.level > max_level)
-                max_level = t->header.level;
-        }
+                if (t->header.level > max_level)
+                    max_level = t->header.level;
+            }
 
-        le = le->Flink;
+            le = le->Flink;
+        }
     }
 
     if (!changed)
@@ -1391,11 +1368,11 @@ static NTSTATUS allocate_tree_extents(device_extension* Vcb, PIRP Irp, LIST_ENTR
 
     level = max_level;
     do {
-        le = Vcb->trees.Flink;
-        while (le != &Vcb->trees) {
-            tree* t = CONTAINING_RECORD(le, tree, list_entry);
+        le = Vcb->dirty_trees[level].Flink;
+        while (le != &Vcb->dirty_trees[level]) {
+            tree* t = CONTAINING_RECORD(le, tree, list_entry_dirty);
 
-            if (t->write && !t->updated_extents && t->has_address && t->header.level == level) {
+            if (!t->updated_extents && t->has_address) {
                 Status = update_tree_extents(Vcb, t, Irp, rollback);
                 if (!NT_SUCCESS(Status)) {
                     ERR("update_tree_extents returned %08x\n", Status);
@@ -1418,50 +1395,53 @@ static NTSTATUS allocate_tree_extents(device_extension* Vcb, PIRP Irp, LIST_ENTR
 static NTSTATUS update_root_root(device_extension* Vcb, BOOL no_cache, PIRP Irp, LIST_ENTRY* rollback) {
     LIST_ENTRY* le;
     NTSTATUS Status;
+    ULONG level;
 
     TRACE("(%p)\n", Vcb);
 
-    le = Vcb->trees.Flink;
-    while (le != &Vcb->trees) {
-        tree* t = CONTAINING_RECORD(le, tree, list_entry);
+    for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
+        le = Vcb->dirty_trees[level].Flink;
+        while (le != &Vcb->dirty_trees[level]) {
+            tree* t = CONTAINING_RECORD(le, tree, list_entry_dirty);
 
-        if (t->write && !t->parent) {
-            if (t->root != Vcb->root_root && t->root != Vcb->chunk_root) {
-                KEY searchkey;
-                traverse_ptr tp;
+            if (!t->parent) {
+                if (t->root != Vcb->root_root && t->root != Vcb->chunk_root) {
+                    KEY searchkey;
+                    traverse_ptr tp;
 
-                searchkey.obj_id = t->root->id;
-                searchkey.obj_type = TYPE_ROOT_ITEM;
-                searchkey.offset = 0xffffffffffffffff;
+                    searchkey.obj_id = t->root->id;
+                    searchkey.obj_type = TYPE_ROOT_ITEM;
+                    searchkey.offset = 0xffffffffffffffff;
 
-                Status = find_item(Vcb, Vcb->root_root, &tp, &searchkey, FALSE, Irp);
-                if (!NT_SUCCESS(Status)) {
-                    ERR("error - find_item returned %08x\n", Status);
-                    return Status;
-                }
+                    Status = find_item(Vcb, Vcb->root_root, &tp, &searchkey, FALSE, Irp);
+                    if (!NT_SUCCESS(Status)) {
+                        ERR("error - find_item returned %08x\n", Status);
+                        return Status;
+                    }
 
-                if (tp.item->key.obj_id != searchkey.obj_id || tp.item->key.obj_type != searchkey.obj_type) {
-                    ERR("could not find ROOT_ITEM for tree %llx\n", searchkey.obj_id);
-                    return STATUS_INTERNAL_ERROR;
-                }
+                    if (tp.item->key.obj_id != searchkey.obj_id || tp.item->key.obj_type != searchkey.obj_type) {
+                        ERR("could not find ROOT_ITEM for tree %llx\n", searchkey.obj_id);
+                        return STATUS_INTERNAL_ERROR;
+                    }
+
+                    TRACE("updating the address for root %llx to %llx\n", searchkey.obj_id, t->new_address);
 
-                TRACE("updating the address for root %llx to %llx\n", searchkey.obj_id, t->new_address);
+                    t->root->root_item.block_number = t->new_address;
+                    t->root->root_item.root_level = t->header.level;
+                    t->root->root_item.generation = Vcb->superblock.generation;
+                    t->root->root_item.generation2 = Vcb->superblock.generation;
 
-                t->root->root_item.block_number = t->new_address;
-                t->root->root_item.root_level = t->header.level;
-                t->root->root_item.generation = Vcb->superblock.generation;
-                t->root->root_item.generation2 = Vcb->superblock.generation;
+                    // item is guaranteed to be at least sizeof(ROOT_ITEM), due to add_parents
 
-                // item is guaranteed to be at least sizeof(ROOT_ITEM), due to add_parents
+                    RtlCopyMemory(tp.item->data, &t->root->root_item, sizeof(ROOT_ITEM));
+                }
 
-                RtlCopyMemory(tp.item->data, &t->root->root_item, sizeof(ROOT_ITEM));
+                t->root->treeholder.address = t->new_address;
+                t->root->treeholder.generation = Vcb->superblock.generation;
             }
 
-            t->root->treeholder.address = t->new_address;
-            t->root->treeholder.generation = Vcb->superblock.generation;
+            le = le->Flink;
         }
-
-        le = le->Flink;
     }
 
     if (!no_cache && !(Vcb->superblock.compat_ro_flags & BTRFS_COMPAT_RO_FLAGS_FREE_SPACE_CACHE)) {
@@ -1478,112 +1458,181 @@ static NTSTATUS update_root_root(device_extension* Vcb, BOOL no_cache, PIRP Irp,
     return STATUS_SUCCESS;
 }
 
-NTSTATUS do_tree_writes(device_extension* Vcb, LIST_ENTRY* tree_writes, BOOL no_free) {
-    chunk* c;
-    LIST_ENTRY* le;
-    tree_write* tw;
-    NTSTATUS Status;
-    ULONG i, num_bits;
-    write_data_context* wtc;
-    ULONG bit_num = 0;
-    BOOL raid56 = FALSE;
+// Runs of trees that are next to each other on disk are sent down as a single write. Rather
+// than copying the nodes into one big buffer, we lock each node's pages and map them
+// together through a partial MDL, so the run appears contiguous without being copied.
+static BOOL can_extend_tree_write_run(tree_write_run* run, tree_write* tw) {
+    if (run->address + run->length != tw->address)
+        return FALSE;
 
-    // merge together runs
-    c = NULL;
-    le = tree_writes->Flink;
-    while (le != tree_writes) {
-        tw = CONTAINING_RECORD(le, tree_write, list_entry);
+    if (run->length + tw->length > TREE_WRITE_RUN_MAX)
+        return FALSE;
 
-        if (!c || tw->address < c->offset || tw->address >= c->offset + c->chunk_item->size)
-            c = get_chunk_from_address(Vcb, tw->address);
-        else {
-            tree_write* tw2 = CONTAINING_RECORD(le->Blink, tree_write, list_entry);
+    if ((ULONG_PTR)run->data % PAGE_SIZE != 0 || (ULONG_PTR)tw->data % PAGE_SIZE != 0 || tw->length % PAGE_SIZE != 0)
+        return FALSE;
 
-            if (tw->address == tw2->address + tw2->length) {
-                UINT8* data = ExAllocatePoolWithTag(NonPagedPool, tw2->length + tw->length, ALLOC_TAG);
+    return TRUE;
+}
 
-                if (!data) {
-                    ERR("out of memory\n");
-                    return STATUS_INSUFFICIENT_RESOURCES;
-                }
+static NTSTATUS map_tree_write_run(tree_write_run* run) {
+    LIST_ENTRY* le = &run->first->list_entry;
+    PFN_NUMBER* pfns;
+    ULONG i, pos = 0;
 
-                RtlCopyMemory(data, tw2->data, tw2->length);
-                RtlCopyMemory(&data[tw2->length], tw->data, tw->length);
+    run->mdl = IoAllocateMdl(NULL, run->length, FALSE, FALSE, NULL);
+    if (!run->mdl) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
 
-                if (!no_free)
-                    ExFreePool(tw2->data);
+    run->mdl->MdlFlags |= MDL_PARTIAL;
+    pfns = (PFN_NUMBER*)(run->mdl + 1);
 
-                tw2->data = data;
-                tw2->length += tw->length;
+    for (i = 0; i < run->num_trees; i++) {
+        tree_write* tw = CONTAINING_RECORD(le, tree_write, list_entry);
+        NTSTATUS Status = STATUS_SUCCESS;
 
-                if (!no_free) // FIXME - what if we allocated this just now?
-                    ExFreePool(tw->data);
+        tw->mdl = IoAllocateMdl(tw->data, tw->length, FALSE, FALSE, NULL);
+        if (!tw->mdl) {
+            ERR("out of memory\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
 
-                RemoveEntryList(&tw->list_entry);
-                ExFreePool(tw);
+        try {
+            MmProbeAndLockPages(tw->mdl, KernelMode, IoReadAccess);
+        } except (EXCEPTION_EXECUTE_HANDLER) {
+            Status = GetExceptionCode();
+        }
 
-                le = tw2->list_entry.Flink;
-                continue;
-            }
+        if (!NT_SUCCESS(Status)) {
+            ERR("MmProbeAndLockPages threw exception %08x\n", Status);
+            IoFreeMdl(tw->mdl);
+            tw->mdl = NULL;
+            return Status;
         }
 
-        tw->c = c;
-
-        if (c->chunk_item->type & (BLOCK_FLAG_RAID5 | BLOCK_FLAG_RAID6))
-            raid56 = TRUE;
+        RtlCopyMemory(&pfns[pos >> PAGE_SHIFT], tw->mdl + 1, (tw->length >> PAGE_SHIFT) * sizeof(PFN_NUMBER));
+        pos += tw->length;
 
         le = le->Flink;
     }
 
-    num_bits = 0;
+    run->data = MmGetSystemAddressForMdlSafe(run->mdl, HighPagePriority);
+    if (!run->data) {
+        ERR("MmGetSystemAddressForMdlSafe returned NULL\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS do_tree_writes(device_extension* Vcb, LIST_ENTRY* tree_writes) {
+    chunk* c;
+    LIST_ENTRY* le;
+    tree_write* tw;
+    NTSTATUS Status;
+    ULONG i, num_trees, num_runs, num_wtc = 0;
+    tree_write_run* runs;
+    write_data_context* wtc = NULL;
+    BOOL raid56 = FALSE;
+
+    num_trees = 0;
 
     le = tree_writes->Flink;
     while (le != tree_writes) {
-        tw = CONTAINING_RECORD(le, tree_write, list_entry);
-
-        num_bits++;
+        num_trees++;
 
         le = le->Flink;
     }
 
-    wtc = ExAllocatePoolWithTag(NonPagedPool, sizeof(write_data_context) * num_bits, ALLOC_TAG);
-    if (!wtc) {
+    if (num_trees == 0)
+        return STATUS_SUCCESS;
+
+    runs = ExAllocatePoolWithTag(PagedPool, sizeof(tree_write_run) * num_trees, ALLOC_TAG);
+    if (!runs) {
         ERR("out of memory\n");
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    le = tree_writes->Flink;
+    // group together runs
+    c = NULL;
+    num_runs = 0;
 
+    le = tree_writes->Flink;
     while (le != tree_writes) {
         tw = CONTAINING_RECORD(le, tree_write, list_entry);
 
-        TRACE("address: %llx, size: %x\n", tw->address, tw->length);
-
-        KeInitializeEvent(&wtc[bit_num].Event, NotificationEvent, FALSE);
-        InitializeListHead(&wtc[bit_num].stripes);
-        wtc[bit_num].need_wait = FALSE;
-        wtc[bit_num].stripes_left = 0;
-        wtc[bit_num].parity1 = wtc[bit_num].parity2 = wtc[bit_num].scratch = NULL;
-        wtc[bit_num].mdl = wtc[bit_num].parity1_mdl = wtc[bit_num].parity2_mdl = NULL;
+        tw->mdl = NULL;
 
-        Status = write_data(Vcb, tw->address, tw->data, tw->length, &wtc[bit_num], NULL, NULL, FALSE, 0, HighPagePriority);
-        if (!NT_SUCCESS(Status)) {
-            ERR("write_data returned %08x\n", Status);
+        if (!c || tw->address < c->offset || tw->address >= c->offset + c->chunk_item->size) {
+            c = get_chunk_from_address(Vcb, tw->address);
 
-            for (i = 0; i < num_bits; i++) {
-                free_write_data_stripes(&wtc[i]);
+            if (!c) {
+                ERR("could not find chunk for address %llx\n", tw->address);
+                Status = STATUS_INTERNAL_ERROR;
+                goto end;
             }
-            ExFreePool(wtc);
+        } else if (can_extend_tree_write_run(&runs[num_runs - 1], tw)) {
+            runs[num_runs - 1].length += tw->length;
+            runs[num_runs - 1].num_trees++;
+            tw->c = c;
 
-            return Status;
+            le = le->Flink;
+            continue;
         }
 
-        bit_num++;
+        tw->c = c;
+
+        if (c->chunk_item->type & (BLOCK_FLAG_RAID5 | BLOCK_FLAG_RAID6))
+            raid56 = TRUE;
+
+        runs[num_runs].address = tw->address;
+        runs[num_runs].length = tw->length;
+        runs[num_runs].data = tw->data;
+        runs[num_runs].mdl = NULL;
+        runs[num_runs].first = tw;
+        runs[num_runs].num_trees = 1;
+        num_runs++;
 
         le = le->Flink;
     }
 
-    for (i = 0; i < num_bits; i++) {
+    for (i = 0; i < num_runs; i++) {
+        if (runs[i].num_trees > 1) {
+            Status = map_tree_write_run(&runs[i]);
+            if (!NT_SUCCESS(Status)) {
+                ERR("map_tree_write_run returned %08x\n", Status);
+                goto end;
+            }
+        }
+    }
+
+    wtc = ExAllocatePoolWithTag(NonPagedPool, sizeof(write_data_context) * num_runs, ALLOC_TAG);
+    if (!wtc) {
+        ERR("out of memory\n");
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
+
+    for (i = 0; i < num_runs; i++) {
+        TRACE("address: %llx, size: %x (%u trees)\n", runs[i].address, runs[i].length, runs[i].num_trees);
+
+        KeInitializeEvent(&wtc[i].Event, NotificationEvent, FALSE);
+        InitializeListHead(&wtc[i].stripes);
+        wtc[i].need_wait = FALSE;
+        wtc[i].stripes_left = 0;
+        wtc[i].parity1 = wtc[i].parity2 = wtc[i].scratch = NULL;
+        wtc[i].mdl = wtc[i].parity1_mdl = wtc[i].parity2_mdl = NULL;
+        num_wtc++;
+
+        Status = write_data(Vcb, runs[i].address, runs[i].data, runs[i].length, &wtc[i], NULL, NULL, FALSE, 0, HighPagePriority);
+        if (!NT_SUCCESS(Status)) {
+            ERR("write_data returned %08x\n", Status);
+            goto end;
+        }
+    }
+
+    for (i = 0; i < num_runs; i++) {
         if (wtc[i].stripes.Flink != &wtc[i].stripes) {
             // launch writes and wait
             le = wtc[i].stripes.Flink;
@@ -1600,12 +1649,12 @@ NTSTATUS do_tree_writes(device_extension* Vcb, LIST_ENTRY* tree_writes, BOOL no_
         }
     }
 
-    for (i = 0; i < num_bits; i++) {
+    for (i = 0; i < num_runs; i++) {
         if (wtc[i].need_wait)
             KeWaitForSingleObject(&wtc[i].Event, Executive, KernelMode, FALSE, NULL);
     }
 
-    for (i = 0; i < num_bits; i++) {
+    for (i = 0; i < num_runs; i++) {
         le = wtc[i].stripes.Flink;
         while (le != &wtc[i].stripes) {
             write_data_stripe* stripe = CONTAINING_RECORD(le, write_data_stripe, list_entry);
@@ -1619,10 +1668,14 @@ NTSTATUS do_tree_writes(device_extension* Vcb, LIST_ENTRY* tree_writes, BOOL no_
             le = le->Flink;
         }
 
-        free_write_data_stripes(&wtc[i]);
+        Vcb->tree_write_bytes += runs[i].length;
+
+        if (runs[i].length > Vcb->tree_write_max_io)
+            Vcb->tree_write_max_io = runs[i].length;
     }
 
-    ExFreePool(wtc);
+    Vcb->tree_write_trees += num_trees;
+    Vcb->tree_write_ios += num_runs;
 
     if (raid56) {
         c = NULL;
@@ -1649,7 +1702,7 @@ NTSTATUS do_tree_writes(device_extension* Vcb, LIST_ENTRY* tree_writes, BOOL no_
                     if (!NT_SUCCESS(Status)) {
                         ERR("flush_partial_stripe returned %08x\n", Status);
                         ExReleaseResourceLite(&c->partial_stripes_lock);
-                        return Status;
+                        goto end;
                     }
                 }
 
@@ -1660,87 +1713,126 @@ NTSTATUS do_tree_writes(device_extension* Vcb, LIST_ENTRY* tree_writes, BOOL no_
         }
     }
 
-    return STATUS_SUCCESS;
+    Status = STATUS_SUCCESS;
+
+end:
+    if (wtc) {
+        for (i = 0; i < num_wtc; i++) {
+            free_write_data_stripes(&wtc[i]);
+        }
+
+        ExFreePool(wtc);
+    }
+
+    for (i = 0; i < num_runs; i++) {
+        if (runs[i].mdl)
+            IoFreeMdl(runs[i].mdl);
+    }
+
+    ExFreePool(runs);
+
+    le = tree_writes->Flink;
+    while (le != tree_writes) {
+        tw = CONTAINING_RECORD(le, tree_write, list_entry);
+
+        if (tw->mdl) {
+            MmUnlockPages(tw->mdl);
+            IoFreeMdl(tw->mdl);
+            tw->mdl = NULL;
+        }
+
+        le = le->Flink;
+    }
+
+    return Status;
+}
+
+static void free_tree_writes(LIST_ENTRY* tree_writes) {
+    while (!IsListEmpty(tree_writes)) {
+        LIST_ENTRY* le = RemoveHeadList(tree_writes);
+        tree_write* tw = CONTAINING_RECORD(le, tree_write, list_entry);
+
+        if (tw->data)
+            ExFreePool(tw->data);
+
+        ExFreePool(tw);
+    }
 }
 
-static NTSTATUS write_trees(device_extension* Vcb, PIRP Irp) {
+// Serializes the dirty trees into tree_writes, sorted by address. The actual
+// writing is done later by do_tree_writes.
+static NTSTATUS write_trees(device_extension* Vcb, LIST_ENTRY* tree_writes, PIRP Irp) {
     ULONG level;
     UINT8 *data, *body;
     UINT32 crc32;
     NTSTATUS Status;
     LIST_ENTRY* le;
-    LIST_ENTRY tree_writes;
     tree_write* tw;
 
     TRACE("(%p)\n", Vcb);
 
-    InitializeListHead(&tree_writes);
-
-    for (level = 0; level <= 255; level++) {
+    for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
         BOOL nothing_found = TRUE;
 
         TRACE("level = %u\n", level);
 
-        le = Vcb->trees.Flink;
-        while (le != &Vcb->trees) {
-            tree* t = CONTAINING_RECORD(le, tree, list_entry);
-
-            if (t->write && t->header.level == level) {
-                KEY firstitem, searchkey;
-                LIST_ENTRY* le2;
-                traverse_ptr tp;
-
-                if (!t->has_new_address) {
-                    ERR("error - tried to write tree with no new address\n");
-                    return STATUS_INTERNAL_ERROR;
-                }
+        le = Vcb->dirty_trees[level].Flink;
+        while (le != &Vcb->dirty_trees[level]) {
+            tree* t = CONTAINING_RECORD(le, tree, list_entry_dirty);
+            KEY firstitem, searchkey;
+            LIST_ENTRY* le2;
+            traverse_ptr tp;
 
-                le2 = t->itemlist.Flink;
-                while (le2 != &t->itemlist) {
-                    tree_data* td = CONTAINING_RECORD(le2, tree_data, list_entry);
-                    if (!td->ignore) {
-                        firstitem = td->key;
-                        break;
-                    }
-                    le2 = le2->Flink;
-                }
+            if (!t->has_new_address) {
+                ERR("error - tried to write tree with no new address\n");
+                return STATUS_INTERNAL_ERROR;
+            }
 
-                if (t->parent) {
-                    t->paritem->key = firstitem;
-                    t->paritem->treeholder.address = t->new_address;
-                    t->paritem->treeholder.generation = Vcb->superblock.generation;
+            le2 = t->itemlist.Flink;
+            while (le2 != &t->itemlist) {
+                tree_data* td = CONTAINING_RECORD(le2, tree_data, list_entry);
+                if (!td->ignore) {
+                    firstitem = td->key;
+                    break;
                 }
+                le2 = le2->Flink;
+            }
 
-                if (!(Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_SKINNY_METADATA)) {
-                    EXTENT_ITEM_TREE* eit;
+            if (t->parent) {
+                t->paritem->key = firstitem;
+                t->paritem->treeholder.address = t->new_address;
+                t->paritem->treeholder.generation = Vcb->superblock.generation;
+            }
 
-                    searchkey.obj_id = t->new_address;
-                    searchkey.obj_type = TYPE_EXTENT_ITEM;
-                    searchkey.offset = Vcb->superblock.node_size;
+            if (!(Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_SKINNY_METADATA)) {
+                EXTENT_ITEM_TREE* eit;
 
-                    Status = find_item(Vcb, Vcb->extent_root, &tp, &searchkey, FALSE, Irp);
-                    if (!NT_SUCCESS(Status)) {
-                        ERR("error - find_item returned %08x\n", Status);
-                        return Status;
-                    }
+                searchkey.obj_id = t->new_address;
+                searchkey.obj_type = TYPE_EXTENT_ITEM;
+                searchkey.offset = Vcb->superblock.node_size;
 
-                    if (keycmp(searchkey, tp.item->key)) {
-                        ERR("could not find %llx,%x,%llx in extent_root (found %llx,%x,%llx instead)\n", searchkey.obj_id, searchkey.obj_type, searchkey.offset, tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset);
-                        return STATUS_INTERNAL_ERROR;
-                    }
+                Status = find_item(Vcb, Vcb->extent_root, &tp, &searchkey, FALSE, Irp);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("error - find_item returned %08x\n", Status);
+                    return Status;
+                }
 
-                    if (tp.item->size < sizeof(EXTENT_ITEM_TREE)) {
-                        ERR("(%llx,%x,%llx) was %u bytes, expected at least %u\n", tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset, tp.item->size, sizeof(EXTENT_ITEM_TREE));
-                        return STATUS_INTERNAL_ERROR;
-                    }
+                if (keycmp(searchkey, tp.item->key)) {
+                    ERR("could not find %llx,%x,%llx in extent_root (found %llx,%x,%llx instead)\n", searchkey.obj_id, searchkey.obj_type, searchkey.offset, tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset);
+                    return STATUS_INTERNAL_ERROR;
+                }
 
-                    eit = (EXTENT_ITEM_TREE*)tp.item->data;
-                    eit->firstitem = firstitem;
+                if (tp.item->size < sizeof(EXTENT_ITEM_TREE)) {
+                    ERR("(%llx,%x,%llx) was %u bytes, expected at least %u\n", tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset, tp.item->size, sizeof(EXTENT_ITEM_TREE));
+                    return STATUS_INTERNAL_ERROR;
                 }
 
-                nothing_found = FALSE;
+                eit = (EXTENT_ITEM_TREE*)tp.item->data;
+                eit->firstitem = firstitem;
             }
 
+            nothing_found = FALSE;
+
             le = le->Flink;
         }
 
@@ -1750,16 +1842,16 @@ static NTSTATUS write_trees(device_extension* Vcb, PIRP Irp) {
 
     TRACE("allocated tree extents\n");
 
-    le = Vcb->trees.Flink;
-    while (le != &Vcb->trees) {
-        tree* t = CONTAINING_RECORD(le, tree, list_entry);
-        LIST_ENTRY* le2;
+    for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
+        le = Vcb->dirty_trees[level].Flink;
+        while (le != &Vcb->dirty_trees[level]) {
+            tree* t = CONTAINING_RECORD(le, tree, list_entry_dirty);
+            LIST_ENTRY* le2;
 #ifdef DEBUG_PARANOID
-        UINT32 num_items = 0, size = 0;
-        BOOL crash = FALSE;
+            UINT32 num_items = 0, size = 0;
+            BOOL crash = FALSE;
 #endif
 
-        if (t->write) {
 #ifdef DEBUG_PARANOID
             BOOL first = TRUE;
             KEY lastkey;
@@ -1903,13 +1995,13 @@ static NTSTATUS write_trees(device_extension* Vcb, PIRP Irp) {
             tw->length = Vcb->superblock.node_size;
             tw->data = data;
 
-            if (IsListEmpty(&tree_writes))
-                InsertTailList(&tree_writes, &tw->list_entry);
+            if (IsListEmpty(tree_writes))
+                InsertTailList(tree_writes, &tw->list_entry);
             else {
                 BOOL inserted = FALSE;
 
-                le2 = tree_writes.Flink;
-                while (le2 != &tree_writes) {
+                le2 = tree_writes->Flink;
+                while (le2 != tree_writes) {
                     tree_write* tw2 = CONTAINING_RECORD(le2, tree_write, list_entry);
 
                     if (tw2->address > tw->address) {
@@ -1922,32 +2014,16 @@ static NTSTATUS write_trees(device_extension* Vcb, PIRP Irp) {
                 }
 
                 if (!inserted)
-                    InsertTailList(&tree_writes, &tw->list_entry);
+                    InsertTailList(tree_writes, &tw->list_entry);
             }
-        }
-
-        le = le->Flink;
-    }
 
-    Status = do_tree_writes(Vcb, &tree_writes, FALSE);
-    if (!NT_SUCCESS(Status)) {
-        ERR("do_tree_writes returned %08x\n", Status);
-        goto end;
+            le = le->Flink;
+        }
     }
 
     Status = STATUS_SUCCESS;
 
 end:
-    while (!IsListEmpty(&tree_writes)) {
-        le = RemoveHeadList(&tree_writes);
-        tw = CONTAINING_RECORD(le, tree_write, list_entry);
-
-        if (tw->data)
-            ExFreePool(tw->data);
-
-        ExFreePool(tw);
-    }
-
     return Status;
 }
 
@@ -2036,6 +2112,14 @@ typedef struct _write_superblocks_context {
     LONG left;
 } write_superblocks_context;
 
+// Everything a transaction still has to send to disk once the trees in memory
+// have been updated - see write_transaction.
+typedef struct {
+    LIST_ENTRY tree_writes;
+    write_superblocks_context superblocks;
+    UINT64 generation;
+} transaction_io;
+
 _Function_class_(IO_COMPLETION_ROUTINE)
 static NTSTATUS write_superblock_completion(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID conptr) {
     write_superblocks_stripe* stripe = conptr;
@@ -2147,30 +2231,34 @@ static NTSTATUS write_superblock(device_extension* Vcb, device* device, write_su
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS write_superblocks(device_extension* Vcb, PIRP Irp) {
+// Builds the IRPs for every copy of the superblock on every device, but doesn't send
+// them - that's done by write_superblocks once the trees they point to are on disk.
+static NTSTATUS prepare_superblocks(device_extension* Vcb, write_superblocks_context* context, PIRP Irp) {
     UINT64 i;
     NTSTATUS Status;
     LIST_ENTRY* le;
-    write_superblocks_context context;
+    ULONG level;
 
     TRACE("(%p)\n", Vcb);
 
-    le = Vcb->trees.Flink;
-    while (le != &Vcb->trees) {
-        tree* t = CONTAINING_RECORD(le, tree, list_entry);
-
-        if (t->write && !t->parent) {
-            if (t->root == Vcb->root_root) {
-                Vcb->superblock.root_tree_addr = t->new_address;
-                Vcb->superblock.root_level = t->header.level;
-            } else if (t->root == Vcb->chunk_root) {
-                Vcb->superblock.chunk_tree_addr = t->new_address;
-                Vcb->superblock.chunk_root_generation = t->header.generation;
-                Vcb->superblock.chunk_root_level = t->header.level;
+    for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
+        le = Vcb->dirty_trees[level].Flink;
+        while (le != &Vcb->dirty_trees[level]) {
+            tree* t = CONTAINING_RECORD(le, tree, list_entry_dirty);
+
+            if (!t->parent) {
+                if (t->root == Vcb->root_root) {
+                    Vcb->superblock.root_tree_addr = t->new_address;
+                    Vcb->superblock.root_level = t->header.level;
+                } else if (t->root == Vcb->chunk_root) {
+                    Vcb->superblock.chunk_tree_addr = t->new_address;
+                    Vcb->superblock.chunk_root_generation = t->header.generation;
+                    Vcb->superblock.chunk_root_level = t->header.level;
+                }
             }
-        }
 
-        le = le->Flink;
+            le = le->Flink;
+        }
     }
 
     for (i = 0; i < BTRFS_NUM_BACKUP_ROOTS - 1; i++) {
@@ -2179,33 +2267,34 @@ static NTSTATUS write_superblocks(device_extension* Vcb, PIRP Irp) {
 
     update_backup_superblock(Vcb, &Vcb->superblock.backup[BTRFS_NUM_BACKUP_ROOTS - 1], Irp);
 
-    KeInitializeEvent(&context.Event, NotificationEvent, FALSE);
-    InitializeListHead(&context.stripes);
-    context.left = 0;
-
     le = Vcb->devices.Flink;
     while (le != &Vcb->devices) {
         device* dev = CONTAINING_RECORD(le, device, list_entry);
 
         if (dev->devobj && !dev->readonly) {
-            Status = write_superblock(Vcb, dev, &context);
+            Status = write_superblock(Vcb, dev, context);
             if (!NT_SUCCESS(Status)) {
                 ERR("write_superblock returned %08x\n", Status);
-                goto end;
+                return Status;
             }
         }
 
         le = le->Flink;
     }
 
-    if (IsListEmpty(&context.stripes)) {
+    if (IsListEmpty(&context->stripes)) {
         ERR("error - not writing any superblocks\n");
-        Status = STATUS_INTERNAL_ERROR;
-        goto end;
+        return STATUS_INTERNAL_ERROR;
     }
 
-    le = context.stripes.Flink;
-    while (le != &context.stripes) {
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS write_superblocks(device_extension* Vcb, write_superblocks_context* context) {
+    LIST_ENTRY* le;
+
+    le = context->stripes.Flink;
+    while (le != &context->stripes) {
         write_superblocks_stripe* stripe = CONTAINING_RECORD(le, write_superblocks_stripe, list_entry);
 
         IoCallDriver(stripe->device->devobj, stripe->Irp);
@@ -2213,27 +2302,27 @@ static NTSTATUS write_superblocks(device_extension* Vcb, PIRP Irp) {
         le = le->Flink;
     }
 
-    KeWaitForSingleObject(&context.Event, Executive, KernelMode, FALSE, NULL);
+    KeWaitForSingleObject(&context->Event, Executive, KernelMode, FALSE, NULL);
 
-    le = context.stripes.Flink;
-    while (le != &context.stripes) {
+    le = context->stripes.Flink;
+    while (le != &context->stripes) {
         write_superblocks_stripe* stripe = CONTAINING_RECORD(le, write_superblocks_stripe, list_entry);
 
         if (!NT_SUCCESS(stripe->Status)) {
             ERR("device %llx returned %08x\n", stripe->device->devitem.dev_id, stripe->Status);
             log_device_error(Vcb, stripe->device, BTRFS_DEV_STAT_WRITE_ERRORS);
-            Status = stripe->Status;
-            goto end;
+            return stripe->Status;
         }
 
         le = le->Flink;
     }
 
-    Status = STATUS_SUCCESS;
+    return STATUS_SUCCESS;
+}
 
-end:
-    while (!IsListEmpty(&context.stripes)) {
-        write_superblocks_stripe* stripe = CONTAINING_RECORD(RemoveHeadList(&context.stripes), write_superblocks_stripe, list_entry);
+static void free_superblock_stripes(write_superblocks_context* context) {
+    while (!IsListEmpty(&context->stripes)) {
+        write_superblocks_stripe* stripe = CONTAINING_RECORD(RemoveHeadList(&context->stripes), write_superblocks_stripe, list_entry);
 
         if (stripe->mdl) {
             if (stripe->mdl->MdlFlags & MDL_PAGES_LOCKED)
@@ -2250,8 +2339,6 @@ end:
 
         ExFreePool(stripe);
     }
-
-    return Status;
 }
 
 static NTSTATUS flush_changed_extent(device_extension* Vcb, chunk* c, changed_extent* ce, PIRP Irp, LIST_ENTRY* rollback) {
@@ -2434,6 +2521,8 @@ void add_checksum_entry(device_extension* Vcb, UINT64 address, ULONG length, UIN
     ULONG* bmparr;
     ULONG runlength, index;
 
+    invalidate_csum_cache(Vcb, address, length);
+
     searchkey.obj_id = EXTENT_CSUM_ID;
     searchkey.obj_type = TYPE_EXTENT_CSUM;
     searchkey.offset = address;
@@ -2789,9 +2878,24 @@ static NTSTATUS split_tree_at(device_extension* Vcb, tree* t, tree_data* newfirs
     tree *nt, *pt;
     tree_data* td;
     tree_data* oldlastitem;
+    LIST_ENTRY* le;
 
     TRACE("splitting tree in %llx at (%llx,%x,%llx)\n", t->root->id, newfirstitem->key.obj_id, newfirstitem->key.obj_type, newfirstitem->key.offset);
 
+    // Give the items we're moving their own allocations first, so that we've not changed anything if this fails.
+
+    le = &newfirstitem->list_entry;
+    while (le != &t->itemlist) {
+        td = unslab_tree_data(Vcb, t, CONTAINING_RECORD(le, tree_data, list_entry));
+        if (!td)
+            return STATUS_INSUFFICIENT_RESOURCES;
+
+        if (le == &newfirstitem->list_entry)
+            newfirstitem = td;
+
+        le = td->list_entry.Flink;
+    }
+
     nt = ExAllocatePoolWithTag(PagedPool, sizeof(tree), ALLOC_TAG);
     if (!nt) {
         ERR("out of memory\n");
@@ -2816,9 +2920,16 @@ static NTSTATUS split_tree_at(device_extension* Vcb, tree* t, tree_data* newfirs
     nt->new_address = 0;
     nt->has_new_address = FALSE;
     nt->updated_extents = FALSE;
+    nt->write = FALSE;
     nt->uniqueness_determined = TRUE;
     nt->is_unique = TRUE;
     nt->list_entry_hash.Flink = NULL;
+    nt->referenced = TRUE;
+    nt->index = NULL;
+    nt->index_size = 0;
+    nt->index_valid = FALSE;
+    nt->slab = NULL;
+    nt->slab_len = 0;
     nt->buf = NULL;
     InitializeListHead(&nt->itemlist);
 
@@ -2831,16 +2942,17 @@ static NTSTATUS split_tree_at(device_extension* Vcb, tree* t, tree_data* newfirs
 
     t->itemlist.Blink = &oldlastitem->list_entry;
     t->itemlist.Blink->Flink = &t->itemlist;
+    t->index_valid = FALSE;
 
     nt->size = t->size - size;
     t->size = size;
     t->header.num_items = numitems;
-    nt->write = TRUE;
+    mark_tree_dirty(nt);
 
     InsertTailList(&Vcb->trees, &nt->list_entry);
 
     if (nt->header.level > 0) {
-        LIST_ENTRY* le = nt->itemlist.Flink;
+        le = nt->itemlist.Flink;
 
         while (le != &nt->itemlist) {
             tree_data* td2 = CONTAINING_RECORD(le, tree_data, list_entry);
@@ -2855,12 +2967,12 @@ static NTSTATUS split_tree_at(device_extension* Vcb, tree* t, tree_data* newfirs
             le = le->Flink;
         }
     } else {
-        LIST_ENTRY* le = nt->itemlist.Flink;
+        le = nt->itemlist.Flink;
 
         while (le != &nt->itemlist) {
             tree_data* td2 = CONTAINING_RECORD(le, tree_data, list_entry);
 
-            if (!td2->inserted && td2->data) {
+            if (!td2->data_alloc && td2->data) {
                 UINT8* data = ExAllocatePoolWithTag(PagedPool, td2->size, ALLOC_TAG);
 
                 if (!data) {
@@ -2871,6 +2983,7 @@ static NTSTATUS split_tree_at(device_extension* Vcb, tree* t, tree_data* newfirs
                 RtlCopyMemory(data, td2->data, td2->size);
                 td2->data = data;
                 td2->inserted = TRUE;
+                td2->data_alloc = TRUE;
             }
 
             le = le->Flink;
@@ -2887,9 +3000,11 @@ static NTSTATUS split_tree_at(device_extension* Vcb, tree* t, tree_data* newfirs
         td->key = newfirstitem->key;
 
         InsertHeadList(&t->paritem->list_entry, &td->list_entry);
+        t->parent->index_valid = FALSE;
 
         td->ignore = FALSE;
         td->inserted = TRUE;
+        td->data_alloc = FALSE;
         td->treeholder.tree = nt;
         nt->paritem = td;
 
@@ -2901,8 +3016,8 @@ static NTSTATUS split_tree_at(device_extension* Vcb, tree* t, tree_data* newfirs
 
     TRACE("adding new tree parent\n");
 
-    if (nt->header.level == 255) {
-        ERR("cannot add parent to tree at level 255\n");
+    if (nt->header.level == BTRFS_MAX_LEVEL - 1) {
+        ERR("cannot add parent to tree at level %u\n", nt->header.level);
         return STATUS_INTERNAL_ERROR;
     }
 
@@ -2926,10 +3041,17 @@ static NTSTATUS split_tree_at(device_extension* Vcb, tree* t, tree_data* newfirs
     pt->new_address = 0;
     pt->has_new_address = FALSE;
     pt->updated_extents = FALSE;
+    pt->write = FALSE;
     pt->size = pt->header.num_items * sizeof(internal_node);
     pt->uniqueness_determined = TRUE;
     pt->is_unique = TRUE;
     pt->list_entry_hash.Flink = NULL;
+    pt->referenced = TRUE;
+    pt->index = NULL;
+    pt->index_size = 0;
+    pt->index_valid = FALSE;
+    pt->slab = NULL;
+    pt->slab_len = 0;
     pt->buf = NULL;
     InitializeListHead(&pt->itemlist);
 
@@ -2944,6 +3066,7 @@ static NTSTATUS split_tree_at(device_extension* Vcb, tree* t, tree_data* newfirs
     get_first_item(t, &td->key);
     td->ignore = FALSE;
     td->inserted = FALSE;
+    td->data_alloc = FALSE;
     td->treeholder.address = 0;
     td->treeholder.generation = Vcb->superblock.generation;
     td->treeholder.tree = t;
@@ -2959,13 +3082,14 @@ static NTSTATUS split_tree_at(device_extension* Vcb, tree* t, tree_data* newfirs
     td->key = newfirstitem->key;
     td->ignore = FALSE;
     td->inserted = FALSE;
+    td->data_alloc = FALSE;
     td->treeholder.address = 0;
     td->treeholder.generation = Vcb->superblock.generation;
     td->treeholder.tree = nt;
     InsertTailList(&pt->itemlist, &td->list_entry);
     nt->paritem = td;
 
-    pt->write = TRUE;
+    mark_tree_dirty(pt);
 
     t->root->treeholder.tree = pt;
 
@@ -3137,6 +3261,15 @@ static NTSTATUS try_tree_amalgamate(device_extension* Vcb, tree* t, BOOL* done,
     if (t->size + next_tree->size <= Vcb->superblock.node_size - sizeof(tree_header)) {
         // merge two trees into one
 
+        le = next_tree->itemlist.Flink;
+        while (le != &next_tree->itemlist) {
+            tree_data* td2 = unslab_tree_data(Vcb, next_tree, CONTAINING_RECORD(le, tree_data, list_entry));
+            if (!td2)
+                return STATUS_INSUFFICIENT_RESOURCES;
+
+            le = td2->list_entry.Flink;
+        }
+
         t->header.num_items += next_tree->header.num_items;
         t->size += next_tree->size;
 
@@ -3162,7 +3295,7 @@ static NTSTATUS try_tree_amalgamate(device_extension* Vcb, tree* t, BOOL* done,
             while (le != &next_tree->itemlist) {
                 tree_data* td2 = CONTAINING_RECORD(le, tree_data, list_entry);
 
-                if (!td2->inserted && td2->data) {
+                if (!td2->data_alloc && td2->data) {
                     UINT8* data = ExAllocatePoolWithTag(PagedPool, td2->size, ALLOC_TAG);
 
                     if (!data) {
@@ -3173,6 +3306,7 @@ static NTSTATUS try_tree_amalgamate(device_extension* Vcb, tree* t, BOOL* done,
                     RtlCopyMemory(data, td2->data, td2->size);
                     td2->data = data;
                     td2->inserted = TRUE;
+                    td2->data_alloc = TRUE;
                 }
 
                 le = le->Flink;
@@ -3186,6 +3320,9 @@ static NTSTATUS try_tree_amalgamate(device_extension* Vcb, tree* t, BOOL* done,
 
         next_tree->itemlist.Flink = next_tree->itemlist.Blink = &next_tree->itemlist;
 
+        t->index_valid = FALSE;
+        next_tree->index_valid = FALSE;
+
         next_tree->header.num_items = 0;
         next_tree->size = 0;
 
@@ -3215,12 +3352,16 @@ static NTSTATUS try_tree_amalgamate(device_extension* Vcb, tree* t, BOOL* done,
 
         par = next_tree->parent;
         while (par) {
-            par->write = TRUE;
+            mark_tree_dirty(par);
             par = par->parent;
         }
 
+        next_tree->parent->index_valid = FALSE;
         RemoveEntryList(&nextparitem->list_entry);
-        ExFreePool(next_tree->paritem);
+
+        if (!tree_data_in_slab(next_tree->parent, nextparitem))
+            ExFreeToPagedLookasideList(&Vcb->tree_data_lookaside, nextparitem);
+
         next_tree->paritem = NULL;
 
         next_tree->root->root_item.bytes_used -= Vcb->superblock.node_size;
@@ -3250,15 +3391,21 @@ static NTSTATUS try_tree_amalgamate(device_extension* Vcb, tree* t, BOOL* done,
                 size = 0;
 
             if (t->size + size < Vcb->superblock.node_size - sizeof(tree_header)) {
+                td = unslab_tree_data(Vcb, next_tree, td);
+                if (!td)
+                    return STATUS_INSUFFICIENT_RESOURCES;
+
                 RemoveEntryList(&td->list_entry);
                 InsertTailList(&t->itemlist, &td->list_entry);
+                t->index_valid = FALSE;
+                next_tree->index_valid = FALSE;
 
                 if (next_tree->header.level > 0 && td->treeholder.tree) {
                     td->treeholder.tree->parent = t;
 #ifdef DEBUG_PARANOID
                     if (td->treeholder.tree->parent && td->treeholder.tree->parent->header.level <= td->treeholder.tree->header.level) int3;
 #endif
-                } else if (next_tree->header.level == 0 && !td->inserted && td->size > 0) {
+                } else if (next_tree->header.level == 0 && !td->data_alloc && td->size > 0) {
                     UINT8* data = ExAllocatePoolWithTag(PagedPool, td->size, ALLOC_TAG);
 
                     if (!data) {
@@ -3271,6 +3418,7 @@ static NTSTATUS try_tree_amalgamate(device_extension* Vcb, tree* t, BOOL* done,
                 }
 
                 td->inserted = TRUE;
+                td->data_alloc = TRUE;
 
                 if (!td->ignore) {
                     next_tree->size -= size;
@@ -3304,7 +3452,7 @@ static NTSTATUS try_tree_amalgamate(device_extension* Vcb, tree* t, BOOL* done,
 
         par = next_tree;
         while (par) {
-            par->write = TRUE;
+            mark_tree_dirty(par);
             par = par->parent;
         }
 
@@ -3444,92 +3592,97 @@ static NTSTATUS do_splits(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
 
     max_level = 0;
 
-    for (level = 0; level <= 255; level++) {
+    for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
         LIST_ENTRY *le, *nextle;
 
         empty = TRUE;
 
         TRACE("doing level %u\n", level);
 
-        le = Vcb->trees.Flink;
+        le = Vcb->dirty_trees[level].Flink;
 
-        while (le != &Vcb->trees) {
-            t = CONTAINING_RECORD(le, tree, list_entry);
+        while (le != &Vcb->dirty_trees[level]) {
+            t = CONTAINING_RECORD(le, tree, list_entry_dirty);
 
             nextle = le->Flink;
 
-            if (t->write && t->header.level == level) {
-                empty = FALSE;
-
-                if (t->header.num_items == 0) {
-                    if (t->parent) {
-                        done_deletions = TRUE;
+            empty = FALSE;
 
-                        TRACE("deleting tree in root %llx\n", t->root->id);
+            if (t->header.num_items == 0) {
+                if (t->parent) {
+                    done_deletions = TRUE;
 
-                        t->root->root_item.bytes_used -= Vcb->superblock.node_size;
+                    TRACE("deleting tree in root %llx\n", t->root->id);
 
-                        if (t->has_new_address) { // delete associated EXTENT_ITEM
-                            Status = reduce_tree_extent(Vcb, t->new_address, t, t->parent->header.tree_id, t->header.level, Irp, rollback);
+                    t->root->root_item.bytes_used -= Vcb->superblock.node_size;
 
-                            if (!NT_SUCCESS(Status)) {
-                                ERR("reduce_tree_extent returned %08x\n", Status);
-                                return Status;
-                            }
+                    if (t->has_new_address) { // delete associated EXTENT_ITEM
+                        Status = reduce_tree_extent(Vcb, t->new_address, t, t->parent->header.tree_id, t->header.level, Irp, rollback);
 
-                            t->has_new_address = FALSE;
-                        } else if (t->has_address) {
-                            Status = reduce_tree_extent(Vcb,t->header.address, t, t->parent->header.tree_id, t->header.level, Irp, rollback);
+                        if (!NT_SUCCESS(Status)) {
+                            ERR("reduce_tree_extent returned %08x\n", Status);
+                            return Status;
+                        }
 
-                            if (!NT_SUCCESS(Status)) {
-                                ERR("reduce_tree_extent returned %08x\n", Status);
-                                return Status;
-                            }
+                        t->has_new_address = FALSE;
+                    } else if (t->has_address) {
+                        Status = reduce_tree_extent(Vcb,t->header.address, t, t->parent->header.tree_id, t->header.level, Irp, rollback);
 
-                            t->has_address = FALSE;
+                        if (!NT_SUCCESS(Status)) {
+                            ERR("reduce_tree_extent returned %08x\n", Status);
+                            return Status;
                         }
 
-                        if (!t->paritem->ignore) {
-                            t->paritem->ignore = TRUE;
-                            t->parent->header.num_items--;
-                            t->parent->size -= sizeof(internal_node);
-                        }
+                        t->has_address = FALSE;
+                    }
 
-                        RemoveEntryList(&t->paritem->list_entry);
-                        ExFreePool(t->paritem);
-                        t->paritem = NULL;
+                    if (!t->paritem->ignore) {
+                        t->paritem->ignore = TRUE;
+                        t->parent->header.num_items--;
+                        t->parent->size -= sizeof(internal_node);
+                    }
 
-                        free_tree(t);
-                    } else if (t->header.level != 0) {
-                        if (t->has_new_address) {
-                            Status = update_extent_level(Vcb, t->new_address, t, 0, Irp);
+                    t->parent->index_valid = FALSE;
+                    RemoveEntryList(&t->paritem->list_entry);
 
-                            if (!NT_SUCCESS(Status)) {
-                                ERR("update_extent_level returned %08x\n", Status);
-                                return Status;
-                            }
-                        }
+                    if (!tree_data_in_slab(t->parent, t->paritem))
+                        ExFreeToPagedLookasideList(&Vcb->tree_data_lookaside, t->paritem);
 
-                        t->header.level = 0;
-                    }
-                } else if (t->size > Vcb->superblock.node_size - sizeof(tree_header)) {
-                    TRACE("splitting overlarge tree (%x > %x)\n", t->size, Vcb->superblock.node_size - sizeof(tree_header));
+                    t->paritem = NULL;
+
+                    free_tree(t);
+                } else if (t->header.level != 0) {
+                    if (t->has_new_address) {
+                        Status = update_extent_level(Vcb, t->new_address, t, 0, Irp);
 
-                    if (!t->updated_extents && t->has_address) {
-                        Status = update_tree_extents_recursive(Vcb, t, Irp, rollback);
                         if (!NT_SUCCESS(Status)) {
-                            ERR("update_tree_extents_recursive returned %08x\n", Status);
+                            ERR("update_extent_level returned %08x\n", Status);
                             return Status;
                         }
                     }
 
-                    Status = split_tree(Vcb, t);
+                    t->header.level = 0;
+
+                    RemoveEntryList(&t->list_entry_dirty);
+                    InsertTailList(&Vcb->dirty_trees[0], &t->list_entry_dirty);
+                }
+            } else if (t->size > Vcb->superblock.node_size - sizeof(tree_header)) {
+                TRACE("splitting overlarge tree (%x > %x)\n", t->size, Vcb->superblock.node_size - sizeof(tree_header));
 
+                if (!t->updated_extents && t->has_address) {
+                    Status = update_tree_extents_recursive(Vcb, t, Irp, rollback);
                     if (!NT_SUCCESS(Status)) {
-                        ERR("split_tree returned %08x\n", Status);
+                        ERR("update_tree_extents_recursive returned %08x\n", Status);
                         return Status;
                     }
                 }
+
+                Status = split_tree(Vcb, t);
+
+                if (!NT_SUCCESS(Status)) {
+                    ERR("split_tree returned %08x\n", Status);
+                    return Status;
+                }
             }
 
             le = nextle;
@@ -3548,12 +3701,12 @@ static NTSTATUS do_splits(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
     for (level = 0; level <= max_level; level++) {
         LIST_ENTRY* le;
 
-        le = Vcb->trees.Flink;
+        le = Vcb->dirty_trees[level].Flink;
 
-        while (le != &Vcb->trees) {
-            t = CONTAINING_RECORD(le, tree, list_entry);
+        while (le != &Vcb->dirty_trees[level]) {
+            t = CONTAINING_RECORD(le, tree, list_entry_dirty);
 
-            if (t->write && t->header.level == level && t->header.num_items > 0 && t->parent && t->size < min_size &&
+            if (t->header.num_items > 0 && t->parent && t->size < min_size &&
                 t->root->id != BTRFS_ROOT_FREE_SPACE && is_tree_unique(Vcb, t, Irp)) {
                 BOOL done;
 
@@ -3576,71 +3729,69 @@ static NTSTATUS do_splits(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
         for (level = max_level; level > 0; level--) {
             LIST_ENTRY *le, *nextle;
 
-            le = Vcb->trees.Flink;
-            while (le != &Vcb->trees) {
+            le = Vcb->dirty_trees[level].Flink;
+            while (le != &Vcb->dirty_trees[level]) {
                 nextle = le->Flink;
-                t = CONTAINING_RECORD(le, tree, list_entry);
-
-                if (t->write && t->header.level == level) {
-                    if (!t->parent && t->header.num_items == 1) {
-                        LIST_ENTRY* le2 = t->itemlist.Flink;
-                        tree_data* td = NULL;
-                        tree* child_tree = NULL;
-
-                        while (le2 != &t->itemlist) {
-                            td = CONTAINING_RECORD(le2, tree_data, list_entry);
-                            if (!td->ignore)
-                                break;
-                            le2 = le2->Flink;
-                        }
-
-                        TRACE("deleting top-level tree in root %llx with one item\n", t->root->id);
+                t = CONTAINING_RECORD(le, tree, list_entry_dirty);
+
+                if (!t->parent && t->header.num_items == 1) {
+                    LIST_ENTRY* le2 = t->itemlist.Flink;
+                    tree_data* td = NULL;
+                    tree* child_tree = NULL;
+
+                    while (le2 != &t->itemlist) {
+                        td = CONTAINING_RECORD(le2, tree_data, list_entry);
+                        if (!td->ignore)
+                            break;
+                        le2 = le2->Flink;
+                    }
 
-                        if (t->has_new_address) { // delete associated EXTENT_ITEM
-                            Status = reduce_tree_extent(Vcb, t->new_address, t, t->header.tree_id, t->header.level, Irp, rollback);
+                    TRACE("deleting top-level tree in root %llx with one item\n", t->root->id);
 
-                            if (!NT_SUCCESS(Status)) {
-                                ERR("reduce_tree_extent returned %08x\n", Status);
-                                return Status;
-                            }
+                    if (t->has_new_address) { // delete associated EXTENT_ITEM
+                        Status = reduce_tree_extent(Vcb, t->new_address, t, t->header.tree_id, t->header.level, Irp, rollback);
 
-                            t->has_new_address = FALSE;
-                        } else if (t->has_address) {
-                            Status = reduce_tree_extent(Vcb,t->header.address, t, t->header.tree_id, t->header.level, Irp, rollback);
+                        if (!NT_SUCCESS(Status)) {
+                            ERR("reduce_tree_extent returned %08x\n", Status);
+                            return Status;
+                        }
 
-                            if (!NT_SUCCESS(Status)) {
-                                ERR("reduce_tree_extent returned %08x\n", Status);
-                                return Status;
-                            }
+                        t->has_new_address = FALSE;
+                    } else if (t->has_address) {
+                        Status = reduce_tree_extent(Vcb,t->header.address, t, t->header.tree_id, t->header.level, Irp, rollback);
 
-                            t->has_address = FALSE;
+                        if (!NT_SUCCESS(Status)) {
+                            ERR("reduce_tree_extent returned %08x\n", Status);
+                            return Status;
                         }
 
-                        if (!td->treeholder.tree) { // load first item if not already loaded
-                            KEY searchkey = {0,0,0};
-                            traverse_ptr tp;
+                        t->has_address = FALSE;
+                    }
 
-                            Status = find_item(Vcb, t->root, &tp, &searchkey, FALSE, Irp);
-                            if (!NT_SUCCESS(Status)) {
-                                ERR("error - find_item returned %08x\n", Status);
-                                return Status;
-                            }
+                    if (!td->treeholder.tree) { // load first item if not already loaded
+                        KEY searchkey = {0,0,0};
+                        traverse_ptr tp;
+
+                        Status = find_item(Vcb, t->root, &tp, &searchkey, FALSE, Irp);
+                        if (!NT_SUCCESS(Status)) {
+                            ERR("error - find_item returned %08x\n", Status);
+                            return Status;
                         }
+                    }
 
-                        child_tree = td->treeholder.tree;
+                    child_tree = td->treeholder.tree;
 
-                        if (child_tree) {
-                            child_tree->parent = NULL;
-                            child_tree->paritem = NULL;
-                        }
+                    if (child_tree) {
+                        child_tree->parent = NULL;
+                        child_tree->paritem = NULL;
+                    }
 
-                        t->root->root_item.bytes_used -= Vcb->superblock.node_size;
+                    t->root->root_item.bytes_used -= Vcb->superblock.node_size;
 
-                        free_tree(t);
+                    free_tree(t);
 
-                        if (child_tree)
-                            child_tree->root->treeholder.tree = child_tree;
-                    }
+                    if (child_tree)
+                        child_tree->root->treeholder.tree = child_tree;
                 }
 
                 le = nextle;
@@ -4674,7 +4825,7 @@ NTSTATUS flush_fcb(fcb* fcb, BOOL cache, LIST_ENTRY* batchlist, PIRP Irp) {
                             nextext->offset == ext->offset + ed2->num_bytes && ned2->offset == ed2->offset + ed2->num_bytes) {
                             chunk* c;
 
-                            if (ext->extent_data.compression == BTRFS_COMPRESSION_NONE && ext->csum) {
+                            if (ext->extent_data.compression == BTRFS_COMPRESSION_NONE && ext->csum && nextext->csum) {
                                 ULONG len = (ULONG)((ed2->num_bytes + ned2->num_bytes) / fcb->Vcb->superblock.sector_size);
                                 UINT32* csum;
 
@@ -4691,6 +4842,10 @@ NTSTATUS flush_fcb(fcb* fcb, BOOL cache, LIST_ENTRY* batchlist, PIRP Irp) {
 
                                 ExFreePool(ext->csum);
                                 ext->csum = csum;
+                            } else if (ext->csum && !nextext->csum) {
+                                // nextext's checksums are only on disk, and by now so are ext's
+                                ExFreePool(ext->csum);
+                                ext->csum = NULL;
                             }
 
                             ext->extent_data.generation = fcb->Vcb->superblock.generation;
@@ -5356,6 +5511,7 @@ static NTSTATUS drop_chunk(device_extension* Vcb, chunk* c, LIST_ENTRY* batchlis
         remove_from_bootstrap(Vcb, 0x100, TYPE_CHUNK_ITEM, c->offset);
 
     RemoveEntryList(&c->list_entry);
+    update_chunk_index(Vcb);
 
     // clear raid56 incompat flag if dropping last RAID5/6 chunk
 
@@ -6083,7 +6239,7 @@ static NTSTATUS add_root_item_to_cache(device_extension* Vcb, UINT64 root, PIRP
             return Status;
         }
     } else {
-        tp.tree->write = TRUE;
+        mark_tree_dirty(tp.tree);
     }
 
     return STATUS_SUCCESS;
@@ -6881,14 +7037,83 @@ static NTSTATUS test_not_full(device_extension* Vcb) {
     return STATUS_DISK_FULL;
 }
 
-static NTSTATUS do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback) {
+static void free_transaction_io(transaction_io* tio) {
+    free_tree_writes(&tio->tree_writes);
+    free_superblock_stripes(&tio->superblocks);
+}
+
+// Does the device IO for a transaction prepared by do_write2. Nothing here touches
+// the trees, so this only needs tree_lock shared - but whoever calls it has to
+// make sure nothing gets allocated until it returns, as space freed by the
+// transaction is still in use by the superblock currently on disk.
+static NTSTATUS write_transaction(device_extension* Vcb, transaction_io* tio) {
+    NTSTATUS Status;
+    LIST_ENTRY* le;
+    volume_device_extension* vde;
+#ifdef DEBUG_FLUSH_TIMES
+    LARGE_INTEGER freq, time1, time2;
+
+    time1 = KeQueryPerformanceCounter(&freq);
+#endif
+
+    Status = do_tree_writes(Vcb, &tio->tree_writes);
+    if (!NT_SUCCESS(Status)) {
+        ERR("do_tree_writes returned %08x\n", Status);
+        goto end;
+    }
+
+    if (!Vcb->options.no_barrier)
+        flush_disk_caches(Vcb);
+
+    Status = write_superblocks(Vcb, &tio->superblocks);
+    if (!NT_SUCCESS(Status)) {
+        ERR("write_superblocks returned %08x\n", Status);
+        goto end;
+    }
+
+    vde = Vcb->vde;
+
+    if (vde) {
+        pdo_device_extension* pdode = vde->pdode;
+
+        ExAcquireResourceSharedLite(&pdode->child_lock, TRUE);
+
+        le = pdode->children.Flink;
+
+        while (le != &pdode->children) {
+            volume_child* vc = CONTAINING_RECORD(le, volume_child, list_entry);
+
+            vc->generation = tio->generation;
+            le = le->Flink;
+        }
+
+        ExReleaseResourceLite(&pdode->child_lock);
+    }
+
+    clean_space_cache(Vcb);
+
+#ifdef DEBUG_FLUSH_TIMES
+    time2 = KeQueryPerformanceCounter(NULL);
+
+    ERR("transaction %llu written in %llu (freq = %llu)\n", tio->generation, time2.QuadPart - time1.QuadPart, freq.QuadPart);
+#endif
+
+    Status = STATUS_SUCCESS;
+
+end:
+    free_transaction_io(tio);
+
+    return Status;
+}
+
+static NTSTATUS do_write2(device_extension* Vcb, transaction_io* tio, PIRP Irp, LIST_ENTRY* rollback) {
     NTSTATUS Status;
     LIST_ENTRY *le, batchlist;
     BOOL cache_changed = FALSE;
-    volume_device_extension* vde;
     BOOL no_cache = FALSE;
 #ifdef DEBUG_FLUSH_TIMES
     UINT64 filerefs = 0, fcbs = 0;
+    UINT64 parents_time = 0, allocate_time = 0, splits_time = 0;
     LARGE_INTEGER freq, time1, time2;
 #endif
 #ifdef DEBUG_WRITE_LOOPS
@@ -7058,7 +7283,7 @@ static NTSTATUS do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
             return Status;
         }
 
-        Vcb->root_root->treeholder.tree->write = TRUE;
+        mark_tree_dirty(Vcb->root_root->treeholder.tree);
     }
 
     // make sure we always update the extent tree
@@ -7089,24 +7314,45 @@ static NTSTATUS do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
     }
 
     do {
+#ifdef DEBUG_FLUSH_TIMES
+        time1 = KeQueryPerformanceCounter(NULL);
+#endif
+
         Status = add_parents(Vcb, Irp);
         if (!NT_SUCCESS(Status)) {
             ERR("add_parents returned %08x\n", Status);
             goto end;
         }
 
+#ifdef DEBUG_FLUSH_TIMES
+        time2 = KeQueryPerformanceCounter(NULL);
+        parents_time += time2.QuadPart - time1.QuadPart;
+        time1 = time2;
+#endif
+
         Status = allocate_tree_extents(Vcb, Irp, rollback);
         if (!NT_SUCCESS(Status)) {
             ERR("allocate_tree_extents returned %08x\n", Status);
             goto end;
         }
 
+#ifdef DEBUG_FLUSH_TIMES
+        time2 = KeQueryPerformanceCounter(NULL);
+        allocate_time += time2.QuadPart - time1.QuadPart;
+        time1 = time2;
+#endif
+
         Status = do_splits(Vcb, Irp, rollback);
         if (!NT_SUCCESS(Status)) {
             ERR("do_splits returned %08x\n", Status);
             goto end;
         }
 
+#ifdef DEBUG_FLUSH_TIMES
+        time2 = KeQueryPerformanceCounter(NULL);
+        splits_time += time2.QuadPart - time1.QuadPart;
+#endif
+
         Status = update_chunk_usage(Vcb, Irp, rollback);
         if (!NT_SUCCESS(Status)) {
             ERR("update_chunk_usage returned %08x\n", Status);
@@ -7150,12 +7396,23 @@ static NTSTATUS do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
         goto end;
     }
 
-    Status = write_trees(Vcb, Irp);
+#ifdef DEBUG_FLUSH_TIMES
+    time1 = KeQueryPerformanceCounter(&freq);
+#endif
+
+    Status = write_trees(Vcb, &tio->tree_writes, Irp);
     if (!NT_SUCCESS(Status)) {
         ERR("write_trees returned %08x\n", Status);
         goto end;
     }
 
+#ifdef DEBUG_FLUSH_TIMES
+    time2 = KeQueryPerformanceCounter(NULL);
+
+    ERR("add_parents took %llu, allocate_tree_extents %llu, do_splits %llu, write_trees %llu (freq = %llu)\n",
+        parents_time, allocate_time, splits_time, time2.QuadPart - time1.QuadPart, freq.QuadPart);
+#endif
+
     Status = test_not_full(Vcb);
     if (!NT_SUCCESS(Status)) {
         ERR("test_not_full returned %08x\n", Status);
@@ -7203,42 +7460,20 @@ static NTSTATUS do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
 
     Vcb->superblock.cache_generation = Vcb->superblock.generation;
 
-    if (!Vcb->options.no_barrier)
-        flush_disk_caches(Vcb);
-
-    Status = write_superblocks(Vcb, Irp);
+    Status = prepare_superblocks(Vcb, &tio->superblocks, Irp);
     if (!NT_SUCCESS(Status)) {
-        ERR("write_superblocks returned %08x\n", Status);
+        ERR("prepare_superblocks returned %08x\n", Status);
         goto end;
     }
 
-    vde = Vcb->vde;
-
-    if (vde) {
-        pdo_device_extension* pdode = vde->pdode;
-
-        ExAcquireResourceSharedLite(&pdode->child_lock, TRUE);
-
-        le = pdode->children.Flink;
-
-        while (le != &pdode->children) {
-            volume_child* vc = CONTAINING_RECORD(le, volume_child, list_entry);
-
-            vc->generation = Vcb->superblock.generation;
-            le = le->Flink;
-        }
-
-        ExReleaseResourceLite(&pdode->child_lock);
-    }
-
-    clean_space_cache(Vcb);
+    tio->generation = Vcb->superblock.generation;
 
+    // space_changed gets cleared by clean_space_cache, once the transaction is on disk
     le = Vcb->chunks.Flink;
     while (le != &Vcb->chunks) {
         chunk* c = CONTAINING_RECORD(le, chunk, list_entry);
 
         c->changed = FALSE;
-        c->space_changed = FALSE;
 
         le = le->Flink;
     }
@@ -7247,20 +7482,16 @@ static NTSTATUS do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
 
     Status = STATUS_SUCCESS;
 
-    le = Vcb->trees.Flink;
-    while (le != &Vcb->trees) {
-        tree* t = CONTAINING_RECORD(le, tree, list_entry);
-
-        t->write = FALSE;
-
-        le = le->Flink;
-    }
+    clean_trees(Vcb);
 
     Vcb->need_write = FALSE;
 
     while (!IsListEmpty(&Vcb->drop_roots)) {
         root* r = CONTAINING_RECORD(RemoveHeadList(&Vcb->drop_roots), root, list_entry);
 
+        if (r->fcbs_hash)
+            ExFreePool(r->fcbs_hash);
+
         ExDeleteResourceLite(&r->nonpaged->load_tree_lock);
         ExFreePool(r->nonpaged);
         ExFreePool(r);
@@ -7272,25 +7503,55 @@ end:
     return Status;
 }
 
-NTSTATUS do_write(device_extension* Vcb, PIRP Irp) {
+// Updates the trees in memory for a new transaction, and fills in tio with the IO
+// needed to put it on disk. Once this has succeeded the transaction can't be rolled
+// back, so if write_transaction then fails the volume has to go readonly.
+static NTSTATUS prepare_transaction(device_extension* Vcb, transaction_io* tio, PIRP Irp) {
     LIST_ENTRY rollback;
     NTSTATUS Status;
 
     InitializeListHead(&rollback);
 
-    Status = do_write2(Vcb, Irp, &rollback);
+    InitializeListHead(&tio->tree_writes);
+    KeInitializeEvent(&tio->superblocks.Event, NotificationEvent, FALSE);
+    InitializeListHead(&tio->superblocks.stripes);
+    tio->superblocks.left = 0;
+
+    Status = do_write2(Vcb, tio, Irp, &rollback);
 
     if (!NT_SUCCESS(Status)) {
         ERR("do_write2 returned %08x, dropping into readonly mode\n", Status);
         Vcb->readonly = TRUE;
         FsRtlNotifyVolumeEvent(Vcb->root_file, FSRTL_VOLUME_FORCED_CLOSED);
         do_rollback(Vcb, &rollback);
+        free_transaction_io(tio);
     } else
         clear_rollback(&rollback);
 
     return Status;
 }
 
+static void transaction_write_failed(device_extension* Vcb, NTSTATUS Status) {
+    ERR("write_transaction returned %08x, dropping into readonly mode\n", Status);
+    Vcb->readonly = TRUE;
+    FsRtlNotifyVolumeEvent(Vcb->root_file, FSRTL_VOLUME_FORCED_CLOSED);
+}
+
+NTSTATUS do_write(device_extension* Vcb, PIRP Irp) {
+    transaction_io tio;
+    NTSTATUS Status;
+
+    Status = prepare_transaction(Vcb, &tio, Irp);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    Status = write_transaction(Vcb, &tio);
+    if (!NT_SUCCESS(Status))
+        transaction_write_failed(Vcb, Status);
+
+    return Status;
+}
+
 #ifdef DEBUG_STATS
 static void print_stats(device_extension* Vcb) {
     LARGE_INTEGER freq;
@@ -7313,17 +7574,35 @@ static void print_stats(device_extension* Vcb) {
     ERR("number of creates: %llu\n", Vcb->stats.num_creates);
     ERR("calls to open_fcb: %llu\n", Vcb->stats.open_fcb_calls);
     ERR("time spent in open_fcb: %llu\n", Vcb->stats.open_fcb_time);
+    ERR("longest call to open_fcb: %llu\n", Vcb->stats.open_fcb_max_time);
+    ERR("calls to open_fcb for fcbs already open: %llu\n", Vcb->stats.open_fcb_cached);
+    ERR("time spent looking up open fcbs: %llu\n", Vcb->stats.fcb_lookup_time);
     ERR("calls to open_fileref_child: %llu\n", Vcb->stats.open_fileref_child_calls);
     ERR("time spent in open_fileref_child: %llu\n", Vcb->stats.open_fileref_child_time);
     ERR("time spent waiting for fcb_lock: %llu\n", Vcb->stats.fcb_lock_time);
+    ERR("references released without fcb_lock: %llu\n", Vcb->stats.unlocked_releases);
     ERR("total time taken: %llu\n", Vcb->stats.create_total_time);
 
     RtlZeroMemory(&Vcb->stats, sizeof(debug_stats));
 }
 #endif
 
+static BOOL trees_dirty(device_extension* Vcb) {
+    ULONG level;
+
+    for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
+        if (!IsListEmpty(&Vcb->dirty_trees[level]))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
 static void do_flush(device_extension* Vcb) {
     NTSTATUS Status;
+    transaction_io tio;
+    BOOL prepared = FALSE;
+    LIST_ENTRY* le;
 
     ExAcquireResourceExclusiveLite(&Vcb->tree_lock, TRUE);
 
@@ -7331,15 +7610,70 @@ static void do_flush(device_extension* Vcb) {
     print_stats(Vcb);
 #endif
 
-    if (Vcb->need_write && !Vcb->readonly)
-        Status = do_write(Vcb, NULL);
-    else
+    if (Vcb->need_write && !Vcb->readonly) {
+        Status = prepare_transaction(Vcb, &tio, NULL);
+        prepared = NT_SUCCESS(Status);
+    } else
         Status = STATUS_SUCCESS;
 
-    free_trees(Vcb);
+    if (!NT_SUCCESS(Status) || Vcb->need_write)
+        free_trees(Vcb);
+    else if (!prepared)
+        prune_trees(Vcb);
+
+    if (!NT_SUCCESS(Status))
+        ERR("prepare_transaction returned %08x\n", Status);
+
+    if (!prepared) {
+        ExReleaseResourceLite(&Vcb->tree_lock);
+        return;
+    }
+
+    // The transaction is complete in memory, so rather than holding up everybody else
+    // while we wait for the disks, we drop down to a shared lock. We keep hold of all
+    // the chunk locks, and of chunk_lock so that no new chunks can be created, which
+    // stops anything being allocated from space the old superblock still refers to.
+
+    ExAcquireResourceSharedLite(&Vcb->chunk_lock, TRUE);
+
+    le = Vcb->chunks.Flink;
+    while (le != &Vcb->chunks) {
+        chunk* c = CONTAINING_RECORD(le, chunk, list_entry);
+
+        acquire_chunk_lock(c, Vcb);
+
+        le = le->Flink;
+    }
+
+    ExConvertExclusiveToSharedLite(&Vcb->tree_lock);
+
+    Status = write_transaction(Vcb, &tio);
+    if (!NT_SUCCESS(Status))
+        transaction_write_failed(Vcb, Status);
+
+    le = Vcb->chunks.Flink;
+    while (le != &Vcb->chunks) {
+        chunk* c = CONTAINING_RECORD(le, chunk, list_entry);
+
+        release_chunk_lock(c, Vcb);
+
+        le = le->Flink;
+    }
+
+    ExReleaseResourceLite(&Vcb->chunk_lock);
+
+    ExReleaseResourceLite(&Vcb->tree_lock);
+
+    // We couldn't evict anything from the tree cache until the new trees were on disk.
+    // If somebody else has started changing the trees in the meantime, we leave it
+    // until the next flush.
+
+    ExAcquireResourceExclusiveLite(&Vcb->tree_lock, TRUE);
 
     if (!NT_SUCCESS(Status))
-        ERR("do_write returned %08x\n", Status);
+        free_trees(Vcb);
+    else if (!trees_dirty(Vcb))
+        prune_trees(Vcb);
 
     ExReleaseResourceLite(&Vcb->tree_lock);
 }
@@ -186,6 +186,104 @@ NTSTATUS clear_free_space_cache(device_extension* Vcb, LIST_ENTRY* batchlist, PI
     return Status;
 }
 
+// The size list is sorted by descending size, and space_size_ptrs points to the
+// first entry in each power-of-two size class, so we can jump straight to the
+// right place rather than walking the whole list.
+// list_size is always the space_size list of a chunk.
+static __inline LIST_ENTRY** get_space_size_ptrs(LIST_ENTRY* list_size) {
+    return CONTAINING_RECORD(list_size, chunk, space_size)->space_size_ptrs;
+}
+
+static __inline UINT8 space_size_bin(UINT64 size) {
+    return size == 0 ? 0 : (UINT8)RtlFindMostSignificantBit(size);
+}
+
+static LIST_ENTRY* space_size_start(LIST_ENTRY* list_size, UINT64 size) {
+    LIST_ENTRY** ptrs = get_space_size_ptrs(list_size);
+    int bin;
+
+    for (bin = space_size_bin(size); bin >= 0; bin--) {
+        if (ptrs[bin])
+            return ptrs[bin];
+    }
+
+    return list_size;
+}
+
+void order_space_entry(space* s, LIST_ENTRY* list_size) {
+    LIST_ENTRY** ptrs = get_space_size_ptrs(list_size);
+    UINT8 bin = space_size_bin(s->size);
+    LIST_ENTRY* le;
+
+    le = space_size_start(list_size, s->size);
+
+    while (le != list_size) {
+        space* s2 = CONTAINING_RECORD(le, space, list_entry_size);
+
+        if (s2->size <= s->size)
+            break;
+
+        le = le->Flink;
+    }
+
+    InsertHeadList(le->Blink, &s->list_entry_size);
+
+    if (!ptrs[bin] || s->list_entry_size.Flink == ptrs[bin])
+        ptrs[bin] = &s->list_entry_size;
+}
+
+// s->size has to be the same as when the entry was added
+static void remove_space_size_entry(space* s, LIST_ENTRY* list_size) {
+    LIST_ENTRY** ptrs = get_space_size_ptrs(list_size);
+    UINT8 bin = space_size_bin(s->size);
+
+    if (ptrs[bin] == &s->list_entry_size) {
+        if (s->list_entry_size.Flink != list_size) {
+            space* s2 = CONTAINING_RECORD(s->list_entry_size.Flink, space, list_entry_size);
+
+            if (space_size_bin(s2->size) == bin)
+                ptrs[bin] = &s2->list_entry_size;
+            else
+                ptrs[bin] = NULL;
+        } else
+            ptrs[bin] = NULL;
+    }
+
+    RemoveEntryList(&s->list_entry_size);
+}
+
+// Returns the smallest entry of at least length bytes, or NULL if there isn't one.
+space* find_space_best_fit(chunk* c, UINT64 length) {
+    LIST_ENTRY* le;
+    space* s;
+
+    if (IsListEmpty(&c->space_size))
+        return NULL;
+
+    le = space_size_start(&c->space_size, length);
+    while (le != &c->space_size) {
+        s = CONTAINING_RECORD(le, space, list_entry_size);
+
+        if (s->size == length)
+            return s;
+        else if (s->size < length) {
+            if (le == c->space_size.Flink)
+                return NULL;
+
+            return CONTAINING_RECORD(le->Blink, space, list_entry_size);
+        }
+
+        le = le->Flink;
+    }
+
+    s = CONTAINING_RECORD(c->space_size.Blink, space, list_entry_size);
+
+    if (s->size > length)
+        return s;
+
+    return NULL;
+}
+
 NTSTATUS add_space_entry(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 offset, UINT64 size) {
     space* s;
 
@@ -224,32 +322,8 @@ NTSTATUS add_space_entry(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 offset,
     }
 
 size:
-    if (!list_size)
-        return STATUS_SUCCESS;
-
-    if (IsListEmpty(list_size))
-        InsertTailList(list_size, &s->list_entry_size);
-    else {
-        space* s2 = CONTAINING_RECORD(list_size->Blink, space, list_entry_size);
-
-        if (s2->size >= size)
-            InsertTailList(list_size, &s->list_entry_size);
-        else {
-            LIST_ENTRY* le;
-
-            le = list_size->Flink;
-            while (le != list_size) {
-                s2 = CONTAINING_RECORD(le, space, list_entry_size);
-
-                if (s2->size <= size) {
-                    InsertHeadList(le->Blink, &s->list_entry_size);
-                    return STATUS_SUCCESS;
-                }
-
-                le = le->Flink;
-            }
-        }
-    }
+    if (list_size)
+        order_space_entry(s, list_size);
 
     return STATUS_SUCCESS;
 }
@@ -283,30 +357,6 @@ static void load_free_space_bitmap(device_extension* Vcb, chunk* c, UINT64 offse
     }
 }
 
-static void order_space_entry(space* s, LIST_ENTRY* list_size) {
-    LIST_ENTRY* le;
-
-    if (IsListEmpty(list_size)) {
-        InsertHeadList(list_size, &s->list_entry_size);
-        return;
-    }
-
-    le = list_size->Flink;
-
-    while (le != list_size) {
-        space* s2 = CONTAINING_RECORD(le, space, list_entry_size);
-
-        if (s2->size <= s->size) {
-            InsertHeadList(le->Blink, &s->list_entry_size);
-            return;
-        }
-
-        le = le->Flink;
-    }
-
-    InsertTailList(list_size, &s->list_entry_size);
-}
-
 typedef struct {
     UINT64 stripe;
     LIST_ENTRY list_entry;
@@ -647,13 +697,13 @@ NTSTATUS load_stored_free_space_cache(device_extension* Vcb, chunk* c, BOOL load
             space* s2 = CONTAINING_RECORD(le2, space, list_entry);
 
             if (s2->address == s->address + s->size) {
+                remove_space_size_entry(s, &c->space_size);
                 s->size += s2->size;
 
                 RemoveEntryList(&s2->list_entry);
-                RemoveEntryList(&s2->list_entry_size);
+                remove_space_size_entry(s2, &c->space_size);
                 ExFreePool(s2);
 
-                RemoveEntryList(&s->list_entry_size);
                 order_space_entry(s, &c->space_size);
 
                 le2 = le;
@@ -699,7 +749,7 @@ clearcache:
         LIST_ENTRY* le2 = le->Flink;
 
         RemoveEntryList(&s->list_entry);
-        RemoveEntryList(&s->list_entry_size);
+        remove_space_size_entry(s, &c->space_size);
         ExFreePool(s);
 
         le = le2;
@@ -831,13 +881,13 @@ static NTSTATUS load_stored_free_space_tree(device_extension* Vcb, chunk* c, PIR
             space* s2 = CONTAINING_RECORD(le2, space, list_entry);
 
             if (s2->address == s->address + s->size) {
+                remove_space_size_entry(s, &c->space_size);
                 s->size += s2->size;
 
                 RemoveEntryList(&s2->list_entry);
-                RemoveEntryList(&s2->list_entry_size);
+                remove_space_size_entry(s2, &c->space_size);
                 ExFreePool(s2);
 
-                RemoveEntryList(&s->list_entry_size);
                 order_space_entry(s, &c->space_size);
 
                 le2 = le;
@@ -1218,7 +1268,7 @@ static NTSTATUS allocate_cache_chunk(device_extension* Vcb, chunk* c, BOOL* chan
             return STATUS_INTERNAL_ERROR;
         }
 
-        tp.tree->write = TRUE;
+        mark_tree_dirty(tp.tree);
 
         // remove existing extents
 
@@ -1312,7 +1362,7 @@ static NTSTATUS allocate_cache_chunk(device_extension* Vcb, chunk* c, BOOL* chan
                 return STATUS_INTERNAL_ERROR;
             }
 
-            tp.tree->write = TRUE;
+            mark_tree_dirty(tp.tree);
         }
 
         searchkey.obj_id = FREE_SPACE_CACHE_ID;
@@ -1335,7 +1385,7 @@ static NTSTATUS allocate_cache_chunk(device_extension* Vcb, chunk* c, BOOL* chan
             return STATUS_INTERNAL_ERROR;
         }
 
-        tp.tree->write = TRUE;
+        mark_tree_dirty(tp.tree);
     }
 
     // FIXME - reduce inode allocation if cache is shrinking. Make sure to avoid infinite write loops
@@ -1424,7 +1474,7 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, UI
         InsertTailList(list, &s->list_entry);
 
         if (list_size)
-            InsertTailList(list_size, &s->list_entry_size);
+            order_space_entry(s, list_size);
 
         if (rollback)
             add_rollback_space(rollback, TRUE, list, list_size, address, length, c);
@@ -1442,6 +1492,9 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, UI
 
         // new entry envelops old one completely
         if (address <= s2->address && address + length >= s2->address + s2->size) {
+            if (list_size)
+                remove_space_size_entry(s2, list_size);
+
             if (address < s2->address) {
                 if (rollback)
                     add_rollback_space(rollback, TRUE, list, list_size, address, s2->address - address, c);
@@ -1459,7 +1512,7 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, UI
                         RemoveEntryList(&s3->list_entry);
 
                         if (list_size)
-                            RemoveEntryList(&s3->list_entry_size);
+                            remove_space_size_entry(s3, list_size);
 
                         ExFreePool(s3);
                     } else
@@ -1482,7 +1535,7 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, UI
                         RemoveEntryList(&s3->list_entry);
 
                         if (list_size)
-                            RemoveEntryList(&s3->list_entry_size);
+                            remove_space_size_entry(s3, list_size);
 
                         ExFreePool(s3);
                     } else
@@ -1490,16 +1543,17 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, UI
                 }
             }
 
-            if (list_size) {
-                RemoveEntryList(&s2->list_entry_size);
+            if (list_size)
                 order_space_entry(s2, list_size);
-            }
 
             return;
         }
 
         // new entry overlaps start of old one
         if (address < s2->address && address + length >= s2->address) {
+            if (list_size)
+                remove_space_size_entry(s2, list_size);
+
             if (rollback)
                 add_rollback_space(rollback, TRUE, list, list_size, address, s2->address - address, c);
 
@@ -1516,23 +1570,24 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, UI
                     RemoveEntryList(&s3->list_entry);
 
                     if (list_size)
-                        RemoveEntryList(&s3->list_entry_size);
+                        remove_space_size_entry(s3, list_size);
 
                     ExFreePool(s3);
                 } else
                     break;
             }
 
-            if (list_size) {
-                RemoveEntryList(&s2->list_entry_size);
+            if (list_size)
                 order_space_entry(s2, list_size);
-            }
 
             return;
         }
 
         // new entry overlaps end of old one
         if (address <= s2->address + s2->size && address + length > s2->address + s2->size) {
+            if (list_size)
+                remove_space_size_entry(s2, list_size);
+
             if (rollback)
                 add_rollback_space(rollback, TRUE, list, list_size, address, s2->address + s2->size - address, c);
 
@@ -1547,17 +1602,15 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, UI
                     RemoveEntryList(&s3->list_entry);
 
                     if (list_size)
-                        RemoveEntryList(&s3->list_entry_size);
+                        remove_space_size_entry(s3, list_size);
 
                     ExFreePool(s3);
                 } else
                     break;
             }
 
-            if (list_size) {
-                RemoveEntryList(&s2->list_entry_size);
+            if (list_size)
                 order_space_entry(s2, list_size);
-            }
 
             return;
         }
@@ -1589,12 +1642,13 @@ void space_list_add2(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, UI
 
     // check if contiguous with last entry
     if (s2->address + s2->size == address) {
+        if (list_size)
+            remove_space_size_entry(s2, list_size);
+
         s2->size += length;
 
-        if (list_size) {
-            RemoveEntryList(&s2->list_entry_size);
+        if (list_size)
             order_space_entry(s2, list_size);
-        }
 
         return;
     }
@@ -1954,7 +2008,7 @@ void space_list_subtract2(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 addres
             RemoveEntryList(&s2->list_entry);
 
             if (list_size)
-                RemoveEntryList(&s2->list_entry_size);
+                remove_space_size_entry(s2, list_size);
 
             ExFreePool(s2);
         } else if (address + length > s2->address && address + length < s2->address + s2->size) {
@@ -1973,11 +2027,13 @@ void space_list_subtract2(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 addres
                 s->size = address - s2->address;
                 InsertHeadList(s2->list_entry.Blink, &s->list_entry);
 
+                if (list_size)
+                    remove_space_size_entry(s2, list_size);
+
                 s2->size = s2->address + s2->size - address - length;
                 s2->address = address + length;
 
                 if (list_size) {
-                    RemoveEntryList(&s2->list_entry_size);
                     order_space_entry(s2, list_size);
                     order_space_entry(s, list_size);
                 }
@@ -1987,24 +2043,26 @@ void space_list_subtract2(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 addres
                 if (rollback)
                     add_rollback_space(rollback, FALSE, list, list_size, s2->address, address + length - s2->address, c);
 
+                if (list_size)
+                    remove_space_size_entry(s2, list_size);
+
                 s2->size -= address + length - s2->address;
                 s2->address = address + length;
 
-                if (list_size) {
-                    RemoveEntryList(&s2->list_entry_size);
+                if (list_size)
                     order_space_entry(s2, list_size);
-                }
             }
         } else if (address > s2->address && address < s2->address + s2->size) { // remove end of entry
             if (rollback)
                 add_rollback_space(rollback, FALSE, list, list_size, address, s2->address + s2->size - address, c);
 
+            if (list_size)
+                remove_space_size_entry(s2, list_size);
+
             s2->size = address - s2->address;
 
-            if (list_size) {
-                RemoveEntryList(&s2->list_entry_size);
+            if (list_size)
                 order_space_entry(s2, list_size);
-            }
         }
 
         le = le2;
@@ -1002,6 +1002,7 @@ static NTSTATUS create_subvol(device_extension* Vcb, PFILE_OBJECT FileObject, vo
 
     acquire_fcb_lock_exclusive(Vcb);
     InsertTailList(&r->fcbs, &rootfcb->list_entry);
+    add_fcb_to_hash(Vcb, rootfcb);
     InsertTailList(&Vcb->all_fcbs, &rootfcb->list_entry_all);
     release_fcb_lock(Vcb);
 
@@ -1047,9 +1048,7 @@ static NTSTATUS create_subvol(device_extension* Vcb, PFILE_OBJECT FileObject, vo
     if (!fr) {
         ERR("out of memory\n");
 
-        acquire_fcb_lock_exclusive(Vcb);
-        free_fcb(Vcb, rootfcb);
-        release_fcb_lock(Vcb);
+        release_fcb(Vcb, rootfcb);
 
         Status = STATUS_INSUFFICIENT_RESOURCES;
         goto end;
@@ -1071,9 +1070,7 @@ static NTSTATUS create_subvol(device_extension* Vcb, PFILE_OBJECT FileObject, vo
     fr->fcb->hash_ptrs = ExAllocatePoolWithTag(PagedPool, sizeof(LIST_ENTRY*) * 256, ALLOC_TAG);
     if (!fr->fcb->hash_ptrs) {
         ERR("out of memory\n");
-        acquire_fcb_lock_exclusive(Vcb);
-        free_fileref(Vcb, fr);
-        release_fcb_lock(Vcb);
+        release_fileref(Vcb, fr);
         Status = STATUS_INSUFFICIENT_RESOURCES;
         goto end;
     }
@@ -1083,9 +1080,7 @@ static NTSTATUS create_subvol(device_extension* Vcb, PFILE_OBJECT FileObject, vo
     fr->fcb->hash_ptrs_uc = ExAllocatePoolWithTag(PagedPool, sizeof(LIST_ENTRY*) * 256, ALLOC_TAG);
     if (!fr->fcb->hash_ptrs_uc) {
         ERR("out of memory\n");
-        acquire_fcb_lock_exclusive(Vcb);
-        free_fileref(Vcb, fr);
-        release_fcb_lock(Vcb);
+        release_fileref(Vcb, fr);
         Status = STATUS_INSUFFICIENT_RESOURCES;
         goto end;
     }
@@ -1152,11 +1147,8 @@ end:
     }
 
 end2:
-    if (fr) {
-        acquire_fcb_lock_exclusive(Vcb);
-        free_fileref(Vcb, fr);
-        release_fcb_lock(Vcb);
-    }
+    if (fr)
+        release_fileref(Vcb, fr);
 
     return Status;
 }
@@ -3123,6 +3115,136 @@ static NTSTATUS query_uuid(device_extension* Vcb, void* data, ULONG length) {
     return STATUS_SUCCESS;
 }
 
+static NTSTATUS get_tree_cache_stats(device_extension* Vcb, void* data, ULONG length) {
+    btrfs_tree_cache_stats* btcs = (btrfs_tree_cache_stats*)data;
+    LIST_ENTRY* le;
+
+    if (!data || length < sizeof(btrfs_tree_cache_stats))
+        return STATUS_BUFFER_OVERFLOW;
+
+    btcs->hits = Vcb->tree_cache_hits;
+    btcs->misses = Vcb->tree_cache_misses;
+    btcs->max_size = (UINT64)Vcb->options.tree_cache_size * 1048576;
+    btcs->num_trees = 0;
+
+    ExAcquireResourceSharedLite(&Vcb->tree_lock, TRUE);
+
+    btcs->evictions = Vcb->tree_cache_evictions;
+
+    le = Vcb->trees.Flink;
+    while (le != &Vcb->trees) {
+        btcs->num_trees++;
+        le = le->Flink;
+    }
+
+    ExReleaseResourceLite(&Vcb->tree_lock);
+
+    btcs->size = btcs->num_trees * Vcb->superblock.node_size;
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS get_dir_cache_stats(device_extension* Vcb, void* data, ULONG length) {
+    btrfs_dir_cache_stats* bdcs = (btrfs_dir_cache_stats*)data;
+    LIST_ENTRY* le;
+
+    if (!data || length < sizeof(btrfs_dir_cache_stats))
+        return STATUS_BUFFER_OVERFLOW;
+
+    bdcs->max_size = (UINT64)Vcb->options.dir_cache_size * 1048576;
+    bdcs->num_dirs = 0;
+
+    acquire_fcb_lock_shared(Vcb);
+
+    bdcs->hits = Vcb->dir_cache_hits;
+    bdcs->misses = Vcb->dir_cache_misses;
+    bdcs->evictions = Vcb->dir_cache_evictions;
+    bdcs->size = Vcb->dir_cache_size;
+
+    le = Vcb->dir_cache.Flink;
+    while (le != &Vcb->dir_cache) {
+        bdcs->num_dirs++;
+        le = le->Flink;
+    }
+
+    release_fcb_lock(Vcb);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS get_csum_cache_stats(device_extension* Vcb, void* data, ULONG length) {
+    btrfs_csum_cache_stats* bccs = (btrfs_csum_cache_stats*)data;
+
+    if (!data || length < sizeof(btrfs_csum_cache_stats))
+        return STATUS_BUFFER_OVERFLOW;
+
+    bccs->max_size = (UINT64)Vcb->options.csum_cache_size * 1048576;
+
+    ExAcquireResourceSharedLite(&Vcb->csum_cache_lock, TRUE);
+
+    bccs->hits = Vcb->csum_cache_hits;
+    bccs->misses = Vcb->csum_cache_misses;
+    bccs->evictions = Vcb->csum_cache_evictions;
+    bccs->size = Vcb->csum_cache_size;
+
+    ExReleaseResourceLite(&Vcb->csum_cache_lock);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS get_range_lock_stats(device_extension* Vcb, void* data, ULONG length) {
+    btrfs_range_lock_stats* brls = (btrfs_range_lock_stats*)data;
+
+    if (!data || length < sizeof(btrfs_range_lock_stats))
+        return STATUS_BUFFER_OVERFLOW;
+
+    brls->shared = Vcb->range_lock_shared;
+    brls->exclusive = Vcb->range_lock_exclusive;
+    brls->contended = Vcb->range_lock_contended;
+    brls->waits = Vcb->range_lock_waits;
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS get_tree_write_stats(device_extension* Vcb, void* data, ULONG length) {
+    btrfs_tree_write_stats* btws = (btrfs_tree_write_stats*)data;
+
+    if (!data || length < sizeof(btrfs_tree_write_stats))
+        return STATUS_BUFFER_OVERFLOW;
+
+    ExAcquireResourceSharedLite(&Vcb->tree_lock, TRUE);
+
+    btws->trees = Vcb->tree_write_trees;
+    btws->ios = Vcb->tree_write_ios;
+    btws->bytes = Vcb->tree_write_bytes;
+    btws->max_io_size = Vcb->tree_write_max_io;
+
+    ExReleaseResourceLite(&Vcb->tree_lock);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS get_calc_stats(device_extension* Vcb, void* data, ULONG length) {
+    btrfs_calc_stats* bcs = (btrfs_calc_stats*)data;
+
+    if (!data || length < sizeof(btrfs_calc_stats))
+        return STATUS_BUFFER_OVERFLOW;
+
+    ExAcquireResourceSharedLite(&Vcb->calcthreads.lock, TRUE);
+
+    bcs->num_threads = Vcb->calcthreads.num_threads;
+    bcs->queue_depth = Vcb->calcthreads.queue_depth;
+    bcs->max_queue_depth = Vcb->calcthreads.max_queue_depth;
+    bcs->num_jobs = Vcb->calcthreads.num_jobs;
+
+    ExReleaseResourceLite(&Vcb->calcthreads.lock);
+
+    bcs->slices_submitter = Vcb->calcthreads.slices_submitter;
+    bcs->slices_threads = Vcb->calcthreads.slices_threads;
+
+    return STATUS_SUCCESS;
+}
+
 static NTSTATUS reset_stats(device_extension* Vcb, void* data, ULONG length, KPROCESSOR_MODE processor_mode) {
     UINT64 devid;
     NTSTATUS Status;
@@ -3658,6 +3780,173 @@ end:
     return Status;
 }
 
+static NTSTATUS write_encoded(device_extension* Vcb, PFILE_OBJECT FileObject, void* data, ULONG datalen, PIRP Irp) {
+    btrfs_write_encoded* bwe = (btrfs_write_encoded*)data;
+    fcb* fcb = FileObject ? FileObject->FsContext : NULL;
+    ccb* ccb = FileObject ? FileObject->FsContext2 : NULL;
+    NTSTATUS Status;
+    LIST_ENTRY rollback;
+    UINT64 end, num_bytes;
+    UINT32 comp_length;
+    UINT8* comp_data;
+    LARGE_INTEGER offset, length, time;
+    BTRFS_TIME now;
+    CC_FILE_SIZES ccfs;
+    BOOL set_size = FALSE;
+
+    // Like on Linux, where this needs CAP_SYS_ADMIN - the caller provides the compressed data, so could
+    // otherwise create extents which don't decompress to what a normal write would have stored.
+
+    if (!SeSinglePrivilegeCheck(RtlConvertLongToLuid(SE_MANAGE_VOLUME_PRIVILEGE), Irp->RequestorMode))
+        return STATUS_PRIVILEGE_NOT_HELD;
+
+    if (!bwe || datalen < offsetof(btrfs_write_encoded, data[0]) || datalen - offsetof(btrfs_write_encoded, data[0]) < bwe->datalen)
+        return STATUS_BUFFER_TOO_SMALL;
+
+    if (Vcb->readonly)
+        return STATUS_MEDIA_WRITE_PROTECTED;
+
+    if (!fcb || !ccb || fcb == Vcb->volume_fcb)
+        return STATUS_INVALID_PARAMETER;
+
+    if (is_subvol_readonly(fcb->subvol, Irp))
+        return STATUS_ACCESS_DENIED;
+
+    if (Irp->RequestorMode == UserMode && !(ccb->access & FILE_WRITE_DATA)) {
+        WARN("insufficient privileges\n");
+        return STATUS_ACCESS_DENIED;
+    }
+
+    if (fcb->ads || fcb->type != BTRFS_TYPE_FILE)
+        return STATUS_INVALID_PARAMETER;
+
+    if (bwe->compression != BTRFS_COMPRESSION_ZLIB && bwe->compression != BTRFS_COMPRESSION_LZO && bwe->compression != BTRFS_COMPRESSION_ZSTD) {
+        WARN("unsupported compression type %x\n", bwe->compression);
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    if (bwe->datalen == 0 || bwe->datalen > COMPRESSED_EXTENT_SIZE || bwe->unencoded_len == 0 || bwe->unencoded_len > COMPRESSED_EXTENT_SIZE ||
+        bwe->unencoded_file_len == 0 || bwe->offset & (Vcb->superblock.sector_size - 1))
+        return STATUS_INVALID_PARAMETER;
+
+    if (bwe->unencoded_offset >= bwe->unencoded_len || bwe->unencoded_file_len > bwe->unencoded_len - bwe->unencoded_offset)
+        return STATUS_INVALID_PARAMETER;
+
+    if (bwe->offset > (UINT64)MAXLONGLONG - bwe->unencoded_file_len)
+        return STATUS_INVALID_PARAMETER;
+
+    num_bytes = sector_align(bwe->unencoded_file_len, Vcb->superblock.sector_size);
+
+    if (bwe->unencoded_offset & (Vcb->superblock.sector_size - 1) ||
+        bwe->unencoded_offset + num_bytes > sector_align(bwe->unencoded_len, Vcb->superblock.sector_size))
+        return STATUS_INVALID_PARAMETER;
+
+    end = bwe->offset + bwe->unencoded_file_len;
+
+    // only the end of the file is allowed to finish partway through a sector
+    if (num_bytes != bwe->unencoded_file_len && end < fcb->inode_item.st_size)
+        return STATUS_INVALID_PARAMETER;
+
+    comp_length = (UINT32)sector_align(bwe->datalen, Vcb->superblock.sector_size);
+
+    comp_data = ExAllocatePoolWithTag(PagedPool, comp_length, ALLOC_TAG);
+    if (!comp_data) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlCopyMemory(comp_data, bwe->data, bwe->datalen);
+    RtlZeroMemory(comp_data + bwe->datalen, comp_length - bwe->datalen);
+
+    InitializeListHead(&rollback);
+
+    ExAcquireResourceSharedLite(&Vcb->tree_lock, TRUE);
+
+    ExAcquireResourceExclusiveLite(fcb->Header.Resource, TRUE);
+
+    offset.QuadPart = bwe->offset;
+    length.QuadPart = num_bytes;
+
+    if (!FsRtlFastCheckLockForWrite(&fcb->lock, &offset, &length, 0, FileObject, PsGetCurrentProcess())) {
+        Status = STATUS_FILE_LOCK_CONFLICT;
+        goto end;
+    }
+
+    if (end > fcb->inode_item.st_size || fcb_is_inline(fcb)) {
+        UINT64 newsize = max(end, fcb->inode_item.st_size);
+
+        // An inline extent can't share a file with our new one, so make sure extend_file gives the file proper extents.
+        Status = extend_file(fcb, ccb->fileref, max(newsize, Vcb->options.max_inline + 1), FALSE, Irp, &rollback);
+        if (!NT_SUCCESS(Status)) {
+            ERR("extend_file returned %08x\n", Status);
+            goto end;
+        }
+
+        if (fcb->inode_item.st_size > newsize) {
+            Status = truncate_file(fcb, newsize, Irp, &rollback);
+            if (!NT_SUCCESS(Status)) {
+                ERR("truncate_file returned %08x\n", Status);
+                goto end;
+            }
+        }
+
+        ccfs.AllocationSize = fcb->Header.AllocationSize;
+        ccfs.FileSize = fcb->Header.FileSize;
+        ccfs.ValidDataLength = fcb->Header.ValidDataLength;
+        set_size = TRUE;
+    }
+
+    Status = write_encoded_extent(fcb, bwe->offset, bwe->compression, comp_data, comp_length, bwe->unencoded_len, bwe->unencoded_offset,
+                                  num_bytes, Irp, &rollback);
+    if (!NT_SUCCESS(Status)) {
+        ERR("write_encoded_extent returned %08x\n", Status);
+        goto end;
+    }
+
+    if (bwe->compression == BTRFS_COMPRESSION_ZSTD)
+        Vcb->superblock.incompat_flags |= BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD;
+    else if (bwe->compression == BTRFS_COMPRESSION_LZO)
+        Vcb->superblock.incompat_flags |= BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO;
+
+    KeQuerySystemTime(&time);
+    win_time_to_unix(time, &now);
+
+    fcb->inode_item.sequence++;
+
+    if (!ccb->user_set_change_time)
+        fcb->inode_item.st_ctime = now;
+
+    if (!ccb->user_set_write_time) {
+        fcb->inode_item.st_mtime = now;
+        send_notification_fcb(ccb->fileref, FILE_NOTIFY_CHANGE_LAST_WRITE, FILE_ACTION_MODIFIED, NULL);
+    }
+
+    fcb->inode_item_changed = TRUE;
+    mark_fcb_dirty(fcb);
+
+    if (fcb->nonpaged->segment_object.DataSectionObject)
+        CcPurgeCacheSection(&fcb->nonpaged->segment_object, &offset, (ULONG)num_bytes, FALSE);
+
+    Status = STATUS_SUCCESS;
+
+end:
+    if (NT_SUCCESS(Status))
+        clear_rollback(&rollback);
+    else
+        do_rollback(Vcb, &rollback);
+
+    ExReleaseResourceLite(fcb->Header.Resource);
+
+    if (set_size && NT_SUCCESS(Status) && FileObject->PrivateCacheMap)
+        CcSetFileSizes(FileObject, &ccfs);
+
+    ExReleaseResourceLite(&Vcb->tree_lock);
+
+    ExFreePool(comp_data);
+
+    return Status;
+}
+
 static NTSTATUS mknod(device_extension* Vcb, PFILE_OBJECT FileObject, void* data, ULONG datalen, PIRP Irp) {
     NTSTATUS Status;
     btrfs_mknod* bmn;
@@ -3670,7 +3959,6 @@ static NTSTATUS mknod(device_extension* Vcb, PFILE_OBJECT FileObject, void* data
     dir_child* dc;
     LARGE_INTEGER time;
     BTRFS_TIME now;
-    LIST_ENTRY* lastle;
     ANSI_STRING utf8;
     ULONG len, i;
     SECURITY_SUBJECT_CONTEXT subjcont;
@@ -3780,30 +4068,18 @@ static NTSTATUS mknod(device_extension* Vcb, PFILE_OBJECT FileObject, void* data
         goto end;
     }
 
-    if (bmn->inode == 0) {
+    if (bmn->inode == 0)
         inode = InterlockedIncrement64(&parfcb->subvol->lastinode);
-        lastle = parfcb->subvol->fcbs.Blink;
-    } else {
-        if (bmn->inode > (UINT64)parfcb->subvol->lastinode) {
+    else {
+        if (bmn->inode > (UINT64)parfcb->subvol->lastinode)
             inode = parfcb->subvol->lastinode = bmn->inode;
-            lastle = parfcb->subvol->fcbs.Blink;
-        } else {
-            LIST_ENTRY* le = parfcb->subvol->fcbs.Flink;
-
-            lastle = parfcb->subvol->fcbs.Blink;;
-            while (le != &parfcb->subvol->fcbs) {
-                struct _fcb* fcb2 = CONTAINING_RECORD(le, struct _fcb, list_entry);
-
-                if (fcb2->inode == bmn->inode && !fcb2->deleted) {
-                    WARN("inode collision\n");
-                    Status = STATUS_INVALID_PARAMETER;
-                    goto end;
-                } else if (fcb2->inode > bmn->inode) {
-                    lastle = fcb2->list_entry.Blink;
-                    break;
-                }
+        else {
+            struct _fcb* fcb2 = find_fcb_in_subvol(Vcb, parfcb->subvol, bmn->inode);
 
-                le = le->Flink;
+            if (fcb2 && !fcb2->deleted) {
+                WARN("inode collision\n");
+                Status = STATUS_INVALID_PARAMETER;
+                goto end;
             }
 
             inode = bmn->inode;
@@ -3976,7 +4252,8 @@ static NTSTATUS mknod(device_extension* Vcb, PFILE_OBJECT FileObject, void* data
         RtlZeroMemory(fcb->hash_ptrs_uc, sizeof(LIST_ENTRY*) * 256);
     }
 
-    InsertHeadList(lastle, &fcb->list_entry);
+    InsertTailList(&fcb->subvol->fcbs, &fcb->list_entry);
+    add_fcb_to_hash(Vcb, fcb);
     InsertTailList(&Vcb->all_fcbs, &fcb->list_entry_all);
 
     if (bmn->type == BTRFS_TYPE_DIRECTORY)
@@ -5396,6 +5673,11 @@ NTSTATUS fsctl_request(PDEVICE_OBJECT DeviceObject, PIRP* Pirp, UINT32 type) {
                                  IrpSp->FileObject, Irp);
             break;
 
+        case FSCTL_BTRFS_SEND_SUBVOL2:
+            Status = send_subvol2(DeviceObject->DeviceExtension, Irp->AssociatedIrp.SystemBuffer, IrpSp->Parameters.FileSystemControl.InputBufferLength,
+                                  IrpSp->FileObject, Irp);
+            break;
+
         case FSCTL_BTRFS_READ_SEND_BUFFER:
             Status = read_send_buffer(DeviceObject->DeviceExtension, IrpSp->FileObject, map_user_buffer(Irp, NormalPagePriority), IrpSp->Parameters.FileSystemControl.OutputBufferLength,
                                       &Irp->IoStatus.Information, Irp->RequestorMode);
@@ -5406,6 +5688,35 @@ NTSTATUS fsctl_request(PDEVICE_OBJECT DeviceObject, PIRP* Pirp, UINT32 type) {
                                    IrpSp->Parameters.FileSystemControl.InputBufferLength, Irp);
             break;
 
+        case FSCTL_BTRFS_GET_TREE_CACHE_STATS:
+            Status = get_tree_cache_stats(DeviceObject->DeviceExtension, map_user_buffer(Irp, NormalPagePriority), IrpSp->Parameters.FileSystemControl.OutputBufferLength);
+            break;
+
+        case FSCTL_BTRFS_GET_CALC_STATS:
+            Status = get_calc_stats(DeviceObject->DeviceExtension, map_user_buffer(Irp, NormalPagePriority), IrpSp->Parameters.FileSystemControl.OutputBufferLength);
+            break;
+
+        case FSCTL_BTRFS_GET_DIR_CACHE_STATS:
+            Status = get_dir_cache_stats(DeviceObject->DeviceExtension, map_user_buffer(Irp, NormalPagePriority), IrpSp->Parameters.FileSystemControl.OutputBufferLength);
+            break;
+
+        case FSCTL_BTRFS_GET_RANGE_LOCK_STATS:
+            Status = get_range_lock_stats(DeviceObject->DeviceExtension, map_user_buffer(Irp, NormalPagePriority), IrpSp->Parameters.FileSystemControl.OutputBufferLength);
+            break;
+
+        case FSCTL_BTRFS_GET_CSUM_CACHE_STATS:
+            Status = get_csum_cache_stats(DeviceObject->DeviceExtension, map_user_buffer(Irp, NormalPagePriority), IrpSp->Parameters.FileSystemControl.OutputBufferLength);
+            break;
+
+        case FSCTL_BTRFS_GET_TREE_WRITE_STATS:
+            Status = get_tree_write_stats(DeviceObject->DeviceExtension, map_user_buffer(Irp, NormalPagePriority), IrpSp->Parameters.FileSystemControl.OutputBufferLength);
+            break;
+
+        case FSCTL_BTRFS_WRITE_ENCODED:
+            Status = write_encoded(DeviceObject->DeviceExtension, IrpSp->FileObject, Irp->AssociatedIrp.SystemBuffer,
+                                   IrpSp->Parameters.FileSystemControl.InputBufferLength, Irp);
+            break;
+
         default:
             WARN("unknown control code %x (DeviceType = %x, Access = %x, Function = %x, Method = %x)\n",
                           IrpSp->Parameters.FileSystemControl.FsControlCode, (IrpSp->Parameters.FileSystemControl.FsControlCode & 0xff0000) >> 16,
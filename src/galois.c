@@ -16,6 +16,18 @@
  * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
 
 #include "btrfs_drv.h"
+#include <tmmintrin.h>
+
+extern BOOL have_ssse3;
+
+// GCC only lets us use the SSE2 and SSSE3 intrinsics in functions marked as such - we still check for them at runtime
+#ifndef _MSC_VER
+#define SSE2_FUNC __attribute__((target("sse2")))
+#define SSSE3_FUNC __attribute__((target("ssse3")))
+#else
+#define SSE2_FUNC
+#define SSSE3_FUNC
+#endif
 
 static const UINT8 glog[] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1d, 0x3a, 0x74, 0xe8, 0xcd, 0x87, 0x13, 0x26,
                              0x4c, 0x98, 0x2d, 0x5a, 0xb4, 0x75, 0xea, 0xc9, 0x8f, 0x03, 0x06, 0x0c, 0x18, 0x30, 0x60, 0xc0,
@@ -51,21 +63,6 @@ static const UINT8 gilog[] = {0x00, 0x00, 0x01, 0x19, 0x02, 0x32, 0x1a, 0xc6, 0x
                               0xcb, 0x59, 0x5f, 0xb0, 0x9c, 0xa9, 0xa0, 0x51, 0x0b, 0xf5, 0x16, 0xeb, 0x7a, 0x75, 0x2c, 0xd7,
                               0x4f, 0xae, 0xd5, 0xe9, 0xe6, 0xe7, 0xad, 0xe8, 0x74, 0xd6, 0xf4, 0xea, 0xa8, 0x50, 0x58, 0xaf};
 
-// divides the bytes in data by 2^div
-void galois_divpower(UINT8* data, UINT8 div, UINT32 len) {
-    while (len > 0) {
-        if (data[0] != 0) {
-            if (gilog[data[0]] <= div)
-                data[0] = glog[(gilog[data[0]] + (255 - div)) % 255];
-            else
-                data[0] = glog[(gilog[data[0]] - div) % 255];
-        }
-
-        data++;
-        len--;
-    }
-}
-
 UINT8 gpow2(UINT8 e) {
     return glog[e%255];
 }
@@ -90,6 +87,124 @@ UINT8 gdiv(UINT8 a, UINT8 b) {
     }
 }
 
+// Multiplication by a constant c distributes over XOR, so c * x = (c * (x & 0xf)) ^ (c * (x & 0xf0)),
+// which lets us get away with two 16-byte tables. These are small enough to fit in an SSE register,
+// so with SSSE3 we can use PSHUFB to do sixteen lookups at a time.
+static void galois_mul_tables(UINT8 c, UINT8* lo, UINT8* hi) {
+    UINT8 i;
+
+    for (i = 0; i < 16; i++) {
+        lo[i] = gmul(c, i);
+        hi[i] = gmul(c, (UINT8)(i << 4));
+    }
+}
+
+static __inline SSSE3_FUNC __m128i galois_mul_sse(__m128i v, __m128i lo, __m128i hi, __m128i mask) {
+    __m128i l = _mm_and_si128(v, mask);
+    __m128i h = _mm_and_si128(_mm_srli_epi64(v, 4), mask);
+
+    return _mm_xor_si128(_mm_shuffle_epi8(lo, l), _mm_shuffle_epi8(hi, h));
+}
+
+// len needs to be a multiple of 16
+static SSSE3_FUNC void galois_mul_ssse3(UINT8* data, UINT8* lo, UINT8* hi, UINT32 len) {
+    __m128i lov = _mm_loadu_si128((__m128i*)lo);
+    __m128i hiv = _mm_loadu_si128((__m128i*)hi);
+    __m128i mask = _mm_set1_epi8(0xf);
+
+    while (len > 0) {
+        __m128i v = _mm_loadu_si128((__m128i*)data);
+
+        _mm_storeu_si128((__m128i*)data, galois_mul_sse(v, lov, hiv, mask));
+
+        data += 16;
+        len -= 16;
+    }
+}
+
+// multiplies the bytes in data by c
+void galois_mul(UINT8* data, UINT8 c, UINT32 len) {
+    UINT8 lo[16], hi[16];
+
+    galois_mul_tables(c, lo, hi);
+
+    if (have_ssse3 && len >= 16) {
+        UINT32 len2 = len & ~15;
+
+        galois_mul_ssse3(data, lo, hi, len2);
+
+        data += len2;
+        len -= len2;
+    }
+
+    while (len > 0) {
+        data[0] = lo[data[0] & 0xf] ^ hi[data[0] >> 4];
+
+        data++;
+        len--;
+    }
+}
+
+// divides the bytes in data by 2^div
+void galois_divpower(UINT8* data, UINT8 div, UINT32 len) {
+    galois_mul(data, gpow2((UINT8)(255 - div)), len);
+}
+
+// len needs to be a multiple of 16
+static SSSE3_FUNC void galois_recover2_ssse3(UINT8* qxy, UINT8* pxy, UINT8* p, UINT8* q, UINT8* alo, UINT8* ahi, UINT8* blo, UINT8* bhi, UINT32 len) {
+    __m128i alov = _mm_loadu_si128((__m128i*)alo);
+    __m128i ahiv = _mm_loadu_si128((__m128i*)ahi);
+    __m128i blov = _mm_loadu_si128((__m128i*)blo);
+    __m128i bhiv = _mm_loadu_si128((__m128i*)bhi);
+    __m128i mask = _mm_set1_epi8(0xf);
+
+    while (len > 0) {
+        __m128i pv = _mm_xor_si128(_mm_loadu_si128((__m128i*)p), _mm_loadu_si128((__m128i*)pxy));
+        __m128i qv = _mm_xor_si128(_mm_loadu_si128((__m128i*)q), _mm_loadu_si128((__m128i*)qxy));
+
+        _mm_storeu_si128((__m128i*)qxy, _mm_xor_si128(galois_mul_sse(pv, alov, ahiv, mask), galois_mul_sse(qv, blov, bhiv, mask)));
+
+        p += 16;
+        q += 16;
+        pxy += 16;
+        qxy += 16;
+        len -= 16;
+    }
+}
+
+// Sets qxy to a(p + pxy) + b(q + qxy), the final step of recovering two missing data stripes.
+void galois_recover2(UINT8* qxy, UINT8* pxy, UINT8* p, UINT8* q, UINT8 a, UINT8 b, UINT32 len) {
+    UINT8 alo[16], ahi[16], blo[16], bhi[16];
+
+    galois_mul_tables(a, alo, ahi);
+    galois_mul_tables(b, blo, bhi);
+
+    if (have_ssse3 && len >= 16) {
+        UINT32 len2 = len & ~15;
+
+        galois_recover2_ssse3(qxy, pxy, p, q, alo, ahi, blo, bhi, len2);
+
+        p += len2;
+        q += len2;
+        pxy += len2;
+        qxy += len2;
+        len -= len2;
+    }
+
+    while (len > 0) {
+        UINT8 pv = *p ^ *pxy;
+        UINT8 qv = *q ^ *qxy;
+
+        *qxy = alo[pv & 0xf] ^ ahi[pv >> 4] ^ blo[qv & 0xf] ^ bhi[qv >> 4];
+
+        p++;
+        q++;
+        pxy++;
+        qxy++;
+        len--;
+    }
+}
+
 // The code from the following functions is derived from the paper
 // "The mathematics of RAID-6", by H. Peter Anvin.
 // https://www.kernel.org/pub/linux/kernel/people/hpa/raid6.pdf
@@ -106,8 +221,33 @@ __inline static UINT32 galois_double_mask32(UINT32 v) {
 }
 #endif
 
+// len needs to be a multiple of 16
+static SSE2_FUNC void galois_double_sse2(UINT8* data, UINT32 len) {
+    __m128i poly = _mm_set1_epi8(0x1d);
+    __m128i zero = _mm_setzero_si128();
+
+    while (len > 0) {
+        __m128i v = _mm_loadu_si128((__m128i*)data);
+        __m128i mask = _mm_cmpgt_epi8(zero, v); // 0xff for bytes with the top bit set
+        __m128i vv = _mm_add_epi8(v, v);
+
+        vv = _mm_xor_si128(vv, _mm_and_si128(mask, poly));
+        _mm_storeu_si128((__m128i*)data, vv);
+
+        data += 16;
+        len -= 16;
+    }
+}
+
 void galois_double(UINT8* data, UINT32 len) {
-    // FIXME - SIMD?
+    if (have_sse2 && len >= 16) {
+        UINT32 len2 = len & ~15;
+
+        galois_double_sse2(data, len2);
+
+        data += len2;
+        len -= len2;
+    }
 
 #ifdef _AMD64_
     while (len > sizeof(UINT64)) {
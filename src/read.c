@@ -37,6 +37,8 @@ typedef struct {
     PMDL mdl;
     UINT64 stripestart;
     UINT64 stripeend;
+    device* dev;
+    LARGE_INTEGER start_time;
 } read_data_stripe;
 
 typedef struct {
@@ -76,12 +78,68 @@ static NTSTATUS read_data_completion(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOI
     else
         stripe->status = ReadDataStatus_Error;
 
+    if (stripe->dev) {
+        LONG64 latency = KeQueryPerformanceCounter(NULL).QuadPart - stripe->start_time.QuadPart;
+        LONG64 old, new;
+
+        InterlockedDecrement(&stripe->dev->reads_in_flight);
+
+        // exponentially-weighted moving average, with each new read counting for 1/8
+        do {
+            old = stripe->dev->read_latency;
+            new = old + ((latency - old) / 8);
+        } while (InterlockedCompareExchange64(&stripe->dev->read_latency, new, old) != old);
+    }
+
     if (InterlockedDecrement(&context->stripes_left) == 0)
         KeSetEvent(&context->Event, 0, FALSE);
 
     return STATUS_MORE_PROCESSING_REQUIRED;
 }
 
+// Chooses one of the num mirrors starting at first to read from, according to the volume's ReadPolicy,
+// starting the search at start so that ties are spread across the devices. Returns first + num if none
+// of the devices are available.
+static UINT16 choose_mirror(device_extension* Vcb, device** devices, UINT16 first, UINT16 num, UINT16 start) {
+    UINT16 i, j, best = first + num;
+    UINT64 best_score = 0;
+
+    for (j = 0; j < num; j++) {
+        UINT64 score;
+
+        i = first + ((start + j) % num);
+
+        if (!devices[i] || !devices[i]->devobj)
+            continue;
+
+        switch (Vcb->options.read_policy) {
+            case READ_POLICY_LEAST_BUSY:
+                score = devices[i]->reads_in_flight;
+                break;
+
+            case READ_POLICY_LATENCY:
+                // a device we've not read from yet will have a latency of 0, so it gets tried straight away
+                score = (UINT64)(devices[i]->reads_in_flight + 1) * (UINT64)devices[i]->read_latency;
+                break;
+
+            case READ_POLICY_PREFERRED:
+                score = devices[i]->devitem.dev_id == Vcb->options.read_prefer_device ? 0 : 1;
+                break;
+
+            default:
+                score = 0;
+                break;
+        }
+
+        if (best == first + num || score < best_score) {
+            best = i;
+            best_score = score;
+        }
+    }
+
+    return best;
+}
+
 NTSTATUS check_csum(device_extension* Vcb, UINT8* data, UINT32 sectors, UINT32* csum) {
     NTSTATUS Status;
     calc_job* cj;
@@ -91,14 +149,16 @@ NTSTATUS check_csum(device_extension* Vcb, UINT8* data, UINT32 sectors, UINT32*
     // point where offloading the crc32 calculation becomes worth it.
 
     if (sectors < 40 || KeQueryActiveProcessorCount(NULL) < 2) {
-        ULONG j;
+        UINT32 csum3[40];
+        ULONG j, n;
+
+        for (j = 0; j < sectors; j += n) {
+            n = min(sectors - j, sizeof(csum3) / sizeof(UINT32));
 
-        for (j = 0; j < sectors; j++) {
-            UINT32 crc32 = ~calc_crc32c(0xffffffff, data + (j * Vcb->superblock.sector_size), Vcb->superblock.sector_size);
+            calc_crc32c_sectors(data + (j * Vcb->superblock.sector_size), Vcb->superblock.sector_size, n, csum3);
 
-            if (crc32 != csum[j]) {
+            if (RtlCompareMemory(csum3, &csum[j], n * sizeof(UINT32)) != n * sizeof(UINT32))
                 return STATUS_CRC_ERROR;
-            }
         }
 
         return STATUS_SUCCESS;
@@ -117,7 +177,7 @@ NTSTATUS check_csum(device_extension* Vcb, UINT8* data, UINT32 sectors, UINT32*
         return Status;
     }
 
-    KeWaitForSingleObject(&cj->event, Executive, KernelMode, FALSE, NULL);
+    do_calc_job(Vcb, cj);
 
     if (RtlCompareMemory(csum2, csum, sectors * sizeof(UINT32)) != sectors * sizeof(UINT32)) {
         free_calc_job(cj);
@@ -883,7 +943,6 @@ void raid6_recover2(UINT8* sectors, UINT16 num_stripes, ULONG sector_size, UINT1
     } else { // reconstruct from p and q
         UINT16 x, y, stripe;
         UINT8 gyx, gx, denom, a, b, *p, *q, *pxy, *qxy;
-        UINT32 j;
 
         stripe = num_stripes - 3;
 
@@ -927,14 +986,7 @@ void raid6_recover2(UINT8* sectors, UINT16 num_stripes, ULONG sector_size, UINT1
         p = sectors + ((num_stripes - 2) * sector_size);
         q = sectors + ((num_stripes - 1) * sector_size);
 
-        for (j = 0; j < sector_size; j++) {
-            *qxy = gmul(a, *p ^ *pxy) ^ gmul(b, *q ^ *qxy);
-
-            p++;
-            q++;
-            pxy++;
-            qxy++;
-        }
+        galois_recover2(qxy, pxy, p, q, a, b, sector_size);
 
         do_xor(out + sector_size, out, sector_size);
         do_xor(out + sector_size, sectors + ((num_stripes - 2) * sector_size), sector_size);
@@ -1553,7 +1605,7 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ UINT64 addr, _In_ UINT32 len
 
     if (c && (type == BLOCK_FLAG_RAID5 || type == BLOCK_FLAG_RAID6)) {
         get_raid56_lock_range(c, addr, length, &lockaddr, &locklen);
-        chunk_lock_range(Vcb, c, lockaddr, locklen);
+        chunk_lock_range(Vcb, c, lockaddr, locklen, FALSE);
     }
 
     RtlZeroMemory(context.stripes, sizeof(read_data_stripe) * ci->num_stripes);
@@ -1771,6 +1823,12 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ UINT64 addr, _In_ UINT32 len
         for (i = 0; i < ci->num_stripes; i += ci->sub_stripes) {
             UINT64 sstart, send;
             BOOL stripeset = FALSE;
+            UINT16 chosen;
+
+            if (c && Vcb->options.read_policy != READ_POLICY_ROUND_ROBIN)
+                chosen = choose_mirror(Vcb, devices, i, ci->sub_stripes, (UINT16)orig_ls) - i;
+            else
+                chosen = (UINT16)orig_ls;
 
             if (startoffstripe > i)
                 sstart = startoff - (startoff % ci->stripe_length) + ci->stripe_length;
@@ -1787,7 +1845,7 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ UINT64 addr, _In_ UINT32 len
                 send = endoff - (endoff % ci->stripe_length);
 
             for (j = 0; j < ci->sub_stripes; j++) {
-                if (j == orig_ls && devices[i+j] && devices[i+j]->devobj) {
+                if (j == chosen && devices[i+j] && devices[i+j]->devobj) {
                     context.stripes[i+j].stripestart = sstart;
                     context.stripes[i+j].stripeend = send;
                     stripes[i / ci->sub_stripes] = &context.stripes[i+j];
@@ -1893,14 +1951,24 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ UINT64 addr, _In_ UINT32 len
         else
             orig_ls = i = 0;
 
-        while (!devices[i] || !devices[i]->devobj) {
-            i = (i + 1) % ci->num_stripes;
+        if (c && Vcb->options.read_policy != READ_POLICY_ROUND_ROBIN) {
+            i = choose_mirror(Vcb, devices, 0, ci->num_stripes, (UINT16)orig_ls);
 
-            if (i == orig_ls) {
+            if (i == ci->num_stripes) {
                 ERR("no devices available to service request\n");
                 Status = STATUS_DEVICE_NOT_READY;
                 goto exit;
             }
+        } else {
+            while (!devices[i] || !devices[i]->devobj) {
+                i = (i + 1) % ci->num_stripes;
+
+                if (i == orig_ls) {
+                    ERR("no devices available to service request\n");
+                    Status = STATUS_DEVICE_NOT_READY;
+                    goto exit;
+                }
+            }
         }
 
         if (c)
@@ -2564,6 +2632,10 @@ NTSTATUS read_data(_In_ device_extension* Vcb, _In_ UINT64 addr, _In_ UINT32 len
     need_to_wait = FALSE;
     for (i = 0; i < ci->num_stripes; i++) {
         if (context.stripes[i].status != ReadDataStatus_MissingDevice && context.stripes[i].status != ReadDataStatus_Skip) {
+            context.stripes[i].dev = devices[i];
+            context.stripes[i].start_time = KeQueryPerformanceCounter(NULL);
+            InterlockedIncrement(&devices[i]->reads_in_flight);
+
             IoCallDriver(devices[i]->devobj, context.stripes[i].Irp);
             need_to_wait = TRUE;
         }
@@ -2700,6 +2772,214 @@ exit:
     return Status;
 }
 
+// Data checksums are loaded from the checksum tree when a range is read, rather than for the
+// whole file when it is opened. They're kept in a volume-wide cache of blocks of
+// CSUM_CACHE_BLOCK_SECTORS checksums, keyed by disk address, with a bitmap of which are valid.
+
+static csum_cache_entry* find_csum_cache_entry(device_extension* Vcb, UINT64 address) {
+    LIST_ENTRY* head = &Vcb->csum_cache_hash[(address / ((UINT64)Vcb->superblock.sector_size * CSUM_CACHE_BLOCK_SECTORS)) % CSUM_CACHE_BUCKETS];
+    LIST_ENTRY* le;
+
+    le = head->Flink;
+    while (le != head) {
+        csum_cache_entry* cce = CONTAINING_RECORD(le, csum_cache_entry, list_entry_hash);
+
+        if (cce->address == address)
+            return cce;
+
+        le = le->Flink;
+    }
+
+    return NULL;
+}
+
+static void free_csum_cache_entry(device_extension* Vcb, csum_cache_entry* cce) {
+    RemoveEntryList(&cce->list_entry);
+    RemoveEntryList(&cce->list_entry_hash);
+    Vcb->csum_cache_size -= sizeof(csum_cache_entry);
+
+    ExFreePool(cce);
+}
+
+static BOOL get_cached_csums(device_extension* Vcb, UINT64 address, ULONG length, UINT32* csum) {
+    UINT64 block_size = (UINT64)Vcb->superblock.sector_size * CSUM_CACHE_BLOCK_SECTORS;
+    ULONG i = 0;
+    BOOL found = TRUE;
+
+    ExAcquireResourceExclusiveLite(&Vcb->csum_cache_lock, TRUE);
+
+    while (i < length) {
+        UINT64 addr = address + ((UINT64)i * Vcb->superblock.sector_size);
+        csum_cache_entry* cce = find_csum_cache_entry(Vcb, addr - (addr % block_size));
+        RTL_BITMAP bmp;
+        ULONG off, num;
+
+        if (!cce) {
+            found = FALSE;
+            break;
+        }
+
+        off = (ULONG)((addr % block_size) / Vcb->superblock.sector_size);
+        num = min(length - i, CSUM_CACHE_BLOCK_SECTORS - off);
+
+        RtlInitializeBitMap(&bmp, cce->valid, CSUM_CACHE_BLOCK_SECTORS);
+
+        if (!RtlAreBitsSet(&bmp, off, num)) {
+            found = FALSE;
+            break;
+        }
+
+        RtlCopyMemory(&csum[i], &cce->csum[off], num * sizeof(UINT32));
+
+        RemoveEntryList(&cce->list_entry);
+        InsertTailList(&Vcb->csum_cache, &cce->list_entry);
+
+        i += num;
+    }
+
+    if (found)
+        Vcb->csum_cache_hits++;
+    else
+        Vcb->csum_cache_misses++;
+
+    ExReleaseResourceLite(&Vcb->csum_cache_lock);
+
+    return found;
+}
+
+static void add_cached_csums(device_extension* Vcb, UINT64 address, ULONG length, UINT32* csum) {
+    UINT64 block_size = (UINT64)Vcb->superblock.sector_size * CSUM_CACHE_BLOCK_SECTORS;
+    UINT64 max_size = (UINT64)Vcb->options.csum_cache_size * 1048576;
+    ULONG i = 0;
+
+    ExAcquireResourceExclusiveLite(&Vcb->csum_cache_lock, TRUE);
+
+    while (i < length) {
+        UINT64 addr = address + ((UINT64)i * Vcb->superblock.sector_size);
+        UINT64 block = addr - (addr % block_size);
+        csum_cache_entry* cce = find_csum_cache_entry(Vcb, block);
+        RTL_BITMAP bmp;
+        ULONG off, num;
+
+        if (!cce) {
+            cce = ExAllocatePoolWithTag(PagedPool, sizeof(csum_cache_entry), ALLOC_TAG);
+            if (!cce) {
+                ERR("out of memory\n");
+                break;
+            }
+
+            cce->address = block;
+            RtlZeroMemory(cce->valid, sizeof(cce->valid));
+
+            InsertTailList(&Vcb->csum_cache_hash[(block / block_size) % CSUM_CACHE_BUCKETS], &cce->list_entry_hash);
+            Vcb->csum_cache_size += sizeof(csum_cache_entry);
+        } else
+            RemoveEntryList(&cce->list_entry);
+
+        InsertTailList(&Vcb->csum_cache, &cce->list_entry);
+
+        off = (ULONG)((addr % block_size) / Vcb->superblock.sector_size);
+        num = min(length - i, CSUM_CACHE_BLOCK_SECTORS - off);
+
+        RtlCopyMemory(&cce->csum[off], &csum[i], num * sizeof(UINT32));
+
+        RtlInitializeBitMap(&bmp, cce->valid, CSUM_CACHE_BLOCK_SECTORS);
+        RtlSetBits(&bmp, off, num);
+
+        i += num;
+    }
+
+    while (Vcb->csum_cache_size > max_size) {
+        free_csum_cache_entry(Vcb, CONTAINING_RECORD(Vcb->csum_cache.Flink, csum_cache_entry, list_entry));
+        Vcb->csum_cache_evictions++;
+    }
+
+    ExReleaseResourceLite(&Vcb->csum_cache_lock);
+}
+
+void invalidate_csum_cache(_Requires_exclusive_lock_held_(_Curr_->tree_lock) device_extension* Vcb, UINT64 address, ULONG length) {
+    UINT64 block_size = (UINT64)Vcb->superblock.sector_size * CSUM_CACHE_BLOCK_SECTORS;
+    ULONG i = 0;
+
+    ExAcquireResourceExclusiveLite(&Vcb->csum_cache_lock, TRUE);
+
+    while (i < length && !IsListEmpty(&Vcb->csum_cache)) {
+        UINT64 addr = address + ((UINT64)i * Vcb->superblock.sector_size);
+        csum_cache_entry* cce = find_csum_cache_entry(Vcb, addr - (addr % block_size));
+        ULONG off, num;
+
+        off = (ULONG)((addr % block_size) / Vcb->superblock.sector_size);
+        num = min(length - i, CSUM_CACHE_BLOCK_SECTORS - off);
+
+        if (cce) {
+            RTL_BITMAP bmp;
+
+            RtlInitializeBitMap(&bmp, cce->valid, CSUM_CACHE_BLOCK_SECTORS);
+            RtlClearBits(&bmp, off, num);
+
+            if (RtlNumberOfSetBits(&bmp) == 0)
+                free_csum_cache_entry(Vcb, cce);
+        }
+
+        i += num;
+    }
+
+    ExReleaseResourceLite(&Vcb->csum_cache_lock);
+}
+
+void free_csum_cache(device_extension* Vcb) {
+    ExAcquireResourceExclusiveLite(&Vcb->csum_cache_lock, TRUE);
+
+    while (!IsListEmpty(&Vcb->csum_cache)) {
+        free_csum_cache_entry(Vcb, CONTAINING_RECORD(Vcb->csum_cache.Flink, csum_cache_entry, list_entry));
+    }
+
+    ExReleaseResourceLite(&Vcb->csum_cache_lock);
+}
+
+static NTSTATUS get_data_csums(fcb* fcb, UINT64 address, ULONG length, UINT32** pcsum, PIRP Irp) {
+    device_extension* Vcb = fcb->Vcb;
+    NTSTATUS Status;
+    UINT32* csum;
+    BOOL tree_lock = FALSE;
+
+    csum = ExAllocatePoolWithTag(PagedPool, length * sizeof(UINT32), ALLOC_TAG);
+    if (!csum) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    if (Vcb->options.csum_cache_size > 0 && get_cached_csums(Vcb, address, length, csum)) {
+        *pcsum = csum;
+        return STATUS_SUCCESS;
+    }
+
+    // The read entry points take the tree lock before the fcb's resource, in the same order as flushing,
+    // so it should already be held here.
+    if (!ExIsResourceAcquiredSharedLite(&Vcb->tree_lock)) {
+        ExAcquireResourceSharedLite(&Vcb->tree_lock, TRUE);
+        tree_lock = TRUE;
+    }
+
+    Status = load_csum(Vcb, csum, address, length, Irp);
+
+    if (NT_SUCCESS(Status) && Vcb->options.csum_cache_size > 0)
+        add_cached_csums(Vcb, address, length, csum);
+
+    if (tree_lock)
+        ExReleaseResourceLite(&Vcb->tree_lock);
+
+    if (!NT_SUCCESS(Status)) {
+        ERR("load_csum returned %08x\n", Status);
+        ExFreePool(csum);
+        return Status;
+    }
+
+    *pcsum = csum;
+
+    return STATUS_SUCCESS;
+}
+
 NTSTATUS read_stream(fcb* fcb, UINT8* data, UINT64 start, ULONG length, ULONG* pbr) {
     ULONG readlen;
 
@@ -2890,7 +3170,7 @@ NTSTATUS read_file(fcb* fcb, UINT8* data, UINT64 start, UINT64 length, ULONG* pb
                     UINT8* buf;
                     BOOL mdl = (Irp && Irp->MdlAddress) ? TRUE : FALSE;
                     BOOL buf_free;
-                    UINT32 bumpoff = 0, *csum;
+                    UINT32 bumpoff = 0, *csum, *csum_alloc = NULL;
                     UINT64 addr;
                     chunk* c;
 
@@ -2944,11 +3224,27 @@ NTSTATUS read_file(fcb* fcb, UINT8* data, UINT64 start, UINT64 length, ULONG* pb
                             csum = &ext->csum[off / fcb->Vcb->superblock.sector_size];
                         else
                             csum = ext->csum;
+                    } else if (!(fcb->inode_item.flags & BTRFS_INODE_NODATASUM) && fcb->Vcb->checksum_root) {
+                        Status = get_data_csums(fcb, addr, to_read / fcb->Vcb->superblock.sector_size, &csum_alloc, Irp);
+                        if (!NT_SUCCESS(Status)) {
+                            ERR("get_data_csums returned %08x\n", Status);
+
+                            if (buf_free)
+                                ExFreePool(buf);
+
+                            goto exit;
+                        }
+
+                        csum = csum_alloc;
                     } else
                         csum = NULL;
 
                     Status = read_data(fcb->Vcb, addr, to_read, csum, FALSE, buf, c, NULL, Irp, 0, mdl,
                                        fcb && fcb->Header.Flags2 & FSRTL_FLAG2_IS_PAGING_FILE ? HighPagePriority : NormalPagePriority);
+
+                    if (csum_alloc)
+                        ExFreePool(csum_alloc);
+
                     if (!NT_SUCCESS(Status)) {
                         ERR("read_data returned %08x\n", Status);
 
@@ -3289,7 +3585,7 @@ NTSTATUS drv_read(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
     BOOL top_level;
     fcb* fcb;
     ccb* ccb;
-    BOOLEAN fcb_lock = FALSE, wait;
+    BOOLEAN tree_lock = FALSE, fcb_lock = FALSE, wait;
 
     FsRtlEnterFileSystem();
 
@@ -3366,7 +3662,23 @@ NTSTATUS drv_read(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
     }
 
     if (!ExIsResourceAcquiredSharedLite(fcb->Header.Resource)) {
+        // Take the tree lock first, in case read_file needs to look up checksums. Paging files
+        // have theirs loaded when they're opened, so don't need it.
+
+        if (!(fcb->Header.Flags2 & FSRTL_FLAG2_IS_PAGING_FILE)) {
+            if (!ExAcquireResourceSharedLite(&Vcb->tree_lock, wait)) {
+                Status = STATUS_PENDING;
+                IoMarkIrpPending(Irp);
+                goto exit;
+            }
+
+            tree_lock = TRUE;
+        }
+
         if (!ExAcquireResourceSharedLite(fcb->Header.Resource, wait)) {
+            if (tree_lock)
+                ExReleaseResourceLite(&Vcb->tree_lock);
+
             Status = STATUS_PENDING;
             IoMarkIrpPending(Irp);
             goto exit;
@@ -3380,6 +3692,9 @@ NTSTATUS drv_read(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
     if (fcb_lock)
         ExReleaseResourceLite(fcb->Header.Resource);
 
+    if (tree_lock)
+        ExReleaseResourceLite(&Vcb->tree_lock);
+
 exit:
     if (FileObject->Flags & FO_SYNCHRONOUS_IO && !(Irp->Flags & IRP_PAGING_IO))
         FileObject->CurrentByteOffset.QuadPart = IrpSp->Parameters.Read.ByteOffset.QuadPart + (NT_SUCCESS(Status) ? bytes_read : 0);
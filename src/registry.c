@@ -37,7 +37,9 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
     BTRFS_UUID* uuid = &Vcb->superblock.uuid;
     mount_options* options = &Vcb->options;
     UNICODE_STRING path, ignoreus, compressus, compressforceus, compresstypeus, readonlyus, zliblevelus, flushintervalus,
-                   maxinlineus, subvolidus, skipbalanceus, nobarrierus, notrimus, clearcacheus, allowdegradedus, zstdlevelus;
+                   maxinlineus, subvolidus, skipbalanceus, nobarrierus, notrimus, clearcacheus, allowdegradedus, zstdlevelus,
+                   treecachesizeus, readpolicyus, readpreferdeviceus, scrubratelimitus, scrubiopslimitus,
+                   sendbuffersizeus, dircachesizeus, csumcachesizeus;
     OBJECT_ATTRIBUTES oa;
     NTSTATUS Status;
     ULONG i, j, kvfilen, index, retlen;
@@ -57,6 +59,14 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
     options->no_trim = mount_no_trim;
     options->clear_cache = mount_clear_cache;
     options->allow_degraded = mount_allow_degraded;
+    options->tree_cache_size = mount_tree_cache_size;
+    options->read_policy = mount_read_policy;
+    options->read_prefer_device = 0;
+    options->scrub_rate_limit = mount_scrub_rate_limit;
+    options->scrub_iops_limit = mount_scrub_iops_limit;
+    options->send_buffer_size = mount_send_buffer_size;
+    options->dir_cache_size = mount_dir_cache_size;
+    options->csum_cache_size = mount_csum_cache_size;
     options->subvol_id = 0;
 
     path.Length = path.MaximumLength = registry_path.Length + (37 * sizeof(WCHAR));
@@ -121,6 +131,14 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
     RtlInitUnicodeString(&clearcacheus, L"ClearCache");
     RtlInitUnicodeString(&allowdegradedus, L"AllowDegraded");
     RtlInitUnicodeString(&zstdlevelus, L"ZstdLevel");
+    RtlInitUnicodeString(&treecachesizeus, L"TreeCacheSize");
+    RtlInitUnicodeString(&readpolicyus, L"ReadPolicy");
+    RtlInitUnicodeString(&readpreferdeviceus, L"ReadPreferDevice");
+    RtlInitUnicodeString(&scrubratelimitus, L"ScrubRateLimit");
+    RtlInitUnicodeString(&scrubiopslimitus, L"ScrubIopsLimit");
+    RtlInitUnicodeString(&sendbuffersizeus, L"SendBufferSize");
+    RtlInitUnicodeString(&dircachesizeus, L"DirCacheSize");
+    RtlInitUnicodeString(&csumcachesizeus, L"CsumCacheSize");
 
     do {
         Status = ZwEnumerateValueKey(h, index, KeyValueFullInformation, kvfi, kvfilen, &retlen);
@@ -193,6 +211,38 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
                 DWORD* val = (DWORD*)((UINT8*)kvfi + kvfi->DataOffset);
 
                 options->zstd_level = *val;
+            } else if (FsRtlAreNamesEqual(&treecachesizeus, &us, TRUE, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((UINT8*)kvfi + kvfi->DataOffset);
+
+                options->tree_cache_size = *val;
+            } else if (FsRtlAreNamesEqual(&readpolicyus, &us, TRUE, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((UINT8*)kvfi + kvfi->DataOffset);
+
+                options->read_policy = *val;
+            } else if (FsRtlAreNamesEqual(&readpreferdeviceus, &us, TRUE, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_QWORD) {
+                UINT64* val = (UINT64*)((UINT8*)kvfi + kvfi->DataOffset);
+
+                options->read_prefer_device = *val;
+            } else if (FsRtlAreNamesEqual(&scrubratelimitus, &us, TRUE, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((UINT8*)kvfi + kvfi->DataOffset);
+
+                options->scrub_rate_limit = *val;
+            } else if (FsRtlAreNamesEqual(&scrubiopslimitus, &us, TRUE, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((UINT8*)kvfi + kvfi->DataOffset);
+
+                options->scrub_iops_limit = *val;
+            } else if (FsRtlAreNamesEqual(&sendbuffersizeus, &us, TRUE, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((UINT8*)kvfi + kvfi->DataOffset);
+
+                options->send_buffer_size = *val;
+            } else if (FsRtlAreNamesEqual(&dircachesizeus, &us, TRUE, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((UINT8*)kvfi + kvfi->DataOffset);
+
+                options->dir_cache_size = *val;
+            } else if (FsRtlAreNamesEqual(&csumcachesizeus, &us, TRUE, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((UINT8*)kvfi + kvfi->DataOffset);
+
+                options->csum_cache_size = *val;
             }
         } else if (Status != STATUS_NO_MORE_ENTRIES) {
             ERR("ZwEnumerateValueKey returned %08x\n", Status);
@@ -212,6 +262,9 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
     if (options->flush_interval == 0)
         options->flush_interval = mount_flush_interval;
 
+    if (options->read_policy > READ_POLICY_PREFERRED)
+        options->read_policy = READ_POLICY_ROUND_ROBIN;
+
     Status = STATUS_SUCCESS;
 
 end2:
@@ -798,6 +851,13 @@ void read_registry(PUNICODE_STRING regpath, BOOL refresh) {
     get_registry_value(h, L"ZlibLevel", REG_DWORD, &mount_zlib_level, sizeof(mount_zlib_level));
     get_registry_value(h, L"FlushInterval", REG_DWORD, &mount_flush_interval, sizeof(mount_flush_interval));
     get_registry_value(h, L"MaxInline", REG_DWORD, &mount_max_inline, sizeof(mount_max_inline));
+    get_registry_value(h, L"TreeCacheSize", REG_DWORD, &mount_tree_cache_size, sizeof(mount_tree_cache_size));
+    get_registry_value(h, L"ReadPolicy", REG_DWORD, &mount_read_policy, sizeof(mount_read_policy));
+    get_registry_value(h, L"ScrubRateLimit", REG_DWORD, &mount_scrub_rate_limit, sizeof(mount_scrub_rate_limit));
+    get_registry_value(h, L"ScrubIopsLimit", REG_DWORD, &mount_scrub_iops_limit, sizeof(mount_scrub_iops_limit));
+    get_registry_value(h, L"SendBufferSize", REG_DWORD, &mount_send_buffer_size, sizeof(mount_send_buffer_size));
+    get_registry_value(h, L"DirCacheSize", REG_DWORD, &mount_dir_cache_size, sizeof(mount_dir_cache_size));
+    get_registry_value(h, L"CsumCacheSize", REG_DWORD, &mount_csum_cache_size, sizeof(mount_csum_cache_size));
     get_registry_value(h, L"SkipBalance", REG_DWORD, &mount_skip_balance, sizeof(mount_skip_balance));
     get_registry_value(h, L"NoBarrier", REG_DWORD, &mount_no_barrier, sizeof(mount_no_barrier));
     get_registry_value(h, L"NoTrim", REG_DWORD, &mount_no_trim, sizeof(mount_no_trim));
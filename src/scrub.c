@@ -44,6 +44,19 @@ typedef struct {
     LIST_ENTRY list_entry;
 } path_part;
 
+typedef struct {
+    device_extension* Vcb;
+    LIST_ENTRY chunks;
+    ERESOURCE lock;
+    KEVENT chunk_done;
+} scrub_queue;
+
+typedef struct {
+    scrub_queue* sq;
+    HANDLE handle;
+    KEVENT finished;
+} scrub_worker;
+
 static void log_file_checksum_error(device_extension* Vcb, UINT64 addr, UINT64 devid, UINT64 subvol, UINT64 inode, UINT64 offset) {
     LIST_ENTRY *le, parts;
     root* r = NULL;
@@ -648,6 +661,45 @@ static void log_error(device_extension* Vcb, UINT64 addr, UINT64 devid, BOOL met
     }
 }
 
+static void scrub_throttle_add(device_extension* Vcb, UINT64 length, ULONG ios) {
+    if (Vcb->options.scrub_rate_limit == 0 && Vcb->options.scrub_iops_limit == 0)
+        return;
+
+    InterlockedExchangeAdd64(&Vcb->scrub.throttle_bytes, length);
+    InterlockedExchangeAdd64(&Vcb->scrub.throttle_ios, ios);
+}
+
+// Sleeps for as long as it takes to bring us back under ScrubRateLimit and ScrubIopsLimit.
+// This mustn't be called with tree_lock held, as otherwise we'd be holding up the flush
+// thread, and everybody queued up behind it, for as long as we're asleep.
+static void scrub_throttle(device_extension* Vcb) {
+    LARGE_INTEGER time, delay;
+    UINT64 bytes, num_ios, due = 0;
+
+    if (Vcb->options.scrub_rate_limit == 0 && Vcb->options.scrub_iops_limit == 0)
+        return;
+
+    bytes = Vcb->scrub.throttle_bytes;
+    num_ios = Vcb->scrub.throttle_ios;
+
+    // the earliest time, in 100ns units since throttle_start, we're allowed to have read this much
+    if (Vcb->options.scrub_rate_limit != 0) {
+        UINT64 rate = (UINT64)Vcb->options.scrub_rate_limit * 1024;
+
+        due = ((bytes / rate) * 10000000) + ((bytes % rate) * 10000000 / rate);
+    }
+
+    if (Vcb->options.scrub_iops_limit != 0)
+        due = max(due, num_ios * 10000000 / Vcb->options.scrub_iops_limit);
+
+    KeQuerySystemTime(&time);
+
+    if (due > (UINT64)(time.QuadPart - Vcb->scrub.throttle_start.QuadPart)) {
+        delay.QuadPart = time.QuadPart - Vcb->scrub.throttle_start.QuadPart - (LONGLONG)due;
+        KeDelayExecutionThread(KernelMode, FALSE, &delay);
+    }
+}
+
 _Function_class_(IO_COMPLETION_ROUTINE)
 static NTSTATUS scrub_read_completion(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID conptr) {
     scrub_context_stripe* stripe = conptr;
@@ -1384,6 +1436,7 @@ end:
 
 static NTSTATUS scrub_extent(device_extension* Vcb, chunk* c, ULONG type, UINT64 offset, UINT32 size, UINT32* csum) {
     ULONG i;
+    UINT64 read_length = 0;
     scrub_context context;
     CHUNK_ITEM_STRIPE* cis;
     NTSTATUS Status;
@@ -1559,7 +1612,9 @@ static NTSTATUS scrub_extent(device_extension* Vcb, chunk* c, ULONG type, UINT64
 
             context.stripes_left++;
 
-            Vcb->scrub.data_scrubbed += context.stripes[i].length;
+            InterlockedExchangeAdd64((LONG64*)&Vcb->scrub.data_scrubbed, context.stripes[i].length);
+            InterlockedExchangeAdd64(&c->devices[i]->scrub_data, context.stripes[i].length);
+            read_length += context.stripes[i].length;
         }
     }
 
@@ -1569,6 +1624,8 @@ static NTSTATUS scrub_extent(device_extension* Vcb, chunk* c, ULONG type, UINT64
         goto end;
     }
 
+    scrub_throttle_add(Vcb, read_length, context.stripes_left);
+
     KeInitializeEvent(&context.Event, NotificationEvent, FALSE);
 
     for (i = 0; i < c->chunk_item->num_stripes; i++) {
@@ -2273,7 +2330,6 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
             UINT64 addr;
             UINT32 len = (RtlCheckBit(&context->is_tree, bad_off1) || RtlCheckBit(&context->is_tree, bad_off2)) ? Vcb->superblock.node_size : Vcb->superblock.sector_size;
             UINT8 gyx, gx, denom, a, b, *p, *q, *pxy, *qxy;
-            UINT32 j;
 
             stripe = parity1 == 0 ? (c->chunk_item->num_stripes - 1) : (parity1 - 1);
 
@@ -2328,14 +2384,7 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
             pxy = &context->parity_scratch2[i * Vcb->superblock.sector_size];
             qxy = &context->parity_scratch[i * Vcb->superblock.sector_size];
 
-            for (j = 0; j < len; j++) {
-                *qxy = gmul(a, *p ^ *pxy) ^ gmul(b, *q ^ *qxy);
-
-                p++;
-                q++;
-                pxy++;
-                qxy++;
-            }
+            galois_recover2(qxy, pxy, p, q, a, b, len);
 
             do_xor(&context->parity_scratch2[i * Vcb->superblock.sector_size], &context->parity_scratch[i * Vcb->superblock.sector_size], len);
             do_xor(&context->parity_scratch2[i * Vcb->superblock.sector_size], &context->stripes[parity1].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)], len);
@@ -2651,12 +2700,14 @@ static NTSTATUS scrub_chunk_raid56_stripe_run(device_extension* Vcb, chunk* c, U
 
     Status = STATUS_SUCCESS;
 
-    chunk_lock_range(Vcb, c, run_start, run_end - run_start);
+    chunk_lock_range(Vcb, c, run_start, run_end - run_start, TRUE);
 
     do {
         ULONG read_stripes;
         UINT16 missing_devices = 0;
         BOOL need_wait = FALSE;
+        UINT64 read_length = 0;
+        ULONG num_reads = 0;
 
         if (max_read < stripe_end + 1 - stripe)
             read_stripes = max_read;
@@ -2728,7 +2779,10 @@ static NTSTATUS scrub_chunk_raid56_stripe_run(device_extension* Vcb, chunk* c, U
 
                 IoSetCompletionRoutine(context.stripes[i].Irp, scrub_read_completion_raid56, &context.stripes[i], TRUE, TRUE, TRUE);
 
-                Vcb->scrub.data_scrubbed += read_stripes * c->chunk_item->stripe_length;
+                InterlockedExchangeAdd64((LONG64*)&Vcb->scrub.data_scrubbed, read_stripes * c->chunk_item->stripe_length);
+                InterlockedExchangeAdd64(&c->devices[i]->scrub_data, read_stripes * c->chunk_item->stripe_length);
+                read_length += read_stripes * c->chunk_item->stripe_length;
+                num_reads++;
                 need_wait = TRUE;
             } else {
                 context.stripes[i].Irp = NULL;
@@ -2749,6 +2803,8 @@ static NTSTATUS scrub_chunk_raid56_stripe_run(device_extension* Vcb, chunk* c, U
         }
 
         if (need_wait) {
+            scrub_throttle_add(Vcb, read_length, num_reads);
+
             KeInitializeEvent(&context.Event, NotificationEvent, FALSE);
 
             for (i = 0; i < c->chunk_item->num_stripes; i++) {
@@ -3127,16 +3183,175 @@ end:
     return Status;
 }
 
+static chunk* get_next_scrub_chunk(scrub_queue* sq) {
+    chunk* c = NULL;
+    UINT16 i;
+
+    ExAcquireResourceExclusiveLite(&sq->lock, TRUE);
+
+    while (!IsListEmpty(&sq->chunks)) {
+        LIST_ENTRY* le = sq->chunks.Flink;
+
+        // find the first chunk whose devices aren't being scrubbed by another thread
+        while (le != &sq->chunks) {
+            chunk* c2 = CONTAINING_RECORD(le, chunk, list_entry_balance);
+            BOOL busy = FALSE;
+
+            for (i = 0; i < c2->chunk_item->num_stripes; i++) {
+                if (c2->devices[i]->scrub_busy) {
+                    busy = TRUE;
+                    break;
+                }
+            }
+
+            if (!busy) {
+                c = c2;
+                break;
+            }
+
+            le = le->Flink;
+        }
+
+        if (c) {
+            RemoveEntryList(&c->list_entry_balance);
+
+            for (i = 0; i < c->chunk_item->num_stripes; i++) {
+                c->devices[i]->scrub_busy = TRUE;
+            }
+
+            break;
+        }
+
+        // everything left shares a device with a chunk in progress, so wait for one to finish
+        KeClearEvent(&sq->chunk_done);
+
+        ExReleaseResourceLite(&sq->lock);
+
+        KeWaitForSingleObject(&sq->chunk_done, Executive, KernelMode, FALSE, NULL);
+
+        ExAcquireResourceExclusiveLite(&sq->lock, TRUE);
+    }
+
+    ExReleaseResourceLite(&sq->lock);
+
+    return c;
+}
+
+static void scrub_chunks(scrub_queue* sq) {
+    device_extension* Vcb = sq->Vcb;
+    chunk* c;
+
+    while ((c = get_next_scrub_chunk(sq))) {
+        UINT64 offset = c->offset;
+        BOOL changed;
+        NTSTATUS Status;
+        LARGE_INTEGER time1, time2;
+        UINT16 i, j;
+
+        c->reloc = TRUE;
+
+        KeWaitForSingleObject(&Vcb->scrub.event, Executive, KernelMode, FALSE, NULL);
+
+        KeQuerySystemTime(&time1);
+
+        if (!Vcb->scrub.stopping) {
+            do {
+                changed = FALSE;
+
+                scrub_throttle(Vcb);
+
+                Status = scrub_chunk(Vcb, c, &offset, &changed);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("scrub_chunk returned %08x\n", Status);
+                    Vcb->scrub.stopping = TRUE;
+                    Vcb->scrub.error = Status;
+                    break;
+                }
+
+                if (offset == c->offset + c->chunk_item->size || Vcb->scrub.stopping)
+                    break;
+
+                KeWaitForSingleObject(&Vcb->scrub.event, Executive, KernelMode, FALSE, NULL);
+            } while (changed);
+        }
+
+        KeQuerySystemTime(&time2);
+
+        ExAcquireResourceExclusiveLite(&Vcb->scrub.stats_lock, TRUE);
+
+        if (!Vcb->scrub.stopping)
+            Vcb->scrub.chunks_left--;
+
+        for (i = 0; i < c->chunk_item->num_stripes; i++) {
+            BOOL dupe = FALSE;
+
+            // DUP chunks have both stripes on the same device
+            for (j = 0; j < i; j++) {
+                if (c->devices[j] == c->devices[i]) {
+                    dupe = TRUE;
+                    break;
+                }
+            }
+
+            if (!dupe) {
+                if (!Vcb->scrub.stopping)
+                    c->devices[i]->scrub_chunks_left--;
+
+                c->devices[i]->scrub_time += time2.QuadPart - time1.QuadPart;
+            }
+        }
+
+        ExReleaseResource(&Vcb->scrub.stats_lock);
+
+        c->reloc = FALSE;
+        c->list_entry_balance.Flink = NULL;
+
+        ExAcquireResourceExclusiveLite(&sq->lock, TRUE);
+
+        for (i = 0; i < c->chunk_item->num_stripes; i++) {
+            c->devices[i]->scrub_busy = FALSE;
+        }
+
+        KeSetEvent(&sq->chunk_done, 0, FALSE);
+
+        ExReleaseResourceLite(&sq->lock);
+    }
+}
+
+_Function_class_(KSTART_ROUTINE)
+static void scrub_worker_thread(void* context) {
+    scrub_worker* sw = context;
+
+    scrub_chunks(sw->sq);
+
+    KeSetEvent(&sw->finished, 0, FALSE);
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
 _Function_class_(KSTART_ROUTINE)
 static void scrub_thread(void* context) {
     device_extension* Vcb = context;
-    LIST_ENTRY chunks, *le;
+    scrub_queue* sq;
+    scrub_worker* workers = NULL;
+    ULONG num_workers = 0, num_devices = 0, i;
+    LIST_ENTRY* le;
     NTSTATUS Status;
     LARGE_INTEGER time;
 
     KeInitializeEvent(&Vcb->scrub.finished, NotificationEvent, FALSE);
 
-    InitializeListHead(&chunks);
+    sq = ExAllocatePoolWithTag(NonPagedPool, sizeof(scrub_queue), ALLOC_TAG);
+    if (!sq) {
+        ERR("out of memory\n");
+        Vcb->scrub.error = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
+
+    sq->Vcb = Vcb;
+    InitializeListHead(&sq->chunks);
+    ExInitializeResourceLite(&sq->lock);
+    KeInitializeEvent(&sq->chunk_done, NotificationEvent, FALSE);
 
     ExAcquireResourceExclusiveLite(&Vcb->tree_lock, TRUE);
 
@@ -3166,12 +3381,31 @@ static void scrub_thread(void* context) {
     Vcb->scrub.chunks_left = 0;
     Vcb->scrub.data_scrubbed = 0;
     Vcb->scrub.num_errors = 0;
+    Vcb->scrub.throttle_start.QuadPart = Vcb->scrub.start_time.QuadPart;
+    Vcb->scrub.throttle_bytes = 0;
+    Vcb->scrub.throttle_ios = 0;
 
     while (!IsListEmpty(&Vcb->scrub.errors)) {
         scrub_error* err = CONTAINING_RECORD(RemoveHeadList(&Vcb->scrub.errors), scrub_error, list_entry);
         ExFreePool(err);
     }
 
+    le = Vcb->devices.Flink;
+    while (le != &Vcb->devices) {
+        device* dev = CONTAINING_RECORD(le, device, list_entry);
+
+        dev->scrub_busy = FALSE;
+        dev->scrub_total_chunks = 0;
+        dev->scrub_chunks_left = 0;
+        dev->scrub_data = 0;
+        dev->scrub_time = 0;
+
+        if (dev->devobj)
+            num_devices++;
+
+        le = le->Flink;
+    }
+
     ExAcquireResourceSharedLite(&Vcb->chunk_lock, TRUE);
 
     le = Vcb->chunks.Flink;
@@ -3181,9 +3415,23 @@ static void scrub_thread(void* context) {
         acquire_chunk_lock(c, Vcb);
 
         if (!c->readonly) {
-            InsertTailList(&chunks, &c->list_entry_balance);
+            UINT16 j, k;
+
+            InsertTailList(&sq->chunks, &c->list_entry_balance);
             Vcb->scrub.total_chunks++;
             Vcb->scrub.chunks_left++;
+
+            for (j = 0; j < c->chunk_item->num_stripes; j++) {
+                for (k = 0; k < j; k++) {
+                    if (c->devices[k] == c->devices[j])
+                        break;
+                }
+
+                if (k == j) {
+                    c->devices[j]->scrub_total_chunks++;
+                    c->devices[j]->scrub_chunks_left++;
+                }
+            }
         }
 
         release_chunk_lock(c, Vcb);
@@ -3197,52 +3445,51 @@ static void scrub_thread(void* context) {
 
     ExReleaseResourceLite(&Vcb->tree_lock);
 
-    while (!IsListEmpty(&chunks)) {
-        chunk* c = CONTAINING_RECORD(RemoveHeadList(&chunks), chunk, list_entry_balance);
-        UINT64 offset = c->offset;
-        BOOL changed;
-
-        c->reloc = TRUE;
-
-        KeWaitForSingleObject(&Vcb->scrub.event, Executive, KernelMode, FALSE, NULL);
-
-        if (!Vcb->scrub.stopping) {
-            do {
-                changed = FALSE;
+    // Chunks on different devices get scrubbed at the same time, one thread per device. We
+    // never scrub two chunks on the same device at once, so each disk only sees one stream of reads.
+    if (num_devices > 1) {
+        workers = ExAllocatePoolWithTag(NonPagedPool, sizeof(scrub_worker) * (num_devices - 1), ALLOC_TAG);
+        if (!workers)
+            ERR("out of memory\n");
+        else {
+            for (i = 0; i < num_devices - 1; i++) {
+                workers[num_workers].sq = sq;
+                KeInitializeEvent(&workers[num_workers].finished, NotificationEvent, FALSE);
 
-                Status = scrub_chunk(Vcb, c, &offset, &changed);
+                Status = PsCreateSystemThread(&workers[num_workers].handle, 0, NULL, NULL, NULL, scrub_worker_thread, &workers[num_workers]);
                 if (!NT_SUCCESS(Status)) {
-                    ERR("scrub_chunk returned %08x\n", Status);
-                    Vcb->scrub.stopping = TRUE;
-                    Vcb->scrub.error = Status;
+                    ERR("PsCreateSystemThread returned %08x\n", Status);
                     break;
                 }
 
-                if (offset == c->offset + c->chunk_item->size || Vcb->scrub.stopping)
-                    break;
-
-                KeWaitForSingleObject(&Vcb->scrub.event, Executive, KernelMode, FALSE, NULL);
-            } while (changed);
+                num_workers++;
+            }
         }
+    }
 
-        ExAcquireResourceExclusiveLite(&Vcb->scrub.stats_lock, TRUE);
-
-        if (!Vcb->scrub.stopping)
-            Vcb->scrub.chunks_left--;
+    scrub_chunks(sq);
 
-        if (IsListEmpty(&chunks))
-            KeQuerySystemTime(&Vcb->scrub.finish_time);
+    for (i = 0; i < num_workers; i++) {
+        KeWaitForSingleObject(&workers[i].finished, Executive, KernelMode, FALSE, NULL);
+        ZwClose(workers[i].handle);
+    }
 
-        ExReleaseResource(&Vcb->scrub.stats_lock);
+    if (workers)
+        ExFreePool(workers);
 
-        c->reloc = FALSE;
-        c->list_entry_balance.Flink = NULL;
-    }
+    ExAcquireResourceExclusiveLite(&Vcb->scrub.stats_lock, TRUE);
+    KeQuerySystemTime(&Vcb->scrub.finish_time);
+    ExReleaseResource(&Vcb->scrub.stats_lock);
 
     KeQuerySystemTime(&time);
     Vcb->scrub.duration.QuadPart += time.QuadPart - Vcb->scrub.resume_time.QuadPart;
 
 end:
+    if (sq) {
+        ExDeleteResourceLite(&sq->lock);
+        ExFreePool(sq);
+    }
+
     ZwClose(Vcb->scrub.thread);
     Vcb->scrub.thread = NULL;
 
@@ -3289,10 +3536,11 @@ NTSTATUS start_scrub(device_extension* Vcb, KPROCESSOR_MODE processor_mode) {
 
 NTSTATUS query_scrub(device_extension* Vcb, KPROCESSOR_MODE processor_mode, void* data, ULONG length) {
     btrfs_query_scrub* bqs = (btrfs_query_scrub*)data;
-    ULONG len;
+    ULONG len, off;
     NTSTATUS Status;
     LIST_ENTRY* le;
     btrfs_scrub_error* bse = NULL;
+    btrfs_scrub_devices* bsds;
 
     if (!SeSinglePrivilegeCheck(RtlConvertLongToLuid(SE_MANAGE_VOLUME_PRIVILEGE), processor_mode))
         return STATUS_PRIVILEGE_NOT_HELD;
@@ -3300,6 +3548,7 @@ NTSTATUS query_scrub(device_extension* Vcb, KPROCESSOR_MODE processor_mode, void
     if (length < offsetof(btrfs_query_scrub, errors))
         return STATUS_BUFFER_TOO_SMALL;
 
+    ExAcquireResourceSharedLite(&Vcb->tree_lock, TRUE);
     ExAcquireResourceSharedLite(&Vcb->scrub.stats_lock, TRUE);
 
     if (Vcb->scrub.thread && Vcb->scrub.chunks_left > 0)
@@ -3379,10 +3628,50 @@ NTSTATUS query_scrub(device_extension* Vcb, KPROCESSOR_MODE processor_mode, void
         le = le->Flink;
     }
 
+    // per-device progress goes after the errors
+    off = (ULONG)sector_align(length - len, 8);
+
+    if (off > length || length - off < offsetof(btrfs_scrub_devices, devices[0])) {
+        Status = STATUS_BUFFER_OVERFLOW;
+        goto end;
+    }
+
+    bsds = (btrfs_scrub_devices*)((UINT8*)bqs + off);
+    bsds->num_devices = 0;
+
+    len = length - off - offsetof(btrfs_scrub_devices, devices[0]);
+
+    le = Vcb->devices.Flink;
+    while (le != &Vcb->devices) {
+        device* dev = CONTAINING_RECORD(le, device, list_entry);
+        btrfs_scrub_device* bsd;
+
+        if (dev->scrub_total_chunks > 0) {
+            if (len < sizeof(btrfs_scrub_device)) {
+                Status = STATUS_BUFFER_OVERFLOW;
+                goto end;
+            }
+
+            bsd = &bsds->devices[bsds->num_devices];
+
+            bsd->dev_id = dev->devitem.dev_id;
+            bsd->total_chunks = dev->scrub_total_chunks;
+            bsd->chunks_left = dev->scrub_chunks_left;
+            bsd->data_scrubbed = dev->scrub_data;
+            bsd->duration = dev->scrub_time;
+
+            bsds->num_devices++;
+            len -= sizeof(btrfs_scrub_device);
+        }
+
+        le = le->Flink;
+    }
+
     Status = STATUS_SUCCESS;
 
 end:
     ExReleaseResourceLite(&Vcb->scrub.stats_lock);
+    ExReleaseResourceLite(&Vcb->tree_lock);
 
     return Status;
 }
@@ -3419,10 +3708,16 @@ NTSTATUS resume_scrub(device_extension* Vcb, KPROCESSOR_MODE processor_mode) {
         return STATUS_DEVICE_NOT_READY;
 
     Vcb->scrub.paused = FALSE;
-    KeSetEvent(&Vcb->scrub.event, 0, FALSE);
 
     KeQuerySystemTime(&Vcb->scrub.resume_time);
 
+    // don't let a scrub which has been paused make up for lost time
+    Vcb->scrub.throttle_start.QuadPart = Vcb->scrub.resume_time.QuadPart;
+    Vcb->scrub.throttle_bytes = 0;
+    Vcb->scrub.throttle_ios = 0;
+
+    KeSetEvent(&Vcb->scrub.event, 0, FALSE);
+
     return STATUS_SUCCESS;
 }
 
@@ -64,12 +64,26 @@ typedef struct {
     EXTENT_DATA data;
 } send_ext;
 
+typedef struct {
+    UINT8* data;
+    ULONG datalen;
+    ULONG readpos;
+    LIST_ENTRY list_entry;
+} send_segment;
+
 typedef struct {
     device_extension* Vcb;
     root* root;
     root* parent;
     UINT8* data;
     ULONG datalen;
+    send_segment* cur_segment;
+    LIST_ENTRY full_segments;
+    LIST_ENTRY free_segments;
+    ERESOURCE segment_lock;
+    BOOL finished;
+    BOOL v2;
+    ULONG max_write;
     ULONG num_clones;
     root** clones;
     LIST_ENTRY orphans;
@@ -107,11 +121,149 @@ typedef struct {
 } send_context;
 
 #define MAX_SEND_WRITE 0xc000 // 48 KB
+#define MAX_SEND_WRITE_V2 0x20000 // 128 KB
 #define SEND_BUFFER_LENGTH 0x100000 // 1 MB
 
 static NTSTATUS find_send_dir(send_context* context, UINT64 dir, UINT64 generation, send_dir** psd, BOOL* added_dummy);
 static NTSTATUS wait_for_flush(send_context* context, traverse_ptr* tp1, traverse_ptr* tp2);
 
+static NTSTATUS alloc_send_segments(send_context* context, ULONG num_segments) {
+    ULONG i;
+
+    context->cur_segment = NULL;
+    InitializeListHead(&context->full_segments);
+    InitializeListHead(&context->free_segments);
+
+    for (i = 0; i < num_segments; i++) {
+        send_segment* seg = ExAllocatePoolWithTag(PagedPool, sizeof(send_segment), ALLOC_TAG);
+
+        if (!seg) {
+            ERR("out of memory\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        seg->data = ExAllocatePoolWithTag(PagedPool, SEND_BUFFER_LENGTH + (2 * MAX_SEND_WRITE_V2), ALLOC_TAG); // give ourselves some wiggle room
+        if (!seg->data) {
+            ERR("out of memory\n");
+            ExFreePool(seg);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        seg->datalen = seg->readpos = 0;
+
+        InsertTailList(&context->free_segments, &seg->list_entry);
+    }
+
+    context->cur_segment = CONTAINING_RECORD(RemoveHeadList(&context->free_segments), send_segment, list_entry);
+    context->data = context->cur_segment->data;
+    context->datalen = 0;
+
+    return STATUS_SUCCESS;
+}
+
+static void free_send_segments(send_context* context) {
+    if (context->cur_segment)
+        InsertTailList(&context->free_segments, &context->cur_segment->list_entry);
+
+    while (!IsListEmpty(&context->full_segments)) {
+        InsertTailList(&context->free_segments, RemoveHeadList(&context->full_segments));
+    }
+
+    while (!IsListEmpty(&context->free_segments)) {
+        send_segment* seg = CONTAINING_RECORD(RemoveHeadList(&context->free_segments), send_segment, list_entry);
+
+        ExFreePool(seg->data);
+        ExFreePool(seg);
+    }
+
+    context->cur_segment = NULL;
+    context->data = NULL;
+}
+
+// Hands the segment we've been filling over to the reader, and moves on to the next free one.
+// Returns FALSE if they're all waiting to be read.
+static BOOL queue_send_segment(send_context* context) {
+    BOOL ret = FALSE;
+
+    ExAcquireResourceExclusiveLite(&context->segment_lock, TRUE);
+
+    if (context->cur_segment) {
+        context->cur_segment->datalen = context->datalen;
+        context->cur_segment->readpos = 0;
+        InsertTailList(&context->full_segments, &context->cur_segment->list_entry);
+
+        context->cur_segment = NULL;
+        context->data = NULL;
+        context->datalen = 0;
+
+        KeSetEvent(&context->buffer_event, 0, FALSE);
+    }
+
+    if (!IsListEmpty(&context->free_segments)) {
+        context->cur_segment = CONTAINING_RECORD(RemoveHeadList(&context->free_segments), send_segment, list_entry);
+        context->data = context->cur_segment->data;
+        context->datalen = 0;
+        ret = TRUE;
+    } else
+        KeClearEvent(&context->send->cleared_event);
+
+    ExReleaseResourceLite(&context->segment_lock);
+
+    return ret;
+}
+
+static void wait_for_send_segment(send_context* context) {
+    while (!context->send->cancelling) {
+        KeWaitForSingleObject(&context->send->cleared_event, Executive, KernelMode, FALSE, NULL);
+
+        if (queue_send_segment(context))
+            return;
+    }
+
+    // nobody's reading any more, but give the caller something to write into
+    ExAcquireResourceExclusiveLite(&context->segment_lock, TRUE);
+
+    if (!context->cur_segment) {
+        if (!IsListEmpty(&context->free_segments))
+            context->cur_segment = CONTAINING_RECORD(RemoveHeadList(&context->free_segments), send_segment, list_entry);
+        else
+            context->cur_segment = CONTAINING_RECORD(RemoveHeadList(&context->full_segments), send_segment, list_entry);
+
+        context->data = context->cur_segment->data;
+        context->datalen = 0;
+    }
+
+    ExReleaseResourceLite(&context->segment_lock);
+}
+
+static void flush_send_segments(send_context* context) {
+    ExAcquireResourceExclusiveLite(&context->segment_lock, TRUE);
+
+    if (context->cur_segment && context->datalen > 0) {
+        context->cur_segment->datalen = context->datalen;
+        context->cur_segment->readpos = 0;
+        InsertTailList(&context->full_segments, &context->cur_segment->list_entry);
+
+        context->cur_segment = NULL;
+        context->data = NULL;
+        context->datalen = 0;
+
+        KeSetEvent(&context->buffer_event, 0, FALSE);
+    }
+
+    while (!IsListEmpty(&context->full_segments) && !context->send->cancelling) {
+        KeClearEvent(&context->send->cleared_event);
+
+        ExReleaseResourceLite(&context->segment_lock);
+
+        KeWaitForSingleObject(&context->send->cleared_event, Executive, KernelMode, FALSE, NULL);
+
+        ExAcquireResourceExclusiveLite(&context->segment_lock, TRUE);
+    }
+
+    ExReleaseResourceLite(&context->segment_lock);
+}
+
 static void send_command(send_context* context, UINT16 cmd) {
     btrfs_send_command* bsc = (btrfs_send_command*)&context->data[context->datalen];
 
@@ -140,6 +292,24 @@ static void send_add_tlv(send_context* context, UINT16 type, void* data, UINT16
     context->datalen += sizeof(btrfs_send_tlv) + length;
 }
 
+// In v2 streams the data attribute always comes last, and its length is implied by that of the command.
+static void send_add_data(send_context* context, void* data, ULONG length) {
+    UINT16* type;
+
+    if (!context->v2) {
+        send_add_tlv(context, BTRFS_SEND_TLV_DATA, data, (UINT16)length);
+        return;
+    }
+
+    type = (UINT16*)&context->data[context->datalen];
+    *type = BTRFS_SEND_TLV_DATA;
+
+    if (length > 0 && data)
+        RtlCopyMemory(&type[1], data, length);
+
+    context->datalen += sizeof(UINT16) + length;
+}
+
 static char* uint64_to_char(UINT64 num, char* buf) {
     char *tmp, tmp2[20];
 
@@ -1602,6 +1772,10 @@ static NTSTATUS wait_for_flush(send_context* context, traverse_ptr* tp1, travers
     NTSTATUS Status;
     KEY key1, key2;
 
+    // if there's a free segment, we can carry on without letting go of tree_lock
+    if (queue_send_segment(context))
+        return STATUS_SUCCESS;
+
     if (tp1)
         key1 = tp1->item->key;
 
@@ -1610,9 +1784,7 @@ static NTSTATUS wait_for_flush(send_context* context, traverse_ptr* tp1, travers
 
     ExReleaseResourceLite(&context->Vcb->tree_lock);
 
-    KeClearEvent(&context->send->cleared_event);
-    KeSetEvent(&context->buffer_event, 0, TRUE);
-    KeWaitForSingleObject(&context->send->cleared_event, Executive, KernelMode, FALSE, NULL);
+    wait_for_send_segment(context);
 
     ExAcquireResourceSharedLite(&context->Vcb->tree_lock, TRUE);
 
@@ -2123,6 +2295,106 @@ static BOOL try_clone(send_context* context, send_ext* se) {
     return FALSE;
 }
 
+// Sends a compressed extent as it is on disk, so the receiver doesn't have to compress it again.
+static NTSTATUS send_encoded_extent(send_context* context, send_ext* se, traverse_ptr* tp1, traverse_ptr* tp2) {
+    NTSTATUS Status;
+    EXTENT_DATA2* ed2 = (EXTENT_DATA2*)se->data.data;
+    UINT64 unencoded_file_len, unencoded_len, unencoded_offset;
+    UINT32 compression;
+    UINT32* csum;
+    ULONG pos;
+
+    if (se->offset >= context->lastinode.size)
+        return STATUS_SUCCESS;
+
+    if (se->data.compression == BTRFS_COMPRESSION_ZLIB)
+        compression = BTRFS_SEND_COMPRESSION_ZLIB;
+    else if (se->data.compression == BTRFS_COMPRESSION_ZSTD)
+        compression = BTRFS_SEND_COMPRESSION_ZSTD;
+    else if (se->data.compression == BTRFS_COMPRESSION_LZO) {
+        UINT32 ss = context->Vcb->superblock.sector_size;
+
+        compression = BTRFS_SEND_COMPRESSION_LZO_4K;
+
+        while (ss > 0x1000) {
+            compression++;
+            ss >>= 1;
+        }
+
+        if (compression > BTRFS_SEND_COMPRESSION_LZO_64K) {
+            ERR("sector size %x too large for LZO encoded write\n", context->Vcb->superblock.sector_size);
+            return STATUS_NOT_SUPPORTED;
+        }
+    } else {
+        ERR("unhandled compression type %x\n", se->data.compression);
+        return STATUS_NOT_IMPLEMENTED;
+    }
+
+    if (context->datalen > SEND_BUFFER_LENGTH) {
+        Status = wait_for_flush(context, tp1, tp2);
+        if (!NT_SUCCESS(Status)) {
+            ERR("wait_for_flush returned %08x\n", Status);
+            return Status;
+        }
+
+        if (context->send->cancelling)
+            return STATUS_SUCCESS;
+    }
+
+    if (context->lastinode.flags & BTRFS_INODE_NODATASUM)
+        csum = NULL;
+    else {
+        UINT32 len = (UINT32)(ed2->size / context->Vcb->superblock.sector_size);
+
+        csum = ExAllocatePoolWithTag(PagedPool, len * sizeof(UINT32), ALLOC_TAG);
+        if (!csum) {
+            ERR("out of memory\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        Status = load_csum(context->Vcb, csum, ed2->address, len, NULL);
+        if (!NT_SUCCESS(Status)) {
+            ERR("load_csum returned %08x\n", Status);
+            ExFreePool(csum);
+            return Status;
+        }
+    }
+
+    unencoded_file_len = min(ed2->num_bytes, context->lastinode.size - se->offset);
+    unencoded_len = se->data.decoded_size;
+    unencoded_offset = ed2->offset;
+
+    pos = context->datalen;
+
+    send_command(context, BTRFS_SEND_CMD_ENCODED_WRITE);
+
+    send_add_tlv(context, BTRFS_SEND_TLV_PATH, context->lastinode.path, context->lastinode.path ? (UINT16)strlen(context->lastinode.path) : 0);
+    send_add_tlv(context, BTRFS_SEND_TLV_OFFSET, &se->offset, sizeof(UINT64));
+    send_add_tlv(context, BTRFS_SEND_TLV_UNENCODED_FILE_LEN, &unencoded_file_len, sizeof(UINT64));
+    send_add_tlv(context, BTRFS_SEND_TLV_UNENCODED_LEN, &unencoded_len, sizeof(UINT64));
+    send_add_tlv(context, BTRFS_SEND_TLV_UNENCODED_OFFSET, &unencoded_offset, sizeof(UINT64));
+    send_add_tlv(context, BTRFS_SEND_TLV_COMPRESSION, &compression, sizeof(UINT32));
+
+    // read straight into the send buffer
+    send_add_data(context, NULL, (ULONG)ed2->size);
+
+    Status = read_data(context->Vcb, ed2->address, (UINT32)ed2->size, csum, FALSE, &context->data[context->datalen - ed2->size],
+                       NULL, NULL, NULL, 0, FALSE, NormalPagePriority);
+
+    if (csum)
+        ExFreePool(csum);
+
+    if (!NT_SUCCESS(Status)) {
+        ERR("read_data returned %08x\n", Status);
+        context->datalen = pos;
+        return Status;
+    }
+
+    send_command_finish(context, pos);
+
+    return STATUS_SUCCESS;
+}
+
 static NTSTATUS flush_extents(send_context* context, traverse_ptr* tp1, traverse_ptr* tp2) {
     NTSTATUS Status;
 
@@ -2186,11 +2458,11 @@ static NTSTATUS flush_extents(send_context* context, traverse_ptr* tp1, traverse
             send_add_tlv(context, BTRFS_SEND_TLV_OFFSET, &se->offset, sizeof(UINT64));
 
             if (se->data.compression == BTRFS_COMPRESSION_NONE)
-                send_add_tlv(context, BTRFS_SEND_TLV_DATA, se->data.data, (UINT16)se->data.decoded_size);
+                send_add_data(context, se->data.data, (ULONG)se->data.decoded_size);
             else if (se->data.compression == BTRFS_COMPRESSION_ZLIB || se->data.compression == BTRFS_COMPRESSION_LZO || se->data.compression == BTRFS_COMPRESSION_ZSTD) {
                 ULONG inlen = se->datalen - (ULONG)offsetof(EXTENT_DATA, data[0]);
 
-                send_add_tlv(context, BTRFS_SEND_TLV_DATA, NULL, (UINT16)se->data.decoded_size);
+                send_add_data(context, NULL, (ULONG)se->data.decoded_size);
                 RtlZeroMemory(&context->data[context->datalen - se->data.decoded_size], (ULONG)se->data.decoded_size);
 
                 if (se->data.compression == BTRFS_COMPRESSION_ZLIB) {
@@ -2253,8 +2525,8 @@ static NTSTATUS flush_extents(send_context* context, traverse_ptr* tp1, traverse
         if (ed2->size == 0) { // write sparse
             UINT64 off, offset;
 
-            for (off = ed2->offset; off < ed2->offset + ed2->num_bytes; off += MAX_SEND_WRITE) {
-                UINT16 length = (UINT16)min(min(ed2->offset + ed2->num_bytes - off, MAX_SEND_WRITE), context->lastinode.size - se->offset - off);
+            for (off = ed2->offset; off < ed2->offset + ed2->num_bytes; off += context->max_write) {
+                ULONG length = (ULONG)min(min(ed2->offset + ed2->num_bytes - off, context->max_write), context->lastinode.size - se->offset - off);
 
                 if (context->datalen > SEND_BUFFER_LENGTH) {
                     Status = wait_for_flush(context, tp1, tp2);
@@ -2281,7 +2553,7 @@ static NTSTATUS flush_extents(send_context* context, traverse_ptr* tp1, traverse
                 offset = se->offset + off;
                 send_add_tlv(context, BTRFS_SEND_TLV_OFFSET, &offset, sizeof(UINT64));
 
-                send_add_tlv(context, BTRFS_SEND_TLV_DATA, NULL, length);
+                send_add_data(context, NULL, length);
                 RtlZeroMemory(&context->data[context->datalen - length], length);
 
                 send_command_finish(context, pos);
@@ -2290,7 +2562,7 @@ static NTSTATUS flush_extents(send_context* context, traverse_ptr* tp1, traverse
             UINT64 off, offset;
             UINT8* buf;
 
-            buf = ExAllocatePoolWithTag(NonPagedPool, MAX_SEND_WRITE + (2 * context->Vcb->superblock.sector_size), ALLOC_TAG);
+            buf = ExAllocatePoolWithTag(NonPagedPool, context->max_write + (2 * context->Vcb->superblock.sector_size), ALLOC_TAG);
             if (!buf) {
                 ERR("out of memory\n");
                 ExFreePool(se);
@@ -2298,8 +2570,8 @@ static NTSTATUS flush_extents(send_context* context, traverse_ptr* tp1, traverse
                 return STATUS_INSUFFICIENT_RESOURCES;
             }
 
-            for (off = ed2->offset; off < ed2->offset + ed2->num_bytes; off += MAX_SEND_WRITE) {
-                UINT16 length = (UINT16)min(ed2->offset + ed2->num_bytes - off, MAX_SEND_WRITE);
+            for (off = ed2->offset; off < ed2->offset + ed2->num_bytes; off += context->max_write) {
+                ULONG length = (ULONG)min(ed2->offset + ed2->num_bytes - off, context->max_write);
                 ULONG skip_start;
                 UINT64 addr = ed2->address + off;
                 UINT32* csum;
@@ -2375,13 +2647,21 @@ static NTSTATUS flush_extents(send_context* context, traverse_ptr* tp1, traverse
                 offset = se->offset + off;
                 send_add_tlv(context, BTRFS_SEND_TLV_OFFSET, &offset, sizeof(UINT64));
 
-                length = (UINT16)min(context->lastinode.size - se->offset - off, length);
-                send_add_tlv(context, BTRFS_SEND_TLV_DATA, buf + skip_start, length);
+                length = (ULONG)min(context->lastinode.size - se->offset - off, length);
+                send_add_data(context, buf + skip_start, length);
 
                 send_command_finish(context, pos);
             }
 
             ExFreePool(buf);
+        } else if (context->v2 && se->data.encryption == BTRFS_ENCRYPTION_NONE && se->data.encoding == BTRFS_ENCODING_NONE) {
+            Status = send_encoded_extent(context, se, tp1, tp2);
+            if (!NT_SUCCESS(Status)) {
+                ERR("send_encoded_extent returned %08x\n", Status);
+                ExFreePool(se);
+                if (se2) ExFreePool(se2);
+                return Status;
+            }
         } else {
             UINT8 *buf, *compbuf;
             UINT64 off;
@@ -2481,8 +2761,8 @@ static NTSTATUS flush_extents(send_context* context, traverse_ptr* tp1, traverse
 
             ExFreePool(compbuf);
 
-            for (off = ed2->offset; off < ed2->offset + ed2->num_bytes; off += MAX_SEND_WRITE) {
-                UINT16 length = (UINT16)min(ed2->offset + ed2->num_bytes - off, MAX_SEND_WRITE);
+            for (off = ed2->offset; off < ed2->offset + ed2->num_bytes; off += context->max_write) {
+                ULONG length = (ULONG)min(ed2->offset + ed2->num_bytes - off, context->max_write);
                 UINT64 offset;
 
                 if (context->datalen > SEND_BUFFER_LENGTH) {
@@ -2512,8 +2792,8 @@ static NTSTATUS flush_extents(send_context* context, traverse_ptr* tp1, traverse
                 offset = se->offset + off;
                 send_add_tlv(context, BTRFS_SEND_TLV_OFFSET, &offset, sizeof(UINT64));
 
-                length = (UINT16)min(context->lastinode.size - se->offset - off, length);
-                send_add_tlv(context, BTRFS_SEND_TLV_DATA, &buf[off], length);
+                length = (ULONG)min(context->lastinode.size - se->offset - off, length);
+                send_add_data(context, &buf[off], length);
 
                 send_command_finish(context, pos);
             }
@@ -3030,14 +3310,12 @@ static void send_thread(void* ctx) {
         do {
             traverse_ptr next_tp;
 
-            if (context->datalen > SEND_BUFFER_LENGTH) {
+            if (context->datalen > SEND_BUFFER_LENGTH && !queue_send_segment(context)) {
                 KEY key1 = tp.item->key, key2 = tp2.item->key;
 
                 ExReleaseResourceLite(&context->Vcb->tree_lock);
 
-                KeClearEvent(&context->send->cleared_event);
-                KeSetEvent(&context->buffer_event, 0, TRUE);
-                KeWaitForSingleObject(&context->send->cleared_event, Executive, KernelMode, FALSE, NULL);
+                wait_for_send_segment(context);
 
                 if (context->send->cancelling)
                     goto end;
@@ -3409,14 +3687,12 @@ static void send_thread(void* ctx) {
         do {
             traverse_ptr next_tp;
 
-            if (context->datalen > SEND_BUFFER_LENGTH) {
+            if (context->datalen > SEND_BUFFER_LENGTH && !queue_send_segment(context)) {
                 KEY key = tp.item->key;
 
                 ExReleaseResourceLite(&context->Vcb->tree_lock);
 
-                KeClearEvent(&context->send->cleared_event);
-                KeSetEvent(&context->buffer_event, 0, TRUE);
-                KeWaitForSingleObject(&context->send->cleared_event, Executive, KernelMode, FALSE, NULL);
+                wait_for_send_segment(context);
 
                 if (context->send->cancelling)
                     goto end;
@@ -3521,19 +3797,19 @@ static void send_thread(void* ctx) {
     } else
         ExReleaseResourceLite(&context->Vcb->tree_lock);
 
-    KeClearEvent(&context->send->cleared_event);
-    KeSetEvent(&context->buffer_event, 0, TRUE);
-    KeWaitForSingleObject(&context->send->cleared_event, Executive, KernelMode, FALSE, NULL);
+    flush_send_segments(context);
 
     Status = STATUS_SUCCESS;
 
 end:
-    if (!NT_SUCCESS(Status)) {
-        KeSetEvent(&context->buffer_event, 0, FALSE);
+    if (!NT_SUCCESS(Status) && context->send->ccb)
+        context->send->ccb->send_status = Status;
 
-        if (context->send->ccb)
-            context->send->ccb->send_status = Status;
-    }
+    // wake up the reader, so it can see we've finished
+    ExAcquireResourceExclusiveLite(&context->segment_lock, TRUE);
+    context->finished = TRUE;
+    KeSetEvent(&context->buffer_event, 0, FALSE);
+    ExReleaseResourceLite(&context->segment_lock);
 
     ExAcquireResourceExclusiveLite(&context->Vcb->send_load_lock, TRUE);
 
@@ -3564,7 +3840,8 @@ end:
 
     RemoveEntryList(&context->send->list_entry);
     ExFreePool(context->send);
-    ExFreePool(context->data);
+    free_send_segments(context);
+    ExDeleteResourceLite(&context->segment_lock);
 
     InterlockedDecrement(&context->Vcb->running_sends);
     InterlockedDecrement(&context->root->send_ops);
@@ -3589,7 +3866,7 @@ end:
     PsTerminateSystemThread(STATUS_SUCCESS);
 }
 
-NTSTATUS send_subvol(device_extension* Vcb, void* data, ULONG datalen, PFILE_OBJECT FileObject, PIRP Irp) {
+static NTSTATUS do_send_subvol(device_extension* Vcb, void* data, ULONG datalen, ULONG flags, PFILE_OBJECT FileObject, PIRP Irp) {
     NTSTATUS Status;
     fcb* fcb;
     ccb* ccb;
@@ -3766,19 +4043,29 @@ NTSTATUS send_subvol(device_extension* Vcb, void* data, ULONG datalen, PFILE_OBJ
     context->root_dir = NULL;
     context->num_clones = num_clones;
     context->clones = clones;
+    context->v2 = flags & BTRFS_SEND_FLAG_V2 ? TRUE : FALSE;
+    context->max_write = context->v2 ? MAX_SEND_WRITE_V2 : MAX_SEND_WRITE;
     InitializeListHead(&context->lastinode.refs);
     InitializeListHead(&context->lastinode.oldrefs);
     InitializeListHead(&context->lastinode.exts);
     InitializeListHead(&context->lastinode.oldexts);
 
-    context->data = ExAllocatePoolWithTag(PagedPool, SEND_BUFFER_LENGTH + (2 * MAX_SEND_WRITE), ALLOC_TAG); // give ourselves some wiggle room
-    if (!context->data) {
+    context->finished = FALSE;
+
+    Status = alloc_send_segments(context, max(2, Vcb->options.send_buffer_size / SEND_BUFFER_LENGTH));
+    if (!NT_SUCCESS(Status)) {
+        ERR("alloc_send_segments returned %08x\n", Status);
+        free_send_segments(context);
         ExFreePool(context);
+
+        if (clones)
+            ExFreePool(clones);
+
         ExReleaseResourceLite(&Vcb->send_load_lock);
-        return STATUS_INSUFFICIENT_RESOURCES;
+        return Status;
     }
 
-    context->datalen = 0;
+    ExInitializeResourceLite(&context->segment_lock);
 
     send_subvol_header(context, fcb->subvol, ccb->fileref); // FIXME - fileref needs some sort of lock here
 
@@ -3787,7 +4074,8 @@ NTSTATUS send_subvol(device_extension* Vcb, void* data, ULONG datalen, PFILE_OBJ
     send = ExAllocatePoolWithTag(NonPagedPool, sizeof(send_info), ALLOC_TAG);
     if (!send) {
         ERR("out of memory\n");
-        ExFreePool(context->data);
+        free_send_segments(context);
+        ExDeleteResourceLite(&context->segment_lock);
         ExFreePool(context);
 
         if (clones)
@@ -3816,7 +4104,8 @@ NTSTATUS send_subvol(device_extension* Vcb, void* data, ULONG datalen, PFILE_OBJ
         ccb->send = NULL;
         InterlockedDecrement(&Vcb->running_sends);
         ExFreePool(send);
-        ExFreePool(context->data);
+        free_send_segments(context);
+        ExDeleteResourceLite(&context->segment_lock);
         ExFreePool(context);
 
         if (clones)
@@ -3832,9 +4121,31 @@ NTSTATUS send_subvol(device_extension* Vcb, void* data, ULONG datalen, PFILE_OBJ
     return STATUS_SUCCESS;
 }
 
+NTSTATUS send_subvol(device_extension* Vcb, void* data, ULONG datalen, PFILE_OBJECT FileObject, PIRP Irp) {
+    return do_send_subvol(Vcb, data, datalen, 0, FileObject, Irp);
+}
+
+// Same as FSCTL_BTRFS_SEND_SUBVOL, but with flags in front of the original structure
+NTSTATUS send_subvol2(device_extension* Vcb, void* data, ULONG datalen, PFILE_OBJECT FileObject, PIRP Irp) {
+    ULONG off;
+
+#if defined(_WIN64)
+    if (IoIs32bitProcess(Irp))
+        off = offsetof(btrfs_send_subvol2_32, bss);
+    else
+#endif
+        off = offsetof(btrfs_send_subvol2, bss);
+
+    if (!data || datalen < off)
+        return STATUS_INVALID_PARAMETER;
+
+    return do_send_subvol(Vcb, (UINT8*)data + off, datalen - off, *(ULONG*)data, FileObject, Irp);
+}
+
 NTSTATUS read_send_buffer(device_extension* Vcb, PFILE_OBJECT FileObject, void* data, ULONG datalen, ULONG_PTR* retlen, KPROCESSOR_MODE processor_mode) {
     ccb* ccb;
     send_context* context;
+    NTSTATUS Status = STATUS_SUCCESS;
 
     ccb = FileObject ? FileObject->FsContext2 : NULL;
     if (!ccb)
@@ -3859,21 +4170,37 @@ NTSTATUS read_send_buffer(device_extension* Vcb, PFILE_OBJECT FileObject, void*
         return STATUS_SUCCESS;
     }
 
-    RtlCopyMemory(data, context->data, min(datalen, context->datalen));
+    *retlen = 0;
 
-    if (datalen < context->datalen) { // not empty yet
-        *retlen = datalen;
-        RtlMoveMemory(context->data, &context->data[datalen], context->datalen - datalen);
-        context->datalen -= datalen;
-        ExReleaseResourceLite(&Vcb->send_load_lock);
-    } else {
-        *retlen = context->datalen;
-        context->datalen = 0;
-        ExReleaseResourceLite(&Vcb->send_load_lock);
+    ExAcquireResourceExclusiveLite(&context->segment_lock, TRUE);
+
+    // copy straight out of the queued segments, rather than moving what's left to the front
+    while (*retlen < datalen && !IsListEmpty(&context->full_segments)) {
+        send_segment* seg = CONTAINING_RECORD(context->full_segments.Flink, send_segment, list_entry);
+        ULONG len = min(datalen - (ULONG)*retlen, seg->datalen - seg->readpos);
+
+        RtlCopyMemory((UINT8*)data + *retlen, seg->data + seg->readpos, len);
 
-        KeClearEvent(&context->buffer_event);
-        KeSetEvent(&ccb->send->cleared_event, 0, FALSE);
+        seg->readpos += len;
+        *retlen += len;
+
+        if (seg->readpos == seg->datalen) {
+            RemoveEntryList(&seg->list_entry);
+            InsertTailList(&context->free_segments, &seg->list_entry);
+            KeSetEvent(&ccb->send->cleared_event, 0, FALSE);
+        }
     }
 
-    return STATUS_SUCCESS;
+    if (IsListEmpty(&context->full_segments)) {
+        if (context->finished) {
+            if (*retlen == 0)
+                Status = NT_SUCCESS(ccb->send_status) ? STATUS_END_OF_FILE : ccb->send_status;
+        } else
+            KeClearEvent(&context->buffer_event);
+    }
+
+    ExReleaseResourceLite(&context->segment_lock);
+    ExReleaseResourceLite(&Vcb->send_load_lock);
+
+    return Status;
 }
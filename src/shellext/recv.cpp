@@ -38,6 +38,9 @@ const string EA_REPARSE = "user.reparse";
 const string EA_EA = "user.EA";
 const string XATTR_USER = "user.";
 
+#define RECV_READ_SIZE 0x400000 // 4 MB
+#define RECV_WRITE_SIZE 0x100000 // 1 MB
+
 bool have_sse42 = false;
 
 static const uint32_t crctable[] = {
@@ -149,6 +152,16 @@ bool BtrfsRecv::find_tlv(uint8_t* data, ULONG datalen, uint16_t type, void** val
         btrfs_send_tlv* tlv = (btrfs_send_tlv*)(data + off);
         uint8_t* payload = data + off + sizeof(btrfs_send_tlv);
 
+        // in v2 streams the data attribute has no length, and runs to the end of the command
+        if (stream_version >= 2 && off + sizeof(uint16_t) <= datalen && tlv->type == BTRFS_SEND_TLV_DATA) {
+            if (type != BTRFS_SEND_TLV_DATA)
+                return false;
+
+            *value = data + off + sizeof(uint16_t);
+            *len = datalen - off - sizeof(uint16_t);
+            return true;
+        }
+
         if (off + sizeof(btrfs_send_tlv) + tlv->length > datalen) // file is truncated
             return false;
 
@@ -816,13 +829,129 @@ void BtrfsRecv::cmd_removexattr(HWND hwnd, btrfs_send_command* cmd, uint8_t* dat
     }
 }
 
+HANDLE BtrfsRecv::open_write_file(const wstring& pathu) {
+    HANDLE h;
+
+    if (lastwritepath != pathu) {
+        FILE_BASIC_INFO fbi;
+
+        close_write_file();
+
+        lastwriteatt = GetFileAttributesW((subvolpath + pathu).c_str());
+        if (lastwriteatt == INVALID_FILE_ATTRIBUTES)
+            throw string_error(IDS_RECV_GETFILEATTRIBUTES_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+
+        if (lastwriteatt & FILE_ATTRIBUTE_READONLY) {
+            if (!SetFileAttributesW((subvolpath + pathu).c_str(), lastwriteatt & ~FILE_ATTRIBUTE_READONLY))
+                throw string_error(IDS_RECV_SETFILEATTRIBUTES_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+        }
+
+        h = CreateFileW((subvolpath + pathu).c_str(), FILE_WRITE_DATA | FILE_WRITE_ATTRIBUTES, 0, nullptr, OPEN_EXISTING,
+                        FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_POSIX_SEMANTICS | FILE_FLAG_OVERLAPPED, nullptr);
+        if (h == INVALID_HANDLE_VALUE)
+            throw string_error(IDS_RECV_CANT_OPEN_FILE, funcname, pathu.c_str(), GetLastError(), format_message(GetLastError()).c_str());
+
+        lastwritepath = pathu;
+        lastwritefile = h;
+
+        memset(&fbi, 0, sizeof(FILE_BASIC_INFO));
+
+        fbi.LastWriteTime.QuadPart = -1;
+
+        if (!SetFileInformationByHandle(h, FileBasicInfo, &fbi, sizeof(FILE_BASIC_INFO)))
+            throw string_error(IDS_RECV_SETFILEINFO_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+    }
+
+    return lastwritefile;
+}
+
+void BtrfsRecv::wait_write(unsigned int i) {
+    DWORD bytes;
+
+    if (!writepending[i])
+        return;
+
+    writepending[i] = false;
+
+    if (!GetOverlappedResult(lastwritefile, &writeol[i], &bytes, true))
+        throw string_error(IDS_RECV_WRITEFILE_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+}
+
+void BtrfsRecv::flush_write() {
+    unsigned int i = writecur;
+
+    if (writelen == 0)
+        return;
+
+    memset(&writeol[i], 0, sizeof(OVERLAPPED));
+    writeol[i].Offset = (DWORD)(writeoff & 0xffffffff);
+    writeol[i].OffsetHigh = (DWORD)(writeoff >> 32);
+    writeol[i].hEvent = writeevent[i];
+
+    if (!WriteFile(lastwritefile, writebuf[i].data(), writelen, nullptr, &writeol[i])) {
+        if (GetLastError() != ERROR_IO_PENDING)
+            throw string_error(IDS_RECV_WRITEFILE_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+    }
+
+    writepending[i] = true;
+    writelen = 0;
+
+    // carry on filling the other buffer while this one is being written
+
+    writecur = i ^ 1;
+    wait_write(writecur);
+}
+
+void BtrfsRecv::close_write_file() {
+    if (lastwritefile == INVALID_HANDLE_VALUE)
+        return;
+
+    flush_write();
+    wait_write(0);
+    wait_write(1);
+
+    if (lastwriteatt & FILE_ATTRIBUTE_READONLY) {
+        if (!SetFileAttributesW((subvolpath + lastwritepath).c_str(), lastwriteatt))
+            throw string_error(IDS_RECV_SETFILEATTRIBUTES_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+    }
+
+    CloseHandle(lastwritefile);
+
+    lastwritefile = INVALID_HANDLE_VALUE;
+    lastwritepath = L"";
+    lastwriteatt = 0;
+}
+
+void BtrfsRecv::abort_write_file() {
+    if (lastwritefile == INVALID_HANDLE_VALUE)
+        return;
+
+    // the buffers must not be freed while the kernel still has them
+
+    CancelIo(lastwritefile);
+
+    for (unsigned int i = 0; i < 2; i++) {
+        if (writepending[i]) {
+            DWORD bytes;
+
+            GetOverlappedResult(lastwritefile, &writeol[i], &bytes, true);
+            writepending[i] = false;
+        }
+    }
+
+    CloseHandle(lastwritefile);
+
+    lastwritefile = INVALID_HANDLE_VALUE;
+    lastwritepath = L"";
+    lastwriteatt = 0;
+    writelen = 0;
+}
+
 void BtrfsRecv::cmd_write(HWND hwnd, btrfs_send_command* cmd, uint8_t* data) {
     uint64_t* offset;
     uint8_t* writedata;
     ULONG offsetlen, datalen;
     wstring pathu;
-    HANDLE h;
-    LARGE_INTEGER offli;
 
     {
         char* path;
@@ -843,49 +972,119 @@ void BtrfsRecv::cmd_write(HWND hwnd, btrfs_send_command* cmd, uint8_t* data) {
     if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_DATA, (void**)&writedata, &datalen))
         throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"data");
 
-    if (lastwritepath != pathu) {
-        FILE_BASIC_INFO fbi;
+    open_write_file(pathu);
 
-        if (lastwriteatt & FILE_ATTRIBUTE_READONLY) {
-            if (!SetFileAttributesW((subvolpath + lastwritepath).c_str(), lastwriteatt))
-                throw string_error(IDS_RECV_SETFILEATTRIBUTES_FAILED, GetLastError(), format_message(GetLastError()).c_str());
-        }
+    // Consecutive writes to the same file are merged into one buffer, which is only
+    // written out when the next write isn't contiguous with it or the buffer is full.
 
-        CloseHandle(lastwritefile);
+    if (writelen > 0 && (*offset != writeoff + writelen || writelen + datalen > RECV_WRITE_SIZE))
+        flush_write();
 
-        lastwriteatt = GetFileAttributesW((subvolpath + pathu).c_str());
-        if (lastwriteatt == INVALID_FILE_ATTRIBUTES)
-            throw string_error(IDS_RECV_GETFILEATTRIBUTES_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+    if (writelen == 0)
+        writeoff = *offset;
 
-        if (lastwriteatt & FILE_ATTRIBUTE_READONLY) {
-            if (!SetFileAttributesW((subvolpath + pathu).c_str(), lastwriteatt & ~FILE_ATTRIBUTE_READONLY))
-                throw string_error(IDS_RECV_SETFILEATTRIBUTES_FAILED, GetLastError(), format_message(GetLastError()).c_str());
-        }
+    if (writebuf[writecur].size() < writelen + datalen)
+        writebuf[writecur].resize(max((ULONG)RECV_WRITE_SIZE, writelen + datalen));
 
-        h = CreateFileW((subvolpath + pathu).c_str(), FILE_WRITE_DATA | FILE_WRITE_ATTRIBUTES, 0, nullptr, OPEN_EXISTING,
-                        FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_POSIX_SEMANTICS, nullptr);
-        if (h == INVALID_HANDLE_VALUE)
-            throw string_error(IDS_RECV_CANT_OPEN_FILE, funcname, pathu.c_str(), GetLastError(), format_message(GetLastError()).c_str());
+    memcpy(writebuf[writecur].data() + writelen, writedata, datalen);
+    writelen += datalen;
+}
 
-        lastwritepath = pathu;
-        lastwritefile = h;
+void BtrfsRecv::cmd_encoded_write(HWND hwnd, btrfs_send_command* cmd, uint8_t* data) {
+    uint64_t *offset, *unencoded_file_len, *unencoded_len, *unencoded_offset;
+    uint32_t* compression;
+    uint8_t* writedata;
+    ULONG offsetlen, unencodedfilelenlen, unencodedlenlen, unencodedoffsetlen, compressionlen, datalen, bwelen;
+    wstring pathu;
+    HANDLE h;
+    btrfs_write_encoded* bwe;
+    NTSTATUS Status;
+    IO_STATUS_BLOCK iosb;
 
-        memset(&fbi, 0, sizeof(FILE_BASIC_INFO));
+    {
+        char* path;
+        ULONG pathlen;
 
-        fbi.LastWriteTime.QuadPart = -1;
+        if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_PATH, (void**)&path, &pathlen))
+            throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"path");
 
-        if (!SetFileInformationByHandle(h, FileBasicInfo, &fbi, sizeof(FILE_BASIC_INFO)))
-            throw string_error(IDS_RECV_SETFILEINFO_FAILED, GetLastError(), format_message(GetLastError()).c_str());
-    } else
-        h = lastwritefile;
+        utf8_to_utf16(string(path, pathlen), pathu);
+    }
+
+    if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_OFFSET, (void**)&offset, &offsetlen))
+        throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"offset");
 
-    offli.QuadPart = *offset;
+    if (offsetlen < sizeof(uint64_t))
+        throw string_error(IDS_RECV_SHORT_PARAM, funcname, L"offset", offsetlen, sizeof(uint64_t));
 
-    if (SetFilePointer(h, offli.LowPart, &offli.HighPart, FILE_BEGIN) == INVALID_SET_FILE_POINTER)
-        throw string_error(IDS_RECV_SETFILEPOINTER_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+    if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_UNENCODED_FILE_LEN, (void**)&unencoded_file_len, &unencodedfilelenlen))
+        throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"unencoded_file_len");
 
-    if (!WriteFile(h, writedata, datalen, nullptr, nullptr))
-        throw string_error(IDS_RECV_WRITEFILE_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+    if (unencodedfilelenlen < sizeof(uint64_t))
+        throw string_error(IDS_RECV_SHORT_PARAM, funcname, L"unencoded_file_len", unencodedfilelenlen, sizeof(uint64_t));
+
+    if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_UNENCODED_LEN, (void**)&unencoded_len, &unencodedlenlen))
+        throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"unencoded_len");
+
+    if (unencodedlenlen < sizeof(uint64_t))
+        throw string_error(IDS_RECV_SHORT_PARAM, funcname, L"unencoded_len", unencodedlenlen, sizeof(uint64_t));
+
+    if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_UNENCODED_OFFSET, (void**)&unencoded_offset, &unencodedoffsetlen))
+        throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"unencoded_offset");
+
+    if (unencodedoffsetlen < sizeof(uint64_t))
+        throw string_error(IDS_RECV_SHORT_PARAM, funcname, L"unencoded_offset", unencodedoffsetlen, sizeof(uint64_t));
+
+    if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_COMPRESSION, (void**)&compression, &compressionlen))
+        throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"compression");
+
+    if (compressionlen < sizeof(uint32_t))
+        throw string_error(IDS_RECV_SHORT_PARAM, funcname, L"compression", compressionlen, sizeof(uint32_t));
+
+    if (!find_tlv(data, cmd->length, BTRFS_SEND_TLV_DATA, (void**)&writedata, &datalen))
+        throw string_error(IDS_RECV_MISSING_PARAM, funcname, L"data");
+
+    h = open_write_file(pathu);
+
+    flush_write();
+    wait_write(0);
+    wait_write(1);
+
+    bwelen = offsetof(btrfs_write_encoded, data[0]) + datalen;
+    bwe = (btrfs_write_encoded*)malloc(bwelen);
+    if (!bwe)
+        throw string_error(IDS_OUT_OF_MEMORY);
+
+    bwe->offset = *offset;
+    bwe->unencoded_file_len = *unencoded_file_len;
+    bwe->unencoded_len = *unencoded_len;
+    bwe->unencoded_offset = *unencoded_offset;
+    bwe->datalen = datalen;
+    memcpy(bwe->data, writedata, datalen);
+
+    // The LZO types differ in the sector size the data was split into - we only accept 4 KB, the usual sector size.
+    if (*compression == BTRFS_SEND_COMPRESSION_ZLIB)
+        bwe->compression = BTRFS_COMPRESSION_ZLIB;
+    else if (*compression == BTRFS_SEND_COMPRESSION_ZSTD)
+        bwe->compression = BTRFS_COMPRESSION_ZSTD;
+    else if (*compression == BTRFS_SEND_COMPRESSION_LZO_4K)
+        bwe->compression = BTRFS_COMPRESSION_LZO;
+    else {
+        free(bwe);
+        throw string_error(IDS_RECV_UNSUPPORTED_COMPRESSION, funcname, *compression);
+    }
+
+    Status = NtFsControlFile(h, writeevent[0], nullptr, nullptr, &iosb, FSCTL_BTRFS_WRITE_ENCODED, bwe, bwelen, nullptr, 0);
+
+    if (Status == (NTSTATUS)STATUS_PENDING) {
+        WaitForSingleObject(writeevent[0], INFINITE);
+        Status = iosb.Status;
+    }
+
+    free(bwe);
+
+    if (!NT_SUCCESS(Status))
+        throw string_error(IDS_RECV_WRITE_ENCODED_FAILED, Status, format_ntstatus(Status).c_str());
 }
 
 void BtrfsRecv::cmd_clone(HWND hwnd, btrfs_send_command* cmd, uint8_t* data) {
@@ -1254,27 +1453,164 @@ static bool check_csum(btrfs_send_command* cmd, uint8_t* data) {
     return calc == crc32 ? true : false;
 }
 
-void BtrfsRecv::do_recv(const win_handle& f, uint64_t* pos, uint64_t size, const win_handle& parent) {
+recv_stream::recv_stream(HANDLE f, uint64_t size) : f(f), size(size) {
+    readoff = 0;
+    cur = 1;
+    bufoff = buflen = 0;
+    pending[0] = pending[1] = false;
+
+    for (unsigned int i = 0; i < 2; i++) {
+        event[i] = CreateEventW(nullptr, true, false, nullptr);
+        if (!event[i])
+            throw last_error(GetLastError());
+
+        buf[i].resize(RECV_READ_SIZE);
+    }
+
+    start_read(0);
+}
+
+recv_stream::~recv_stream() {
+    if (!pending[0] && !pending[1])
+        return;
+
+    CancelIo(f);
+
+    for (unsigned int i = 0; i < 2; i++) {
+        if (pending[i]) {
+            DWORD bytes;
+
+            GetOverlappedResult(f, &ol[i], &bytes, true);
+        }
+    }
+}
+
+void recv_stream::start_read(unsigned int i) {
+    ULONG len;
+
+    if (readoff >= size)
+        return;
+
+    len = (ULONG)min((uint64_t)RECV_READ_SIZE, size - readoff);
+
+    memset(&ol[i], 0, sizeof(OVERLAPPED));
+    ol[i].Offset = (DWORD)(readoff & 0xffffffff);
+    ol[i].OffsetHigh = (DWORD)(readoff >> 32);
+    ol[i].hEvent = event[i];
+
+    if (!ReadFile(f, buf[i].data(), len, nullptr, &ol[i])) {
+        if (GetLastError() != ERROR_IO_PENDING)
+            throw string_error(IDS_RECV_READFILE_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+    }
+
+    pending[i] = true;
+    readoff += len;
+}
+
+bool recv_stream::next_buffer() {
+    unsigned int next = cur ^ 1;
+    DWORD bytes;
+
+    if (!pending[next])
+        return false;
+
+    pending[next] = false;
+
+    if (!GetOverlappedResult(f, &ol[next], &bytes, true)) {
+        if (GetLastError() == ERROR_HANDLE_EOF)
+            return false;
+
+        throw string_error(IDS_RECV_READFILE_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+    }
+
+    if (bytes == 0)
+        return false;
+
+    // the buffer we've just finished with starts reading ahead while this one is parsed
+
+    start_read(cur);
+
+    cur = next;
+    bufoff = 0;
+    buflen = bytes;
+
+    return true;
+}
+
+bool recv_stream::read(void* data, ULONG len) {
+    ULONG done = 0;
+
+    while (done < len) {
+        ULONG copy;
+
+        if (bufoff == buflen) {
+            if (!next_buffer()) {
+                if (done == 0)
+                    return false;
+
+                throw string_error(IDS_RECV_FILE_TRUNCATED);
+            }
+        }
+
+        copy = min(len - done, buflen - bufoff);
+
+        memcpy((uint8_t*)data + done, buf[cur].data() + bufoff, copy);
+
+        bufoff += copy;
+        done += copy;
+    }
+
+    return true;
+}
+
+// Returns a pointer to the next len bytes of the stream, which stays valid until the next call
+// to read or get. This points straight into the read buffer unless the data straddles two reads,
+// in which case it gets copied into the arena, which is reused for the next command.
+uint8_t* recv_stream::get(ULONG len) {
+    if (bufoff == buflen && !next_buffer())
+        throw string_error(IDS_RECV_FILE_TRUNCATED);
+
+    if (buflen - bufoff >= len) {
+        uint8_t* ret = buf[cur].data() + bufoff;
+
+        bufoff += len;
+
+        return ret;
+    }
+
+    if (arena.size() < len)
+        arena.resize(len);
+
+    if (!read(arena.data(), len))
+        throw string_error(IDS_RECV_FILE_TRUNCATED);
+
+    return arena.data();
+}
+
+void BtrfsRecv::do_recv(recv_stream& stream, uint64_t* pos, uint64_t size, const win_handle& parent) {
     try {
         btrfs_send_header header;
         bool ended = false;
 
-        if (!ReadFile(f, &header, sizeof(btrfs_send_header), nullptr, nullptr))
-            throw string_error(IDS_RECV_READFILE_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+        if (!stream.read(&header, sizeof(btrfs_send_header)))
+            throw string_error(IDS_RECV_FILE_TRUNCATED);
 
         *pos += sizeof(btrfs_send_header);
 
         if (memcmp(header.magic, BTRFS_SEND_MAGIC, sizeof(header.magic)))
             throw string_error(IDS_RECV_NOT_A_SEND_STREAM);
 
-        if (header.version > 1)
+        if (header.version > 2)
             throw string_error(IDS_RECV_UNSUPPORTED_VERSION, header.version);
 
+        stream_version = header.version;
+
         SendMessageW(GetDlgItem(hwnd, IDC_RECV_PROGRESS), PBM_SETRANGE32, 0, (LPARAM)65536);
 
         lastwritefile = INVALID_HANDLE_VALUE;
         lastwritepath = L"";
         lastwriteatt = 0;
+        writelen = 0;
 
         while (true) {
             btrfs_send_command cmd;
@@ -1287,12 +1623,8 @@ void BtrfsRecv::do_recv(const win_handle& f, uint64_t* pos, uint64_t size, const
             progress = (ULONG)((float)*pos * 65536.0f / (float)size);
             SendMessageW(GetDlgItem(hwnd, IDC_RECV_PROGRESS), PBM_SETPOS, progress, 0);
 
-            if (!ReadFile(f, &cmd, sizeof(btrfs_send_command), nullptr, nullptr)) {
-                if (GetLastError() != ERROR_HANDLE_EOF)
-                    throw string_error(IDS_RECV_READFILE_FAILED, GetLastError(), format_message(GetLastError()).c_str());
-
+            if (!stream.read(&cmd, sizeof(btrfs_send_command)))
                 break;
-            }
 
             *pos += sizeof(btrfs_send_command);
 
@@ -1300,130 +1632,103 @@ void BtrfsRecv::do_recv(const win_handle& f, uint64_t* pos, uint64_t size, const
                 if (*pos + cmd.length > size)
                     throw string_error(IDS_RECV_FILE_TRUNCATED);
 
-                data = (uint8_t*)malloc(cmd.length);
-                if (!data)
-                    throw string_error(IDS_OUT_OF_MEMORY);
+                data = stream.get(cmd.length);
+
+                *pos += cmd.length;
             }
 
-            try {
-                if (data) {
-                    if (!ReadFile(f, data, cmd.length, nullptr, nullptr))
-                        throw string_error(IDS_RECV_READFILE_FAILED, GetLastError(), format_message(GetLastError()).c_str());
+            if (!check_csum(&cmd, data))
+                throw string_error(IDS_RECV_CSUM_ERROR);
 
-                    *pos += cmd.length;
-                }
+            if (cmd.cmd == BTRFS_SEND_CMD_END) {
+                ended = true;
+                break;
+            }
 
-                if (!check_csum(&cmd, data))
-                    throw string_error(IDS_RECV_CSUM_ERROR);
+            if (cmd.cmd != BTRFS_SEND_CMD_WRITE && cmd.cmd != BTRFS_SEND_CMD_ENCODED_WRITE)
+                close_write_file();
 
-                if (cmd.cmd == BTRFS_SEND_CMD_END) {
-                    ended = true;
-                    break;
-                }
+            switch (cmd.cmd) {
+                case BTRFS_SEND_CMD_SUBVOL:
+                    cmd_subvol(hwnd, &cmd, data, parent);
+                break;
 
-                if (lastwritefile != INVALID_HANDLE_VALUE && cmd.cmd != BTRFS_SEND_CMD_WRITE) {
-                    if (lastwriteatt & FILE_ATTRIBUTE_READONLY) {
-                        if (!SetFileAttributesW((subvolpath + lastwritepath).c_str(), lastwriteatt))
-                            throw string_error(IDS_RECV_SETFILEATTRIBUTES_FAILED, GetLastError(), format_message(GetLastError()).c_str());
-                    }
+                case BTRFS_SEND_CMD_SNAPSHOT:
+                    cmd_snapshot(hwnd, &cmd, data, parent);
+                break;
 
-                    CloseHandle(lastwritefile);
-
-                    lastwritefile = INVALID_HANDLE_VALUE;
-                    lastwritepath = L"";
-                    lastwriteatt = 0;
-                }
-
-                switch (cmd.cmd) {
-                    case BTRFS_SEND_CMD_SUBVOL:
-                        cmd_subvol(hwnd, &cmd, data, parent);
-                    break;
-
-                    case BTRFS_SEND_CMD_SNAPSHOT:
-                        cmd_snapshot(hwnd, &cmd, data, parent);
-                    break;
-
-                    case BTRFS_SEND_CMD_MKFILE:
-                    case BTRFS_SEND_CMD_MKDIR:
-                    case BTRFS_SEND_CMD_MKNOD:
-                    case BTRFS_SEND_CMD_MKFIFO:
-                    case BTRFS_SEND_CMD_MKSOCK:
-                    case BTRFS_SEND_CMD_SYMLINK:
-                        cmd_mkfile(hwnd, &cmd, data);
-                    break;
-
-                    case BTRFS_SEND_CMD_RENAME:
-                        cmd_rename(hwnd, &cmd, data);
-                    break;
-
-                    case BTRFS_SEND_CMD_LINK:
-                        cmd_link(hwnd, &cmd, data);
-                    break;
-
-                    case BTRFS_SEND_CMD_UNLINK:
-                        cmd_unlink(hwnd, &cmd, data);
-                    break;
-
-                    case BTRFS_SEND_CMD_RMDIR:
-                        cmd_rmdir(hwnd, &cmd, data);
-                    break;
-
-                    case BTRFS_SEND_CMD_SET_XATTR:
-                        cmd_setxattr(hwnd, &cmd, data);
-                    break;
-
-                    case BTRFS_SEND_CMD_REMOVE_XATTR:
-                        cmd_removexattr(hwnd, &cmd, data);
-                    break;
-
-                    case BTRFS_SEND_CMD_WRITE:
-                        cmd_write(hwnd, &cmd, data);
-                    break;
-
-                    case BTRFS_SEND_CMD_CLONE:
-                        cmd_clone(hwnd, &cmd, data);
-                    break;
-
-                    case BTRFS_SEND_CMD_TRUNCATE:
-                        cmd_truncate(hwnd, &cmd, data);
-                    break;
-
-                    case BTRFS_SEND_CMD_CHMOD:
-                        cmd_chmod(hwnd, &cmd, data);
-                    break;
-
-                    case BTRFS_SEND_CMD_CHOWN:
-                        cmd_chown(hwnd, &cmd, data);
-                    break;
-
-                    case BTRFS_SEND_CMD_UTIMES:
-                        cmd_utimes(hwnd, &cmd, data);
-                    break;
-
-                    case BTRFS_SEND_CMD_UPDATE_EXTENT:
-                        // does nothing
-                    break;
-
-                    default:
-                        throw string_error(IDS_RECV_UNKNOWN_COMMAND, cmd.cmd);
-                }
-            } catch (...) {
-                if (data) free(data);
-                throw;
-            }
+                case BTRFS_SEND_CMD_MKFILE:
+                case BTRFS_SEND_CMD_MKDIR:
+                case BTRFS_SEND_CMD_MKNOD:
+                case BTRFS_SEND_CMD_MKFIFO:
+                case BTRFS_SEND_CMD_MKSOCK:
+                case BTRFS_SEND_CMD_SYMLINK:
+                    cmd_mkfile(hwnd, &cmd, data);
+                break;
 
-            if (data) free(data);
-        }
+                case BTRFS_SEND_CMD_RENAME:
+                    cmd_rename(hwnd, &cmd, data);
+                break;
 
-        if (lastwritefile != INVALID_HANDLE_VALUE) {
-            if (lastwriteatt & FILE_ATTRIBUTE_READONLY) {
-                if (!SetFileAttributesW((subvolpath + lastwritepath).c_str(), lastwriteatt))
-                    throw string_error(IDS_RECV_SETFILEATTRIBUTES_FAILED, GetLastError(), format_message(GetLastError()).c_str());
-            }
+                case BTRFS_SEND_CMD_LINK:
+                    cmd_link(hwnd, &cmd, data);
+                break;
+
+                case BTRFS_SEND_CMD_UNLINK:
+                    cmd_unlink(hwnd, &cmd, data);
+                break;
+
+                case BTRFS_SEND_CMD_RMDIR:
+                    cmd_rmdir(hwnd, &cmd, data);
+                break;
+
+                case BTRFS_SEND_CMD_SET_XATTR:
+                    cmd_setxattr(hwnd, &cmd, data);
+                break;
+
+                case BTRFS_SEND_CMD_REMOVE_XATTR:
+                    cmd_removexattr(hwnd, &cmd, data);
+                break;
+
+                case BTRFS_SEND_CMD_WRITE:
+                    cmd_write(hwnd, &cmd, data);
+                break;
+
+                case BTRFS_SEND_CMD_ENCODED_WRITE:
+                    cmd_encoded_write(hwnd, &cmd, data);
+                break;
+
+                case BTRFS_SEND_CMD_CLONE:
+                    cmd_clone(hwnd, &cmd, data);
+                break;
+
+                case BTRFS_SEND_CMD_TRUNCATE:
+                    cmd_truncate(hwnd, &cmd, data);
+                break;
 
-            CloseHandle(lastwritefile);
+                case BTRFS_SEND_CMD_CHMOD:
+                    cmd_chmod(hwnd, &cmd, data);
+                break;
+
+                case BTRFS_SEND_CMD_CHOWN:
+                    cmd_chown(hwnd, &cmd, data);
+                break;
+
+                case BTRFS_SEND_CMD_UTIMES:
+                    cmd_utimes(hwnd, &cmd, data);
+                break;
+
+                case BTRFS_SEND_CMD_UPDATE_EXTENT:
+                    // does nothing
+                break;
+
+                default:
+                    throw string_error(IDS_RECV_UNKNOWN_COMMAND, cmd.cmd);
+            }
         }
 
+        close_write_file();
+
         if (!ended && !cancelling)
             throw string_error(IDS_RECV_FILE_TRUNCATED);
 
@@ -1446,6 +1751,8 @@ void BtrfsRecv::do_recv(const win_handle& f, uint64_t* pos, uint64_t size, const
         if (master != INVALID_HANDLE_VALUE)
             CloseHandle(master);
     } catch (...) {
+        abort_write_file();
+
         if (subvolpath != L"") {
             ULONG attrib;
 
@@ -1468,21 +1775,31 @@ DWORD BtrfsRecv::recv_thread() {
     running = true;
 
     try {
-        win_handle f = CreateFileW(streamfile.c_str(), GENERIC_READ, 0, nullptr, OPEN_EXISTING, 0, nullptr);
+        win_handle f = CreateFileW(streamfile.c_str(), GENERIC_READ, 0, nullptr, OPEN_EXISTING, FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
         if (f == INVALID_HANDLE_VALUE)
             throw string_error(IDS_RECV_CANT_OPEN_FILE, funcname, streamfile.c_str(), GetLastError(), format_message(GetLastError()).c_str());
 
         if (!GetFileSizeEx(f, &size))
             throw string_error(IDS_RECV_GETFILESIZEEX_FAILED, GetLastError(), format_message(GetLastError()).c_str());
 
+        win_handle ev0 = CreateEventW(nullptr, true, false, nullptr);
+        win_handle ev1 = CreateEventW(nullptr, true, false, nullptr);
+
+        if (!ev0 || !ev1)
+            throw last_error(GetLastError());
+
+        writeevent[0] = ev0;
+        writeevent[1] = ev1;
+
         {
+            recv_stream stream(f, size.QuadPart);
             win_handle parent = CreateFileW(dirpath.c_str(), FILE_ADD_SUBDIRECTORY | FILE_ADD_FILE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
                                             nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_POSIX_SEMANTICS, nullptr);
             if (parent == INVALID_HANDLE_VALUE)
                 throw string_error(IDS_RECV_CANT_OPEN_PATH, dirpath.c_str(), GetLastError(), format_message(GetLastError()).c_str());
 
             do {
-                do_recv(f, &pos, size.QuadPart, parent);
+                do_recv(stream, &pos, size.QuadPart, parent);
             } while (pos < (uint64_t)size.QuadPart);
         }
     } catch (const exception& e) {
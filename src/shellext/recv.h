@@ -28,6 +28,27 @@ typedef struct {
     wstring path;
 } subvol_cache;
 
+class recv_stream {
+public:
+    recv_stream(HANDLE f, uint64_t size);
+    ~recv_stream();
+    bool read(void* data, ULONG len);
+    uint8_t* get(ULONG len);
+
+private:
+    void start_read(unsigned int i);
+    bool next_buffer();
+
+    HANDLE f;
+    uint64_t size, readoff;
+    vector<uint8_t> buf[2], arena;
+    OVERLAPPED ol[2];
+    win_handle event[2];
+    bool pending[2];
+    unsigned int cur;
+    ULONG bufoff, buflen;
+};
+
 class BtrfsRecv {
 public:
     BtrfsRecv() {
@@ -37,8 +58,14 @@ public:
         running = false;
         cancelling = false;
         stransid = 0;
+        stream_version = 1;
         num_received = 0;
         hwnd = nullptr;
+        writecur = 0;
+        writeoff = 0;
+        writelen = 0;
+        writepending[0] = writepending[1] = false;
+        writeevent[0] = writeevent[1] = nullptr;
         cache.clear();
     }
 
@@ -61,6 +88,7 @@ private:
     void cmd_setxattr(HWND hwnd, btrfs_send_command* cmd, uint8_t* data);
     void cmd_removexattr(HWND hwnd, btrfs_send_command* cmd, uint8_t* data);
     void cmd_write(HWND hwnd, btrfs_send_command* cmd, uint8_t* data);
+    void cmd_encoded_write(HWND hwnd, btrfs_send_command* cmd, uint8_t* data);
     void cmd_clone(HWND hwnd, btrfs_send_command* cmd, uint8_t* data);
     void cmd_truncate(HWND hwnd, btrfs_send_command* cmd, uint8_t* data);
     void cmd_chmod(HWND hwnd, btrfs_send_command* cmd, uint8_t* data);
@@ -68,14 +96,27 @@ private:
     void cmd_utimes(HWND hwnd, btrfs_send_command* cmd, uint8_t* data);
     void add_cache_entry(BTRFS_UUID* uuid, uint64_t transid, const wstring& path);
     bool find_tlv(uint8_t* data, ULONG datalen, uint16_t type, void** value, ULONG* len);
-    void do_recv(const win_handle& f, uint64_t* pos, uint64_t size, const win_handle& parent);
+    HANDLE open_write_file(const wstring& pathu);
+    void flush_write();
+    void wait_write(unsigned int i);
+    void close_write_file();
+    void abort_write_file();
+    void do_recv(recv_stream& stream, uint64_t* pos, uint64_t size, const win_handle& parent);
 
     HANDLE dir, master, thread, lastwritefile;
+    HANDLE writeevent[2];
+    OVERLAPPED writeol[2];
+    vector<uint8_t> writebuf[2];
+    unsigned int writecur;
+    uint64_t writeoff;
+    ULONG writelen;
+    bool writepending[2];
     HWND hwnd;
     wstring streamfile, dirpath, subvolpath, lastwritepath;
     DWORD lastwriteatt;
     ULONG num_received;
     uint64_t stransid;
+    uint32_t stream_version;
     BTRFS_UUID subvol_uuid;
     bool running, cancelling;
     vector<subvol_cache> cache;
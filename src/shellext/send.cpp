@@ -554,10 +554,11 @@ void CALLBACK SendSubvolGUIW(HWND hwnd, HINSTANCE hinst, LPWSTR lpszCmdLine, int
     }
 }
 
-static void send_subvol(const wstring& subvol, const wstring& file, const wstring& parent, const vector<wstring>& clones) {
+static void send_subvol(const wstring& subvol, const wstring& file, const wstring& parent, const vector<wstring>& clones, bool compressed) {
     char* buf;
     win_handle dirh, stream;
     ULONG bss_size, i;
+    btrfs_send_subvol2* bss2;
     btrfs_send_subvol* bss;
     IO_STATUS_BLOCK iosb;
     NTSTATUS Status;
@@ -576,9 +577,12 @@ static void send_subvol(const wstring& subvol, const wstring& file, const wstrin
             throw last_error(GetLastError());
 
         try {
-            bss_size = offsetof(btrfs_send_subvol, clones[0]) + (clones.size() * sizeof(HANDLE));
-            bss = (btrfs_send_subvol*)malloc(bss_size);
-            memset(bss, 0, bss_size);
+            bss_size = offsetof(btrfs_send_subvol2, bss.clones[0]) + (clones.size() * sizeof(HANDLE));
+            bss2 = (btrfs_send_subvol2*)malloc(bss_size);
+            memset(bss2, 0, bss_size);
+
+            bss2->flags = compressed ? BTRFS_SEND_FLAG_V2 : 0;
+            bss = &bss2->bss;
 
             if (parent != L"") {
                 HANDLE parenth;
@@ -613,7 +617,7 @@ static void send_subvol(const wstring& subvol, const wstring& file, const wstrin
                 bss->clones[i] = h;
             }
 
-            Status = NtFsControlFile(dirh, nullptr, nullptr, nullptr, &iosb, FSCTL_BTRFS_SEND_SUBVOL, bss, bss_size, nullptr, 0);
+            Status = NtFsControlFile(dirh, nullptr, nullptr, nullptr, &iosb, FSCTL_BTRFS_SEND_SUBVOL2, bss2, bss_size, nullptr, 0);
 
             for (i = 0; i < bss->num_clones; i++) {
                 CloseHandle(bss->clones[i]);
@@ -625,7 +629,7 @@ static void send_subvol(const wstring& subvol, const wstring& file, const wstrin
                 throw ntstatus_error(Status);
 
             memcpy(header.magic, BTRFS_SEND_MAGIC, sizeof(header.magic));
-            header.version = 1;
+            header.version = compressed ? 2 : 1;
 
             if (!WriteFile(stream, &header, sizeof(header), nullptr, nullptr))
                 throw last_error(GetLastError());
@@ -669,6 +673,7 @@ void CALLBACK SendSubvolW(HWND hwnd, HINSTANCE hinst, LPWSTR lpszCmdLine, int nC
     vector<wstring> args;
     wstring subvol = L"", parent = L"", file = L"";
     vector<wstring> clones;
+    bool compressed = false;
 
     command_line_to_args(lpszCmdLine, args);
 
@@ -694,7 +699,9 @@ void CALLBACK SendSubvolW(HWND hwnd, HINSTANCE hinst, LPWSTR lpszCmdLine, int nC
         }
 
         for (unsigned int i = 0; i < args.size(); i++) {
-            if (args[i][0] == '-') {
+            if (args[i] == L"--compressed-data")
+                compressed = true;
+            else if (args[i][0] == '-') {
                 if (args[i][2] == 0 && i < args.size() - 1) {
                     if (args[i][1] == 'p') {
                         parent = args[i+1];
@@ -714,7 +721,7 @@ void CALLBACK SendSubvolW(HWND hwnd, HINSTANCE hinst, LPWSTR lpszCmdLine, int nC
 
         if (subvol != L"" && file != L"") {
             try {
-                send_subvol(subvol, file, parent, clones);
+                send_subvol(subvol, file, parent, clones, compressed);
             } catch (const exception& e) {
                 cerr << "Error: " << e.what() << endl;
             }
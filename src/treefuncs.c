@@ -17,6 +17,71 @@
 
 #include "btrfs_drv.h"
 
+static void insert_tree_hash(device_extension* Vcb, tree* t) {
+    UINT8 h;
+    BOOL inserted;
+    LIST_ENTRY* le;
+
+    h = t->hash >> 24;
+
+    if (!Vcb->trees_ptrs[h]) {
+        UINT8 h2 = h;
+
+        le = Vcb->trees_hash.Flink;
+
+        if (h2 > 0) {
+            h2--;
+            do {
+                if (Vcb->trees_ptrs[h2]) {
+                    le = Vcb->trees_ptrs[h2];
+                    break;
+                }
+
+                h2--;
+            } while (h2 > 0);
+        }
+    } else
+        le = Vcb->trees_ptrs[h];
+
+    inserted = FALSE;
+    while (le != &Vcb->trees_hash) {
+        tree* t2 = CONTAINING_RECORD(le, tree, list_entry_hash);
+
+        if (t2->hash >= t->hash) {
+            InsertHeadList(le->Blink, &t->list_entry_hash);
+            inserted = TRUE;
+            break;
+        }
+
+        le = le->Flink;
+    }
+
+    if (!inserted)
+        InsertTailList(&Vcb->trees_hash, &t->list_entry_hash);
+
+    if (!Vcb->trees_ptrs[h] || t->list_entry_hash.Flink == Vcb->trees_ptrs[h])
+        Vcb->trees_ptrs[h] = &t->list_entry_hash;
+}
+
+static void remove_tree_hash(device_extension* Vcb, tree* t) {
+    UINT8 h = t->hash >> 24;
+
+    if (Vcb->trees_ptrs[h] == &t->list_entry_hash) {
+        if (t->list_entry_hash.Flink != &Vcb->trees_hash) {
+            tree* t2 = CONTAINING_RECORD(t->list_entry_hash.Flink, tree, list_entry_hash);
+
+            if ((t2->hash >> 24) == h)
+                Vcb->trees_ptrs[h] = &t2->list_entry_hash;
+            else
+                Vcb->trees_ptrs[h] = NULL;
+        } else
+            Vcb->trees_ptrs[h] = NULL;
+    }
+
+    RemoveEntryList(&t->list_entry_hash);
+    t->list_entry_hash.Flink = NULL;
+}
+
 NTSTATUS load_tree(device_extension* Vcb, UINT64 addr, root* r, tree** pt, UINT64 generation, PIRP Irp) {
     UINT8* buf;
     NTSTATUS Status;
@@ -24,9 +89,7 @@ NTSTATUS load_tree(device_extension* Vcb, UINT64 addr, root* r, tree** pt, UINT6
     tree* t;
     tree_data* td;
     chunk* c;
-    UINT8 h;
-    BOOL inserted;
-    LIST_ENTRY* le;
+    ULONG max_items;
 
     buf = ExAllocatePoolWithTag(PagedPool, Vcb->superblock.node_size, ALLOC_TAG);
     if (!buf) {
@@ -43,7 +106,26 @@ NTSTATUS load_tree(device_extension* Vcb, UINT64 addr, root* r, tree** pt, UINT6
 
     th = (tree_header*)buf;
 
-    t = ExAllocatePoolWithTag(PagedPool, sizeof(tree), ALLOC_TAG);
+    if (th->level >= BTRFS_MAX_LEVEL) {
+        ERR("tree at %llx has invalid level %u\n", addr, th->level);
+        ExFreePool(buf);
+        return STATUS_INTERNAL_ERROR;
+    }
+
+    if (th->level == 0)
+        max_items = (Vcb->superblock.node_size - sizeof(tree_header)) / sizeof(leaf_node);
+    else
+        max_items = (Vcb->superblock.node_size - sizeof(tree_header)) / sizeof(internal_node);
+
+    if (th->num_items > max_items) {
+        ERR("tree at %llx has more items than expected (%x)\n", addr, th->num_items);
+        ExFreePool(buf);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    // The items we read from disk are allocated along with the tree itself; anything
+    // inserted later on comes from tree_data_lookaside as before.
+    t = ExAllocatePoolWithTag(PagedPool, sizeof(tree) + (th->num_items * sizeof(tree_data)), ALLOC_TAG);
     if (!t) {
         ERR("out of memory\n");
         ExFreePool(buf);
@@ -63,6 +145,12 @@ NTSTATUS load_tree(device_extension* Vcb, UINT64 addr, root* r, tree** pt, UINT6
     t->updated_extents = FALSE;
     t->write = FALSE;
     t->uniqueness_determined = FALSE;
+    t->referenced = TRUE;
+    t->index = NULL;
+    t->index_size = 0;
+    t->index_valid = FALSE;
+    t->slab = (tree_data*)((UINT8*)t + sizeof(tree));
+    t->slab_len = t->header.num_items;
 
     InitializeListHead(&t->itemlist);
 
@@ -70,21 +158,8 @@ NTSTATUS load_tree(device_extension* Vcb, UINT64 addr, root* r, tree** pt, UINT6
         leaf_node* ln = (leaf_node*)(buf + sizeof(tree_header));
         unsigned int i;
 
-        if ((t->header.num_items * sizeof(leaf_node)) + sizeof(tree_header) > Vcb->superblock.node_size) {
-            ERR("tree at %llx has more items than expected (%x)\n", t->header.num_items);
-            ExFreePool(t);
-            ExFreePool(buf);
-            return STATUS_INSUFFICIENT_RESOURCES;
-        }
-
         for (i = 0; i < t->header.num_items; i++) {
-            td = ExAllocateFromPagedLookasideList(&Vcb->tree_data_lookaside);
-            if (!td) {
-                ERR("out of memory\n");
-                ExFreePool(t);
-                ExFreePool(buf);
-                return STATUS_INSUFFICIENT_RESOURCES;
-            }
+            td = &t->slab[i];
 
             td->key = ln[i].key;
 
@@ -95,7 +170,6 @@ NTSTATUS load_tree(device_extension* Vcb, UINT64 addr, root* r, tree** pt, UINT6
 
             if (ln[i].size + sizeof(tree_header) + sizeof(leaf_node) > Vcb->superblock.node_size) {
                 ERR("overlarge item in tree %llx: %u > %u\n", addr, ln[i].size, Vcb->superblock.node_size - sizeof(tree_header) - sizeof(leaf_node));
-                ExFreeToPagedLookasideList(&t->Vcb->tree_data_lookaside, td);
                 ExFreePool(t);
                 ExFreePool(buf);
                 return STATUS_INTERNAL_ERROR;
@@ -104,6 +178,7 @@ NTSTATUS load_tree(device_extension* Vcb, UINT64 addr, root* r, tree** pt, UINT6
             td->size = (UINT16)ln[i].size;
             td->ignore = FALSE;
             td->inserted = FALSE;
+            td->data_alloc = FALSE;
 
             InsertTailList(&t->itemlist, &td->list_entry);
 
@@ -116,21 +191,8 @@ NTSTATUS load_tree(device_extension* Vcb, UINT64 addr, root* r, tree** pt, UINT6
         internal_node* in = (internal_node*)(buf + sizeof(tree_header));
         unsigned int i;
 
-        if ((t->header.num_items * sizeof(internal_node)) + sizeof(tree_header) > Vcb->superblock.node_size) {
-            ERR("tree at %llx has more items than expected (%x)\n", t->header.num_items);
-            ExFreePool(t);
-            ExFreePool(buf);
-            return STATUS_INSUFFICIENT_RESOURCES;
-        }
-
         for (i = 0; i < t->header.num_items; i++) {
-            td = ExAllocateFromPagedLookasideList(&Vcb->tree_data_lookaside);
-            if (!td) {
-                ERR("out of memory\n");
-                ExFreePool(t);
-                ExFreePool(buf);
-                return STATUS_INSUFFICIENT_RESOURCES;
-            }
+            td = &t->slab[i];
 
             td->key = in[i].key;
 
@@ -139,6 +201,7 @@ NTSTATUS load_tree(device_extension* Vcb, UINT64 addr, root* r, tree** pt, UINT6
             td->treeholder.tree = NULL;
             td->ignore = FALSE;
             td->inserted = FALSE;
+            td->data_alloc = FALSE;
 
             InsertTailList(&t->itemlist, &td->list_entry);
         }
@@ -150,45 +213,9 @@ NTSTATUS load_tree(device_extension* Vcb, UINT64 addr, root* r, tree** pt, UINT6
 
     InsertTailList(&Vcb->trees, &t->list_entry);
 
-    h = t->hash >> 24;
-
-    if (!Vcb->trees_ptrs[h]) {
-        UINT8 h2 = h;
-
-        le = Vcb->trees_hash.Flink;
-
-        if (h2 > 0) {
-            h2--;
-            do {
-                if (Vcb->trees_ptrs[h2]) {
-                    le = Vcb->trees_ptrs[h2];
-                    break;
-                }
-
-                h2--;
-            } while (h2 > 0);
-        }
-    } else
-        le = Vcb->trees_ptrs[h];
-
-    inserted = FALSE;
-    while (le != &Vcb->trees_hash) {
-        tree* t2 = CONTAINING_RECORD(le, tree, list_entry_hash);
-
-        if (t2->hash >= t->hash) {
-            InsertHeadList(le->Blink, &t->list_entry_hash);
-            inserted = TRUE;
-            break;
-        }
+    insert_tree_hash(Vcb, t);
 
-        le = le->Flink;
-    }
-
-    if (!inserted)
-        InsertTailList(&Vcb->trees_hash, &t->list_entry_hash);
-
-    if (!Vcb->trees_ptrs[h] || t->list_entry_hash.Flink == Vcb->trees_ptrs[h])
-        Vcb->trees_ptrs[h] = &t->list_entry_hash;
+    InterlockedIncrement64(&Vcb->tree_cache_misses);
 
     TRACE("returning %p\n", t);
 
@@ -214,33 +241,26 @@ static tree* free_tree2(tree* t) {
     while (!IsListEmpty(&t->itemlist)) {
         tree_data* td = CONTAINING_RECORD(RemoveHeadList(&t->itemlist), tree_data, list_entry);
 
-        if (t->header.level == 0 && td->data && td->inserted)
+        if (t->header.level == 0 && td->data && td->data_alloc)
             ExFreePool(td->data);
 
-        ExFreeToPagedLookasideList(&t->Vcb->tree_data_lookaside, td);
+        if (!tree_data_in_slab(t, td))
+            ExFreeToPagedLookasideList(&t->Vcb->tree_data_lookaside, td);
     }
 
     RemoveEntryList(&t->list_entry);
 
+    if (t->write)
+        RemoveEntryList(&t->list_entry_dirty);
+
     if (r)
         r->treeholder.tree = NULL;
 
-    if (t->list_entry_hash.Flink) {
-        UINT8 h = t->hash >> 24;
-        if (t->Vcb->trees_ptrs[h] == &t->list_entry_hash) {
-            if (t->list_entry_hash.Flink != &t->Vcb->trees_hash) {
-                tree* t2 = CONTAINING_RECORD(t->list_entry_hash.Flink, tree, list_entry_hash);
+    if (t->list_entry_hash.Flink)
+        remove_tree_hash(t->Vcb, t);
 
-                if ((t2->hash >> 24) == h)
-                    t->Vcb->trees_ptrs[h] = &t2->list_entry_hash;
-                else
-                    t->Vcb->trees_ptrs[h] = NULL;
-            } else
-                t->Vcb->trees_ptrs[h] = NULL;
-        }
-
-        RemoveEntryList(&t->list_entry_hash);
-    }
+    if (t->index)
+        ExFreePool(t->index);
 
     if (t->buf)
         ExFreePool(t->buf);
@@ -427,11 +447,62 @@ NTSTATUS skip_to_difference(device_extension* Vcb, traverse_ptr* tp, traverse_pt
     }
 }
 
+// Builds the sorted array of item pointers used by find_item_in_tree. We can get called
+// concurrently with only the shared tree_lock held, so we serialize on load_tree_lock.
+static void build_tree_index(tree* t) {
+    ExAcquireResourceExclusiveLite(&t->root->nonpaged->load_tree_lock, TRUE);
+
+    if (!t->index_valid) {
+        ULONG num_items = 0;
+        LIST_ENTRY* le;
+
+        le = t->itemlist.Flink;
+        while (le != &t->itemlist) {
+            num_items++;
+            le = le->Flink;
+        }
+
+        if (num_items > t->index_size) {
+            tree_data** index = ExAllocatePoolWithTag(PagedPool, num_items * sizeof(tree_data*), ALLOC_TAG);
+            if (!index) {
+                ERR("out of memory\n");
+                goto end;
+            }
+
+            if (t->index)
+                ExFreePool(t->index);
+
+            t->index = index;
+            t->index_size = num_items;
+        }
+
+        num_items = 0;
+
+        le = t->itemlist.Flink;
+        while (le != &t->itemlist) {
+            t->index[num_items] = CONTAINING_RECORD(le, tree_data, list_entry);
+            num_items++;
+            le = le->Flink;
+        }
+
+        t->index_len = num_items;
+
+        KeMemoryBarrier();
+
+        t->index_valid = TRUE;
+    }
+
+end:
+    ExReleaseResourceLite(&t->root->nonpaged->load_tree_lock);
+}
+
 static NTSTATUS find_item_in_tree(device_extension* Vcb, tree* t, traverse_ptr* tp, const KEY* searchkey, BOOL ignore, UINT8 level, PIRP Irp) {
     int cmp;
     tree_data *td, *lasttd;
     KEY key2;
 
+    t->referenced = TRUE;
+
     cmp = 1;
     td = first_item(t);
     lasttd = NULL;
@@ -440,34 +511,68 @@ static NTSTATUS find_item_in_tree(device_extension* Vcb, tree* t, traverse_ptr*
 
     key2 = *searchkey;
 
-    do {
-        cmp = keycmp(key2, td->key);
+    if (!t->index_valid)
+        build_tree_index(t);
+
+    if (t->index_valid) {
+        ULONG lo = 0, hi = t->index_len;
 
-        if (cmp == 1) {
-            lasttd = td;
-            td = next_item(t, td);
+        // find first item >= searchkey
+        while (lo < hi) {
+            ULONG mid = (lo + hi) / 2;
+
+            if (keycmp(key2, t->index[mid]->key) == 1)
+                lo = mid + 1;
+            else
+                hi = mid;
         }
 
-        if (t->header.level == 0 && cmp == 0 && !ignore && td && td->ignore) {
-            tree_data* origtd = td;
+        if (lo < t->index_len && keycmp(key2, t->index[lo]->key) == 0) {
+            td = t->index[lo];
 
-            while (td && td->ignore)
+            if (t->header.level == 0 && !ignore && td->ignore) {
+                ULONG i = lo + 1;
+
+                while (i < t->index_len && t->index[i]->ignore)
+                    i++;
+
+                if (i < t->index_len && keycmp(key2, t->index[i]->key) == 0)
+                    td = t->index[i];
+            }
+        } else if (lo > 0)
+            td = t->index[lo - 1];
+        else
+            td = t->index[0];
+    } else {
+        do {
+            cmp = keycmp(key2, td->key);
+
+            if (cmp == 1) {
+                lasttd = td;
                 td = next_item(t, td);
+            }
 
-            if (td) {
-                cmp = keycmp(key2, td->key);
+            if (t->header.level == 0 && cmp == 0 && !ignore && td && td->ignore) {
+                tree_data* origtd = td;
 
-                if (cmp != 0) {
+                while (td && td->ignore)
+                    td = next_item(t, td);
+
+                if (td) {
+                    cmp = keycmp(key2, td->key);
+
+                    if (cmp != 0) {
+                        td = origtd;
+                        cmp = 0;
+                    }
+                } else
                     td = origtd;
-                    cmp = 0;
-                }
-            } else
-                td = origtd;
-        }
-    } while (td && cmp == 1);
+            }
+        } while (td && cmp == 1);
 
-    if ((cmp == -1 || !td) && lasttd)
-        td = lasttd;
+        if ((cmp == -1 || !td) && lasttd)
+            td = lasttd;
+    }
 
     if (t->header.level == 0) {
         if (td->ignore && !ignore) {
@@ -525,7 +630,8 @@ static NTSTATUS find_item_in_tree(device_extension* Vcb, tree* t, traverse_ptr*
                 ERR("do_load_tree returned %08x\n", Status);
                 return Status;
             }
-        }
+        } else
+            InterlockedIncrement64(&Vcb->tree_cache_hits);
 
         Status = find_item_in_tree(Vcb, td->treeholder.tree, tp, searchkey, ignore, level, Irp);
 
@@ -544,7 +650,8 @@ NTSTATUS find_item(_In_ _Requires_lock_held_(_Curr_->tree_lock) device_extension
             ERR("do_load_tree returned %08x\n", Status);
             return Status;
         }
-    }
+    } else
+        InterlockedIncrement64(&Vcb->tree_cache_hits);
 
     Status = find_item_in_tree(Vcb, r->treeholder.tree, tp, searchkey, ignore, 0, Irp);
     if (!NT_SUCCESS(Status) && Status != STATUS_NOT_FOUND) {
@@ -564,7 +671,8 @@ NTSTATUS find_item_to_level(device_extension* Vcb, root* r, traverse_ptr* tp, co
             ERR("do_load_tree returned %08x\n", Status);
             return Status;
         }
-    }
+    } else
+        InterlockedIncrement64(&Vcb->tree_cache_hits);
 
     Status = find_item_in_tree(Vcb, r->treeholder.tree, tp, searchkey, ignore, level, Irp);
     if (!NT_SUCCESS(Status) && Status != STATUS_NOT_FOUND) {
@@ -737,76 +845,215 @@ BOOL find_prev_item(_Requires_lock_held_(_Curr_->tree_lock) device_extension* Vc
     return TRUE;
 }
 
+// free_tree2 clears the pointer in the parent's item, so before we free every tree we
+// detach them all from their parents first - otherwise we'd have to go through the
+// list once per level to make sure children went before their parents.
 void free_trees_root(device_extension* Vcb, root* r) {
     LIST_ENTRY* le;
+
+    le = Vcb->trees.Flink;
+    while (le != &Vcb->trees) {
+        tree* t = CONTAINING_RECORD(le, tree, list_entry);
+
+        if (t->root == r) {
+            t->parent = NULL;
+            t->paritem = NULL;
+        }
+
+        le = le->Flink;
+    }
+
+    le = Vcb->trees.Flink;
+    while (le != &Vcb->trees) {
+        LIST_ENTRY* nextle = le->Flink;
+        tree* t = CONTAINING_RECORD(le, tree, list_entry);
+
+        if (t->root == r)
+            free_tree2(t);
+
+        le = nextle;
+    }
+}
+
+void free_trees(device_extension* Vcb) {
+    LIST_ENTRY* le;
+
+    le = Vcb->trees.Flink;
+    while (le != &Vcb->trees) {
+        tree* t = CONTAINING_RECORD(le, tree, list_entry);
+
+        t->parent = NULL;
+        t->paritem = NULL;
+
+        le = le->Flink;
+    }
+
+    while (!IsListEmpty(&Vcb->trees)) {
+        tree* t = CONTAINING_RECORD(Vcb->trees.Flink, tree, list_entry);
+
+        free_tree2(t);
+    }
+}
+
+// Called once a transaction has hit the disk, so that the trees we have in
+// memory can be kept around as a read cache for the next one.
+void clean_trees(device_extension* Vcb) {
+    LIST_ENTRY* le = Vcb->trees.Flink;
     ULONG level;
 
-    for (level = 0; level <= 255; level++) {
-        BOOL empty = TRUE;
+    while (le != &Vcb->trees) {
+        tree* t = CONTAINING_RECORD(le, tree, list_entry);
+        LIST_ENTRY* le2;
 
-        le = Vcb->trees.Flink;
+        if (t->write) {
+            if (t->list_entry_hash.Flink)
+                remove_tree_hash(Vcb, t);
 
-        while (le != &Vcb->trees) {
-            LIST_ENTRY* nextle = le->Flink;
-            tree* t = CONTAINING_RECORD(le, tree, list_entry);
+            t->hash = calc_crc32c(0xffffffff, (UINT8*)&t->header.address, sizeof(UINT64));
+            insert_tree_hash(Vcb, t);
+        }
 
-            if (t->root == r) {
-                if (t->header.level == level) {
-                    BOOL top = !t->paritem;
+        le2 = t->itemlist.Flink;
+        while (le2 != &t->itemlist) {
+            LIST_ENTRY* nextle2 = le2->Flink;
+            tree_data* td = CONTAINING_RECORD(le2, tree_data, list_entry);
 
-                    empty = FALSE;
+            if (td->ignore && (t->header.level == 0 || !td->treeholder.tree)) {
+                if (t->header.level == 0 && td->data && td->data_alloc)
+                    ExFreePool(td->data);
 
-                    free_tree2(t);
-                    if (top && r->treeholder.tree == t)
-                        r->treeholder.tree = NULL;
+                RemoveEntryList(&td->list_entry);
 
-                    if (IsListEmpty(&Vcb->trees))
-                        return;
-                } else if (t->header.level > level)
-                    empty = FALSE;
-            }
+                if (!tree_data_in_slab(t, td))
+                    ExFreeToPagedLookasideList(&Vcb->tree_data_lookaside, td);
+
+                t->index_valid = FALSE;
+            } else
+                td->inserted = FALSE; // now on disk, so needs its refs adding like any other item if the tree gets COWed
 
-            le = nextle;
+            le2 = nextle2;
         }
 
-        if (empty)
-            break;
+        t->write = FALSE;
+        t->has_new_address = FALSE;
+        t->new_address = 0;
+        t->updated_extents = FALSE;
+        t->uniqueness_determined = FALSE;
+
+        le = le->Flink;
+    }
+
+    for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
+        InitializeListHead(&Vcb->dirty_trees[level]);
     }
 }
 
-void free_trees(device_extension* Vcb) {
+// Items in a tree's slab are freed along with the tree, so they need to be given
+// their own allocation before being moved into another tree.
+tree_data* unslab_tree_data(device_extension* Vcb, tree* t, tree_data* td) {
+    tree_data* td2;
+
+    if (!tree_data_in_slab(t, td))
+        return td;
+
+    td2 = ExAllocateFromPagedLookasideList(&Vcb->tree_data_lookaside);
+    if (!td2) {
+        ERR("out of memory\n");
+        return NULL;
+    }
+
+    RtlCopyMemory(td2, td, sizeof(tree_data));
+
+    InsertHeadList(&td->list_entry, &td2->list_entry);
+    RemoveEntryList(&td->list_entry);
+
+    if (t->header.level > 0 && td2->treeholder.tree)
+        td2->treeholder.tree->paritem = td2;
+
+    t->index_valid = FALSE;
+
+    return td2;
+}
+
+static BOOL tree_has_loaded_children(tree* t) {
     LIST_ENTRY* le;
-    ULONG level;
 
-    for (level = 0; level <= 255; level++) {
-        BOOL empty = TRUE;
+    if (t->header.level == 0)
+        return FALSE;
+
+    le = t->itemlist.Flink;
+    while (le != &t->itemlist) {
+        tree_data* td = CONTAINING_RECORD(le, tree_data, list_entry);
+
+        if (td->treeholder.tree)
+            return TRUE;
+
+        le = le->Flink;
+    }
+
+    return FALSE;
+}
+
+// Evicts clean trees until we're within the cache budget, using a CLOCK-style
+// second chance: anything not looked at since the last flush goes first.
+void prune_trees(device_extension* Vcb) {
+    LIST_ENTRY* le;
+    UINT64 num_trees = 0, max_trees;
+    ULONG level, pass;
+
+    le = Vcb->trees.Flink;
+    while (le != &Vcb->trees) {
+        tree* t = CONTAINING_RECORD(le, tree, list_entry);
+
+        // shouldn't happen, but if there's anything dirty left over then fall back to the old behaviour
+        if (t->write) {
+            free_trees(Vcb);
+            return;
+        }
 
-        le = Vcb->trees.Flink;
+        num_trees++;
 
-        while (le != &Vcb->trees) {
-            LIST_ENTRY* nextle = le->Flink;
-            tree* t = CONTAINING_RECORD(le, tree, list_entry);
-            root* r = t->root;
+        le = le->Flink;
+    }
 
-            if (t->header.level == level) {
-                BOOL top = !t->paritem;
+    max_trees = ((UINT64)Vcb->options.tree_cache_size * 1048576) / Vcb->superblock.node_size;
 
-                empty = FALSE;
+    for (pass = 0; pass < 2 && num_trees > max_trees; pass++) {
+        for (level = 0; level <= 255 && num_trees > max_trees; level++) {
+            BOOL empty = TRUE;
 
-                free_tree2(t);
-                if (top && r->treeholder.tree == t)
-                    r->treeholder.tree = NULL;
+            le = Vcb->trees.Flink;
 
-                if (IsListEmpty(&Vcb->trees))
-                    return;
-            } else if (t->header.level > level)
-                empty = FALSE;
+            while (le != &Vcb->trees && num_trees > max_trees) {
+                LIST_ENTRY* nextle = le->Flink;
+                tree* t = CONTAINING_RECORD(le, tree, list_entry);
 
-            le = nextle;
+                if (t->header.level == level) {
+                    empty = FALSE;
+
+                    if ((pass == 1 || !t->referenced) && !tree_has_loaded_children(t)) {
+                        free_tree2(t);
+                        num_trees--;
+                        Vcb->tree_cache_evictions++;
+                    }
+                } else if (t->header.level > level)
+                    empty = FALSE;
+
+                le = nextle;
+            }
+
+            if (empty)
+                break;
         }
+    }
 
-        if (empty)
-            break;
+    le = Vcb->trees.Flink;
+    while (le != &Vcb->trees) {
+        tree* t = CONTAINING_RECORD(le, tree, list_entry);
+
+        t->referenced = FALSE;
+
+        le = le->Flink;
     }
 }
 
@@ -911,6 +1158,7 @@ NTSTATUS insert_tree_item(_In_ _Requires_exclusive_lock_held_(_Curr_->tree_lock)
     td->data = data;
     td->ignore = FALSE;
     td->inserted = TRUE;
+    td->data_alloc = TRUE;
 
 #ifdef _DEBUG
     le = tp.tree->itemlist.Flink;
@@ -940,11 +1188,12 @@ NTSTATUS insert_tree_item(_In_ _Requires_exclusive_lock_held_(_Curr_->tree_lock)
     else
         InsertHeadList(&tp.item->list_entry, &td->list_entry);
 
+    tp.tree->index_valid = FALSE;
     tp.tree->header.num_items++;
     tp.tree->size += size + sizeof(leaf_node);
 
     if (!tp.tree->write) {
-        tp.tree->write = TRUE;
+        mark_tree_dirty(tp.tree);
         Vcb->need_write = TRUE;
     }
 
@@ -986,7 +1235,7 @@ NTSTATUS delete_tree_item(_In_ _Requires_exclusive_lock_held_(_Curr_->tree_lock)
     tp->item->ignore = TRUE;
 
     if (!tp->tree->write) {
-        tp->tree->write = TRUE;
+        mark_tree_dirty(tp->tree);
         Vcb->need_write = TRUE;
     }
 
@@ -1524,12 +1773,13 @@ static NTSTATUS handle_batch_collision(device_extension* Vcb, batch_item* bi, tr
                                 td2->data = newdi;
                                 td2->ignore = FALSE;
                                 td2->inserted = TRUE;
+                                td2->data_alloc = TRUE;
 
                                 InsertHeadList(td->list_entry.Blink, &td2->list_entry);
 
                                 t->header.num_items++;
                                 t->size += newlen + sizeof(leaf_node);
-                                t->write = TRUE;
+                                mark_tree_dirty(t);
                             }
 
                             break;
@@ -1611,12 +1861,13 @@ static NTSTATUS handle_batch_collision(device_extension* Vcb, batch_item* bi, tr
                                 td2->data = newir;
                                 td2->ignore = FALSE;
                                 td2->inserted = TRUE;
+                                td2->data_alloc = TRUE;
 
                                 InsertHeadList(td->list_entry.Blink, &td2->list_entry);
 
                                 t->header.num_items++;
                                 t->size += newlen + sizeof(leaf_node);
-                                t->write = TRUE;
+                                mark_tree_dirty(t);
                             }
 
                             break;
@@ -1705,12 +1956,13 @@ static NTSTATUS handle_batch_collision(device_extension* Vcb, batch_item* bi, tr
                                 td2->data = newier;
                                 td2->ignore = FALSE;
                                 td2->inserted = TRUE;
+                                td2->data_alloc = TRUE;
 
                                 InsertHeadList(td->list_entry.Blink, &td2->list_entry);
 
                                 t->header.num_items++;
                                 t->size += newlen + sizeof(leaf_node);
-                                t->write = TRUE;
+                                mark_tree_dirty(t);
                             }
 
                             break;
@@ -1776,12 +2028,13 @@ static NTSTATUS handle_batch_collision(device_extension* Vcb, batch_item* bi, tr
                                 td2->data = newdi;
                                 td2->ignore = FALSE;
                                 td2->inserted = TRUE;
+                                td2->data_alloc = TRUE;
 
                                 InsertHeadList(td->list_entry.Blink, &td2->list_entry);
 
                                 t->header.num_items++;
                                 t->size += newlen + sizeof(leaf_node);
-                                t->write = TRUE;
+                                mark_tree_dirty(t);
                             }
 
                             break;
@@ -1814,7 +2067,7 @@ static NTSTATUS handle_batch_collision(device_extension* Vcb, batch_item* bi, tr
 
             t->header.num_items--;
             t->size -= sizeof(leaf_node) + td->size;
-            t->write = TRUE;
+            mark_tree_dirty(t);
         }
 
         if (newtd) {
@@ -1869,7 +2122,7 @@ static NTSTATUS commit_batch_list_root(_Requires_exclusive_lock_held_(_Curr_->tr
                     tp.item->ignore = TRUE;
                     tp.tree->header.num_items--;
                     tp.tree->size -= tp.item->size + sizeof(leaf_node);
-                    tp.tree->write = TRUE;
+                    mark_tree_dirty(tp.tree);
                 }
 
                 le2 = tp.item->list_entry.Flink;
@@ -1881,7 +2134,7 @@ static NTSTATUS commit_batch_list_root(_Requires_exclusive_lock_held_(_Curr_->tr
                             td->ignore = TRUE;
                             tp.tree->header.num_items--;
                             tp.tree->size -= td->size + sizeof(leaf_node);
-                            tp.tree->write = TRUE;
+                            mark_tree_dirty(tp.tree);
                         }
                     } else {
                         ended = TRUE;
@@ -1910,7 +2163,7 @@ static NTSTATUS commit_batch_list_root(_Requires_exclusive_lock_held_(_Curr_->tr
                                 td->ignore = TRUE;
                                 tp.tree->header.num_items--;
                                 tp.tree->size -= td->size + sizeof(leaf_node);
-                                tp.tree->write = TRUE;
+                                mark_tree_dirty(tp.tree);
                             }
                         } else {
                             ended = TRUE;
@@ -1942,7 +2195,7 @@ static NTSTATUS commit_batch_list_root(_Requires_exclusive_lock_held_(_Curr_->tr
                     tp.item->ignore = TRUE;
                     tp.tree->header.num_items--;
                     tp.tree->size -= tp.item->size + sizeof(leaf_node);
-                    tp.tree->write = TRUE;
+                    mark_tree_dirty(tp.tree);
                 }
 
                 le2 = tp.item->list_entry.Flink;
@@ -1954,7 +2207,7 @@ static NTSTATUS commit_batch_list_root(_Requires_exclusive_lock_held_(_Curr_->tr
                             td->ignore = TRUE;
                             tp.tree->header.num_items--;
                             tp.tree->size -= td->size + sizeof(leaf_node);
-                            tp.tree->write = TRUE;
+                            mark_tree_dirty(tp.tree);
                         }
                     } else {
                         ended = TRUE;
@@ -1983,7 +2236,7 @@ static NTSTATUS commit_batch_list_root(_Requires_exclusive_lock_held_(_Curr_->tr
                                 td->ignore = TRUE;
                                 tp.tree->header.num_items--;
                                 tp.tree->size -= td->size + sizeof(leaf_node);
-                                tp.tree->write = TRUE;
+                                mark_tree_dirty(tp.tree);
                             }
                         } else {
                             ended = TRUE;
@@ -2004,7 +2257,7 @@ static NTSTATUS commit_batch_list_root(_Requires_exclusive_lock_held_(_Curr_->tr
                     tp.item->ignore = TRUE;
                     tp.tree->header.num_items--;
                     tp.tree->size -= tp.item->size + sizeof(leaf_node);
-                    tp.tree->write = TRUE;
+                    mark_tree_dirty(tp.tree);
                 }
 
                 le2 = tp.item->list_entry.Flink;
@@ -2016,7 +2269,7 @@ static NTSTATUS commit_batch_list_root(_Requires_exclusive_lock_held_(_Curr_->tr
                             td->ignore = TRUE;
                             tp.tree->header.num_items--;
                             tp.tree->size -= td->size + sizeof(leaf_node);
-                            tp.tree->write = TRUE;
+                            mark_tree_dirty(tp.tree);
                         }
                     } else {
                         ended = TRUE;
@@ -2045,7 +2298,7 @@ static NTSTATUS commit_batch_list_root(_Requires_exclusive_lock_held_(_Curr_->tr
                                 td->ignore = TRUE;
                                 tp.tree->header.num_items--;
                                 tp.tree->size -= td->size + sizeof(leaf_node);
-                                tp.tree->write = TRUE;
+                                mark_tree_dirty(tp.tree);
                             }
                         } else {
                             ended = TRUE;
@@ -2057,6 +2310,9 @@ static NTSTATUS commit_batch_list_root(_Requires_exclusive_lock_held_(_Curr_->tr
                 }
             }
         } else {
+            // everything below inserts into tp.tree, including handle_batch_collision
+            tp.tree->index_valid = FALSE;
+
             if (bi->operation == Batch_Delete || bi->operation == Batch_DeleteDirItem || bi->operation == Batch_DeleteInodeRef ||
                 bi->operation == Batch_DeleteInodeExtRef || bi->operation == Batch_DeleteXattr)
                 td = NULL;
@@ -2072,6 +2328,7 @@ static NTSTATUS commit_batch_list_root(_Requires_exclusive_lock_held_(_Curr_->tr
                 td->data = bi->data;
                 td->ignore = FALSE;
                 td->inserted = TRUE;
+                td->data_alloc = TRUE;
             }
 
             cmp = keycmp(bi->key, tp.item->key);
@@ -2118,7 +2375,7 @@ static NTSTATUS commit_batch_list_root(_Requires_exclusive_lock_held_(_Curr_->tr
             if (!ignore && td) {
                 tp.tree->header.num_items++;
                 tp.tree->size += bi->datalen + sizeof(leaf_node);
-                tp.tree->write = TRUE;
+                mark_tree_dirty(tp.tree);
 
                 listhead = td;
             } else
@@ -2161,6 +2418,7 @@ static NTSTATUS commit_batch_list_root(_Requires_exclusive_lock_held_(_Curr_->tr
                         td->data = bi2->data;
                         td->ignore = FALSE;
                         td->inserted = TRUE;
+                        td->data_alloc = TRUE;
                     }
 
                     le3 = &listhead->list_entry;
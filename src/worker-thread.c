@@ -30,11 +30,16 @@ void do_read_job(PIRP Irp) {
     PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
     PFILE_OBJECT FileObject = IrpSp->FileObject;
     fcb* fcb = FileObject->FsContext;
-    BOOL fcb_lock = FALSE;
+    BOOL tree_lock = FALSE, fcb_lock = FALSE;
 
     Irp->IoStatus.Information = 0;
 
     if (!ExIsResourceAcquiredSharedLite(fcb->Header.Resource)) {
+        if (!(fcb->Header.Flags2 & FSRTL_FLAG2_IS_PAGING_FILE)) {
+            ExAcquireResourceSharedLite(&fcb->Vcb->tree_lock, TRUE);
+            tree_lock = TRUE;
+        }
+
         ExAcquireResourceSharedLite(fcb->Header.Resource, TRUE);
         fcb_lock = TRUE;
     }
@@ -48,6 +53,9 @@ void do_read_job(PIRP Irp) {
     if (fcb_lock)
         ExReleaseResourceLite(fcb->Header.Resource);
 
+    if (tree_lock)
+        ExReleaseResourceLite(&fcb->Vcb->tree_lock);
+
     if (!NT_SUCCESS(Status))
         ERR("do_read returned %08x\n", Status);
 
@@ -36,7 +36,6 @@ extern tFsRtlUpdateDiskCounters fFsRtlUpdateDiskCounters;
 extern BOOL diskacc;
 
 BOOL find_data_address_in_chunk(device_extension* Vcb, chunk* c, UINT64 length, UINT64* address) {
-    LIST_ENTRY* le;
     space* s;
 
     TRACE("(%p, %llx, %llx, %p)\n", Vcb, c->offset, length, address);
@@ -53,47 +52,101 @@ BOOL find_data_address_in_chunk(device_extension* Vcb, chunk* c, UINT64 length,
         }
     }
 
-    if (IsListEmpty(&c->space_size))
+    s = find_space_best_fit(c, length);
+    if (!s)
         return FALSE;
 
-    le = c->space_size.Flink;
-    while (le != &c->space_size) {
-        s = CONTAINING_RECORD(le, space, list_entry_size);
+    *address = s->address;
 
-        if (s->size == length) {
-            *address = s->address;
-            return TRUE;
-        } else if (s->size < length) {
-            if (le == c->space_size.Flink)
-                return FALSE;
+    return TRUE;
+}
 
-            s = CONTAINING_RECORD(le->Blink, space, list_entry_size);
+// Called with chunk_lock held exclusively whenever Vcb->chunks changes. If we can't
+// allocate the index, get_chunk_from_address falls back to walking the list.
+void update_chunk_index(device_extension* Vcb) {
+    ULONG num_chunks = 0;
+    LIST_ENTRY* le;
 
-            *address = s->address;
-            return TRUE;
-        }
+    Vcb->last_chunk = NULL;
 
+    le = Vcb->chunks.Flink;
+    while (le != &Vcb->chunks) {
+        num_chunks++;
         le = le->Flink;
     }
 
-    s = CONTAINING_RECORD(c->space_size.Blink, space, list_entry_size);
+    if (num_chunks > Vcb->chunk_index_size) {
+        ULONG size = max(num_chunks * 2, 64);
+
+        if (Vcb->chunk_index)
+            ExFreePool(Vcb->chunk_index);
+
+        Vcb->chunk_index = ExAllocatePoolWithTag(PagedPool, size * sizeof(chunk*), ALLOC_TAG);
+        if (!Vcb->chunk_index) {
+            ERR("out of memory\n");
+            Vcb->chunk_index_size = 0;
+            Vcb->chunk_index_len = 0;
+            return;
+        }
+
+        Vcb->chunk_index_size = size;
+    }
+
+    num_chunks = 0;
 
-    if (s->size > length) {
-        *address = s->address;
-        return TRUE;
+    le = Vcb->chunks.Flink;
+    while (le != &Vcb->chunks) {
+        Vcb->chunk_index[num_chunks] = CONTAINING_RECORD(le, chunk, list_entry);
+        num_chunks++;
+        le = le->Flink;
     }
 
-    return FALSE;
+    Vcb->chunk_index_len = num_chunks;
 }
 
 chunk* get_chunk_from_address(device_extension* Vcb, UINT64 address) {
     LIST_ENTRY* le2;
+    chunk* c;
 
     ExAcquireResourceSharedLite(&Vcb->chunk_lock, TRUE);
 
+    c = Vcb->last_chunk;
+    if (c && address >= c->offset && address < c->offset + c->chunk_item->size) {
+        ExReleaseResourceLite(&Vcb->chunk_lock);
+        return c;
+    }
+
+    if (Vcb->chunk_index_len > 0) {
+        ULONG lo = 0, hi = Vcb->chunk_index_len;
+
+        // chunks are sorted by offset and don't overlap, so look for the last one starting at or before address
+        while (lo < hi) {
+            ULONG mid = (lo + hi) / 2;
+
+            if (Vcb->chunk_index[mid]->offset <= address)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        if (lo > 0) {
+            c = Vcb->chunk_index[lo - 1];
+
+            if (address < c->offset + c->chunk_item->size) {
+                Vcb->last_chunk = c;
+                ExReleaseResourceLite(&Vcb->chunk_lock);
+                return c;
+            }
+        }
+
+        ExReleaseResourceLite(&Vcb->chunk_lock);
+
+        return NULL;
+    }
+
     le2 = Vcb->chunks.Flink;
     while (le2 != &Vcb->chunks) {
-        chunk* c = CONTAINING_RECORD(le2, chunk, list_entry);
+        c = CONTAINING_RECORD(le2, chunk, list_entry);
 
         if (address >= c->offset && address < c->offset + c->chunk_item->size) {
             ExReleaseResourceLite(&Vcb->chunk_lock);
@@ -605,12 +658,12 @@ NTSTATUS alloc_chunk(device_extension* Vcb, UINT64 flags, chunk** pc, BOOL full_
 
     InitializeListHead(&c->space);
     InitializeListHead(&c->space_size);
+    RtlZeroMemory(c->space_size_ptrs, sizeof(c->space_size_ptrs));
     InitializeListHead(&c->deleting);
     InitializeListHead(&c->changed_extents);
 
     InitializeListHead(&c->range_locks);
     ExInitializeResourceLite(&c->range_locks_lock);
-    KeInitializeEvent(&c->range_locks_event, NotificationEvent, FALSE);
 
     InitializeListHead(&c->partial_stripes);
     ExInitializeResourceLite(&c->partial_stripes_lock);
@@ -628,7 +681,7 @@ NTSTATUS alloc_chunk(device_extension* Vcb, UINT64 flags, chunk** pc, BOOL full_
     s->address = c->offset;
     s->size = c->chunk_item->size;
     InsertTailList(&c->space, &s->list_entry);
-    InsertTailList(&c->space_size, &s->list_entry_size);
+    order_space_entry(s, &c->space_size);
 
     protect_superblocks(c);
 
@@ -678,6 +731,8 @@ end:
         if (!done)
             InsertTailList(&Vcb->chunks, &c->list_entry);
 
+        update_chunk_index(Vcb);
+
         c->created = TRUE;
         c->changed = TRUE;
         c->space_changed = TRUE;
@@ -2184,7 +2239,7 @@ NTSTATUS write_data_complete(device_extension* Vcb, UINT64 address, void* data,
 
     if (c->chunk_item->type & BLOCK_FLAG_RAID5 || c->chunk_item->type & BLOCK_FLAG_RAID6) {
         get_raid56_lock_range(c, address, length, &lockaddr, &locklen);
-        chunk_lock_range(Vcb, c, lockaddr, locklen);
+        chunk_lock_range(Vcb, c, lockaddr, locklen, TRUE);
     }
 
     try {
@@ -2788,12 +2843,7 @@ NTSTATUS calc_csum(_In_ device_extension* Vcb, _In_reads_bytes_(sectors*Vcb->sup
     // point where offloading the crc32 calculation becomes worth it.
 
     if (sectors < 40 || KeQueryActiveProcessorCount(NULL) < 2) {
-        ULONG j;
-
-        for (j = 0; j < sectors; j++) {
-            csum[j] = ~calc_crc32c(0xffffffff, data + (j * Vcb->superblock.sector_size), Vcb->superblock.sector_size);
-        }
-
+        calc_crc32c_sectors(data, Vcb->superblock.sector_size, sectors, csum);
         return STATUS_SUCCESS;
     }
 
@@ -2803,7 +2853,7 @@ NTSTATUS calc_csum(_In_ device_extension* Vcb, _In_reads_bytes_(sectors*Vcb->sup
         return Status;
     }
 
-    KeWaitForSingleObject(&cj->event, Executive, KernelMode, FALSE, NULL);
+    do_calc_job(Vcb, cj);
     free_calc_job(cj);
 
     return STATUS_SUCCESS;
@@ -2811,8 +2861,9 @@ NTSTATUS calc_csum(_In_ device_extension* Vcb, _In_reads_bytes_(sectors*Vcb->sup
 
 _Requires_lock_held_(c->lock)
 _When_(return != 0, _Releases_lock_(c->lock))
-BOOL insert_extent_chunk(_In_ device_extension* Vcb, _In_ fcb* fcb, _In_ chunk* c, _In_ UINT64 start_data, _In_ UINT64 length, _In_ BOOL prealloc, _In_opt_ void* data,
-                         _In_opt_ PIRP Irp, _In_ LIST_ENTRY* rollback, _In_ UINT8 compression, _In_ UINT64 decoded_size, _In_ BOOL file_write, _In_ UINT64 irp_offset) {
+static BOOL insert_extent_chunk_offset(_In_ device_extension* Vcb, _In_ fcb* fcb, _In_ chunk* c, _In_ UINT64 start_data, _In_ UINT64 length, _In_ BOOL prealloc,
+                                       _In_opt_ void* data, _In_opt_ PIRP Irp, _In_ LIST_ENTRY* rollback, _In_ UINT8 compression, _In_ UINT64 decoded_size,
+                                       _In_ UINT64 extent_offset, _In_ UINT64 num_bytes, _In_ BOOL file_write, _In_ UINT64 irp_offset) {
     UINT64 address;
     NTSTATUS Status;
     EXTENT_DATA* ed;
@@ -2842,8 +2893,8 @@ BOOL insert_extent_chunk(_In_ device_extension* Vcb, _In_ fcb* fcb, _In_ chunk*
     ed2 = (EXTENT_DATA2*)ed->data;
     ed2->address = address;
     ed2->size = length;
-    ed2->offset = 0;
-    ed2->num_bytes = decoded_size;
+    ed2->offset = extent_offset;
+    ed2->num_bytes = num_bytes;
 
     if (!prealloc && data && !(fcb->inode_item.flags & BTRFS_INODE_NODATASUM)) {
         ULONG sl = (ULONG)(length / Vcb->superblock.sector_size);
@@ -2877,7 +2928,7 @@ BOOL insert_extent_chunk(_In_ device_extension* Vcb, _In_ fcb* fcb, _In_ chunk*
     c->used += length;
     space_list_subtract(c, FALSE, address, length, rollback);
 
-    fcb->inode_item.st_blocks += decoded_size;
+    fcb->inode_item.st_blocks += num_bytes;
 
     fcb->extents_changed = TRUE;
     fcb->inode_item_changed = TRUE;
@@ -2885,7 +2936,7 @@ BOOL insert_extent_chunk(_In_ device_extension* Vcb, _In_ fcb* fcb, _In_ chunk*
 
     ExAcquireResourceExclusiveLite(&c->changed_extents_lock, TRUE);
 
-    add_changed_extent_ref(c, address, length, fcb->subvol->id, fcb->inode, start_data, 1, fcb->inode_item.flags & BTRFS_INODE_NODATASUM);
+    add_changed_extent_ref(c, address, length, fcb->subvol->id, fcb->inode, start_data - extent_offset, 1, fcb->inode_item.flags & BTRFS_INODE_NODATASUM);
 
     ExReleaseResourceLite(&c->changed_extents_lock);
 
@@ -2901,6 +2952,13 @@ BOOL insert_extent_chunk(_In_ device_extension* Vcb, _In_ fcb* fcb, _In_ chunk*
     return TRUE;
 }
 
+_Requires_lock_held_(c->lock)
+_When_(return != 0, _Releases_lock_(c->lock))
+BOOL insert_extent_chunk(_In_ device_extension* Vcb, _In_ fcb* fcb, _In_ chunk* c, _In_ UINT64 start_data, _In_ UINT64 length, _In_ BOOL prealloc, _In_opt_ void* data,
+                         _In_opt_ PIRP Irp, _In_ LIST_ENTRY* rollback, _In_ UINT8 compression, _In_ UINT64 decoded_size, _In_ BOOL file_write, _In_ UINT64 irp_offset) {
+    return insert_extent_chunk_offset(Vcb, fcb, c, start_data, length, prealloc, data, Irp, rollback, compression, decoded_size, 0, decoded_size, file_write, irp_offset);
+}
+
 static BOOL try_extend_data(device_extension* Vcb, fcb* fcb, UINT64 start_data, UINT64 length, void* data,
                             PIRP Irp, UINT64* written, BOOL file_write, UINT64 irp_offset, LIST_ENTRY* rollback) {
     BOOL success = FALSE;
@@ -3000,7 +3058,7 @@ static NTSTATUS insert_chunk_fragmented(fcb* fcb, UINT64 start, UINT64 length, U
     NTSTATUS Status;
     chunk* c;
 
-    ExAcquireResourceSharedLite(&fcb->Vcb->chunk_lock, TRUE);
+    ExAcquireResourceExclusiveLite(&fcb->Vcb->chunk_lock, TRUE);
 
     // first create as many chunks as we can
     do {
@@ -3013,6 +3071,8 @@ static NTSTATUS insert_chunk_fragmented(fcb* fcb, UINT64 start, UINT64 length, U
         return Status;
     }
 
+    ExConvertExclusiveToSharedLite(&fcb->Vcb->chunk_lock);
+
     le = fcb->Vcb->chunks.Flink;
     while (le != &fcb->Vcb->chunks) {
         c = CONTAINING_RECORD(le, chunk, list_entry);
@@ -4090,22 +4150,167 @@ nextitem:
     return STATUS_SUCCESS;
 }
 
+typedef struct {
+    UINT8* comp_data;
+    UINT32 comp_length;
+    calc_job* cj;
+} comp_part;
+
+// Writes an already-compressed extent, of which the file uses num_bytes starting from extent_offset.
+NTSTATUS write_encoded_extent(fcb* fcb, UINT64 start_data, UINT8 compression, void* comp_data, UINT32 comp_length, UINT64 decoded_size,
+                              UINT64 extent_offset, UINT64 num_bytes, PIRP Irp, LIST_ENTRY* rollback) {
+    NTSTATUS Status;
+    LIST_ENTRY* le;
+    chunk* c;
+
+    Status = excise_extents(fcb->Vcb, fcb, start_data, start_data + num_bytes, Irp, rollback);
+    if (!NT_SUCCESS(Status)) {
+        ERR("excise_extents returned %08x\n", Status);
+        return Status;
+    }
+
+    ExAcquireResourceSharedLite(&fcb->Vcb->chunk_lock, TRUE);
+
+    le = fcb->Vcb->chunks.Flink;
+    while (le != &fcb->Vcb->chunks) {
+        c = CONTAINING_RECORD(le, chunk, list_entry);
+
+        if (!c->readonly && !c->reloc) {
+            acquire_chunk_lock(c, fcb->Vcb);
+
+            if (c->chunk_item->type == fcb->Vcb->data_flags && (c->chunk_item->size - c->used) >= comp_length) {
+                if (insert_extent_chunk_offset(fcb->Vcb, fcb, c, start_data, comp_length, FALSE, comp_data, Irp, rollback, compression, decoded_size,
+                                               extent_offset, num_bytes, FALSE, 0)) {
+                    ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
+                    return STATUS_SUCCESS;
+                }
+            }
+
+            release_chunk_lock(c, fcb->Vcb);
+        }
+
+        le = le->Flink;
+    }
+
+    ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
+
+    ExAcquireResourceExclusiveLite(&fcb->Vcb->chunk_lock, TRUE);
+
+    Status = alloc_chunk(fcb->Vcb, fcb->Vcb->data_flags, &c, FALSE);
+
+    ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
+
+    if (!NT_SUCCESS(Status)) {
+        ERR("alloc_chunk returned %08x\n", Status);
+        return Status;
+    }
+
+    if (c) {
+        acquire_chunk_lock(c, fcb->Vcb);
+
+        if (c->chunk_item->type == fcb->Vcb->data_flags && (c->chunk_item->size - c->used) >= comp_length) {
+            if (insert_extent_chunk_offset(fcb->Vcb, fcb, c, start_data, comp_length, FALSE, comp_data, Irp, rollback, compression, decoded_size,
+                                           extent_offset, num_bytes, FALSE, 0))
+                return STATUS_SUCCESS;
+        }
+
+        release_chunk_lock(c, fcb->Vcb);
+    }
+
+    WARN("couldn't find any data chunks with %x bytes free\n", comp_length);
+
+    return STATUS_DISK_FULL;
+}
+
+static NTSTATUS write_compressed_bit(fcb* fcb, UINT64 start_data, UINT64 end_data, void* data, UINT8 compression, void* comp_data, UINT32 comp_length,
+                                     PIRP Irp, LIST_ENTRY* rollback) {
+    if (compression == BTRFS_COMPRESSION_NONE) {
+        comp_data = data;
+        comp_length = (UINT32)(end_data - start_data);
+    }
+
+    return write_encoded_extent(fcb, start_data, compression, comp_data, comp_length, end_data - start_data, 0, end_data - start_data, Irp, rollback);
+}
+
 NTSTATUS write_compressed(fcb* fcb, UINT64 start_data, UINT64 end_data, void* data, PIRP Irp, LIST_ENTRY* rollback) {
     NTSTATUS Status;
     UINT64 i;
+    ULONG num_parts;
+    UINT8 type;
+    comp_part* parts;
+
+    type = get_compression_type(fcb);
+
+    if (type == BTRFS_COMPRESSION_ZSTD)
+        fcb->Vcb->superblock.incompat_flags |= BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD;
+    else if (type == BTRFS_COMPRESSION_LZO)
+        fcb->Vcb->superblock.incompat_flags |= BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO;
+
+    num_parts = (ULONG)(sector_align(end_data - start_data, COMPRESSED_EXTENT_SIZE) / COMPRESSED_EXTENT_SIZE);
+
+    parts = ExAllocatePoolWithTag(PagedPool, sizeof(comp_part) * num_parts, ALLOC_TAG);
+    if (!parts) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(parts, sizeof(comp_part) * num_parts);
+
+    // Compression doesn't depend on the trees, so we hand each 128 KB extent to the calc threads
+    // and only serialize the allocation and extent insertion, which we do in order below.
+
+    for (i = 0; i < num_parts; i++) {
+        UINT32 len = (UINT32)(min(start_data + ((i + 1) * COMPRESSED_EXTENT_SIZE), end_data) - start_data - (i * COMPRESSED_EXTENT_SIZE));
 
-    for (i = 0; i < sector_align(end_data - start_data, COMPRESSED_EXTENT_SIZE) / COMPRESSED_EXTENT_SIZE; i++) {
+        parts[i].comp_data = ExAllocatePoolWithTag(PagedPool, compress_buffer_size(type, len), ALLOC_TAG);
+        if (!parts[i].comp_data) {
+            ERR("out of memory\n");
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            goto end;
+        }
+
+        if (num_parts == 1) {
+            Status = compress_bit(fcb->Vcb, type, data, len, parts[i].comp_data, &parts[i].comp_length);
+            if (!NT_SUCCESS(Status)) {
+                ERR("compress_bit returned %08x\n", Status);
+                goto end;
+            }
+        } else {
+            Status = add_calc_job_comp(fcb->Vcb, type, (UINT8*)data + (i * COMPRESSED_EXTENT_SIZE), len, parts[i].comp_data, &parts[i].cj);
+            if (!NT_SUCCESS(Status)) {
+                ERR("add_calc_job_comp returned %08x\n", Status);
+                goto end;
+            }
+        }
+    }
+
+    for (i = 0; i < num_parts; i++) {
         UINT64 s2, e2;
         BOOL compressed;
 
         s2 = start_data + (i * COMPRESSED_EXTENT_SIZE);
         e2 = min(s2 + COMPRESSED_EXTENT_SIZE, end_data);
 
-        Status = write_compressed_bit(fcb, s2, e2, (UINT8*)data + (i * COMPRESSED_EXTENT_SIZE), &compressed, Irp, rollback);
+        if (parts[i].cj) {
+            KeWaitForSingleObject(&parts[i].cj->event, Executive, KernelMode, FALSE, NULL);
+
+            Status = parts[i].cj->Status;
+            if (!NT_SUCCESS(Status)) {
+                ERR("compress_bit returned %08x\n", Status);
+                goto end;
+            }
+
+            parts[i].comp_length = parts[i].cj->comp_length;
+        }
+
+        compressed = parts[i].comp_length != 0;
+
+        Status = write_compressed_bit(fcb, s2, e2, (UINT8*)data + (i * COMPRESSED_EXTENT_SIZE), compressed ? type : BTRFS_COMPRESSION_NONE,
+                                      parts[i].comp_data, parts[i].comp_length, Irp, rollback);
 
         if (!NT_SUCCESS(Status)) {
             ERR("write_compressed_bit returned %08x\n", Status);
-            return Status;
+            goto end;
         }
 
         // If the first 128 KB of a file is incompressible, we set the nocompress flag so we don't
@@ -4121,15 +4326,31 @@ NTSTATUS write_compressed(fcb* fcb, UINT64 start_data, UINT64 end_data, void* da
 
                 if (!NT_SUCCESS(Status)) {
                     ERR("do_write_file returned %08x\n", Status);
-                    return Status;
+                    goto end;
                 }
             }
 
-            return STATUS_SUCCESS;
+            break;
         }
     }
 
-    return STATUS_SUCCESS;
+    Status = STATUS_SUCCESS;
+
+end:
+    // make sure the calc threads have finished with our buffers before we free them
+    for (i = 0; i < num_parts; i++) {
+        if (parts[i].cj) {
+            KeWaitForSingleObject(&parts[i].cj->event, Executive, KernelMode, FALSE, NULL);
+            free_calc_job(parts[i].cj);
+        }
+
+        if (parts[i].comp_data)
+            ExFreePool(parts[i].comp_data);
+    }
+
+    ExFreePool(parts);
+
+    return Status;
 }
 
 NTSTATUS write_file2(device_extension* Vcb, PIRP Irp, LARGE_INTEGER offset, void* buf, ULONG* length, BOOLEAN paging_io, BOOLEAN no_cache,